@@ -0,0 +1,154 @@
+// Router::resolve microbenchmark: linear rule scan (the old resolve) vs compiled RoutingIndex, with and
+// without the resolve cache. Build with -DPGPOOLER_BUILD_BENCH=ON, run: ./router_bench [rules] [lookups] [regex]
+// "regex" makes every database matcher a regex (one std::regex per rule vs the combined RegexSet automaton).
+#include "config/config.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace pgpooler::config;
+
+namespace {
+
+FieldMatcher exact(const std::string& v) {
+  FieldMatcher m;
+  m.type = MatchType::Exact;
+  m.value = v;
+  return m;
+}
+
+FieldMatcher prefix(const std::string& v) {
+  FieldMatcher m;
+  m.type = MatchType::Prefix;
+  m.value = v;
+  return m;
+}
+
+FieldMatcher regex(const std::string& v) {
+  FieldMatcher m;
+  m.type = MatchType::Regex;
+  m.value = v;
+  m.re = std::regex(v);
+  return m;
+}
+
+FieldMatcher list(std::vector<std::string> v) {
+  FieldMatcher m;
+  m.type = MatchType::List;
+  m.list = std::move(v);
+  return m;
+}
+
+/** Tenant-style config: mostly exact databases, some lists, prefixes and user rules, default at the end. */
+std::vector<RoutingRule> make_rules(std::size_t n, bool regexes) {
+  std::vector<RoutingRule> rules;
+  for (std::size_t i = 0; i < n; ++i) {
+    RoutingRule r;
+    r.backend_name = "b" + std::to_string(i % 4);
+    if (regexes) {
+      if (i % 10 == 0)
+        r.database = regex("^grp" + std::to_string(i) + "_[a-z0-9]+$");
+      else
+        r.database = regex("tenant_" + std::to_string(i) + "(_ro|_rw)?");
+      rules.push_back(std::move(r));
+      continue;
+    }
+    switch (i % 10) {
+      case 0:
+        r.database = prefix("grp" + std::to_string(i) + "_");
+        break;
+      case 1:
+        r.database = list({"tenant_" + std::to_string(i), "tenant_" + std::to_string(i) + "_ro"});
+        break;
+      case 2:
+        r.user = exact("svc_" + std::to_string(i));
+        break;
+      case 3:
+        r.database = exact("tenant_" + std::to_string(i));
+        r.user = exact("owner_" + std::to_string(i));
+        break;
+      default:
+        r.database = exact("tenant_" + std::to_string(i));
+        break;
+    }
+    rules.push_back(std::move(r));
+  }
+  RoutingRule def;
+  def.is_default = true;
+  def.backend_name = "b0";
+  rules.push_back(std::move(def));
+  return rules;
+}
+
+/** The pre-index resolve: every rule in order, then a search of backends by name. */
+const BackendEntry* linear_resolve(const std::vector<RoutingRule>& rules, const std::vector<BackendEntry>& backends,
+                                   const std::string& user, const std::string& database) {
+  for (const auto& rule : rules) {
+    if (!rule.is_default) {
+      if (rule.database.has_value() && !rule.database->match(database)) continue;
+      if (rule.user.has_value() && !rule.user->match(user)) continue;
+    }
+    for (const auto& b : backends)
+      if (b.name == rule.backend_name) return &b;
+  }
+  return nullptr;
+}
+
+template <typename F>
+double ns_per_op(std::size_t lookups, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < lookups; ++i) f(i);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(lookups);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const std::size_t n_rules = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+  const std::size_t lookups = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 200000;
+  const bool regexes = argc > 3 && std::string(argv[3]) == "regex";
+
+  std::vector<BackendEntry> backends(4);
+  for (std::size_t i = 0; i < backends.size(); ++i) backends[i].name = "b" + std::to_string(i);
+  std::vector<RoutingRule> rules = make_rules(n_rules, regexes);
+
+  // Connections spread over all tenants: exact hits, prefix hits, user rules and misses (default rule).
+  std::vector<std::pair<std::string, std::string>> keys;
+  for (std::size_t i = 0; i < 1024; ++i) {
+    std::size_t t = (i * 7919) % (n_rules ? n_rules : 1);
+    keys.emplace_back(i % 3 ? "app" : "owner_" + std::to_string(t),
+                      i % 5 ? "tenant_" + std::to_string(t) : "grp" + std::to_string(t - t % 10) + "_x");
+  }
+
+  Router indexed(backends, Defaults{}, rules, 0);
+  Router cached(backends, Defaults{}, rules, 4096);
+  for (const auto& k : keys) {
+    const BackendEntry* want = linear_resolve(rules, backends, k.first, k.second);
+    auto got = indexed.resolve(k.first, k.second);
+    if ((want == nullptr) != !got || (want && want->name != got->name)) {
+      std::fprintf(stderr, "mismatch for user=%s database=%s\n", k.first.c_str(), k.second.c_str());
+      return 1;
+    }
+    cached.resolve(k.first, k.second);  // warm up: DFA states and cache entries are built on first use
+  }
+
+  volatile std::size_t sink = 0;
+  double linear = ns_per_op(lookups, [&](std::size_t i) {
+    const auto& k = keys[i % keys.size()];
+    sink = sink + (linear_resolve(rules, backends, k.first, k.second) != nullptr);
+  });
+  double index = ns_per_op(lookups, [&](std::size_t i) {
+    const auto& k = keys[i % keys.size()];
+    sink = sink + indexed.resolve(k.first, k.second).has_value();
+  });
+  double cache = ns_per_op(lookups, [&](std::size_t i) {
+    const auto& k = keys[i % keys.size()];
+    sink = sink + cached.resolve(k.first, k.second).has_value();
+  });
+  std::printf("%srules=%zu lookups=%zu linear=%.0fns index=%.0fns index+cache=%.0fns\n", regexes ? "regex " : "", rules.size(), lookups,
+              linear, index, cache);
+  return 0;
+}
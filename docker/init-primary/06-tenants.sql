@@ -0,0 +1,13 @@
+-- Primary: базы тенантов для shard_map (tenants.yaml, tenant_options.yaml)
+CREATE DATABASE tenant_b;
+CREATE DATABASE tenant_z;
+CREATE DATABASE tenants;
+\c tenant_b
+CREATE TABLE backend_id (name text);
+INSERT INTO backend_id VALUES ('primary');
+\c tenant_z
+CREATE TABLE backend_id (name text);
+INSERT INTO backend_id VALUES ('primary');
+\c tenants
+CREATE TABLE backend_id (name text);
+INSERT INTO backend_id VALUES ('primary');
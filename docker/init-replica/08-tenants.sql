@@ -0,0 +1,9 @@
+-- Replica: базы тенантов для shard_map (tenants.yaml, tenant_options.yaml)
+CREATE DATABASE tenant_n;
+CREATE DATABASE tenants;
+\c tenant_n
+CREATE TABLE backend_id (name text);
+INSERT INTO backend_id VALUES ('replica');
+\c tenants
+CREATE TABLE backend_id (name text);
+INSERT INTO backend_id VALUES ('replica');
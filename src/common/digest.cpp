@@ -0,0 +1,218 @@
+#include "common/digest.hpp"
+#include <cstring>
+
+namespace pgpooler {
+namespace common {
+
+namespace {
+
+inline std::uint32_t rotl(std::uint32_t x, unsigned n) { return (x << n) | (x >> (32 - n)); }
+inline std::uint32_t rotr(std::uint32_t x, unsigned n) { return (x >> n) | (x << (32 - n)); }
+
+/** Message padding shared by MD5 (little-endian length) and SHA-256 (big-endian length). */
+std::vector<std::uint8_t> pad_message(const std::uint8_t* data, std::size_t len, bool big_endian) {
+  std::vector<std::uint8_t> m(data, data + len);
+  m.push_back(0x80);
+  while (m.size() % 64 != 56) m.push_back(0);
+  const std::uint64_t bits = static_cast<std::uint64_t>(len) * 8;
+  for (int i = 0; i < 8; ++i)
+    m.push_back(static_cast<std::uint8_t>(bits >> (big_endian ? 56 - 8 * i : 8 * i)));
+  return m;
+}
+
+constexpr std::uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+constexpr unsigned MD5_S[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+                                5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+                                4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+                                6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+constexpr std::uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+}  // namespace
+
+Md5Digest md5(const std::uint8_t* data, std::size_t len) {
+  std::uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  const std::vector<std::uint8_t> m = pad_message(data, len, false);
+  for (std::size_t off = 0; off < m.size(); off += 64) {
+    std::uint32_t w[16];
+    for (int i = 0; i < 16; ++i)
+      w[i] = static_cast<std::uint32_t>(m[off + 4 * i]) | (static_cast<std::uint32_t>(m[off + 4 * i + 1]) << 8) |
+             (static_cast<std::uint32_t>(m[off + 4 * i + 2]) << 16) |
+             (static_cast<std::uint32_t>(m[off + 4 * i + 3]) << 24);
+    std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (unsigned i = 0; i < 64; ++i) {
+      std::uint32_t f;
+      unsigned g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      const std::uint32_t t = d;
+      d = c;
+      c = b;
+      b = b + rotl(a + f + MD5_K[i] + w[g], MD5_S[i]);
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+  }
+  Md5Digest out;
+  for (int i = 0; i < 16; ++i) out[i] = static_cast<std::uint8_t>(h[i / 4] >> (8 * (i % 4)));
+  return out;
+}
+
+std::string md5_hex(const std::string& s) {
+  static const char hex[] = "0123456789abcdef";
+  const Md5Digest d = md5(reinterpret_cast<const std::uint8_t*>(s.data()), s.size());
+  std::string out;
+  for (std::uint8_t b : d) {
+    out.push_back(hex[b >> 4]);
+    out.push_back(hex[b & 0xf]);
+  }
+  return out;
+}
+
+Sha256Digest sha256(const std::uint8_t* data, std::size_t len) {
+  std::uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  const std::vector<std::uint8_t> m = pad_message(data, len, true);
+  for (std::size_t off = 0; off < m.size(); off += 64) {
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+      w[i] = (static_cast<std::uint32_t>(m[off + 4 * i]) << 24) |
+             (static_cast<std::uint32_t>(m[off + 4 * i + 1]) << 16) |
+             (static_cast<std::uint32_t>(m[off + 4 * i + 2]) << 8) | static_cast<std::uint32_t>(m[off + 4 * i + 3]);
+    for (int i = 16; i < 64; ++i) {
+      const std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; ++i) {
+      const std::uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+      const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+  Sha256Digest out;
+  for (int i = 0; i < 32; ++i) out[i] = static_cast<std::uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+  return out;
+}
+
+Sha256Digest hmac_sha256(const std::uint8_t* key, std::size_t key_len, const std::uint8_t* data, std::size_t len) {
+  std::uint8_t k[64] = {};
+  if (key_len > 64) {
+    const Sha256Digest kd = sha256(key, key_len);
+    std::memcpy(k, kd.data(), kd.size());
+  } else if (key_len > 0) {
+    std::memcpy(k, key, key_len);
+  }
+  std::vector<std::uint8_t> inner(64 + len);
+  for (int i = 0; i < 64; ++i) inner[i] = k[i] ^ 0x36;
+  if (len) std::memcpy(inner.data() + 64, data, len);
+  const Sha256Digest ih = sha256(inner.data(), inner.size());
+  std::uint8_t outer[64 + 32];
+  for (int i = 0; i < 64; ++i) outer[i] = k[i] ^ 0x5c;
+  std::memcpy(outer + 64, ih.data(), ih.size());
+  return sha256(outer, sizeof(outer));
+}
+
+Sha256Digest pbkdf2_sha256(const std::string& password, const std::vector<std::uint8_t>& salt, unsigned iterations) {
+  const auto* key = reinterpret_cast<const std::uint8_t*>(password.data());
+  std::vector<std::uint8_t> first(salt);
+  first.insert(first.end(), {0, 0, 0, 1});  // block index 1
+  Sha256Digest u = hmac_sha256(key, password.size(), first.data(), first.size());
+  Sha256Digest out = u;
+  for (unsigned i = 1; i < iterations; ++i) {
+    u = hmac_sha256(key, password.size(), u.data(), u.size());
+    for (std::size_t j = 0; j < out.size(); ++j) out[j] ^= u[j];
+  }
+  return out;
+}
+
+std::string base64_encode(const std::uint8_t* data, std::size_t len) {
+  std::string out;
+  out.reserve((len + 2) / 3 * 4);
+  for (std::size_t i = 0; i < len; i += 3) {
+    std::uint32_t v = static_cast<std::uint32_t>(data[i]) << 16;
+    if (i + 1 < len) v |= static_cast<std::uint32_t>(data[i + 1]) << 8;
+    if (i + 2 < len) v |= data[i + 2];
+    out.push_back(BASE64[(v >> 18) & 63]);
+    out.push_back(BASE64[(v >> 12) & 63]);
+    out.push_back(i + 1 < len ? BASE64[(v >> 6) & 63] : '=');
+    out.push_back(i + 2 < len ? BASE64[v & 63] : '=');
+  }
+  return out;
+}
+
+std::optional<std::vector<std::uint8_t>> base64_decode(const std::string& s) {
+  if (s.size() % 4 != 0) return std::nullopt;
+  std::vector<std::uint8_t> out;
+  out.reserve(s.size() / 4 * 3);
+  for (std::size_t i = 0; i < s.size(); i += 4) {
+    std::uint32_t v = 0;
+    int pad = 0;
+    for (std::size_t j = 0; j < 4; ++j) {
+      const char c = s[i + j];
+      const char* p = c ? std::strchr(BASE64, c) : nullptr;
+      if (c == '=' && i + 4 == s.size() && j >= 2) {
+        ++pad;
+        v <<= 6;
+        continue;
+      }
+      if (!p || pad) return std::nullopt;
+      v = (v << 6) | static_cast<std::uint32_t>(p - BASE64);
+    }
+    out.push_back(static_cast<std::uint8_t>(v >> 16));
+    if (pad < 2) out.push_back(static_cast<std::uint8_t>(v >> 8));
+    if (pad < 1) out.push_back(static_cast<std::uint8_t>(v));
+  }
+  return out;
+}
+
+}  // namespace common
+}  // namespace pgpooler
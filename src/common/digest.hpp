@@ -0,0 +1,33 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace pgpooler {
+namespace common {
+
+/** Hashes and encodings the pooler needs to authenticate its own backend connections (md5 and SCRAM-SHA-256
+ * password auth). Small self-contained implementations: no crypto library dependency. */
+
+using Md5Digest = std::array<std::uint8_t, 16>;
+using Sha256Digest = std::array<std::uint8_t, 32>;
+
+Md5Digest md5(const std::uint8_t* data, std::size_t len);
+/** Lowercase hex of md5(s), as in PostgreSQL's "md5" password hashes. */
+std::string md5_hex(const std::string& s);
+
+Sha256Digest sha256(const std::uint8_t* data, std::size_t len);
+Sha256Digest hmac_sha256(const std::uint8_t* key, std::size_t key_len, const std::uint8_t* data, std::size_t len);
+/** PBKDF2-HMAC-SHA-256 with one output block (SCRAM's Hi()). */
+Sha256Digest pbkdf2_sha256(const std::string& password, const std::vector<std::uint8_t>& salt, unsigned iterations);
+
+std::string base64_encode(const std::uint8_t* data, std::size_t len);
+/** nullopt on characters outside the alphabet or bad padding. */
+std::optional<std::vector<std::uint8_t>> base64_decode(const std::string& s);
+
+}  // namespace common
+}  // namespace pgpooler
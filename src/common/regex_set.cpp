@@ -0,0 +1,511 @@
+#include "common/regex_set.hpp"
+#include <algorithm>
+#include <set>
+#include <utility>
+
+namespace pgpooler {
+namespace common {
+
+namespace {
+
+using Bytes = std::array<std::uint64_t, 4>;
+
+constexpr std::size_t kMaxStatesPerPattern = 20000;
+constexpr int kMaxRepeat = 1000;
+constexpr std::size_t kMaxDfaBytes = 8u << 20;  // over this the DFA cache is dropped and rebuilt on demand
+
+void set_byte(Bytes& b, unsigned char c) { b[c >> 6] |= std::uint64_t{1} << (c & 63); }
+bool has_byte(const Bytes& b, unsigned char c) { return (b[c >> 6] >> (c & 63)) & 1; }
+void set_range(Bytes& b, unsigned char lo, unsigned char hi) {
+  for (unsigned c = lo; c <= hi; ++c) set_byte(b, static_cast<unsigned char>(c));
+}
+void merge(Bytes& b, const Bytes& other) {
+  for (std::size_t i = 0; i < b.size(); ++i) b[i] |= other[i];
+}
+Bytes negated(const Bytes& b) {
+  Bytes out;
+  for (std::size_t i = 0; i < b.size(); ++i) out[i] = ~b[i];
+  return out;
+}
+
+Bytes digit_bytes() {
+  Bytes b{};
+  set_range(b, '0', '9');
+  return b;
+}
+Bytes word_bytes() {  // isalnum in the "C" locale + '_'
+  Bytes b{};
+  set_range(b, '0', '9');
+  set_range(b, 'A', 'Z');
+  set_range(b, 'a', 'z');
+  set_byte(b, '_');
+  return b;
+}
+Bytes space_bytes() {  // isspace in the "C" locale
+  Bytes b{};
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) set_byte(b, c);
+  return b;
+}
+
+bool is_meta(char c) {
+  switch (c) {
+    case '^': case '$': case '\\': case '.': case '*': case '+': case '?':
+    case '(': case ')': case '[': case ']': case '{': case '}': case '|':
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+/** Parsed pattern. */
+struct RegexSet::Node {
+  enum class Kind : std::uint8_t { Set, Concat, Alt, Repeat, Empty, Begin, End };
+  Kind kind = Kind::Empty;
+  Bytes bytes{};
+  std::vector<Node> kids;
+  int min = 0;
+  int max = 0;  // -1 = unbounded
+};
+
+/** Recursive descent over the supported ECMAScript subset; fails on anything else. */
+class RegexSet::Parser {
+ public:
+  explicit Parser(const std::string& p) : p_(p) {}
+
+  bool parse(Node& out) {
+    if (!parse_alt(out)) return false;
+    return pos_ == p_.size();
+  }
+
+ private:
+  bool at_end() const { return pos_ >= p_.size(); }
+  char peek() const { return p_[pos_]; }
+
+  bool parse_alt(Node& out) {
+    Node first;
+    if (!parse_concat(first)) return false;
+    if (at_end() || peek() != '|') {
+      out = std::move(first);
+      return true;
+    }
+    out.kind = Node::Kind::Alt;
+    out.kids.push_back(std::move(first));
+    while (!at_end() && peek() == '|') {
+      ++pos_;
+      Node next;
+      if (!parse_concat(next)) return false;
+      out.kids.push_back(std::move(next));
+    }
+    return true;
+  }
+
+  bool parse_concat(Node& out) {
+    out.kind = Node::Kind::Concat;
+    while (!at_end() && peek() != '|' && peek() != ')') {
+      Node piece;
+      if (!parse_piece(piece)) return false;
+      out.kids.push_back(std::move(piece));
+    }
+    return true;
+  }
+
+  bool parse_piece(Node& out) {
+    Node atom;
+    if (!parse_atom(atom)) return false;
+    if (at_end()) {
+      out = std::move(atom);
+      return true;
+    }
+    int min = 0;
+    int max = 0;
+    char c = peek();
+    if (c == '*') {
+      min = 0, max = -1, ++pos_;
+    } else if (c == '+') {
+      min = 1, max = -1, ++pos_;
+    } else if (c == '?') {
+      min = 0, max = 1, ++pos_;
+    } else if (c == '{') {
+      if (!parse_braces(min, max)) return false;
+    } else {
+      out = std::move(atom);
+      return true;
+    }
+    if (atom.kind == Node::Kind::Begin || atom.kind == Node::Kind::End) return false;
+    if (!at_end() && peek() == '?') ++pos_;  // lazy: same set of matched strings
+    if (!at_end() && (peek() == '*' || peek() == '+' || peek() == '?' || peek() == '{')) return false;
+    out.kind = Node::Kind::Repeat;
+    out.min = min;
+    out.max = max;
+    out.kids.push_back(std::move(atom));
+    return true;
+  }
+
+  bool parse_number(int& v) {
+    std::size_t start = pos_;
+    v = 0;
+    while (!at_end() && peek() >= '0' && peek() <= '9') {
+      v = v * 10 + (peek() - '0');
+      if (v > kMaxRepeat) return false;
+      ++pos_;
+    }
+    return pos_ > start;
+  }
+
+  bool parse_braces(int& min, int& max) {
+    ++pos_;  // '{'
+    if (!parse_number(min)) return false;
+    max = min;
+    if (!at_end() && peek() == ',') {
+      ++pos_;
+      max = -1;
+      if (!at_end() && peek() != '}' && !parse_number(max)) return false;
+    }
+    if (at_end() || peek() != '}') return false;
+    ++pos_;
+    return max < 0 || max >= min;
+  }
+
+  bool parse_atom(Node& out) {
+    char c = peek();
+    out.kind = Node::Kind::Set;
+    switch (c) {
+      case '(': {
+        ++pos_;
+        if (!at_end() && peek() == '?') {
+          if (pos_ + 1 >= p_.size() || p_[pos_ + 1] != ':') return false;  // lookahead etc.
+          pos_ += 2;
+        }
+        if (!parse_alt(out)) return false;
+        if (at_end() || peek() != ')') return false;
+        ++pos_;
+        return true;
+      }
+      case '[':
+        ++pos_;
+        return parse_class(out.bytes);
+      case '.':
+        ++pos_;
+        out.bytes = Bytes{};
+        set_byte(out.bytes, '\n');
+        set_byte(out.bytes, '\r');
+        out.bytes = negated(out.bytes);
+        return true;
+      case '^':
+        ++pos_;
+        out.kind = Node::Kind::Begin;
+        return true;
+      case '$':
+        ++pos_;
+        out.kind = Node::Kind::End;
+        return true;
+      case '\\':
+        ++pos_;
+        return parse_escape(out.bytes);
+      default:
+        if (is_meta(c)) return false;
+        ++pos_;
+        set_byte(out.bytes, static_cast<unsigned char>(c));
+        return true;
+    }
+  }
+
+  /** After '\': a class escape or one literal byte. */
+  bool parse_escape(Bytes& out) {
+    if (at_end()) return false;
+    char c = p_[pos_++];
+    switch (c) {
+      case 'd': merge(out, digit_bytes()); return true;
+      case 'D': merge(out, negated(digit_bytes())); return true;
+      case 'w': merge(out, word_bytes()); return true;
+      case 'W': merge(out, negated(word_bytes())); return true;
+      case 's': merge(out, space_bytes()); return true;
+      case 'S': merge(out, negated(space_bytes())); return true;
+      case 't': set_byte(out, '\t'); return true;
+      case 'n': set_byte(out, '\n'); return true;
+      case 'r': set_byte(out, '\r'); return true;
+      case 'f': set_byte(out, '\f'); return true;
+      case 'v': set_byte(out, '\v'); return true;
+      default:
+        break;
+    }
+    unsigned char u = static_cast<unsigned char>(c);
+    if ((u >= '0' && u <= '9') || (u >= 'A' && u <= 'Z') || (u >= 'a' && u <= 'z')) return false;  // \b, \1, \x..
+    set_byte(out, u);
+    return true;
+  }
+
+  /** Single byte inside a class (for range ends); false for class escapes like \d. */
+  bool parse_class_char(unsigned char& out) {
+    if (at_end()) return false;
+    if (peek() != '\\') {
+      out = static_cast<unsigned char>(p_[pos_++]);
+      return true;
+    }
+    ++pos_;
+    Bytes b{};
+    std::size_t before = pos_;
+    if (!parse_escape(b)) return false;
+    char e = p_[before];
+    if (e == 'd' || e == 'D' || e == 'w' || e == 'W' || e == 's' || e == 'S') return false;
+    for (unsigned c = 0; c < 256; ++c)
+      if (has_byte(b, static_cast<unsigned char>(c))) out = static_cast<unsigned char>(c);
+    return true;
+  }
+
+  bool parse_class(Bytes& out) {
+    bool negate = false;
+    if (!at_end() && peek() == '^') {
+      negate = true;
+      ++pos_;
+    }
+    if (at_end() || peek() == ']') return false;  // "[]" / "[^]" differ between engines
+    Bytes b{};
+    while (!at_end() && peek() != ']') {
+      if (peek() == '[' && pos_ + 1 < p_.size() &&
+          (p_[pos_ + 1] == ':' || p_[pos_ + 1] == '.' || p_[pos_ + 1] == '='))
+        return false;  // [[:alpha:]] and friends
+      if (peek() == '\\' && pos_ + 1 < p_.size() &&
+          std::string("dDwWsS").find(p_[pos_ + 1]) != std::string::npos) {
+        ++pos_;
+        if (!parse_escape(b)) return false;
+        if (!at_end() && peek() == '-' && pos_ + 1 < p_.size() && p_[pos_ + 1] != ']') return false;
+        continue;
+      }
+      unsigned char lo = 0;
+      if (!parse_class_char(lo)) return false;
+      if (!at_end() && peek() == '-' && pos_ + 1 < p_.size() && p_[pos_ + 1] != ']') {
+        ++pos_;
+        unsigned char hi = 0;
+        if (!parse_class_char(hi) || hi < lo) return false;
+        set_range(b, lo, hi);
+      } else {
+        set_byte(b, lo);
+      }
+    }
+    if (at_end()) return false;
+    ++pos_;  // ']'
+    out = negate ? negated(b) : b;
+    return true;
+  }
+
+  const std::string& p_;
+  std::size_t pos_ = 0;
+};
+
+int RegexSet::new_state(Op op) {
+  NfaState s;
+  s.op = op;
+  nfa_.push_back(std::move(s));
+  return static_cast<int>(nfa_.size() - 1);
+}
+
+int RegexSet::compile(const Node& node, int next) {
+  switch (node.kind) {
+    case Node::Kind::Set: {
+      int s = new_state(Op::Char);
+      nfa_[s].bytes = node.bytes;
+      nfa_[s].out = {next};
+      return s;
+    }
+    case Node::Kind::Concat:
+      for (auto it = node.kids.rbegin(); it != node.kids.rend(); ++it) next = compile(*it, next);
+      return next;
+    case Node::Kind::Alt: {
+      int s = new_state(Op::Split);
+      std::vector<int> outs;
+      for (const auto& kid : node.kids) outs.push_back(compile(kid, next));
+      nfa_[s].out = std::move(outs);
+      return s;
+    }
+    case Node::Kind::Repeat: {
+      const Node& kid = node.kids.front();
+      int cur = next;
+      if (node.max < 0) {
+        int loop = new_state(Op::Split);
+        int body = compile(kid, loop);
+        nfa_[loop].out = {body, next};
+        cur = loop;
+      } else {
+        for (int i = node.min; i < node.max; ++i) {
+          int opt = new_state(Op::Split);
+          int body = compile(kid, cur);
+          nfa_[opt].out = {body, cur};
+          cur = opt;
+        }
+      }
+      for (int i = 0; i < node.min; ++i) cur = compile(kid, cur);
+      return cur;
+    }
+    case Node::Kind::Empty:
+      return next;
+    case Node::Kind::Begin:
+    case Node::Kind::End: {
+      int s = new_state(node.kind == Node::Kind::Begin ? Op::Begin : Op::End);
+      nfa_[s].out = {next};
+      return s;
+    }
+  }
+  return next;
+}
+
+bool RegexSet::add(const std::string& pattern, std::uint32_t tag) {
+  Node root;
+  Parser parser(pattern);
+  if (!parser.parse(root)) return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const std::size_t mark = nfa_.size();
+  int match = new_state(Op::Match);
+  nfa_[match].tag = tag;
+  int start = compile(root, match);
+  if (nfa_.size() - mark > kMaxStatesPerPattern) {  // e.g. (a{1000}){1000}
+    nfa_.resize(mark);
+    return false;
+  }
+  starts_.push_back(start);
+  prepared_ = false;
+  return true;
+}
+
+void RegexSet::closure(int start, bool at_begin, bool at_end, std::vector<int>& out, std::vector<char>& seen) const {
+  std::vector<int> stack{start};
+  while (!stack.empty()) {
+    int s = stack.back();
+    stack.pop_back();
+    if (seen[s]) continue;
+    seen[s] = 1;
+    const NfaState& st = nfa_[s];
+    switch (st.op) {
+      case Op::Char:
+      case Op::Match:
+        out.push_back(s);
+        break;
+      case Op::Split:
+        for (auto it = st.out.rbegin(); it != st.out.rend(); ++it) stack.push_back(*it);
+        break;
+      case Op::Begin:
+        if (at_begin) stack.push_back(st.out.front());
+        break;
+      case Op::End:
+        if (at_end)
+          stack.push_back(st.out.front());
+        else
+          out.push_back(s);  // followed if the string ends here
+        break;
+    }
+  }
+}
+
+void RegexSet::prepare() const {
+  if (prepared_) return;
+  // Bytes no pattern tells apart share a class: DFA rows are per class, not per byte.
+  std::set<Bytes> sets;
+  for (const auto& s : nfa_)
+    if (s.op == Op::Char) sets.insert(s.bytes);
+  byte_class_.fill(0);
+  classes_ = 1;
+  for (const auto& b : sets) {
+    std::map<std::pair<int, bool>, int> refine;
+    for (unsigned c = 0; c < 256; ++c) {
+      auto key = std::make_pair(static_cast<int>(byte_class_[c]), has_byte(b, static_cast<unsigned char>(c)));
+      auto it = refine.emplace(key, static_cast<int>(refine.size())).first;
+      byte_class_[c] = static_cast<std::uint8_t>(it->second);
+    }
+    classes_ = refine.size();
+    if (classes_ == 256) break;
+  }
+  std::vector<char> seen(nfa_.size(), 0);
+  start_set_.clear();
+  for (int s : starts_) closure(s, true, false, start_set_, seen);
+  std::sort(start_set_.begin(), start_set_.end());
+  dfa_.clear();
+  dfa_index_.clear();
+  dfa_bytes_ = 0;
+  start_ = -1;
+  prepared_ = true;
+}
+
+int RegexSet::intern(std::vector<int> nfa) const {
+  auto it = dfa_index_.find(nfa);
+  if (it != dfa_index_.end()) return it->second;
+  if (dfa_bytes_ > kMaxDfaBytes) {
+    ++flushes_;
+    dfa_.clear();
+    dfa_index_.clear();
+    dfa_bytes_ = 0;
+    start_ = -1;
+  }
+  dfa_bytes_ += 2 * nfa.size() * sizeof(int) + classes_ * sizeof(int) + sizeof(DfaState);
+  DfaState d;
+  d.next.assign(classes_, -1);
+  d.nfa = nfa;
+  dfa_.push_back(std::move(d));
+  int id = static_cast<int>(dfa_.size() - 1);
+  dfa_index_.emplace(std::move(nfa), id);
+  return id;
+}
+
+int RegexSet::step(int d, unsigned char c) const {
+  const std::uint8_t cls = byte_class_[c];
+  int n = dfa_[d].next[cls];
+  if (n >= 0) return n;
+  std::vector<int> set;
+  std::vector<char> seen(nfa_.size(), 0);
+  for (int s : dfa_[d].nfa) {
+    const NfaState& st = nfa_[s];
+    if (st.op == Op::Char && has_byte(st.bytes, c)) closure(st.out.front(), false, false, set, seen);
+  }
+  std::sort(set.begin(), set.end());
+  const std::size_t flushes = flushes_;
+  n = intern(std::move(set));
+  if (flushes == flushes_) dfa_[d].next[cls] = n;  // else intern() dropped the cache and d is gone
+  return n;
+}
+
+const std::vector<std::uint32_t>& RegexSet::accept_tags(int d) const {
+  DfaState& st = dfa_[d];
+  if (st.tags_ready) return st.tags;
+  std::vector<int> reached;
+  std::vector<char> seen(nfa_.size(), 0);
+  for (int s : st.nfa) {
+    if (nfa_[s].op == Op::Match) st.tags.push_back(nfa_[s].tag);
+    if (nfa_[s].op == Op::End) closure(nfa_[s].out.front(), false, true, reached, seen);
+  }
+  for (int s : reached)
+    if (nfa_[s].op == Op::Match) st.tags.push_back(nfa_[s].tag);
+  std::sort(st.tags.begin(), st.tags.end());
+  st.tags.erase(std::unique(st.tags.begin(), st.tags.end()), st.tags.end());
+  st.tags_ready = true;
+  return st.tags;
+}
+
+void RegexSet::match(const std::string& s, std::vector<std::uint32_t>& out) const {
+  if (starts_.empty()) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  prepare();
+  if (s.empty()) {  // both ^ and $ hold at position 0
+    std::vector<int> reached;
+    std::vector<char> seen(nfa_.size(), 0);
+    for (int st : starts_) closure(st, true, true, reached, seen);
+    std::vector<std::uint32_t> tags;
+    for (int st : reached)
+      if (nfa_[st].op == Op::Match) tags.push_back(nfa_[st].tag);
+    std::sort(tags.begin(), tags.end());
+    tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+    out.insert(out.end(), tags.begin(), tags.end());
+    return;
+  }
+  if (start_ < 0) start_ = intern(start_set_);
+  int d = start_;
+  for (char c : s) {
+    d = step(d, static_cast<unsigned char>(c));
+    if (dfa_[d].nfa.empty()) return;  // dead: no pattern can match any more
+  }
+  const auto& tags = accept_tags(d);
+  out.insert(out.end(), tags.begin(), tags.end());
+}
+
+}  // namespace common
+}  // namespace pgpooler
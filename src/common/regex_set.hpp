@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace pgpooler {
+namespace common {
+
+/** Many regular expressions compiled into one automaton: match() runs a lazily built DFA over the string once
+ * and reports every pattern that matches the whole string (std::regex_match semantics, ECMAScript syntax).
+ * Cost per lookup is linear in the string length, independent of the number of patterns once the DFA states
+ * it needs are built.
+ *
+ * Supported: literals, ., [...] classes with ranges and negation, \d \w \s \D \W \S, escaped metacharacters,
+ * \t \n \r \f \v, groups (...) and (?:...), |, * + ? {n} {n,} {n,m} (lazy variants match the same strings),
+ * ^ and $. Anything else (backreferences, lookahead, \b, [[:alpha:]], ...) makes add() return false; the caller
+ * keeps std::regex for that pattern. Thread-safe (the DFA cache is guarded by a mutex). */
+class RegexSet {
+ public:
+  RegexSet() = default;
+  RegexSet(const RegexSet&) = delete;
+  RegexSet& operator=(const RegexSet&) = delete;
+
+  /** Add pattern reported as tag. False if the pattern is outside the supported syntax (nothing is added). */
+  bool add(const std::string& pattern, std::uint32_t tag);
+
+  bool empty() const { return starts_.empty(); }
+
+  /** Append tags of all patterns matching the whole of s (ascending, each once). */
+  void match(const std::string& s, std::vector<std::uint32_t>& out) const;
+
+ private:
+  enum class Op : std::uint8_t { Char, Split, Begin, End, Match };
+  struct NfaState {
+    Op op = Op::Split;
+    std::array<std::uint64_t, 4> bytes{};  // Char: accepted bytes
+    std::vector<int> out;                  // Char/Begin/End: one successor; Split: any number
+    std::uint32_t tag = 0;                 // Match
+  };
+  struct DfaState {
+    std::vector<int> nfa;   // Char, End and Match states reached (sorted)
+    std::vector<int> next;  // per byte class; -1 = not built yet
+    bool tags_ready = false;
+    std::vector<std::uint32_t> tags;  // patterns accepting if the string ends here
+  };
+
+  struct Node;
+  class Parser;
+  int compile(const Node& node, int next);
+  int new_state(Op op);
+
+  void prepare() const;
+  void closure(int start, bool at_begin, bool at_end, std::vector<int>& out, std::vector<char>& seen) const;
+  int intern(std::vector<int> nfa) const;
+  int step(int d, unsigned char c) const;
+  const std::vector<std::uint32_t>& accept_tags(int d) const;
+
+  std::vector<NfaState> nfa_;
+  std::vector<int> starts_;  // start state of every pattern
+
+  mutable std::mutex mutex_;
+  mutable bool prepared_ = false;
+  mutable std::array<std::uint8_t, 256> byte_class_{};
+  mutable std::size_t classes_ = 1;
+  mutable std::vector<int> start_set_;
+  mutable int start_ = -1;
+  mutable std::vector<DfaState> dfa_;
+  mutable std::map<std::vector<int>, int> dfa_index_;
+  mutable std::size_t dfa_bytes_ = 0;
+  mutable std::size_t flushes_ = 0;
+};
+
+}  // namespace common
+}  // namespace pgpooler
@@ -0,0 +1,93 @@
+#include "common/stats.hpp"
+#include "common/log.hpp"
+#include <event2/event.h>
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+namespace pgpooler {
+namespace stats {
+
+namespace {
+
+struct PeriodicLog {
+  struct event* ev = nullptr;
+  std::string prefix;
+  std::string last;
+};
+
+void periodic_log_cb(evutil_socket_t, short, void* ctx) {
+  auto* p = static_cast<PeriodicLog*>(ctx);
+  std::string line = format();
+  if (line == p->last) return;  // nothing happened since the last line
+  p->last = line;
+  pgpooler::log::info(p->prefix + "stats: " + line);
+}
+
+struct ReplicaLag {
+  double lag_sec = 0;
+  bool lagging = false;
+};
+
+std::mutex lag_mutex;
+std::map<std::string, ReplicaLag> replica_lag;  // backend name -> last probe result
+
+}  // namespace
+
+void set_replica_lag(const std::string& backend_name, double lag_sec, bool lagging) {
+  std::lock_guard<std::mutex> lock(lag_mutex);
+  replica_lag[backend_name] = ReplicaLag{lag_sec, lagging};
+}
+
+void clear_replica_lag(const std::string& backend_name) {
+  std::lock_guard<std::mutex> lock(lag_mutex);
+  replica_lag.erase(backend_name);
+}
+
+namespace {
+
+/** " lag[replica]=0.250s" per probed backend; "down" if the probe fails, "!" if over max_lag. */
+std::string format_lag() {
+  std::lock_guard<std::mutex> lock(lag_mutex);
+  std::string out;
+  for (const auto& kv : replica_lag) {
+    out += " lag[" + kv.first + "]=";
+    if (kv.second.lag_sec < 0) {
+      out += "down";
+      continue;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3fs", kv.second.lag_sec);
+    out += buf;
+    if (kv.second.lagging) out += "!";
+  }
+  return out;
+}
+
+}  // namespace
+
+std::string format() {
+  const Counters& c = counters();
+  return "early_releases=" + std::to_string(c.early_releases.load(std::memory_order_relaxed)) +
+         " backend_hold_saved_ms=" + std::to_string(c.backend_hold_saved_us.load(std::memory_order_relaxed) / 1000) +
+         " spill_bytes=" + std::to_string(c.spill_bytes.load(std::memory_order_relaxed)) +
+         " spill_files=" + std::to_string(c.spill_files.load(std::memory_order_relaxed)) +
+         " read_routed=" + std::to_string(c.read_routed_requests.load(std::memory_order_relaxed)) +
+         " read_your_writes_primary=" + std::to_string(c.read_your_writes_primary.load(std::memory_order_relaxed)) +
+         format_lag();
+}
+
+void start_periodic_log(struct event_base* base, unsigned interval_sec, const std::string& prefix) {
+  if (!base || interval_sec == 0) return;
+  auto* p = new PeriodicLog{nullptr, prefix, format()};  // lives as long as the process
+  p->ev = event_new(base, -1, EV_PERSIST, periodic_log_cb, p);
+  if (!p->ev) {
+    delete p;
+    return;
+  }
+  struct timeval tv = {static_cast<long>(interval_sec), 0};
+  event_add(p->ev, &tv);
+}
+
+}  // namespace stats
+}  // namespace pgpooler
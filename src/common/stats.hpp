@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+struct event_base;
+
+namespace pgpooler {
+namespace stats {
+
+/** Process-wide counters (each worker process has its own). Written from the event loop, read by the stats timer. */
+struct Counters {
+  /** Responses whose backend went back to the pool before the client had read them (fed from the spool). */
+  std::atomic<std::uint64_t> early_releases{0};
+  /** Time those backends would otherwise have stayed checked out waiting for the client, microseconds. */
+  std::atomic<std::uint64_t> backend_hold_saved_us{0};
+  /** Bytes of client output written to spill files. */
+  std::atomic<std::uint64_t> spill_bytes{0};
+  /** Spill files created. */
+  std::atomic<std::uint64_t> spill_files{0};
+  /** Requests sent to a read backend by read/write splitting. */
+  std::atomic<std::uint64_t> read_routed_requests{0};
+  /** Read requests kept on the primary because no read backend had replayed the client's last write yet. */
+  std::atomic<std::uint64_t> read_your_writes_primary{0};
+};
+
+inline Counters& counters() {
+  static Counters value;
+  return value;
+}
+
+/** Replica lag gauge from the lag probe (server::LagMonitor); lag_sec < 0 = probe failing. */
+void set_replica_lag(const std::string& backend_name, double lag_sec, bool lagging);
+/** Backend no longer probed: drop its gauge. */
+void clear_replica_lag(const std::string& backend_name);
+
+/** One line with all counters and replica lag gauges, e.g. for the periodic log. */
+std::string format();
+
+/** Log format() every interval_sec seconds on base (prefix e.g. "[worker 0] "). 0 = disabled. */
+void start_periodic_log(struct event_base* base, unsigned interval_sec, const std::string& prefix);
+
+}  // namespace stats
+}  // namespace pgpooler
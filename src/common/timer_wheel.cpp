@@ -0,0 +1,74 @@
+#include "common/timer_wheel.hpp"
+#include <event2/event.h>
+
+namespace pgpooler {
+namespace common {
+
+TimerWheel::Timer::~Timer() {
+  if (wheel_) wheel_->cancel(*this);
+}
+
+TimerWheel::TimerWheel(struct event_base* base, std::chrono::milliseconds tick, std::size_t slots)
+    : tick_(tick.count() > 0 ? tick : std::chrono::milliseconds(1)), slots_(slots ? slots : 1) {
+  tick_ev_ = event_new(base, -1, EV_PERSIST, tick_cb, this);
+}
+
+TimerWheel::~TimerWheel() {
+  for (auto& slot : slots_)
+    for (Timer* t : slot) t->wheel_ = nullptr;
+  for (Timer* t : firing_) t->wheel_ = nullptr;
+  if (tick_ev_) event_free(tick_ev_);
+}
+
+void TimerWheel::schedule(Timer& timer, std::chrono::milliseconds delay) {
+  cancel(timer);
+  std::uint64_t ticks = static_cast<std::uint64_t>((delay.count() + tick_.count() - 1) / tick_.count());
+  if (ticks == 0) ticks = 1;
+  std::list<Timer*>& slot = slots_[(current_ + ticks) % slots_.size()];
+  timer.wheel_ = this;
+  timer.list_ = &slot;
+  timer.pos_ = slot.insert(slot.end(), &timer);
+  timer.rounds_ = (ticks - 1) / slots_.size();
+  if (armed_++ == 0 && tick_ev_) {
+    struct timeval tv = {static_cast<long>(tick_.count() / 1000), static_cast<long>((tick_.count() % 1000) * 1000)};
+    event_add(tick_ev_, &tv);
+  }
+}
+
+void TimerWheel::cancel(Timer& timer) {
+  if (timer.wheel_ != this) return;
+  timer.list_->erase(timer.pos_);
+  timer.wheel_ = nullptr;
+  timer.list_ = nullptr;
+  if (--armed_ == 0 && tick_ev_) event_del(tick_ev_);
+}
+
+void TimerWheel::tick_cb(evutil_socket_t, short, void* ctx) {
+  static_cast<TimerWheel*>(ctx)->advance();
+}
+
+void TimerWheel::advance() {
+  current_ = (current_ + 1) % slots_.size();
+  std::list<Timer*>& slot = slots_[current_];
+  for (auto it = slot.begin(); it != slot.end();) {
+    Timer* t = *it;
+    auto next = std::next(it);
+    if (t->rounds_ == 0) {
+      firing_.splice(firing_.end(), slot, it);
+      t->list_ = &firing_;
+    } else {
+      --t->rounds_;
+    }
+    it = next;
+  }
+  // A callback may cancel or destroy other timers (even ones in firing_), so take them one at a time.
+  while (!firing_.empty()) {
+    Timer* t = firing_.front();
+    cancel(*t);
+    std::function<void()> callback = t->callback_;  // the callback may destroy the timer's owner
+    if (callback) callback();
+  }
+}
+
+}  // namespace common
+}  // namespace pgpooler
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <event2/util.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <vector>
+
+struct event_base;
+struct event;
+
+namespace pgpooler {
+namespace common {
+
+/** Hashed timing wheel on a single libevent tick: O(1) schedule/cancel for many coarse timeouts (one or more per
+ * session) instead of one event per timer. Resolution is one tick; the tick event runs only while timers are
+ * armed. One wheel per worker; event loop thread only. */
+class TimerWheel {
+ public:
+  /** Timer owned by its user (e.g. a session member). Destroying it cancels it. */
+  class Timer {
+   public:
+    explicit Timer(std::function<void()> callback = {}) : callback_(std::move(callback)) {}
+    ~Timer();
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    void set_callback(std::function<void()> callback) { callback_ = std::move(callback); }
+    bool armed() const { return wheel_ != nullptr; }
+
+   private:
+    friend class TimerWheel;
+    std::function<void()> callback_;
+    TimerWheel* wheel_ = nullptr;
+    std::list<Timer*>* list_ = nullptr;
+    std::list<Timer*>::iterator pos_;
+    std::uint64_t rounds_ = 0;
+  };
+
+  TimerWheel(struct event_base* base, std::chrono::milliseconds tick = std::chrono::milliseconds(100),
+             std::size_t slots = 512);
+  ~TimerWheel();
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  /** (Re)arm timer to fire once after delay (rounded up to whole ticks). */
+  void schedule(Timer& timer, std::chrono::milliseconds delay);
+  void cancel(Timer& timer);
+
+ private:
+  static void tick_cb(evutil_socket_t fd, short what, void* ctx);
+  void advance();
+
+  struct event* tick_ev_ = nullptr;
+  std::chrono::milliseconds tick_;
+  std::vector<std::list<Timer*>> slots_;
+  std::list<Timer*> firing_;  // expired in the current tick, callbacks not run yet
+  std::size_t current_ = 0;
+  std::size_t armed_ = 0;
+};
+
+}  // namespace common
+}  // namespace pgpooler
@@ -1,4 +1,7 @@
 #include "config/config.hpp"
+#include "config/routing_index.hpp"
+#include "config/shard_map.hpp"
+#include "pool/shared_pool_budget.hpp"
 #include <algorithm>
 #include <iostream>
 #include <string>
@@ -24,46 +27,134 @@ bool FieldMatcher::match(const std::string& s) const {
 
 Router::Router(const std::vector<BackendEntry>& backends,
                const Defaults& defaults,
-               const std::vector<RoutingRule>& rules)
-    : backends_(backends), defaults_(defaults), rules_(rules) {}
+               const std::vector<RoutingRule>& rules,
+               std::size_t resolve_cache_size,
+               std::vector<BackendGroup> groups)
+    : backends_(backends),
+      defaults_(defaults),
+      rules_(rules),
+      groups_(std::move(groups)),
+      index_(std::make_unique<RoutingIndex>(rules_, backends_, groups_)),
+      cache_(resolve_cache_size ? std::make_unique<ResolveCache>(resolve_cache_size) : nullptr) {}
 
-std::optional<ResolvedBackend> Router::resolve(const std::string& user, const std::string& database) const {
-  for (const auto& rule : rules_) {
-    if (rule.is_default) {
-      // Default rule: match any
+Router::~Router() = default;
+
+std::optional<ResolvedBackend> Router::resolve(const std::string& user, const std::string& database,
+                                               const StartupParameter& parameter) const {
+  if (cache_) {
+    if (auto hit = cache_->find(user, database)) return *hit;
+  }
+  std::optional<ResolvedBackend> out;
+  bool cacheable = true;
+  std::size_t rule = index_->first_match(user, database);
+  if (rule != RoutingIndex::npos) {
+    const RoutingRule& r = rules_[rule];
+    if (r.shard_map) {
+      // A miss on a parameter-keyed rule is not cached either: the next client may send the parameter.
+      cacheable = r.shard_map->keyed_by_login();
+      if (auto value = r.shard_map->key_value(user, database, parameter)) {
+        const std::string& shard = r.shard_map->lookup(*value);
+        if (const BackendEntry* be = entry(shard)) out = make_resolved(r, shard, *be);
+      }
     } else {
-      if (rule.database.has_value() && !rule.database->match(database)) continue;
-      if (rule.user.has_value() && !rule.user->match(user)) continue;
+      out = make_resolved(r, r.backend_name, *index_->backend(rule));
+    }
+    if (out) out->origin.rule = static_cast<std::uint32_t>(rule);
+  }
+  if (cache_ && cacheable) cache_->insert(user, database, out);
+  return out;
+}
+
+std::optional<ResolvedBackend> Router::resolve_rule(std::uint32_t rule, const std::string& target) const {
+  if (rule >= rules_.size()) return std::nullopt;
+  const RoutingRule& r = rules_[rule];
+  if (!r.shard_map) {
+    if (target != r.backend_name) return std::nullopt;
+    ResolvedBackend out = make_resolved(r, r.backend_name, *index_->backend(rule));
+    out.origin.rule = rule;
+    return out;
+  }
+  const BackendEntry* be = entry(target);
+  if (!be) return std::nullopt;
+  ResolvedBackend out = make_resolved(r, target, *be);
+  out.origin.rule = rule;
+  return out;
+}
+
+const BackendEntry* Router::entry(const std::string& name) const {
+  std::string backend_name = name;
+  for (const auto& g : groups_) {
+    if (g.name == name && !g.members.empty()) {
+      backend_name = g.members.front().backend_name;
+      break;
     }
-    // Find backend by name
-    const BackendEntry* be = nullptr;
+  }
+  for (const auto& b : backends_)
+    if (b.name == backend_name) return &b;
+  return nullptr;
+}
+
+ResolvedBackend Router::make_resolved(const RoutingRule& rule, const std::string& target,
+                                      const BackendEntry& be) const {
+  ResolvedBackend out;
+  out.name = be.name;
+  out.host = be.host;
+  out.port = be.port;
+  out.pool_size = (rule.pool_size_override != 0) ? rule.pool_size_override : be.pool_size;
+  if (out.pool_size == 0) out.pool_size = defaults_.pool_size;
+  out.pool_mode = rule.has_pool_mode_override ? rule.pool_mode_override : be.pool_mode;
+  out.server_idle_timeout_sec = be.server_idle_timeout_sec;
+  out.server_lifetime_sec = be.server_lifetime_sec;
+  out.query_wait_timeout_sec = be.query_wait_timeout_sec;
+  out.server_drain_timeout_sec = be.server_drain_timeout_sec;
+  out.client_idle_timeout_sec = rule.client_idle_timeout_override.value_or(be.client_idle_timeout_sec);
+  out.idle_transaction_timeout_sec =
+      rule.idle_transaction_timeout_override.value_or(be.idle_transaction_timeout_sec);
+  out.query_timeout_sec = rule.query_timeout_override.value_or(be.query_timeout_sec);
+  out.server_reset_mode = be.server_reset_mode;
+  out.server_reset_tracking = be.server_reset_tracking;
+  out.server_reset_query = be.server_reset_query;
+  out.max_prepared_statements = be.max_prepared_statements;
+  out.client_buffer_memory = be.client_buffer_memory;
+  out.client_buffer_spill = be.client_buffer_spill;
+  out.origin.target = target;
+  out.members = targets(target, out.balance);
+  if (out.members.empty()) out.members.push_back(BackendTarget{be.name, be.host, be.port, 1});
+  if (!rule.read_backend_name.empty()) {
+    out.read_members = targets(rule.read_backend_name, out.read_balance);
+    if (!out.read_members.empty()) {
+      out.read_exclude_applications = rule.read_exclude_applications;
+      out.read_your_writes = rule.read_your_writes;
+    }
+  }
+  return out;
+}
+
+std::vector<BackendTarget> Router::targets(const std::string& name, BalanceMode& balance) const {
+  std::vector<BackendTarget> out;
+  auto add = [&](const std::string& backend_name, unsigned weight) {
     for (const auto& b : backends_) {
-      if (b.name == rule.backend_name) {
-        be = &b;
-        break;
-      }
+      if (b.name != backend_name) continue;
+      out.push_back(BackendTarget{b.name, b.host, b.port, weight});
+      return;
     }
-    if (!be) continue;
-    ResolvedBackend out;
-    out.name = be->name;
-    out.host = be->host;
-    out.port = be->port;
-    out.pool_size = (rule.pool_size_override != 0) ? rule.pool_size_override : be->pool_size;
-    if (out.pool_size == 0) out.pool_size = defaults_.pool_size;
-    out.pool_mode = rule.has_pool_mode_override ? rule.pool_mode_override : be->pool_mode;
-    out.server_idle_timeout_sec = be->server_idle_timeout_sec;
-    out.server_lifetime_sec = be->server_lifetime_sec;
-    out.query_wait_timeout_sec = be->query_wait_timeout_sec;
+  };
+  for (const auto& g : groups_) {
+    if (g.name != name) continue;
+    balance = g.balance;
+    for (const auto& m : g.members) add(m.backend_name, m.weight);
     return out;
   }
-  return std::nullopt;
+  add(name, 1);
+  return out;
 }
 
 BackendResolver make_resolver(const std::vector<BackendEntry>& backends,
                               const RoutingConfig& routing_cfg,
                               const Router* router) {
   if (!router || routing_cfg.routing.empty()) {
-    if (backends.empty()) return [](const std::string&, const std::string&) { return std::nullopt; };
+    if (backends.empty())
+      return [](const std::string&, const std::string&, const StartupParameter&) { return std::nullopt; };
     const BackendEntry& b = backends.front();
     ResolvedBackend fixed;
     fixed.name = b.name;
@@ -74,14 +165,66 @@ BackendResolver make_resolver(const std::vector<BackendEntry>& backends,
     fixed.server_idle_timeout_sec = b.server_idle_timeout_sec;
     fixed.server_lifetime_sec = b.server_lifetime_sec;
     fixed.query_wait_timeout_sec = b.query_wait_timeout_sec;
-    return [fixed](const std::string&, const std::string&) { return fixed; };
+    fixed.server_drain_timeout_sec = b.server_drain_timeout_sec;
+    fixed.client_idle_timeout_sec = b.client_idle_timeout_sec;
+    fixed.idle_transaction_timeout_sec = b.idle_transaction_timeout_sec;
+    fixed.query_timeout_sec = b.query_timeout_sec;
+    fixed.server_reset_mode = b.server_reset_mode;
+    fixed.server_reset_tracking = b.server_reset_tracking;
+    fixed.server_reset_query = b.server_reset_query;
+    fixed.max_prepared_statements = b.max_prepared_statements;
+    fixed.client_buffer_memory = b.client_buffer_memory;
+    fixed.client_buffer_spill = b.client_buffer_spill;
+    fixed.members.push_back(BackendTarget{b.name, b.host, b.port, 1});
+    fixed.origin.target = b.name;
+    return [fixed](const std::string&, const std::string&, const StartupParameter&) { return fixed; };
   }
   const Router* r = router;
-  return [r](const std::string& user, const std::string& database) {
-    return r->resolve(user, database);
+  return [r](const std::string& user, const std::string& database, const StartupParameter& parameter) {
+    return r->resolve(user, database, parameter);
+  };
+}
+
+std::shared_ptr<const RoutingSnapshot> make_routing_snapshot(BackendsConfig backends_cfg, RoutingConfig routing_cfg) {
+  auto s = std::make_shared<RoutingSnapshot>();
+  s->backends_cfg = std::move(backends_cfg);
+  s->routing_cfg = std::move(routing_cfg);
+  if (!s->routing_cfg.routing.empty())
+    s->router = std::make_unique<Router>(s->backends_cfg.backends, s->routing_cfg.defaults, s->routing_cfg.routing,
+                                         s->routing_cfg.resolve_cache_size, s->backends_cfg.groups);
+  s->resolve = make_resolver(s->backends_cfg.backends, s->routing_cfg, s->router.get());
+  s->fingerprint = s->backends_cfg.source_hash * 1099511628211ull ^ s->routing_cfg.source_hash;
+  return s;
+}
+
+BackendResolver make_resolver(const RoutingState* state) {
+  return [state](const std::string& user, const std::string& database, const StartupParameter& parameter) {
+    std::shared_ptr<const RoutingSnapshot> s = state->current();
+    auto out = s->resolve(user, database, parameter);
+    if (out) out->origin.config_fingerprint = s->fingerprint;
+    return out;
   };
 }
 
+std::optional<ResolvedBackend> replay_route(const RoutingState* state, const RouteOrigin& origin) {
+  std::shared_ptr<const RoutingSnapshot> s = state->current();
+  if (origin.config_fingerprint == 0 || origin.config_fingerprint != s->fingerprint) return std::nullopt;
+  std::optional<ResolvedBackend> out;
+  if (!s->router) {
+    if (origin.rule == RouteOrigin::NO_RULE) out = s->resolve("", "", {});  // the first backend, whoever asks
+  } else {
+    out = s->router->resolve_rule(origin.rule, origin.target);
+  }
+  if (out) out->origin.config_fingerprint = s->fingerprint;
+  return out;
+}
+
+unsigned worker_pool_size(unsigned pool_size, std::size_t index, std::size_t count) {
+  if (pool_size == 0 || count <= 1) return pool_size;
+  const std::size_t share = pool_size / count + (index < pool_size % count ? 1 : 0);
+  return share > 0 ? static_cast<unsigned>(share) : 1u;
+}
+
 PoolManager::PoolManager(const std::vector<BackendEntry>& backends) {
   for (const auto& b : backends) {
     state_[b.name] = std::make_tuple(0u, 0u, b.pool_size);
@@ -95,7 +238,12 @@ bool PoolManager::acquire(const std::string& backend_name) {
   unsigned& in_use = std::get<0>(it->second);
   unsigned& in_pool = std::get<1>(it->second);
   unsigned max_val = std::get<2>(it->second);
-  if (max_val != 0 && in_use + in_pool >= max_val) return false;
+  const int slot = shared_slot(backend_name);
+  if (slot >= 0) {
+    if (!shared_->acquire(slot)) return false;
+  } else if (max_val != 0 && in_use + in_pool >= max_val) {
+    return false;
+  }
   ++in_use;
   return true;
 }
@@ -103,7 +251,11 @@ bool PoolManager::acquire(const std::string& backend_name) {
 void PoolManager::release(const std::string& backend_name) {
   std::lock_guard<std::mutex> lock(mutex_);
   auto it = state_.find(backend_name);
-  if (it != state_.end() && std::get<0>(it->second) > 0) --std::get<0>(it->second);
+  if (it != state_.end() && std::get<0>(it->second) > 0) {
+    --std::get<0>(it->second);
+    const int slot = shared_slot(backend_name);
+    if (slot >= 0) shared_->release(slot);
+  }
 }
 
 void PoolManager::put_backend(const std::string& backend_name) {
@@ -115,6 +267,8 @@ void PoolManager::put_backend(const std::string& backend_name) {
   if (in_use > 0) {
     --in_use;
     ++in_pool;
+    const int slot = shared_slot(backend_name);
+    if (slot >= 0) shared_->put(slot);
   }
 }
 
@@ -126,8 +280,169 @@ bool PoolManager::take_backend(const std::string& backend_name) {
   if (in_pool == 0) return false;
   --in_pool;
   ++std::get<0>(it->second);
+  const int slot = shared_slot(backend_name);
+  if (slot >= 0) shared_->take(slot);
   return true;
 }
 
+void PoolManager::use_shared_budget(pgpooler::pool::SharedPoolBudget* budget) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  shared_ = budget;
+  shared_slots_.clear();
+  if (!shared_) return;
+  for (const auto& kv : state_) {
+    const int slot = shared_->configure(kv.first, std::get<2>(kv.second));
+    if (slot >= 0) shared_slots_[kv.first] = slot;
+  }
+}
+
+void PoolManager::set_waiting(const std::string& backend_name, bool waiting) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int slot = shared_slot(backend_name);
+  if (slot >= 0) shared_->set_waiting(slot, waiting);
+}
+
+bool PoolManager::wanted_elsewhere(const std::string& backend_name, const std::string& user,
+                                   const std::string& database) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int slot = shared_slot(backend_name);
+  return slot >= 0 && shared_->waited_elsewhere(slot) &&
+         peer_wants_.count(std::make_tuple(backend_name, user, database)) == 0;
+}
+
+void PoolManager::set_wanted_by_peer(const std::string& backend_name, const std::string& user,
+                                     const std::string& database, bool wanted) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (wanted)
+    peer_wants_.insert(std::make_tuple(backend_name, user, database));
+  else
+    peer_wants_.erase(std::make_tuple(backend_name, user, database));
+}
+
+void PoolManager::hand_over_backend(const std::string& backend_name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = state_.find(backend_name);
+  if (it != state_.end() && std::get<1>(it->second) > 0) --std::get<1>(it->second);
+}
+
+bool PoolManager::adopt_backend(const std::string& backend_name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = state_.find(backend_name);
+  if (it == state_.end()) return false;
+  ++std::get<1>(it->second);
+  return true;
+}
+
+int PoolManager::shared_slot(const std::string& backend_name) const {
+  if (!shared_) return -1;
+  auto it = shared_slots_.find(backend_name);
+  return it == shared_slots_.end() ? -1 : it->second;
+}
+
+bool PoolManager::has_backend(const std::string& backend_name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return state_.count(backend_name) != 0;
+}
+
+std::size_t PoolManager::pick(const std::vector<BackendTarget>& members, BalanceMode balance,
+                              std::uint64_t min_replay_lsn) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::size_t best = 0;
+  // 2 = free slot, 1 = full but has idle connections (maybe for this user/database), 0 = full, -1 = lagging
+  int best_rank = -2;
+  double best_score = 0;
+  bool best_idle = false;
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    auto it = state_.find(members[i].name);
+    if (it == state_.end()) continue;
+    const unsigned in_use = std::get<0>(it->second);
+    const unsigned in_pool = std::get<1>(it->second);
+    const unsigned max_val = std::get<2>(it->second);
+    const bool idle = in_pool > 0;
+    const int slot = shared_slot(members[i].name);
+    const bool room = slot >= 0 ? shared_->room(slot) > 0 : (max_val == 0 || in_use + in_pool < max_val);
+    const int rank = behind(members[i].name, min_replay_lsn) ? -1
+                     : room ? 2
+                     : idle ? 1
+                            : 0;
+    const double weight = members[i].weight ? members[i].weight : 1;
+    double score = in_use / weight;
+    if (balance == BalanceMode::Latency) {
+      auto lat = latency_us_.find(members[i].name);
+      // Members without samples score 0 so that each one gets probed.
+      score = (lat == latency_us_.end() ? 0.0 : lat->second) * (in_use + 1) / weight;
+    }
+    // An idle connection only breaks ties: reusing it must not pin all load to one member.
+    if (rank > best_rank || (rank == best_rank && (score < best_score || (score == best_score && idle && !best_idle)))) {
+      best = i;
+      best_rank = rank;
+      best_score = score;
+      best_idle = idle;
+    }
+  }
+  return best;
+}
+
+void PoolManager::record_latency(const std::string& backend_name, std::uint64_t us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = latency_us_.find(backend_name);
+  if (it == latency_us_.end())
+    latency_us_[backend_name] = static_cast<double>(us);
+  else
+    it->second += 0.2 * (static_cast<double>(us) - it->second);
+}
+
+void PoolManager::set_lagging(const std::string& backend_name, bool lagging) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (lagging)
+    lagging_.insert(backend_name);
+  else
+    lagging_.erase(backend_name);
+}
+
+bool PoolManager::all_lagging(const std::vector<BackendTarget>& members, std::uint64_t min_replay_lsn) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& m : members)
+    if (!behind(m.name, min_replay_lsn)) return false;
+  return true;
+}
+
+bool PoolManager::behind(const std::string& backend_name, std::uint64_t min_replay_lsn) const {
+  if (lagging_.count(backend_name)) return true;
+  if (min_replay_lsn == 0) return false;
+  auto it = wal_.find(backend_name);
+  return it == wal_.end() || !it->second.replay_lsn || *it->second.replay_lsn < min_replay_lsn;
+}
+
+void PoolManager::set_wal_position(const std::string& backend_name, std::optional<std::uint64_t> replay_lsn,
+                                   std::optional<std::uint64_t> current_lsn,
+                                   std::chrono::steady_clock::time_point probe_sent_at) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  wal_[backend_name] = WalPosition{replay_lsn, current_lsn, probe_sent_at};
+}
+
+std::optional<std::uint64_t> PoolManager::current_lsn_since(const std::string& backend_name,
+                                                            std::chrono::steady_clock::time_point after) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = wal_.find(backend_name);
+  if (it == wal_.end() || it->second.sampled_at <= after) return std::nullopt;
+  return it->second.current_lsn;
+}
+
+void PoolManager::reconfigure(const std::vector<BackendEntry>& backends) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& b : backends) {
+    auto it = state_.find(b.name);
+    if (it == state_.end())
+      state_[b.name] = std::make_tuple(0u, 0u, b.pool_size);
+    else
+      std::get<2>(it->second) = b.pool_size;
+    if (shared_) {
+      const int slot = shared_->configure(b.name, b.pool_size);
+      if (slot >= 0) shared_slots_[b.name] = slot;
+    }
+  }
+}
+
 }  // namespace config
 }  // namespace pgpooler
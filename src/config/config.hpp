@@ -1,15 +1,23 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <regex>
+#include <set>
 #include <string>
+#include <tuple>
 #include <vector>
 
 namespace pgpooler {
+namespace pool {
+class SharedPoolBudget;
+}
 namespace config {
 
 /** When to return a backend connection to the pool (PgBouncer/Odyssey style). */
@@ -22,6 +30,33 @@ enum class PoolMode {
   Statement
 };
 
+/** How the reset query (DISCARD ALL) is issued on a pooled connection handed out again. */
+enum class ResetMode {
+  /** Send the reset, wait for its ReadyForQuery, then forward the client's buffered messages. */
+  Take,
+  /** Send the reset and the client's buffered messages in one write; the reset's replies are swallowed. */
+  Pipelined,
+  /** Reset when the connection is returned: the pool offers it to take() only after the reset's ReadyForQuery. */
+  Return
+};
+
+/** Replica lag probe: a dedicated connection that periodically reads the replay position and delay. */
+struct LagProbeConfig {
+  /** Seconds between probes. 0 = probing disabled. */
+  double interval_sec = 0;
+  /** Replay delay (seconds) above which the backend is lagging and drops out of routing. 0 = only a failing
+   * probe (backend unreachable, auth error, no answer within interval) takes it out. */
+  double max_lag_sec = 0;
+  std::string user;
+  std::string password;  // for cleartext, md5 or SCRAM-SHA-256 auth; empty = trust
+  std::string database;  // empty = same as user
+
+  bool operator==(const LagProbeConfig& o) const {
+    return interval_sec == o.interval_sec && max_lag_sec == o.max_lag_sec && user == o.user &&
+           password == o.password && database == o.database;
+  }
+};
+
 struct BackendEntry {
   std::string name;
   std::string host;
@@ -35,6 +70,72 @@ struct BackendEntry {
   unsigned server_lifetime_sec = 3600;
   /** Max time to wait in queue for a connection (seconds). 0 = wait indefinitely. */
   unsigned query_wait_timeout_sec = 0;
+  /** Client disconnected mid-query: cancel it and let the pool drain the connection to ReadyForQuery for at
+   * most this long (seconds) before reusing it; over the limit it is closed. 0 = close right away. */
+  unsigned server_drain_timeout_sec = 10;
+  /** Close a client that sent nothing for this long outside a transaction (seconds). 0 = disabled. */
+  unsigned client_idle_timeout_sec = 0;
+  /** Close a client idle inside an open transaction (its backend is pinned) for this long (seconds). 0 = disabled. */
+  unsigned idle_transaction_timeout_sec = 0;
+  /** Cancel a query running on the backend longer than this (seconds). 0 = disabled. */
+  unsigned query_timeout_sec = 0;
+  /** How to run the reset query when a pooled connection is reused (server_reset_mode: take | pipelined | return). */
+  ResetMode server_reset_mode = ResetMode::Take;
+  /** Track whether clients changed server-side state: clean connections skip the reset,
+   * connections with only SET/ParameterStatus changes get server_reset_query, the rest DISCARD ALL.
+   * false = DISCARD ALL on every reuse. Off by default: state changed inside functions is not seen. */
+  bool server_reset_tracking = false;
+  /** Cheaper reset for connections that only changed settings. Empty = DISCARD ALL. */
+  std::string server_reset_query = "RESET ALL";
+  /** Transaction/statement mode: named prepared statements are tracked per client and re-prepared
+   * (under pooler-unique names) on whatever connection runs them; at most this many per connection,
+   * least recently used are closed. 0 = disabled (named statements pass through as is). */
+  unsigned max_prepared_statements = 0;
+  /** Transaction/statement mode: buffer a finished response for a slow client in memory up to this many bytes
+   * (then up to client_buffer_spill bytes in a spill file) and return the backend on ReadyForQuery instead of
+   * waiting until the client has read everything. 0 = disabled. */
+  std::size_t client_buffer_memory = 0;
+  /** Bytes of a buffered response that may go to the spill file. 0 = memory only. */
+  std::size_t client_buffer_spill = 0;
+  /** Replica lag probing (lag_probe: in backends.yaml). */
+  LagProbeConfig lag_probe;
+};
+
+/** How a backend group picks the member for a new backend connection. */
+enum class BalanceMode {
+  /** Fewest connections checked out (in use), relative to weight. */
+  LeastConnections,
+  /** Lowest EWMA of observed query latency, scaled by connections in use and weight. */
+  Latency
+};
+
+struct BackendGroupMember {
+  std::string backend_name;
+  unsigned weight = 1;
+};
+
+/** Named set of backends (e.g. replicas); a routing rule may target it like a backend. */
+struct BackendGroup {
+  std::string name;
+  BalanceMode balance = BalanceMode::LeastConnections;
+  std::vector<BackendGroupMember> members;
+};
+
+/** One backend a session may connect to. */
+struct BackendTarget {
+  std::string name;
+  std::string host;
+  std::uint16_t port = 5432;
+  unsigned weight = 1;
+};
+
+/** Where a routing result came from, so another process loaded from the same config files can rebuild it
+ * without matching the rules again (replay_route): the dispatcher sends it to the worker with the client. */
+struct RouteOrigin {
+  static constexpr std::uint32_t NO_RULE = 0xffffffffu;
+  std::uint64_t config_fingerprint = 0;  // RoutingSnapshot::fingerprint; 0 = unknown
+  std::uint32_t rule = NO_RULE;          // index into the routing rules; NO_RULE without rules
+  std::string target;                    // backend, group or shard the rule routed to
 };
 
 /** Result of routing: backend to use, pool_size, pool_mode and timeouts. */
@@ -47,11 +148,37 @@ struct ResolvedBackend {
   unsigned server_idle_timeout_sec = 600;
   unsigned server_lifetime_sec = 3600;
   unsigned query_wait_timeout_sec = 0;
+  unsigned server_drain_timeout_sec = 10;
+  unsigned client_idle_timeout_sec = 0;
+  unsigned idle_transaction_timeout_sec = 0;
+  unsigned query_timeout_sec = 0;
+  ResetMode server_reset_mode = ResetMode::Take;
+  bool server_reset_tracking = false;
+  std::string server_reset_query = "RESET ALL";
+  unsigned max_prepared_statements = 0;
+  std::size_t client_buffer_memory = 0;
+  std::size_t client_buffer_spill = 0;
+  /** Backends to pick from per new connection: the group's members, or just this backend (name/host/port are
+   * the first one). */
+  std::vector<BackendTarget> members;
+  BalanceMode balance = BalanceMode::LeastConnections;
+  /** Read/write splitting: backend (or group members) for autocommit read-only statements. Empty = disabled. */
+  std::vector<BackendTarget> read_members;
+  BalanceMode read_balance = BalanceMode::LeastConnections;
+  /** application_name values that opt out of splitting (everything goes to name). */
+  std::vector<std::string> read_exclude_applications;
+  /** After a write, reads go only to read members that replayed the primary's WAL past it. */
+  bool read_your_writes = false;
+  RouteOrigin origin;
 };
 
-/** Resolver: (user, database) -> backend to use. Used when first message is Startup or for SSL default. */
-using BackendResolver =
-    std::function<std::optional<ResolvedBackend>(const std::string& user, const std::string& database)>;
+/** Startup parameter by name (application_name, options, ...); nullopt if the client did not send it. */
+using StartupParameter = std::function<std::optional<std::string>(const std::string& name)>;
+
+/** Resolver: (user, database) -> backend to use. Used when first message is Startup or for SSL default.
+ * parameter is consulted only by shard maps keyed on other startup parameters; may be empty. */
+using BackendResolver = std::function<std::optional<ResolvedBackend>(
+    const std::string& user, const std::string& database, const StartupParameter& parameter)>;
 
 /** Thread-safe: limits connections per backend. Tracks in_use + in_pool; acquire before creating, put_backend when putting in pool, take_backend when taking from pool, release when closing. */
 class PoolManager {
@@ -65,10 +192,66 @@ class PoolManager {
   void put_backend(const std::string& backend_name);
   /** Call when taking a connection from the pool (in_pool--, in_use++). Returns false if backend unknown. */
   bool take_backend(const std::string& backend_name);
+  /** Config reload: new pool_size for known backends, new backends added. Backends missing from the list keep
+   * their counters (connections still in use are returned or closed later); nothing routes to them any more. */
+  void reconfigure(const std::vector<BackendEntry>& backends);
+  /** True if this process keeps a pool for backend_name (a worker only has its own backends). */
+  bool has_backend(const std::string& backend_name);
+  /** Backend group: index of the member to open or take the next connection from. Prefers members with a free
+   * slot, then full ones with idle connections, lagging ones (or, with min_replay_lsn, ones not known to have
+   * replayed that far) last; among those the lowest score (see BalanceMode), an idle connection breaking ties.
+   * Members must be non-empty. */
+  std::size_t pick(const std::vector<BackendTarget>& members, BalanceMode balance, std::uint64_t min_replay_lsn = 0);
+  /** Observed query latency on a backend (for BalanceMode::Latency), microseconds. */
+  void record_latency(const std::string& backend_name, std::uint64_t us);
+  /** Lag probe verdict: a lagging backend is picked from a group only if every member lags, and is not used
+   * as a read backend at all. */
+  void set_lagging(const std::string& backend_name, bool lagging);
+  /** True if every member lags (see set_lagging) or, with min_replay_lsn, has not replayed up to it; a read
+   * route then falls back to the primary. */
+  bool all_lagging(const std::vector<BackendTarget>& members, std::uint64_t min_replay_lsn = 0);
+  /** Lag probe sample: replay LSN (replica) and current WAL LSN (primary), from a probe sent at probe_sent_at. */
+  void set_wal_position(const std::string& backend_name, std::optional<std::uint64_t> replay_lsn,
+                        std::optional<std::uint64_t> current_lsn, std::chrono::steady_clock::time_point probe_sent_at);
+  /** The primary's current WAL LSN from a probe sent after `after` (so it covers everything committed before);
+   * nullopt until such a sample arrives. */
+  std::optional<std::uint64_t> current_lsn_since(const std::string& backend_name,
+                                                 std::chrono::steady_clock::time_point after);
+  /** Worker processes: enforce pool_size across all of them through the shared segment (the local max is then
+   * not checked; in_use/in_pool stay counted locally for pick). Backends that get no slot stay local. */
+  void use_shared_budget(pgpooler::pool::SharedPoolBudget* budget);
+  /** Shared budget: this process has (or no longer has) clients queued for backend_name. */
+  void set_waiting(const std::string& backend_name, bool waiting);
+  /** Shared budget: another worker has clients queued for backend_name, so a connection going idle here
+   * should be closed to give them its slot rather than pooled. False if a worker wants this very
+   * (user, database): the connection is pooled and handed over to it (PeerChannel). */
+  bool wanted_elsewhere(const std::string& backend_name, const std::string& user, const std::string& database);
+  /** PeerChannel: some worker has (or no longer has) clients queued for this key. */
+  void set_wanted_by_peer(const std::string& backend_name, const std::string& user, const std::string& database,
+                          bool wanted);
+  /** An idle connection left this process for another worker (in_pool--); the shared budget keeps counting it. */
+  void hand_over_backend(const std::string& backend_name);
+  /** An idle connection came from another worker (in_pool++). False if the backend is not served here. */
+  bool adopt_backend(const std::string& backend_name);
 
  private:
   std::mutex mutex_;
   std::map<std::string, std::tuple<unsigned, unsigned, unsigned>> state_;  // name -> (in_use, in_pool, max)
+  pgpooler::pool::SharedPoolBudget* shared_ = nullptr;
+  std::map<std::string, int> shared_slots_;  // name -> slot in shared_
+  std::set<std::tuple<std::string, std::string, std::string>> peer_wants_;  // (backend, user, database)
+  /** Slot of a backend in the shared budget, or -1. Caller holds mutex_. */
+  int shared_slot(const std::string& backend_name) const;
+  std::map<std::string, double> latency_us_;  // name -> EWMA of record_latency samples
+  std::set<std::string> lagging_;
+  struct WalPosition {
+    std::optional<std::uint64_t> replay_lsn;
+    std::optional<std::uint64_t> current_lsn;
+    std::chrono::steady_clock::time_point sampled_at;
+  };
+  std::map<std::string, WalPosition> wal_;
+  /** Lagging, or min_replay_lsn given and not known to be replayed. Caller holds mutex_. */
+  bool behind(const std::string& backend_name, std::uint64_t min_replay_lsn) const;
 };
 
 /** Match type for database/user in routing rules. */
@@ -84,15 +267,31 @@ struct FieldMatcher {
   bool match(const std::string& s) const;
 };
 
+class ShardMap;
+
 /** One routing rule: conditions + backend + optional pool_size / pool_mode override. */
 struct RoutingRule {
   std::optional<FieldMatcher> database;
   std::optional<FieldMatcher> user;
   bool is_default = false;
-  std::string backend_name;
+  std::string backend_name;         // backend or group (BackendsConfig::groups)
+  /** Sharding: the backend (or group) comes from this shard map instead of backend_name. */
+  std::shared_ptr<const ShardMap> shard_map;
   unsigned pool_size_override = 0;   // 0 = use backend/defaults
   PoolMode pool_mode_override = PoolMode::Session;  // only used if explicitly set in YAML
   bool has_pool_mode_override = false;
+  /** Client timeouts for this route (seconds, 0 = disabled); unset = backend's value. */
+  std::optional<unsigned> client_idle_timeout_override;
+  std::optional<unsigned> idle_transaction_timeout_override;
+  std::optional<unsigned> query_timeout_override;
+  /** Read/write splitting (transaction/statement mode): autocommit read-only statements outside a transaction
+   * go to this backend or group, everything else to backend_name. Empty = disabled. */
+  std::string read_backend_name;
+  /** application_name values whose sessions never split. */
+  std::vector<std::string> read_exclude_applications;
+  /** Read-your-writes: after a client's write, its reads go only to read backends whose replay LSN reached the
+   * primary's WAL position after that write (lag_probe of the primary reports it); else to backend_name. */
+  bool read_your_writes = false;
 };
 
 /** Global defaults (pool_size, pool_mode) for routing config. */
@@ -101,25 +300,63 @@ struct Defaults {
   PoolMode pool_mode = PoolMode::Session;
 };
 
-/** Router: first matching rule wins. */
+class RoutingIndex;
+class ResolveCache;
+
+/** Router: first matching rule wins. Rules are compiled into a RoutingIndex; results are kept in a bounded
+ * (user, database) cache of resolve_cache_size entries (0 = no cache). */
 class Router {
  public:
   Router(const std::vector<BackendEntry>& backends,
          const Defaults& defaults,
-         const std::vector<RoutingRule>& rules);
-  std::optional<ResolvedBackend> resolve(const std::string& user, const std::string& database) const;
+         const std::vector<RoutingRule>& rules,
+         std::size_t resolve_cache_size = 4096,
+         std::vector<BackendGroup> groups = {});
+  ~Router();
+  Router(const Router&) = delete;
+  Router& operator=(const Router&) = delete;
+
+  /** Results of rules sharded on a parameter other than user/database are not cached. */
+  std::optional<ResolvedBackend> resolve(const std::string& user, const std::string& database,
+                                         const StartupParameter& parameter = {}) const;
+  /** Result of rule `rule` routing to target (RouteOrigin of an earlier resolve), without matching. nullopt if
+   * there is no such rule or target. */
+  std::optional<ResolvedBackend> resolve_rule(std::uint32_t rule, const std::string& target) const;
 
  private:
+  /** target: backend or group the rule routes to (backend_name, or the shard); be: it or its first member. */
+  ResolvedBackend make_resolved(const RoutingRule& rule, const std::string& target, const BackendEntry& be) const;
+  /** Targets for a backend or group name (empty if unknown); balance is set for a group. */
+  std::vector<BackendTarget> targets(const std::string& name, BalanceMode& balance) const;
+  /** Backend entry of a backend, or of a group's first member; nullptr if unknown. */
+  const BackendEntry* entry(const std::string& name) const;
+
   const std::vector<BackendEntry>& backends_;
   Defaults defaults_;
   std::vector<RoutingRule> rules_;
+  std::vector<BackendGroup> groups_;
+  std::unique_ptr<RoutingIndex> index_;
+  std::unique_ptr<ResolveCache> cache_;
 };
 
-/** One worker: owns pools for the listed backends. */
+/** One worker: owns pools for the listed backends. A backend listed for several workers is served by all of
+ * them: the dispatcher spreads its (user, database) pairs over them and each gets a share of its pool_size. */
 struct WorkerEntry {
   std::vector<std::string> backends;  // backend names this worker serves
 };
 
+/** pool_size of a backend for worker `index` of the `count` workers serving it: an even split, the remainder
+ * to the first workers, at least 1 (so a pool_size below count is exceeded). 0 (unlimited) stays 0. */
+unsigned worker_pool_size(unsigned pool_size, std::size_t index, std::size_t count);
+
+/** How workers serving the same backend share its pool_size. */
+enum class PoolBudget {
+  /** One limit for all workers, counted in shared memory; a freed slot wakes clients queued in any worker. */
+  Shared,
+  /** Each worker gets a fixed share (worker_pool_size); no shared state. */
+  Split
+};
+
 /** Main application config (YAML): listen, paths to logging/backends/routing configs. */
 struct AppConfig {
   std::string listen_host = "0.0.0.0";
@@ -129,6 +366,21 @@ struct AppConfig {
   std::string routing_config_path;
   /** If non-empty, run in dispatcher+workers mode: dispatcher accepts and hands off to workers. */
   std::vector<WorkerEntry> workers;
+  /** Directory for client_buffer_spill files (created and unlinked right away). */
+  std::string spill_directory = "/tmp";
+  /** Log the stats counters every N seconds (per process). 0 = disabled. */
+  unsigned stats_interval_sec = 60;
+  /** Dispatcher: a (backend, user, database) key handed off more often than this per second is hot and goes to
+   * the least loaded of its backend's workers instead of its own. 0 = always its own worker. */
+  unsigned hot_key_rate = 0;
+  /** Dispatcher processes, each with its own SO_REUSEPORT listener and sockets to every worker. */
+  unsigned dispatcher_processes = 1;
+  /** Pin dispatcher i to CPU i (mod CPU count) and steer connections to it with SO_INCOMING_CPU. */
+  bool dispatcher_incoming_cpu = false;
+  /** Dispatcher: TCP_DEFER_ACCEPT for this many seconds, startup read in the accept callback. 0 = off. */
+  unsigned dispatcher_defer_accept_sec = 0;
+  /** Workers: pool_size of a backend served by several workers is shared or split between them. */
+  PoolBudget pool_budget = PoolBudget::Shared;
 };
 
 /** Logging config (YAML): level, destination, file options, format, rotation. */
@@ -144,15 +396,20 @@ struct LoggingConfig {
   int rotation_size_mb = 0;           // 0 = no size-based rotation
 };
 
-/** Backends config (YAML): list of PostgreSQL backends. */
+/** Backends config (YAML): list of PostgreSQL backends and groups of them. */
 struct BackendsConfig {
   std::vector<BackendEntry> backends;
+  std::vector<BackendGroup> groups;
+  std::uint64_t source_hash = 0;  // of the file's bytes
 };
 
 /** Routing config (YAML): pool defaults and routing rules only (backend names refer to backends config). */
 struct RoutingConfig {
   Defaults defaults;
   std::vector<RoutingRule> routing;
+  /** Max (user, database) pairs whose resolve result the router remembers. 0 = no cache. */
+  std::size_t resolve_cache_size = 4096;
+  std::uint64_t source_hash = 0;  // of the file's bytes
 };
 
 /** Load main application config from YAML. Returns false on error (logs to stderr). */
@@ -172,5 +429,41 @@ BackendResolver make_resolver(const std::vector<BackendEntry>& backends,
                               const RoutingConfig& routing_cfg,
                               const Router* router);
 
+/** Backends and routing loaded together, with the Router and resolver built over them. Never modified once
+ * published (RoutingState); a reload builds a new one. */
+struct RoutingSnapshot {
+  BackendsConfig backends_cfg;
+  RoutingConfig routing_cfg;
+  std::unique_ptr<Router> router;  // nullptr if there are no routing rules
+  BackendResolver resolve;
+  /** Of the backends and routing files: processes that loaded the same files have the same rules and targets. */
+  std::uint64_t fingerprint = 0;
+};
+
+/** Build a snapshot from loaded configs (the Router refers to the snapshot's own copy of the backends). */
+std::shared_ptr<const RoutingSnapshot> make_routing_snapshot(BackendsConfig backends_cfg, RoutingConfig routing_cfg);
+
+/** Current routing snapshot of the process. A reload publishes a new one with a single atomic pointer swap;
+ * a reader keeps the snapshot it loaded alive while it uses it. Sessions copy ResolvedBackend at startup, so
+ * they keep the backend they were routed to. */
+class RoutingState {
+ public:
+  explicit RoutingState(std::shared_ptr<const RoutingSnapshot> snapshot) : current_(std::move(snapshot)) {}
+
+  std::shared_ptr<const RoutingSnapshot> current() const { return std::atomic_load(&current_); }
+  void publish(std::shared_ptr<const RoutingSnapshot> snapshot) { std::atomic_store(&current_, std::move(snapshot)); }
+
+ private:
+  std::shared_ptr<const RoutingSnapshot> current_;
+};
+
+/** Resolver that always uses the snapshot current at call time (results carry its fingerprint in origin).
+ * state must outlive the resolver. */
+BackendResolver make_resolver(const RoutingState* state);
+
+/** Rebuild a result resolved by another process (origin from its resolver). nullopt if the current snapshot
+ * was loaded from different files or has no such rule: resolve the client's startup instead. */
+std::optional<ResolvedBackend> replay_route(const RoutingState* state, const RouteOrigin& origin);
+
 }  // namespace config
 }  // namespace pgpooler
@@ -1,7 +1,14 @@
 #include "config/config.hpp"
+#include "config/shard_map.hpp"
 #include <yaml-cpp/yaml.h>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
 #include <regex>
+#include <sstream>
 #include <string>
 
 namespace pgpooler {
@@ -24,6 +31,27 @@ bool parse_pool_mode(const YAML::Node& node, PoolMode& out) {
   return false;
 }
 
+/** Parse server_reset_mode: "take" | "pipelined" | "return". */
+bool parse_reset_mode(const YAML::Node& node, ResetMode& out) {
+  if (!node || !node.IsScalar()) return false;
+  std::string s = node.Scalar();
+  if (s == "take") { out = ResetMode::Take; return true; }
+  if (s == "pipelined") { out = ResetMode::Pipelined; return true; }
+  if (s == "return") { out = ResetMode::Return; return true; }
+  return false;
+}
+
+/** Non-negative number of seconds; nullopt if the key is absent or not a number (negative = 0). */
+std::optional<unsigned> parse_seconds(const YAML::Node& node) {
+  if (!node || !node.IsScalar()) return std::nullopt;
+  try {
+    int v = node.as<int>();
+    return (v >= 0) ? static_cast<unsigned>(v) : 0u;
+  } catch (const YAML::Exception&) {
+    return std::nullopt;
+  }
+}
+
 /** Parse a field (database or user) from a YAML node: scalar -> Exact/Prefix/Regex, sequence -> List. */
 bool parse_field_matcher(const YAML::Node& node, FieldMatcher& out) {
   if (!node) return false;
@@ -39,6 +67,10 @@ bool parse_field_matcher(const YAML::Node& node, FieldMatcher& out) {
   if (s.size() >= 2 && s[0] == '~' && s[1] == ' ') {
     out.type = MatchType::Regex;
     out.value = s.substr(2);
+    // `~ "regex"` is one plain YAML scalar, quotes included: they delimit the pattern, not part of it.
+    if (out.value.size() >= 2 && (out.value.front() == '"' || out.value.front() == '\'') &&
+        out.value.back() == out.value.front())
+      out.value = out.value.substr(1, out.value.size() - 2);
     try {
       out.re = std::regex(out.value);
     } catch (const std::regex_error&) {
@@ -56,6 +88,86 @@ bool parse_field_matcher(const YAML::Node& node, FieldMatcher& out) {
   return true;
 }
 
+/** YAML of a file, like YAML::LoadFile, and the FNV-1a hash of its bytes (config fingerprint). */
+YAML::Node load_hashed(const std::string& path, std::uint64_t& hash) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw YAML::BadFile(path);
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  const std::string text = contents.str();
+  hash = 14695981039346656037ull;
+  for (unsigned char c : text) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return YAML::Load(text);
+}
+
+/** Relative path: relative to the directory of base_file (shard maps next to routing.yaml). */
+std::string relative_to(const std::string& base_file, const std::string& path) {
+  if (path.empty() || path[0] == '/') return path;
+  std::string::size_type pos = base_file.find_last_of('/');
+  if (pos == std::string::npos) return path;
+  return base_file.substr(0, pos + 1) + path;
+}
+
+/** Load a shard map file (key, method, shards, pinned). nullptr on error (logs to stderr). */
+std::shared_ptr<const ShardMap> load_shard_map(const std::string& path) {
+  YAML::Node root;
+  try {
+    root = YAML::LoadFile(path);
+  } catch (const YAML::Exception& e) {
+    std::cerr << "PgPooler: failed to load shard map " << path << ": " << e.what() << std::endl;
+    return nullptr;
+  }
+  if (!root.IsMap()) {
+    std::cerr << "PgPooler: shard map root is not a map: " << path << std::endl;
+    return nullptr;
+  }
+  std::string key = "database";
+  if (root["key"] && root["key"].IsScalar()) key = root["key"].Scalar();
+  ShardMethod method = ShardMethod::Hash;
+  if (root["method"] && root["method"].IsScalar()) {
+    const std::string m = root["method"].Scalar();
+    if (m == "range") {
+      method = ShardMethod::Range;
+    } else if (m != "hash") {
+      std::cerr << "PgPooler: shard map " << path << ": unknown method " << m << std::endl;
+      return nullptr;
+    }
+  }
+  std::vector<ShardMap::Shard> shards;
+  auto shards_node = root["shards"];
+  if (shards_node && shards_node.IsSequence()) {
+    for (const auto& sn : shards_node) {
+      ShardMap::Shard shard;
+      if (sn.IsScalar()) {
+        shard.backend = sn.Scalar();
+      } else if (sn.IsMap() && sn["backend"] && sn["backend"].IsScalar()) {
+        shard.backend = sn["backend"].Scalar();
+        if (sn["weight"]) {
+          int w = sn["weight"].as<int>(1);
+          shard.weight = (w > 0) ? static_cast<unsigned>(w) : 1u;
+        }
+        if (sn["from"] && sn["from"].IsScalar()) shard.from = sn["from"].Scalar();
+      }
+      if (!shard.backend.empty()) shards.push_back(std::move(shard));
+    }
+  }
+  if (shards.empty()) {
+    std::cerr << "PgPooler: shard map " << path << ": no shards defined" << std::endl;
+    return nullptr;
+  }
+  std::unordered_map<std::string, std::string> pinned;
+  auto pinned_node = root["pinned"];
+  if (pinned_node && pinned_node.IsMap()) {
+    pinned.reserve(pinned_node.size());
+    for (const auto& kv : pinned_node)
+      if (kv.first.IsScalar() && kv.second.IsScalar()) pinned[kv.first.Scalar()] = kv.second.Scalar();
+  }
+  return std::make_shared<const ShardMap>(std::move(key), method, std::move(shards), std::move(pinned));
+}
+
 }  // namespace
 
 bool load_app_config(const std::string& path, AppConfig& out) {
@@ -103,6 +215,45 @@ bool load_app_config(const std::string& path, AppConfig& out) {
     }
   }
 
+  auto dispatcher = root["dispatcher"];
+  if (dispatcher && dispatcher.IsMap() && dispatcher["hot_key_rate"]) {
+    int v = dispatcher["hot_key_rate"].as<int>(0);
+    out.hot_key_rate = (v > 0) ? static_cast<unsigned>(v) : 0u;
+  }
+  if (dispatcher && dispatcher.IsMap() && dispatcher["processes"]) {
+    int v = dispatcher["processes"].as<int>(1);
+    if (v < 1) {
+      std::cerr << "PgPooler: dispatcher.processes must be >= 1, using 1" << std::endl;
+      v = 1;
+    }
+    out.dispatcher_processes = static_cast<unsigned>(v);
+  }
+  if (dispatcher && dispatcher.IsMap() && dispatcher["incoming_cpu"])
+    out.dispatcher_incoming_cpu = dispatcher["incoming_cpu"].as<bool>(false);
+  if (dispatcher && dispatcher.IsMap()) {
+    if (auto v = parse_seconds(dispatcher["defer_accept"])) out.dispatcher_defer_accept_sec = *v;
+  }
+  auto pool_budget = root["pool_budget"];
+  if (pool_budget && pool_budget.IsScalar()) {
+    const std::string v = pool_budget.Scalar();
+    if (v == "split")
+      out.pool_budget = PoolBudget::Split;
+    else if (v == "shared")
+      out.pool_budget = PoolBudget::Shared;
+    else
+      std::cerr << "PgPooler: unknown pool_budget " << v << ", using shared: " << path << std::endl;
+  }
+
+  auto spill = root["spill"];
+  if (spill && spill.IsMap() && spill["directory"] && spill["directory"].IsScalar()) {
+    out.spill_directory = spill["directory"].Scalar();
+  }
+  auto stats = root["stats"];
+  if (stats && stats.IsMap() && stats["interval"]) {
+    int v = stats["interval"].as<int>(60);
+    out.stats_interval_sec = (v >= 0) ? static_cast<unsigned>(v) : 0u;
+  }
+
   if (out.logging_config_path.empty()) {
     std::cerr << "PgPooler: app config must have logging.path: " << path << std::endl;
     return false;
@@ -155,7 +306,7 @@ bool load_logging_config(const std::string& path, LoggingConfig& out) {
 bool load_backends_config(const std::string& path, BackendsConfig& out) {
   YAML::Node root;
   try {
-    root = YAML::LoadFile(path);
+    root = load_hashed(path, out.source_hash);
   } catch (const YAML::Exception& e) {
     std::cerr << "PgPooler: failed to load backends config " << path << ": " << e.what() << std::endl;
     return false;
@@ -192,19 +343,118 @@ bool load_backends_config(const std::string& path, BackendsConfig& out) {
       int v = be["query_wait_timeout"].as<int>(0);
       e.query_wait_timeout_sec = (v >= 0) ? static_cast<unsigned>(v) : 0u;
     }
+    if (be["server_drain_timeout"]) {
+      int v = be["server_drain_timeout"].as<int>(10);
+      e.server_drain_timeout_sec = (v >= 0) ? static_cast<unsigned>(v) : 0u;
+    }
+    if (auto v = parse_seconds(be["client_idle_timeout"])) e.client_idle_timeout_sec = *v;
+    if (auto v = parse_seconds(be["idle_transaction_timeout"])) e.idle_transaction_timeout_sec = *v;
+    if (auto v = parse_seconds(be["query_timeout"])) e.query_timeout_sec = *v;
+    parse_reset_mode(be["server_reset_mode"], e.server_reset_mode);
+    if (be["server_reset_tracking"]) {
+      try { e.server_reset_tracking = be["server_reset_tracking"].as<bool>(); } catch (...) {}
+    }
+    if (be["server_reset_query"] && be["server_reset_query"].IsScalar()) {
+      e.server_reset_query = be["server_reset_query"].Scalar();
+    }
+    if (be["max_prepared_statements"]) {
+      int v = be["max_prepared_statements"].as<int>(0);
+      e.max_prepared_statements = (v >= 0) ? static_cast<unsigned>(v) : 0u;
+    }
+    if (be["client_buffer_memory"]) {
+      long long v = be["client_buffer_memory"].as<long long>(0);
+      e.client_buffer_memory = (v >= 0) ? static_cast<std::size_t>(v) : 0u;
+    }
+    if (be["client_buffer_spill"]) {
+      long long v = be["client_buffer_spill"].as<long long>(0);
+      e.client_buffer_spill = (v >= 0) ? static_cast<std::size_t>(v) : 0u;
+    }
+    if (be["lag_probe"] && be["lag_probe"].IsMap()) {
+      const YAML::Node lp = be["lag_probe"];
+      LagProbeConfig& c = e.lag_probe;
+      if (lp["user"] && lp["user"].IsScalar()) c.user = lp["user"].Scalar();
+      if (lp["password"] && lp["password"].IsScalar()) c.password = lp["password"].Scalar();
+      if (lp["database"] && lp["database"].IsScalar()) c.database = lp["database"].Scalar();
+      c.interval_sec = 1;
+      if (lp["interval"]) {
+        double v = lp["interval"].as<double>(1);
+        c.interval_sec = (v > 0) ? v : 0;
+      }
+      if (lp["max_lag"]) {
+        double v = lp["max_lag"].as<double>(0);
+        c.max_lag_sec = (v > 0) ? v : 0;
+      }
+      if (c.user.empty()) {
+        std::cerr << "PgPooler: backends config: " << e.name << ": lag_probe needs user, probing disabled" << std::endl;
+        c.interval_sec = 0;
+      }
+    }
     if (!e.host.empty()) out.backends.push_back(std::move(e));
   }
   if (out.backends.empty()) {
     std::cerr << "PgPooler: backends config: no backends defined: " << path << std::endl;
     return false;
   }
+
+  out.groups.clear();
+  auto groups = root["groups"];
+  if (groups && groups.IsSequence()) {
+    auto known = [&out](const std::string& name) {
+      for (const auto& b : out.backends)
+        if (b.name == name) return true;
+      return false;
+    };
+    for (const auto& gn : groups) {
+      if (!gn.IsMap() || !gn["name"] || !gn["name"].IsScalar()) continue;
+      BackendGroup g;
+      g.name = gn["name"].Scalar();
+      if (known(g.name)) {
+        std::cerr << "PgPooler: backends config: group " << g.name << " has the name of a backend, skipped" << std::endl;
+        continue;
+      }
+      if (gn["balance"] && gn["balance"].IsScalar()) {
+        const std::string b = gn["balance"].Scalar();
+        if (b == "latency")
+          g.balance = BalanceMode::Latency;
+        else if (b != "least_connections")
+          std::cerr << "PgPooler: backends config: group " << g.name << ": unknown balance " << b
+                    << ", using least_connections" << std::endl;
+      }
+      if (gn["members"] && gn["members"].IsSequence()) {
+        for (const auto& mn : gn["members"]) {
+          BackendGroupMember m;
+          if (mn.IsScalar()) {
+            m.backend_name = mn.Scalar();
+          } else if (mn.IsMap() && mn["backend"] && mn["backend"].IsScalar()) {
+            m.backend_name = mn["backend"].Scalar();
+            if (mn["weight"]) {
+              int w = mn["weight"].as<int>(1);
+              m.weight = (w > 0) ? static_cast<unsigned>(w) : 1u;
+            }
+          }
+          if (m.backend_name.empty()) continue;
+          if (!known(m.backend_name)) {
+            std::cerr << "PgPooler: backends config: group " << g.name << ": unknown backend " << m.backend_name
+                      << ", skipped" << std::endl;
+            continue;
+          }
+          g.members.push_back(std::move(m));
+        }
+      }
+      if (g.members.empty()) {
+        std::cerr << "PgPooler: backends config: group " << g.name << " has no members, skipped" << std::endl;
+        continue;
+      }
+      out.groups.push_back(std::move(g));
+    }
+  }
   return true;
 }
 
 bool load_routing_config(const std::string& path, RoutingConfig& out) {
   YAML::Node root;
   try {
-    root = YAML::LoadFile(path);
+    root = load_hashed(path, out.source_hash);
   } catch (const YAML::Exception& e) {
     std::cerr << "PgPooler: failed to load routing config " << path << ": " << e.what() << std::endl;
     return false;
@@ -222,8 +472,13 @@ bool load_routing_config(const std::string& path, RoutingConfig& out) {
     }
     parse_pool_mode(defaults["pool_mode"], out.defaults.pool_mode);
   }
+  if (root["resolve_cache_size"]) {
+    int v = root["resolve_cache_size"].as<int>(4096);
+    out.resolve_cache_size = (v > 0) ? static_cast<std::size_t>(v) : 0u;
+  }
 
   out.routing.clear();
+  std::map<std::string, std::shared_ptr<const ShardMap>> shard_maps;  // by path: rules may share a file
   auto routing = root["routing"];
   if (routing && routing.IsSequence()) {
     for (const auto& rule_node : routing) {
@@ -239,6 +494,23 @@ bool load_routing_config(const std::string& path, RoutingConfig& out) {
       if (rule_node["backend"] && rule_node["backend"].IsScalar()) {
         rule.backend_name = rule_node["backend"].Scalar();
       }
+      if (rule_node["shard_map"] && rule_node["shard_map"].IsScalar()) {
+        const std::string shard_path = relative_to(path, rule_node["shard_map"].Scalar());
+        auto it = shard_maps.find(shard_path);
+        if (it == shard_maps.end()) it = shard_maps.emplace(shard_path, load_shard_map(shard_path)).first;
+        if (!it->second) return false;
+        rule.shard_map = it->second;
+      }
+      if (rule_node["read_backend"] && rule_node["read_backend"].IsScalar()) {
+        rule.read_backend_name = rule_node["read_backend"].Scalar();
+      }
+      if (rule_node["read_your_writes"]) {
+        try { rule.read_your_writes = rule_node["read_your_writes"].as<bool>(); } catch (...) {}
+      }
+      if (rule_node["read_exclude_applications"] && rule_node["read_exclude_applications"].IsSequence()) {
+        for (const auto& app : rule_node["read_exclude_applications"])
+          if (app.IsScalar()) rule.read_exclude_applications.push_back(app.Scalar());
+      }
       if (rule_node["pool_size"]) {
         int ps = rule_node["pool_size"].as<int>(0);
         rule.pool_size_override = (ps > 0) ? static_cast<unsigned>(ps) : 0u;
@@ -251,12 +523,15 @@ bool load_routing_config(const std::string& path, RoutingConfig& out) {
         FieldMatcher um;
         if (parse_field_matcher(rule_node["user"], um)) rule.user = std::move(um);
       }
+      rule.client_idle_timeout_override = parse_seconds(rule_node["client_idle_timeout"]);
+      rule.idle_transaction_timeout_override = parse_seconds(rule_node["idle_transaction_timeout"]);
+      rule.query_timeout_override = parse_seconds(rule_node["query_timeout"]);
       if (rule_node["pool_mode"]) {
         if (parse_pool_mode(rule_node["pool_mode"], rule.pool_mode_override)) {
           rule.has_pool_mode_override = true;
         }
       }
-      if (rule.is_default || !rule.backend_name.empty()) {
+      if (rule.is_default || !rule.backend_name.empty() || rule.shard_map) {
         out.routing.push_back(std::move(rule));
       }
     }
@@ -0,0 +1,165 @@
+#include "config/routing_index.hpp"
+#include "config/shard_map.hpp"
+#include <algorithm>
+
+namespace pgpooler {
+namespace config {
+
+void RoutingIndex::FieldIndex::add(std::uint32_t rule, const FieldMatcher& m) {
+  switch (m.type) {
+    case MatchType::Exact:
+      exact_[m.value].push_back(rule);
+      break;
+    case MatchType::List:
+      for (const auto& v : m.list) {
+        auto& rules = exact_[v];
+        if (rules.empty() || rules.back() != rule) rules.push_back(rule);
+      }
+      break;
+    case MatchType::Prefix: {
+      std::uint32_t node = 0;
+      for (char c : m.value) {
+        auto it = trie_[node].next.find(c);
+        if (it == trie_[node].next.end()) {
+          trie_.push_back(TrieNode{});
+          it = trie_[node].next.emplace(c, static_cast<std::uint32_t>(trie_.size() - 1)).first;
+        }
+        node = it->second;
+      }
+      trie_[node].rules.push_back(rule);
+      break;
+    }
+    case MatchType::Regex:
+      if (!regex_.add(m.value, rule)) regex_fallback_.emplace_back(rule, &m);
+      break;
+  }
+}
+
+void RoutingIndex::FieldIndex::collect(const std::string& s, std::vector<std::uint32_t>& out) const {
+  out.clear();
+  auto it = exact_.find(s);
+  if (it != exact_.end()) out = it->second;
+  std::uint32_t node = 0;
+  for (std::size_t i = 0;; ++i) {
+    out.insert(out.end(), trie_[node].rules.begin(), trie_[node].rules.end());
+    if (i == s.size()) break;
+    auto next = trie_[node].next.find(s[i]);
+    if (next == trie_[node].next.end()) break;
+    node = next->second;
+  }
+  regex_.match(s, out);
+  for (const auto& r : regex_fallback_)
+    if (r.second->match(s)) out.push_back(r.first);
+  std::sort(out.begin(), out.end());
+  out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+RoutingIndex::RoutingIndex(const std::vector<RoutingRule>& rules, const std::vector<BackendEntry>& backends,
+                           const std::vector<BackendGroup>& groups)
+    : backends_(rules.size(), nullptr), has_database_(rules.size()), has_user_(rules.size()) {
+  for (std::size_t i = 0; i < rules.size(); ++i) {
+    const RoutingRule& rule = rules[i];
+    auto find = [&](std::string target) -> const BackendEntry* {
+      for (const auto& g : groups) {
+        if (g.name == target && !g.members.empty()) {
+          target = g.members.front().backend_name;
+          break;
+        }
+      }
+      for (const auto& b : backends)
+        if (b.name == target) return &b;
+      return nullptr;
+    };
+    if (rule.shard_map) {
+      // The Router picks the shard; any shard with a known backend makes the rule a candidate.
+      for (const auto& shard : rule.shard_map->shards())
+        if ((backends_[i] = find(shard.backend))) break;
+    } else {
+      backends_[i] = find(rule.backend_name);
+    }
+    if (!backends_[i]) continue;
+    const auto idx = static_cast<std::uint32_t>(i);
+    // A default rule matches anything, whatever database/user it lists.
+    has_database_[i] = !rule.is_default && rule.database.has_value();
+    has_user_[i] = !rule.is_default && rule.user.has_value();
+    if (has_database_[i]) database_.add(idx, *rule.database);
+    if (has_user_[i]) user_.add(idx, *rule.user);
+    if (!has_database_[i] && !has_user_[i] && unconditional_ == npos) unconditional_ = i;
+  }
+}
+
+std::size_t RoutingIndex::first_match(const std::string& user, const std::string& database) const {
+  std::vector<std::uint32_t> by_database;
+  std::vector<std::uint32_t> by_user;
+  database_.collect(database, by_database);
+  user_.collect(user, by_user);
+
+  std::size_t best = unconditional_;
+  for (std::uint32_t r : by_database) {  // database matches, no user condition
+    if (r >= best) break;
+    if (!has_user_[r]) {
+      best = r;
+      break;
+    }
+  }
+  for (std::uint32_t r : by_user) {  // user matches, no database condition
+    if (r >= best) break;
+    if (!has_database_[r]) {
+      best = r;
+      break;
+    }
+  }
+  std::size_t i = 0;
+  std::size_t j = 0;
+  while (i < by_database.size() && j < by_user.size() && by_database[i] < best) {  // both match
+    if (by_database[i] == by_user[j]) {
+      best = by_database[i];
+      break;
+    }
+    if (by_database[i] < by_user[j])
+      ++i;
+    else
+      ++j;
+  }
+  return best;
+}
+
+std::string ResolveCache::key(const std::string& user, const std::string& database) {
+  std::string k;
+  k.reserve(user.size() + 1 + database.size());
+  k.append(user).push_back('\0');  // neither name can contain NUL (Startup packet strings)
+  k.append(database);
+  return k;
+}
+
+std::optional<std::optional<ResolvedBackend>> ResolveCache::find(const std::string& user,
+                                                                 const std::string& database) {
+  const std::string k = key(user, database);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = map_.find(k);
+  if (it == map_.end()) return std::nullopt;
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void ResolveCache::insert(const std::string& user, const std::string& database,
+                          const std::optional<ResolvedBackend>& value) {
+  if (capacity_ == 0) return;
+  std::string k = key(user, database);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = map_.find(k);
+  if (it != map_.end()) {
+    it->second->second = value;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  if (map_.size() >= capacity_) {
+    map_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  lru_.emplace_front(k, value);
+  map_.emplace(std::move(k), lru_.begin());
+}
+
+}  // namespace config
+}  // namespace pgpooler
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common/regex_set.hpp"
+#include "config/config.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace pgpooler {
+namespace config {
+
+/** Routing rules compiled for lookup: hash maps for Exact/List, a prefix trie, all regexes of a field in one
+ * automaton (common::RegexSet), backends resolved up front.
+ * first_match() returns the same rule as a scan in order would (first match wins), but only looks at rules
+ * whose conditions can match the given strings. Immutable after construction. */
+class RoutingIndex {
+ public:
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  /** rules and backends must outlive the index (Router owns both). A rule targeting a group maps to the group's
+   * first member, a sharded rule to its first shard with a known backend. Rules with an unknown backend are
+   * skipped, like in the linear scan. */
+  RoutingIndex(const std::vector<RoutingRule>& rules, const std::vector<BackendEntry>& backends,
+               const std::vector<BackendGroup>& groups = {});
+
+  /** Index of the first rule matching (user, database), or npos. */
+  std::size_t first_match(const std::string& user, const std::string& database) const;
+
+  /** Backend (or first group member) of a rule returned by first_match (never nullptr for such a rule). */
+  const BackendEntry* backend(std::size_t rule) const { return backends_[rule]; }
+
+ private:
+  /** Rules that have a condition on one field (database or user), indexed by that field's matcher. */
+  class FieldIndex {
+   public:
+    void add(std::uint32_t rule, const FieldMatcher& m);
+    /** Ascending indices of rules whose matcher for this field accepts s. */
+    void collect(const std::string& s, std::vector<std::uint32_t>& out) const;
+
+   private:
+    struct TrieNode {
+      std::map<char, std::uint32_t> next;
+      std::vector<std::uint32_t> rules;  // Prefix matchers ending at this node
+    };
+    std::unordered_map<std::string, std::vector<std::uint32_t>> exact_;  // Exact and List values
+    std::vector<TrieNode> trie_{TrieNode{}};
+    pgpooler::common::RegexSet regex_;
+    /** Regexes outside RegexSet's syntax: matched one by one with std::regex. */
+    std::vector<std::pair<std::uint32_t, const FieldMatcher*>> regex_fallback_;
+  };
+
+  FieldIndex database_;
+  FieldIndex user_;
+  std::vector<const BackendEntry*> backends_;  // per rule; nullptr = backend unknown, rule never matches
+  std::vector<bool> has_database_;
+  std::vector<bool> has_user_;
+  std::size_t unconditional_ = npos;  // first rule without conditions (default: true or neither field)
+};
+
+/** Bounded LRU of resolve results keyed by (user, database); misses (no route) are cached too.
+ * Thread-safe. */
+class ResolveCache {
+ public:
+  explicit ResolveCache(std::size_t capacity) : capacity_(capacity) {}
+
+  /** Cached result, or nullopt if (user, database) is not in the cache. */
+  std::optional<std::optional<ResolvedBackend>> find(const std::string& user, const std::string& database);
+  void insert(const std::string& user, const std::string& database, const std::optional<ResolvedBackend>& value);
+
+ private:
+  static std::string key(const std::string& user, const std::string& database);
+
+  using Entry = std::pair<std::string, std::optional<ResolvedBackend>>;
+  std::mutex mutex_;
+  std::size_t capacity_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> map_;
+};
+
+}  // namespace config
+}  // namespace pgpooler
@@ -0,0 +1,107 @@
+#include "config/shard_map.hpp"
+#include <algorithm>
+
+namespace pgpooler {
+namespace config {
+
+ShardMap::ShardMap(std::string key, ShardMethod method, std::vector<Shard> shards,
+                   std::unordered_map<std::string, std::string> pinned)
+    : key_(std::move(key)), method_(method), shards_(std::move(shards)), pinned_(std::move(pinned)) {
+  if (method_ == ShardMethod::Range) {
+    std::stable_sort(shards_.begin(), shards_.end(), [](const Shard& a, const Shard& b) { return a.from < b.from; });
+    return;
+  }
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    const unsigned points = VNODES * std::max(1u, shards_[i].weight);
+    // Points depend only on the backend name, so shards keep their points when others are added or removed.
+    for (unsigned p = 0; p < points; ++p)
+      ring_.emplace_back(hash(shards_[i].backend + "#" + std::to_string(p)), static_cast<std::uint32_t>(i));
+  }
+  std::sort(ring_.begin(), ring_.end());
+}
+
+std::optional<std::string> ShardMap::key_value(const std::string& user, const std::string& database,
+                                               const StartupParameter& parameter) const {
+  if (key_ == "database") return database;
+  if (key_ == "user") return user;
+  if (!parameter) return std::nullopt;
+  static const std::string options_prefix = "options.";
+  if (key_.compare(0, options_prefix.size(), options_prefix) == 0) {
+    auto options = parameter("options");
+    if (!options) return std::nullopt;
+    return startup_option(*options, key_.substr(options_prefix.size()));
+  }
+  return parameter(key_);
+}
+
+const std::string& ShardMap::lookup(const std::string& value) const {
+  if (!pinned_.empty()) {
+    auto it = pinned_.find(value);
+    if (it != pinned_.end()) return it->second;
+  }
+  if (method_ == ShardMethod::Range) {
+    auto it = std::upper_bound(shards_.begin(), shards_.end(), value,
+                               [](const std::string& v, const Shard& s) { return v < s.from; });
+    return (it == shards_.begin()) ? shards_.front().backend : std::prev(it)->backend;
+  }
+  const std::uint64_t h = hash(value);
+  auto it = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(h, std::uint32_t{0}));
+  if (it == ring_.end()) it = ring_.begin();
+  return shards_[it->second].backend;
+}
+
+std::uint64_t ShardMap::hash(const std::string& s) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  // FNV-1a alone spreads short, similar strings (tenant_1, tenant_2, ...) poorly over the high bits.
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+std::optional<std::string> startup_option(const std::string& options, const std::string& name) {
+  std::vector<std::string> words;
+  std::string word;
+  bool in_word = false;
+  for (std::size_t i = 0; i < options.size(); ++i) {
+    char c = options[i];
+    if (c == '\\' && i + 1 < options.size()) {
+      word.push_back(options[++i]);
+      in_word = true;
+    } else if (c == ' ' || c == '\t') {
+      if (in_word) words.push_back(std::move(word));
+      word.clear();
+      in_word = false;
+    } else {
+      word.push_back(c);
+      in_word = true;
+    }
+  }
+  if (in_word) words.push_back(std::move(word));
+
+  std::optional<std::string> out;  // the last setting wins, as in the server
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    std::string setting;
+    if (words[i] == "-c" && i + 1 < words.size())
+      setting = words[++i];
+    else if (words[i].size() > 2 && words[i].compare(0, 2, "-c") == 0)
+      setting = words[i].substr(2);
+    else if (words[i].size() > 2 && words[i].compare(0, 2, "--") == 0)
+      setting = words[i].substr(2);
+    else
+      continue;
+    const std::size_t eq = setting.find('=');
+    if (eq != std::string::npos && setting.compare(0, eq, name) == 0)
+      out = setting.substr(eq + 1);
+  }
+  return out;
+}
+
+}  // namespace config
+}  // namespace pgpooler
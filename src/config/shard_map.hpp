@@ -0,0 +1,74 @@
+#pragma once
+
+#include "config/config.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace pgpooler {
+namespace config {
+
+/** How a shard map turns a key value into a shard. */
+enum class ShardMethod {
+  /** Consistent hashing: every shard owns weight * VNODES points on a 64-bit ring, a value goes to the first
+   * point at or after its hash. Adding or removing a shard moves only the values of the neighbouring points. */
+  Hash,
+  /** Ranges of key values: the shard with the largest `from` not greater than the value (byte order). */
+  Range
+};
+
+/** Shard map file (shard_map: in a routing rule): startup parameter -> backend or group, without a rule per
+ * tenant. Lookup does not depend on the number of tenants (hash: binary search over the ring, range: over the
+ * shards; pinned values: hash map). Immutable after construction; a config reload loads the file again. */
+class ShardMap {
+ public:
+  struct Shard {
+    std::string backend;  // backend or group (BackendsConfig::groups)
+    unsigned weight = 1;  // Hash
+    std::string from;     // Range: lower bound of the values this shard owns
+  };
+
+  /** Ring points per unit of weight. */
+  static constexpr unsigned VNODES = 160;
+
+  /** shards must be non-empty. key: "database", "user", "options.<name>" (a -c name=value in the options
+   * parameter) or any other startup parameter name. pinned: values placed explicitly (moved tenants). */
+  ShardMap(std::string key, ShardMethod method, std::vector<Shard> shards,
+           std::unordered_map<std::string, std::string> pinned);
+
+  const std::string& key() const { return key_; }
+  ShardMethod method() const { return method_; }
+  const std::vector<Shard>& shards() const { return shards_; }
+  const std::unordered_map<std::string, std::string>& pinned() const { return pinned_; }
+
+  /** The key is user or database, so the result depends only on (user, database) and may be cached. */
+  bool keyed_by_login() const { return key_ == "user" || key_ == "database"; }
+
+  /** Value of the key for a client; nullopt if the client did not send that parameter. */
+  std::optional<std::string> key_value(const std::string& user, const std::string& database,
+                                       const StartupParameter& parameter) const;
+
+  /** Backend or group for a key value. */
+  const std::string& lookup(const std::string& value) const;
+
+  /** 64-bit hash of the ring (FNV-1a with a final mix). */
+  static std::uint64_t hash(const std::string& s);
+
+ private:
+  std::string key_;
+  ShardMethod method_;
+  std::vector<Shard> shards_;  // Range: sorted by from
+  std::unordered_map<std::string, std::string> pinned_;
+  std::vector<std::pair<std::uint64_t, std::uint32_t>> ring_;  // (point, shard index), sorted
+};
+
+/** Value of `name` set in a startup options string ("-c name=value", "-cname=value" or "--name=value");
+ * backslash escapes a space, as in libpq. */
+std::optional<std::string> startup_option(const std::string& options, const std::string& name);
+
+}  // namespace config
+}  // namespace pgpooler
@@ -1,12 +1,20 @@
 #include "common/log.hpp"
+#include "common/stats.hpp"
+#include "common/timer_wheel.hpp"
 #include "config/config.hpp"
 #include "pool/backend_connection_pool.hpp"
 #include "pool/connection_wait_queue.hpp"
+#include "pool/shared_pool_budget.hpp"
 #include "server/dispatcher.hpp"
+#include "server/lag_monitor.hpp"
 #include "server/listener.hpp"
+#include "server/reload.hpp"
+#include "session/response_spool.hpp"
 #include <event2/event.h>
+#include <algorithm>
 #include <csignal>
 #include <cstdlib>
+#include <memory>
 #include <string>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -36,6 +44,7 @@ int main(int argc, char* argv[]) {
   (void)argv;
 
   std::signal(SIGPIPE, SIG_IGN);
+  std::signal(SIGHUP, SIG_IGN);  // until the reload handler is set up (forked workers set up their own)
 
   const std::string app_config_path = getenv_default("CONFIG_PATH", "pgpooler.yaml");
 
@@ -68,10 +77,7 @@ int main(int argc, char* argv[]) {
   }
 
   const auto& backends = backends_cfg.backends;
-  pgpooler::config::Router* router_ptr = nullptr;
-  pgpooler::config::Router router(backends, routing_cfg.defaults, routing_cfg.routing);
   if (!routing_cfg.routing.empty()) {
-    router_ptr = &router;
     pgpooler::log::info("app config " + app_config_path + " -> listen " + app_cfg.listen_host + ":" +
                         std::to_string(app_cfg.listen_port) + ", backends " + backends_path +
                         " (" + std::to_string(backends.size()) + "), routing " + routing_path +
@@ -82,8 +88,12 @@ int main(int argc, char* argv[]) {
                         " -> " + backends.front().name);
   }
 
-  pgpooler::config::BackendResolver resolver =
-      pgpooler::config::make_resolver(backends, routing_cfg, router_ptr);
+  pgpooler::config::RoutingState routing_state(pgpooler::config::make_routing_snapshot(backends_cfg, routing_cfg));
+  pgpooler::config::BackendResolver resolver = pgpooler::config::make_resolver(&routing_state);
+  pgpooler::server::ReloadCtx reload_ctx;
+  reload_ctx.backends_path = backends_path;
+  reload_ctx.routing_path = routing_path;
+  reload_ctx.routing = &routing_state;
 
   struct event_base* base = event_base_new();
   if (!base) {
@@ -92,23 +102,52 @@ int main(int argc, char* argv[]) {
   }
 
   if (!app_cfg.workers.empty()) {
-    std::map<std::string, std::size_t> backend_to_worker;
+    std::map<std::string, std::vector<std::size_t>> backend_to_worker;
     for (std::size_t i = 0; i < app_cfg.workers.size(); ++i) {
       for (const auto& name : app_cfg.workers[i].backends)
-        backend_to_worker[name] = i;
+        backend_to_worker[name].push_back(i);
     }
-    std::vector<std::pair<int, int>> pairs(app_cfg.workers.size());
-    for (std::size_t i = 0; i < app_cfg.workers.size(); ++i) {
-      int fds[2];
-      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
-        pgpooler::log::error("socketpair failed for worker " + std::to_string(i));
-        event_base_free(base);
-        return 1;
+    std::unique_ptr<pgpooler::pool::SharedPoolBudget> budget;
+    if (app_cfg.pool_budget == pgpooler::config::PoolBudget::Shared) {
+      budget = pgpooler::pool::SharedPoolBudget::create(app_cfg.workers.size());
+      if (!budget)
+        pgpooler::log::warn("cannot create the shared pool budget for " + std::to_string(app_cfg.workers.size()) +
+                            " workers, splitting pool_size between them");
+    }
+    /* Workers sharing a backend get a socket pair each, to hand idle connections over (shared budget only). */
+    const std::size_t n = app_cfg.workers.size();
+    std::vector<std::vector<int>> peer_fds(n, std::vector<int>(n, -1));
+    for (std::size_t i = 0; budget && i < n; ++i) {
+      for (std::size_t j = i + 1; j < n; ++j) {
+        const auto& a = app_cfg.workers[i].backends;
+        const auto& b = app_cfg.workers[j].backends;
+        if (std::find_first_of(a.begin(), a.end(), b.begin(), b.end()) == a.end()) continue;
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+          pgpooler::log::warn("socketpair failed for workers " + std::to_string(i) + " and " + std::to_string(j) +
+                              ", they will not hand idle connections over");
+          continue;
+        }
+        peer_fds[i][j] = fds[0];
+        peer_fds[j][i] = fds[1];
       }
-      pairs[i].first = fds[0];
-      pairs[i].second = fds[1];
     }
-    for (std::size_t i = 0; i < app_cfg.workers.size(); ++i) {
+    /* One socket pair per (dispatcher, worker): every dispatcher process hands off to every worker. */
+    const std::size_t dispatchers = app_cfg.dispatcher_processes;
+    std::vector<std::vector<std::pair<int, int>>> links(dispatchers, std::vector<std::pair<int, int>>(n));
+    for (std::size_t d = 0; d < dispatchers; ++d) {
+      for (std::size_t i = 0; i < n; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+          pgpooler::log::error("socketpair failed for worker " + std::to_string(i));
+          event_base_free(base);
+          return 1;
+        }
+        links[d][i].first = fds[0];
+        links[d][i].second = fds[1];
+      }
+    }
+    for (std::size_t i = 0; i < n; ++i) {
       pid_t pid = fork();
       if (pid < 0) {
         pgpooler::log::error("fork failed");
@@ -116,37 +155,81 @@ int main(int argc, char* argv[]) {
         return 1;
       }
       if (pid == 0) {
-        for (std::size_t j = 0; j < pairs.size(); ++j) {
-          if (j != i) {
-            close(pairs[j].first);
-            close(pairs[j].second);
-          } else {
+        std::vector<int> dispatcher_fds;
+        for (auto& pairs : links) {
+          for (std::size_t j = 0; j < pairs.size(); ++j) {
             close(pairs[j].first);
+            if (j != i)
+              close(pairs[j].second);
+            else
+              dispatcher_fds.push_back(pairs[j].second);
           }
         }
-        pgpooler::server::run_worker(i, pairs[i].second,
+        for (std::size_t j = 0; j < n; ++j) {
+          if (j == i) continue;
+          for (int fd : peer_fds[j])
+            if (fd >= 0) close(fd);
+        }
+        pgpooler::server::run_worker(i, dispatcher_fds,
             app_cfg.workers[i].backends, app_config_path,
-            app_cfg.backends_config_path, app_cfg.routing_config_path);
+            app_cfg.backends_config_path, app_cfg.routing_config_path, budget.get(), peer_fds[i]);
         _exit(0);
       }
+      reload_ctx.forward_to.push_back(pid);
+    }
+    for (auto& pairs : links)
+      for (auto& p : pairs)
+        close(p.second);
+    for (const auto& fds : peer_fds)
+      for (int fd : fds)
+        if (fd >= 0) close(fd);
+    /* Dispatchers 1..N-1 are forked; this process is dispatcher 0 and forwards SIGHUP to all children. */
+    const bool reuse_port = dispatchers > 1;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    auto cpu_of = [&](std::size_t d) {
+      return app_cfg.dispatcher_incoming_cpu && cpus > 0 ? static_cast<int>(d % static_cast<std::size_t>(cpus)) : -1;
+    };
+    std::size_t dispatcher_id = 0;
+    for (std::size_t d = 1; d < dispatchers; ++d) {
+      pid_t pid = fork();
+      if (pid < 0) {
+        pgpooler::log::error("fork failed for dispatcher " + std::to_string(d));
+        break;
+      }
+      if (pid == 0) {
+        dispatcher_id = d;
+        reload_ctx.forward_to.clear();
+        event_reinit(base);
+        break;
+      }
+      reload_ctx.forward_to.push_back(pid);
     }
-    for (auto& p : pairs)
-      close(p.second);
     std::vector<int> worker_fds;
-    for (auto& p : pairs)
-      worker_fds.push_back(p.first);
+    for (std::size_t d = 0; d < dispatchers; ++d) {
+      for (auto& p : links[d]) {
+        if (d == dispatcher_id)
+          worker_fds.push_back(p.first);
+        else
+          close(p.first);
+      }
+    }
+    struct event* reload_ev = pgpooler::server::add_reload_signal(base, &reload_ctx);
     pgpooler::server::run_dispatcher(base, app_cfg.listen_host, app_cfg.listen_port,
-        worker_fds, backend_to_worker, resolver);
+        worker_fds, backend_to_worker, resolver, app_cfg.hot_key_rate, dispatcher_id, reuse_port,
+        cpu_of(dispatcher_id), app_cfg.dispatcher_defer_accept_sec);
+    if (reload_ev) event_free(reload_ev);
     event_base_free(base);
     return 0;
   }
 
+  pgpooler::session::ResponseSpool::set_spill_directory(resolve_path(app_config_path, app_cfg.spill_directory));
   pgpooler::config::PoolManager pool_manager(backends);
   pgpooler::pool::BackendConnectionPool connection_pool;
   pgpooler::pool::ConnectionWaitQueue wait_queue(base);
+  pgpooler::common::TimerWheel timer_wheel(base);
 
   pgpooler::server::Listener listener(base, app_cfg.listen_host.c_str(), app_cfg.listen_port,
-                                       resolver, &pool_manager, &connection_pool, &wait_queue);
+                                       resolver, &pool_manager, &connection_pool, &wait_queue, &timer_wheel);
   if (!listener.ok()) {
     pgpooler::log::error("failed to bind listener on " + app_cfg.listen_host + ":" +
                          std::to_string(app_cfg.listen_port));
@@ -154,10 +237,19 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  reload_ctx.pool_manager = &pool_manager;
+  reload_ctx.connection_pool = &connection_pool;
+  reload_ctx.wait_queue = &wait_queue;
+  struct event* reload_ev = pgpooler::server::add_reload_signal(base, &reload_ctx);
+  auto lag_monitor = std::make_unique<pgpooler::server::LagMonitor>(base, &routing_state, &pool_manager, "");
+
   pgpooler::log::info("ready, listening on " + app_cfg.listen_host + ":" + std::to_string(app_cfg.listen_port) +
                       " (connect with psql -h <host> -p " + std::to_string(app_cfg.listen_port) + " -U <user> -d <db>)");
+  pgpooler::stats::start_periodic_log(base, app_cfg.stats_interval_sec, "");
 
   event_base_dispatch(base);
+  lag_monitor.reset();
+  if (reload_ev) event_free(reload_ev);
   event_base_free(base);
   return 0;
 }
@@ -1,4 +1,7 @@
 #include "pool/backend_connection_pool.hpp"
+#include "common/log.hpp"
+#include "protocol/message.hpp"
+#include <event2/buffer.h>
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 
@@ -51,16 +54,177 @@ void BackendConnectionPool::put(const std::string& backend_name,
                                 const std::string& database,
                                 struct bufferevent* bev,
                                 std::vector<std::uint8_t> cached_startup_response,
-                                std::chrono::steady_clock::time_point created_at) {
+                                std::chrono::steady_clock::time_point created_at,
+                                protocol::SessionStateEffect dirty,
+                                PreparedStatementCache prepared_statements) {
   if (!bev) return;
   bufferevent_setcb(bev, nullptr, nullptr, nullptr, nullptr);
   bufferevent_disable(bev, EV_READ);
   std::lock_guard<std::mutex> lock(mutex_);
   Key key{backend_name, user, database};
-  IdleConnection c{bev, std::move(cached_startup_response), std::chrono::steady_clock::now(), created_at};
+  IdleConnection c{bev, std::move(cached_startup_response), std::chrono::steady_clock::now(), created_at, dirty,
+                   std::move(prepared_statements)};
   idle_[key].push_back(std::move(c));
 }
 
+namespace {
+
+/** Free bufferevent in next event loop iteration (must not free inside its own callback). */
+void deferred_free_bev_cb(evutil_socket_t, short, void* ctx) {
+  bufferevent_free(static_cast<struct bufferevent*>(ctx));
+}
+
+}  // namespace
+
+void BackendConnectionPool::put_resetting(const std::string& backend_name,
+                                          const std::string& user,
+                                          const std::string& database,
+                                          struct bufferevent* bev,
+                                          std::vector<std::uint8_t> cached_startup_response,
+                                          std::chrono::steady_clock::time_point created_at,
+                                          PreparedStatementCache prepared_statements,
+                                          const std::string& reset_query,
+                                          ResetDoneCallback done) {
+  put_draining(backend_name, user, database, bev, std::move(cached_startup_response), created_at,
+               protocol::SessionStateEffect::None, std::move(prepared_statements), 0, reset_query, 0,
+               std::move(done));
+}
+
+void BackendConnectionPool::put_draining(const std::string& backend_name,
+                                         const std::string& user,
+                                         const std::string& database,
+                                         struct bufferevent* bev,
+                                         std::vector<std::uint8_t> cached_startup_response,
+                                         std::chrono::steady_clock::time_point created_at,
+                                         protocol::SessionStateEffect dirty,
+                                         PreparedStatementCache prepared_statements,
+                                         unsigned pending_ready,
+                                         const std::string& reset_query,
+                                         unsigned timeout_sec,
+                                         ResetDoneCallback done,
+                                         unsigned char tx_state) {
+  if (!bev) return;
+  Resetting* r = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    resetting_.push_back(Resetting{this, Key{backend_name, user, database},
+                                   IdleConnection{bev, std::move(cached_startup_response),
+                                                  std::chrono::steady_clock::now(), created_at, dirty,
+                                                  std::move(prepared_statements)},
+                                   std::move(done), pending_ready, reset_query, false, nullptr});
+    r = &resetting_.back();
+  }
+  if (pending_ready > 0)
+    pgpooler::log::debug("pool: draining connection backend=" + backend_name + " user=" + user +
+                         " database=" + database + " pending_ready=" + std::to_string(pending_ready));
+  bufferevent_setcb(bev, resetting_read_cb, nullptr, resetting_event_cb, r);
+  bufferevent_enable(bev, EV_READ);
+  if (timeout_sec > 0) {
+    r->deadline = evtimer_new(bufferevent_get_base(bev), resetting_deadline_cb, r);
+    struct timeval tv = {static_cast<long>(timeout_sec), 0};
+    if (r->deadline) evtimer_add(r->deadline, &tv);
+  }
+  if (pending_ready == 0) {
+    advance_resetting(r, tx_state, false);
+    return;
+  }
+  resetting_read_cb(bev, r);  // replies may already be buffered
+}
+
+void BackendConnectionPool::advance_resetting(Resetting* r, unsigned char tx_state, bool trailing_bytes) {
+  if (r->failed) {
+    pgpooler::log::info("pool: reset query failed backend=" + r->key.backend_name + " user=" + r->key.user +
+                        " database=" + r->key.database);
+    finish_resetting(r, false);
+    return;
+  }
+  if (r->reset_sent) {
+    r->reset_sent = false;
+    r->conn.dirty = protocol::SessionStateEffect::None;
+  }
+  std::string query;
+  if (tx_state != protocol::TXSTATE_IDLE && !r->rolled_back) {
+    r->rolled_back = true;
+    query = "ROLLBACK";
+  } else if (!r->reset_query.empty()) {
+    query = std::move(r->reset_query);
+    r->reset_query.clear();
+    r->reset_sent = true;
+  } else {
+    // Anything after ReadyForQuery would belong to nobody: such a connection is not reusable.
+    finish_resetting(r, tx_state == protocol::TXSTATE_IDLE && !trailing_bytes);
+    return;
+  }
+  pgpooler::log::debug("pool: resetting connection backend=" + r->key.backend_name + " user=" + r->key.user +
+                       " database=" + r->key.database + " query=\"" + query + "\"");
+  r->pending_ready = 1;
+  r->own_query = true;
+  std::vector<std::uint8_t> q = protocol::build_query_message(query);
+  bufferevent_write(r->conn.bev, q.data(), q.size());
+}
+
+void BackendConnectionPool::resetting_read_cb(struct bufferevent* bev, void* ctx) {
+  auto* r = static_cast<Resetting*>(ctx);
+  struct evbuffer* in = bufferevent_get_input(bev);
+  std::vector<std::uint8_t> msg;
+  while (protocol::try_extract_typed_message(in, msg)) {
+    if (r->own_query && protocol::get_message_type(msg) == 'E') r->failed = true;
+    auto tx_state = protocol::get_ready_for_query_state(msg);
+    if (!tx_state || r->pending_ready == 0) continue;
+    if (--r->pending_ready > 0) continue;
+    r->pool->advance_resetting(r, *tx_state, evbuffer_get_length(in) != 0);
+    return;
+  }
+}
+
+void BackendConnectionPool::resetting_event_cb(struct bufferevent* /*bev*/, short what, void* ctx) {
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
+    auto* r = static_cast<Resetting*>(ctx);
+    r->pool->finish_resetting(r, false);
+  }
+}
+
+void BackendConnectionPool::resetting_deadline_cb(evutil_socket_t, short, void* ctx) {
+  auto* r = static_cast<Resetting*>(ctx);
+  pgpooler::log::info("pool: drain/reset timeout backend=" + r->key.backend_name + " user=" + r->key.user +
+                      " database=" + r->key.database);
+  r->pool->finish_resetting(r, false);
+}
+
+void BackendConnectionPool::finish_resetting(Resetting* r, bool ok) {
+  ResetDoneCallback done;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = resetting_.begin(); it != resetting_.end(); ++it) {
+      if (&*it != r) continue;
+      struct bufferevent* bev = it->conn.bev;
+      bufferevent_setcb(bev, nullptr, nullptr, nullptr, nullptr);
+      bufferevent_disable(bev, EV_READ);
+      if (it->deadline) {
+        event_free(it->deadline);  // also removes it if pending
+        it->deadline = nullptr;
+      }
+      if (ok && it->retired) {
+        ok = false;
+        pgpooler::log::info("pool: backend retired by reload, closing drained connection backend=" +
+                            it->key.backend_name + " user=" + it->key.user + " database=" + it->key.database);
+        event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, deferred_free_bev_cb, bev, nullptr);
+      } else if (ok) {
+        it->conn.idle_since = std::chrono::steady_clock::now();
+        idle_[it->key].push_back(std::move(it->conn));
+      } else {
+        pgpooler::log::info("pool: drain/reset failed, closing connection backend=" + it->key.backend_name +
+                            " user=" + it->key.user + " database=" + it->key.database);
+        event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, deferred_free_bev_cb, bev, nullptr);
+      }
+      done = std::move(it->done);
+      resetting_.erase(it);
+      break;
+    }
+  }
+  if (done) done(ok);
+}
+
 std::optional<IdleConnection> BackendConnectionPool::take_one_to_close(
     const std::string& backend_name,
     const std::string& user,
@@ -75,6 +239,33 @@ std::optional<IdleConnection> BackendConnectionPool::take_one_to_close(
   return c;
 }
 
+std::vector<std::pair<std::string, std::string>> BackendConnectionPool::retire_backend(
+    const std::string& backend_name) {
+  std::vector<std::pair<std::string, std::string>> closed;
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++generations_[backend_name];
+  for (auto it = idle_.begin(); it != idle_.end();) {
+    if (it->first.backend_name != backend_name) {
+      ++it;
+      continue;
+    }
+    for (IdleConnection& c : it->second) {
+      bufferevent_free(c.bev);  // idle: no callbacks set, safe to free right away
+      closed.emplace_back(it->first.user, it->first.database);
+    }
+    it = idle_.erase(it);
+  }
+  for (Resetting& r : resetting_)
+    if (r.key.backend_name == backend_name) r.retired = true;
+  return closed;
+}
+
+std::uint64_t BackendConnectionPool::generation(const std::string& backend_name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = generations_.find(backend_name);
+  return it == generations_.end() ? 0 : it->second;
+}
+
 std::optional<IdleConnection> BackendConnectionPool::take_one_expired(
     const std::string& backend_name,
     const std::string& user,
@@ -1,24 +1,36 @@
 #pragma once
 
+#include "pool/prepared_statement_cache.hpp"
+#include "protocol/message.hpp"
+#include "protocol/sql_classifier.hpp"
+#include <event2/util.h>
 #include <chrono>
 #include <cstdint>
+#include <functional>
+#include <list>
 #include <map>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 struct bufferevent;
+struct event;
 
 namespace pgpooler {
 namespace pool {
 
-/** One idle backend connection: bev + cached startup response + timestamps for timeout eviction. */
+/** One idle backend connection: bev + cached startup response + timestamps for timeout eviction.
+ * dirty: server-side state left by the last user; decides which reset query (if any) runs on reuse.
+ * prepared_statements: pooler-managed prepared statements that exist on this connection. */
 struct IdleConnection {
   struct bufferevent* bev = nullptr;
   std::vector<std::uint8_t> cached_startup_response;
   std::chrono::steady_clock::time_point idle_since{std::chrono::steady_clock::now()};
   std::chrono::steady_clock::time_point created_at{std::chrono::steady_clock::now()};
+  protocol::SessionStateEffect dirty = protocol::SessionStateEffect::Full;
+  PreparedStatementCache prepared_statements;
 };
 
 /** Thread-safe pool of idle backend connections keyed by (backend_name, user, database). */
@@ -40,19 +52,65 @@ class BackendConnectionPool {
                                     unsigned lifetime_sec);
 
   /** Return a connection to the pool. Disables read and clears callbacks on bev.
-   * created_at is when the connection was first established (for server_lifetime). */
+   * created_at is when the connection was first established (for server_lifetime).
+   * dirty is what the last user left behind (Full if unknown). */
   void put(const std::string& backend_name,
            const std::string& user,
            const std::string& database,
            struct bufferevent* bev,
            std::vector<std::uint8_t> cached_startup_response,
-           std::chrono::steady_clock::time_point created_at);
+           std::chrono::steady_clock::time_point created_at,
+           protocol::SessionStateEffect dirty = protocol::SessionStateEffect::Full,
+           PreparedStatementCache prepared_statements = {});
+
+  /** Called once a resetting connection is done: ok=true → it is idle in the pool now; false → it was closed. */
+  using ResetDoneCallback = std::function<void(bool ok)>;
+
+  /** Return a connection in the "resetting" sub-state: reset_query is written to bev now, and the connection
+   * is offered to take() only after its ReadyForQuery arrives (then it is clean). Pool owns bev from here on. */
+  void put_resetting(const std::string& backend_name,
+                     const std::string& user,
+                     const std::string& database,
+                     struct bufferevent* bev,
+                     std::vector<std::uint8_t> cached_startup_response,
+                     std::chrono::steady_clock::time_point created_at,
+                     PreparedStatementCache prepared_statements,
+                     const std::string& reset_query,
+                     ResetDoneCallback done);
+
+  /** Return a connection whose replies are still in flight (client went away mid-query; the caller has sent a
+   * CancelRequest if needed). The pool discards everything up to the pending_ready-th ReadyForQuery, rolls back
+   * an open transaction, runs reset_query if non-empty, and only then offers the connection to take() with
+   * dirty (None after a reset). Closed if this takes longer than timeout_sec (0 = no limit). With
+   * pending_ready == 0, tx_state is the transaction state of the last ReadyForQuery the session saw. */
+  void put_draining(const std::string& backend_name,
+                    const std::string& user,
+                    const std::string& database,
+                    struct bufferevent* bev,
+                    std::vector<std::uint8_t> cached_startup_response,
+                    std::chrono::steady_clock::time_point created_at,
+                    protocol::SessionStateEffect dirty,
+                    PreparedStatementCache prepared_statements,
+                    unsigned pending_ready,
+                    const std::string& reset_query,
+                    unsigned timeout_sec,
+                    ResetDoneCallback done,
+                    unsigned char tx_state = protocol::TXSTATE_IDLE);
 
   /** Remove one idle connection (e.g. to close it when session that had put disconnects). */
   std::optional<IdleConnection> take_one_to_close(const std::string& backend_name,
                                                    const std::string& user,
                                                    const std::string& database);
 
+  /** Config reload changed or removed the backend: its idle connections are closed now, connections still
+   * draining or resetting are closed when they finish, and the backend's generation is bumped so sessions holding
+   * a connection from before close it instead of returning it. Returns (user, database) of every idle
+   * connection closed; the caller releases their slots. */
+  std::vector<std::pair<std::string, std::string>> retire_backend(const std::string& backend_name);
+
+  /** Incremented by retire_backend. A connection opened or taken at another generation must not go back to the pool. */
+  std::uint64_t generation(const std::string& backend_name) const;
+
   /** Remove and return one idle connection that is expired (idle or lifetime). Caller must close bev and release slot. */
   std::optional<IdleConnection> take_one_expired(const std::string& backend_name,
                                                   const std::string& user,
@@ -62,7 +120,7 @@ class BackendConnectionPool {
                                                   unsigned lifetime_sec);
 
  private:
-  std::mutex mutex_;
+  mutable std::mutex mutex_;
   struct Key {
     std::string backend_name;
     std::string user;
@@ -74,6 +132,37 @@ class BackendConnectionPool {
     }
   };
   std::map<Key, std::vector<IdleConnection>> idle_;
+  std::map<std::string, std::uint64_t> generations_;  // backend name -> generation (absent = 0)
+
+  /** Connection owned by the pool while it drains old replies and/or its reset query runs. */
+  struct Resetting {
+    BackendConnectionPool* pool = nullptr;
+    Key key;
+    IdleConnection conn;
+    ResetDoneCallback done;
+    /** ReadyForQuery messages still expected before the next step. */
+    unsigned pending_ready = 0;
+    /** Reset query not sent yet (sent once the connection is drained and idle). */
+    std::string reset_query;
+    bool rolled_back = false;
+    struct event* deadline = nullptr;
+    /** Backend retired meanwhile: close instead of moving to idle_. */
+    bool retired = false;
+    /** The pool's own ROLLBACK or reset query is running (replies before it belong to the client). */
+    bool own_query = false;
+    /** The reset query was sent: dirty is cleared once it completes without an error. */
+    bool reset_sent = false;
+    /** ErrorResponse to the pool's own query: the connection is closed instead of pooled. */
+    bool failed = false;
+  };
+  static void resetting_read_cb(struct bufferevent* bev, void* ctx);
+  static void resetting_event_cb(struct bufferevent* bev, short what, void* ctx);
+  static void resetting_deadline_cb(evutil_socket_t fd, short what, void* ctx);
+  /** Drained up to a ReadyForQuery with tx_state: send ROLLBACK / reset query, or finish. */
+  void advance_resetting(Resetting* r, unsigned char tx_state, bool trailing_bytes);
+  /** Remove r from resetting_; ok → move its connection to idle_, else close it. Then call done. */
+  void finish_resetting(Resetting* r, bool ok);
+  std::list<Resetting> resetting_;
 };
 
 }  // namespace pool
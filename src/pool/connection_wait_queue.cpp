@@ -1,6 +1,8 @@
 #include "pool/connection_wait_queue.hpp"
 #include "session/client_session.hpp"
 #include <event2/event.h>
+#include <iterator>
+#include <vector>
 
 namespace pgpooler {
 namespace pool {
@@ -25,12 +27,7 @@ void ConnectionWaitQueue::on_timeout_cb(evutil_socket_t, short, void* ctx) {
   if (!queue) return;
   for (auto it = queue->waiters_.begin(); it != queue->waiters_.end(); ++it) {
     if (&*it == w) {
-      if (it->timeout_ev) {
-        event_del(it->timeout_ev);
-        event_free(it->timeout_ev);
-        it->timeout_ev = nullptr;
-      }
-      queue->waiters_.erase(it);
+      queue->erase(it);
       break;
     }
   }
@@ -53,6 +50,9 @@ void ConnectionWaitQueue::enqueue(session::ClientSession* session,
   tv.tv_usec = 0;
   w.timeout_ev = event_new(base_, -1, 0, &ConnectionWaitQueue::on_timeout_cb, nullptr);
   if (!w.timeout_ev) return;
+  if (waiting_hook_ && !has_waiters(backend_name)) waiting_hook_(backend_name, true);
+  if (key_waiting_hook_ && !has_waiters(backend_name, user, database))
+    key_waiting_hook_(backend_name, user, database, true);
   waiters_.push_back(std::move(w));
   Waiter& back = waiters_.back();
   back.queue = this;
@@ -66,31 +66,67 @@ void ConnectionWaitQueue::on_connection_available(const std::string& backend_nam
   for (auto it = waiters_.begin(); it != waiters_.end(); ++it) {
     if (it->backend_name == backend_name && it->user == user && it->database == database) {
       session::ClientSession* session = it->session;
-      if (it->timeout_ev) {
-        event_del(it->timeout_ev);
-        event_free(it->timeout_ev);
-        it->timeout_ev = nullptr;
-      }
-      waiters_.erase(it);
+      erase(it);
       if (session) session->retry_connect_to_backend();
       return;
     }
   }
+  if (unclaimed_hook_) unclaimed_hook_(backend_name, user, database);
+}
+
+void ConnectionWaitQueue::wake_backend(const std::string& backend_name, std::size_t max_waiters) {
+  /* Collect first: a woken session may queue itself again (the slot was taken meanwhile), at the tail. */
+  std::vector<session::ClientSession*> woken;
+  for (auto it = waiters_.begin(); it != waiters_.end() && woken.size() < max_waiters;) {
+    if (it->backend_name != backend_name) {
+      ++it;
+      continue;
+    }
+    woken.push_back(it->session);
+    auto next = std::next(it);
+    erase(it);
+    it = next;
+  }
+  for (session::ClientSession* session : woken)
+    if (session) session->retry_connect_to_backend();
 }
 
 void ConnectionWaitQueue::remove(session::ClientSession* session) {
   for (auto it = waiters_.begin(); it != waiters_.end(); ++it) {
     if (it->session == session) {
-      if (it->timeout_ev) {
-        event_del(it->timeout_ev);
-        event_free(it->timeout_ev);
-        it->timeout_ev = nullptr;
-      }
-      waiters_.erase(it);
+      erase(it);
       return;
     }
   }
 }
 
+void ConnectionWaitQueue::erase(std::list<Waiter>::iterator it) {
+  if (it->timeout_ev) {
+    event_del(it->timeout_ev);
+    event_free(it->timeout_ev);
+    it->timeout_ev = nullptr;
+  }
+  const std::string backend_name = std::move(it->backend_name);
+  const std::string user = std::move(it->user);
+  const std::string database = std::move(it->database);
+  waiters_.erase(it);
+  if (waiting_hook_ && !has_waiters(backend_name)) waiting_hook_(backend_name, false);
+  if (key_waiting_hook_ && !has_waiters(backend_name, user, database))
+    key_waiting_hook_(backend_name, user, database, false);
+}
+
+bool ConnectionWaitQueue::has_waiters(const std::string& backend_name) const {
+  for (const auto& w : waiters_)
+    if (w.backend_name == backend_name) return true;
+  return false;
+}
+
+bool ConnectionWaitQueue::has_waiters(const std::string& backend_name, const std::string& user,
+                                      const std::string& database) const {
+  for (const auto& w : waiters_)
+    if (w.backend_name == backend_name && w.user == user && w.database == database) return true;
+  return false;
+}
+
 }  // namespace pool
 }  // namespace pgpooler
@@ -3,6 +3,7 @@
 #include <event2/event.h>
 #include <event2/util.h>
 #include <cstdint>
+#include <functional>
 #include <list>
 #include <string>
 
@@ -35,9 +36,27 @@ class ConnectionWaitQueue {
                                const std::string& user,
                                const std::string& database);
 
+  /** Wake up to max_waiters waiters of backend_name, any user/database, oldest first: a connection slot was
+   * freed in another worker (shared pool budget). */
+  void wake_backend(const std::string& backend_name, std::size_t max_waiters);
+
   /** Remove session from queue (e.g. on destroy). */
   void remove(session::ClientSession* session);
 
+  /** Called with true when the first session starts waiting for a backend, false when the last one leaves. */
+  void set_waiting_hook(std::function<void(const std::string& backend_name, bool waiting)> hook) {
+    waiting_hook_ = std::move(hook);
+  }
+  /** The same per (backend, user, database). */
+  using KeyHook = std::function<void(const std::string& backend_name, const std::string& user,
+                                     const std::string& database, bool waiting)>;
+  void set_key_waiting_hook(KeyHook hook) { key_waiting_hook_ = std::move(hook); }
+  /** Called by on_connection_available when no session here waits for that key. */
+  void set_unclaimed_hook(std::function<void(const std::string& backend_name, const std::string& user,
+                                             const std::string& database)> hook) {
+    unclaimed_hook_ = std::move(hook);
+  }
+
  private:
   struct Waiter {
     ConnectionWaitQueue* queue = nullptr;
@@ -48,9 +67,17 @@ class ConnectionWaitQueue {
     struct event* timeout_ev = nullptr;
   };
   static void on_timeout_cb(evutil_socket_t, short, void* ctx);
+  /** Free the waiter's timeout and erase it; reports the backend to the hook if it was the last waiter. */
+  void erase(std::list<Waiter>::iterator it);
+  bool has_waiters(const std::string& backend_name) const;
+  bool has_waiters(const std::string& backend_name, const std::string& user, const std::string& database) const;
 
   struct event_base* base_ = nullptr;
   std::list<Waiter> waiters_;
+  std::function<void(const std::string& backend_name, bool waiting)> waiting_hook_;
+  KeyHook key_waiting_hook_;
+  std::function<void(const std::string& backend_name, const std::string& user, const std::string& database)>
+      unclaimed_hook_;
 };
 
 }  // namespace pool
@@ -0,0 +1,47 @@
+#include "pool/prepared_statement_cache.hpp"
+
+namespace pgpooler {
+namespace pool {
+
+const PreparedStatementCache::Body* PreparedStatementCache::find(const std::string& name) const {
+  auto it = index_.find(name);
+  return it == index_.end() ? nullptr : &it->second->second;
+}
+
+void PreparedStatementCache::touch(const std::string& name) {
+  auto it = index_.find(name);
+  if (it == index_.end()) return;
+  lru_.splice(lru_.begin(), lru_, it->second);
+}
+
+std::optional<std::pair<std::string, PreparedStatementCache::Body>> PreparedStatementCache::insert(
+    const std::string& name, Body body, std::size_t capacity) {
+  auto it = index_.find(name);
+  if (it != index_.end()) {
+    it->second->second = std::move(body);
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return std::nullopt;
+  }
+  lru_.emplace_front(name, std::move(body));
+  index_[name] = lru_.begin();
+  if (capacity == 0 || lru_.size() <= capacity) return std::nullopt;
+  std::pair<std::string, Body> victim = std::move(lru_.back());
+  lru_.pop_back();
+  index_.erase(victim.first);
+  return victim;
+}
+
+void PreparedStatementCache::erase(const std::string& name) {
+  auto it = index_.find(name);
+  if (it == index_.end()) return;
+  lru_.erase(it->second);
+  index_.erase(it);
+}
+
+void PreparedStatementCache::clear() {
+  lru_.clear();
+  index_.clear();
+}
+
+}  // namespace pool
+}  // namespace pgpooler
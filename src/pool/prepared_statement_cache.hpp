@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace pgpooler {
+namespace pool {
+
+/** Prepared statements that exist on one backend connection (pooler-unique names), in LRU order, each with the
+ * Parse payload it was prepared from (query + parameter types): a name is reused only for the same bytes.
+ * Travels with the connection: session while it is in use, IdleConnection while it is in the pool. */
+class PreparedStatementCache {
+ public:
+  using Body = std::vector<std::uint8_t>;
+
+  bool contains(const std::string& name) const { return index_.count(name) != 0; }
+  /** Parse payload name was prepared from, or nullptr if name is not on the connection. */
+  const Body* find(const std::string& name) const;
+  std::size_t size() const { return lru_.size(); }
+
+  /** Mark name as most recently used (no-op if absent). */
+  void touch(const std::string& name);
+
+  /** Add name (prepared from body) as most recently used. If that makes the cache larger than capacity, removes
+   * and returns the least recently used entry — the caller must Close it on the server. capacity 0 = unlimited. */
+  std::optional<std::pair<std::string, Body>> insert(const std::string& name, Body body, std::size_t capacity);
+
+  void erase(const std::string& name);
+  void clear();
+
+ private:
+  std::list<std::pair<std::string, Body>> lru_;  // front = most recently used
+  std::unordered_map<std::string, std::list<std::pair<std::string, Body>>::iterator> index_;
+};
+
+}  // namespace pool
+}  // namespace pgpooler
@@ -0,0 +1,168 @@
+#include "pool/shared_pool_budget.hpp"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <new>
+
+namespace pgpooler {
+namespace pool {
+
+namespace {
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared counters must be lock-free (address-free)");
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free, "shared counters must be lock-free (address-free)");
+
+constexpr std::uint64_t IN_USE_ONE = std::uint64_t{1} << 32;
+
+std::uint32_t in_use_of(std::uint64_t counts) { return static_cast<std::uint32_t>(counts >> 32); }
+std::uint32_t in_pool_of(std::uint64_t counts) { return static_cast<std::uint32_t>(counts & 0xffffffffu); }
+
+}  // namespace
+
+std::unique_ptr<SharedPoolBudget> SharedPoolBudget::create(std::size_t workers) {
+  if (workers == 0 || workers > MAX_WORKERS) return nullptr;
+  void* mem = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return nullptr;
+  auto* segment = new (mem) Segment();  // zeroed by mmap; value-initialised atomics
+  std::vector<int> fds;
+  for (std::size_t i = 0; i < workers; ++i) {
+    int fd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0) {
+      for (int f : fds) close(f);
+      munmap(mem, sizeof(Segment));
+      return nullptr;
+    }
+    fds.push_back(fd);
+  }
+  return std::unique_ptr<SharedPoolBudget>(new SharedPoolBudget(segment, std::move(fds)));
+}
+
+SharedPoolBudget::~SharedPoolBudget() {
+  for (int fd : wake_fds_) close(fd);
+  munmap(segment_, sizeof(Segment));
+}
+
+int SharedPoolBudget::wake_fd() const { return worker_id_ < wake_fds_.size() ? wake_fds_[worker_id_] : -1; }
+
+int SharedPoolBudget::configure(const std::string& backend_name, unsigned max) {
+  if (backend_name.empty() || backend_name.size() > MAX_NAME) return -1;
+  while (segment_->lock.exchange(1, std::memory_order_acquire) != 0) {
+  }
+  int found = -1;
+  int free_slot = -1;
+  for (std::size_t i = 0; i < MAX_BACKENDS; ++i) {
+    Slot& s = segment_->slots[i];
+    if (!s.claimed.load(std::memory_order_relaxed)) {
+      if (free_slot < 0) free_slot = static_cast<int>(i);
+      continue;
+    }
+    if (backend_name == s.name) {
+      found = static_cast<int>(i);
+      break;
+    }
+  }
+  if (found < 0 && free_slot >= 0) {
+    Slot& s = segment_->slots[free_slot];
+    std::memcpy(s.name, backend_name.c_str(), backend_name.size() + 1);
+    s.claimed.store(1, std::memory_order_release);
+    found = free_slot;
+  }
+  segment_->lock.store(0, std::memory_order_release);
+  if (found >= 0) segment_->slots[found].max.store(max, std::memory_order_release);
+  return found;
+}
+
+bool SharedPoolBudget::acquire(int slot) {
+  Slot& s = segment_->slots[slot];
+  const std::uint32_t max = s.max.load(std::memory_order_acquire);
+  std::uint64_t counts = s.counts.load(std::memory_order_relaxed);
+  do {
+    if (max != 0 && static_cast<std::uint64_t>(in_use_of(counts)) + in_pool_of(counts) >= max) return false;
+  } while (!s.counts.compare_exchange_weak(counts, counts + IN_USE_ONE, std::memory_order_acq_rel));
+  return true;
+}
+
+void SharedPoolBudget::release(int slot) {
+  Slot& s = segment_->slots[slot];
+  std::uint64_t counts = s.counts.load(std::memory_order_relaxed);
+  do {
+    if (in_use_of(counts) == 0) return;
+  } while (!s.counts.compare_exchange_weak(counts, counts - IN_USE_ONE, std::memory_order_acq_rel));
+  wake_waiters(slot);
+}
+
+void SharedPoolBudget::put(int slot) {
+  Slot& s = segment_->slots[slot];
+  std::uint64_t counts = s.counts.load(std::memory_order_relaxed);
+  do {
+    if (in_use_of(counts) == 0) return;
+  } while (!s.counts.compare_exchange_weak(counts, counts - IN_USE_ONE + 1, std::memory_order_acq_rel));
+}
+
+bool SharedPoolBudget::take(int slot) {
+  Slot& s = segment_->slots[slot];
+  std::uint64_t counts = s.counts.load(std::memory_order_relaxed);
+  do {
+    if (in_pool_of(counts) == 0) return false;
+  } while (!s.counts.compare_exchange_weak(counts, counts + IN_USE_ONE - 1, std::memory_order_acq_rel));
+  return true;
+}
+
+std::uint32_t SharedPoolBudget::room(int slot) const {
+  const Slot& s = segment_->slots[slot];
+  const std::uint32_t max = s.max.load(std::memory_order_acquire);
+  if (max == 0) return UINT32_MAX;
+  const std::uint64_t counts = s.counts.load(std::memory_order_acquire);
+  const std::uint64_t used = static_cast<std::uint64_t>(in_use_of(counts)) + in_pool_of(counts);
+  return used >= max ? 0 : static_cast<std::uint32_t>(max - used);
+}
+
+void SharedPoolBudget::set_waiting(int slot, bool waiting) {
+  const std::uint64_t bit = std::uint64_t{1} << worker_id_;
+  if (!waiting) {
+    segment_->slots[slot].waiting.fetch_and(~bit, std::memory_order_acq_rel);
+    return;
+  }
+  segment_->slots[slot].waiting.fetch_or(bit, std::memory_order_acq_rel);
+  // A release between our failed acquire and the bit being set signalled nobody: check again.
+  if (room(slot) > 0) {
+    const std::uint64_t one = 1;
+    ssize_t n = write(wake_fd(), &one, sizeof(one));
+    (void)n;
+  }
+}
+
+bool SharedPoolBudget::waited_elsewhere(int slot) const {
+  const std::uint64_t bit = std::uint64_t{1} << worker_id_;
+  return (segment_->slots[slot].waiting.load(std::memory_order_acquire) & ~bit) != 0;
+}
+
+void SharedPoolBudget::wake_waiters(int slot) {
+  std::uint64_t waiting = segment_->slots[slot].waiting.load(std::memory_order_acquire);
+  for (std::size_t w = 0; waiting != 0 && w < wake_fds_.size(); ++w, waiting >>= 1) {
+    if (!(waiting & 1)) continue;
+    const std::uint64_t one = 1;
+    ssize_t n = write(wake_fds_[w], &one, sizeof(one));  // only fails if the counter is saturated: already woken
+    (void)n;
+  }
+}
+
+std::vector<int> SharedPoolBudget::take_wakeups() {
+  std::vector<int> out;
+  std::uint64_t value = 0;
+  if (read(wake_fd(), &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value))) return out;
+  const std::uint64_t bit = std::uint64_t{1} << worker_id_;
+  for (std::size_t i = 0; i < MAX_BACKENDS; ++i) {
+    const Slot& s = segment_->slots[i];
+    if (!s.claimed.load(std::memory_order_acquire)) continue;
+    if ((s.waiting.load(std::memory_order_acquire) & bit) && room(static_cast<int>(i)) > 0)
+      out.push_back(static_cast<int>(i));
+  }
+  return out;
+}
+
+const char* SharedPoolBudget::name(int slot) const { return segment_->slots[slot].name; }
+
+}  // namespace pool
+}  // namespace pgpooler
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pgpooler {
+namespace pool {
+
+/** Connection limits of backends shared by worker processes: a MAP_SHARED segment and one eventfd per worker,
+ * created by the parent before fork() and inherited by the workers.
+ * Each backend has a slot with (in_use, in_pool) packed into one atomic word and its max (pool_size), so
+ * acquire/release/put/take are single CAS loops without locks, and pool_size holds across all workers.
+ * A worker with clients queued for a backend sets its bit in the slot; whoever frees a connection slot signals
+ * those workers' eventfds, and they wake their queued sessions (wake_fd / take_wakeups).
+ * Slots are claimed by backend name on first configure() (under a spin lock: config time only). A worker that
+ * dies holding connections leaves them counted until restart. */
+class SharedPoolBudget {
+ public:
+  static constexpr std::size_t MAX_BACKENDS = 256;
+  static constexpr std::size_t MAX_NAME = 63;
+  static constexpr std::size_t MAX_WORKERS = 64;
+
+  /** Map the segment and create the eventfds (before fork). nullptr on failure or too many workers. */
+  static std::unique_ptr<SharedPoolBudget> create(std::size_t workers);
+  ~SharedPoolBudget();
+  SharedPoolBudget(const SharedPoolBudget&) = delete;
+  SharedPoolBudget& operator=(const SharedPoolBudget&) = delete;
+
+  /** In a worker after fork: this process is worker `worker_id` (its eventfd and waiting bit). */
+  void set_worker(std::size_t worker_id) { worker_id_ = worker_id; }
+  /** This worker's eventfd: readable when a backend it waits for freed a connection slot. */
+  int wake_fd() const;
+
+  /** Slot of backend_name, claimed if new; sets its max (0 = unlimited). -1 if all slots are taken or the
+   * name is longer than MAX_NAME. */
+  int configure(const std::string& backend_name, unsigned max);
+
+  /** in_use++ if in_use + in_pool < max. */
+  bool acquire(int slot);
+  /** in_use-- (connection closed); wakes the workers waiting for this backend. */
+  void release(int slot);
+  /** in_use--, in_pool++ (connection put into some worker's pool). */
+  void put(int slot);
+  /** in_pool--, in_use++; false if no connection is pooled. */
+  bool take(int slot);
+  /** Connections that may still be opened (max - in_use - in_pool); UINT32_MAX if unlimited. */
+  std::uint32_t room(int slot) const;
+
+  /** This worker has (or no longer has) clients queued for the slot's backend. */
+  void set_waiting(int slot, bool waiting);
+  /** Some other worker has clients queued for the slot's backend. */
+  bool waited_elsewhere(int slot) const;
+  /** Read this worker's eventfd; slots it waits for that have room now. */
+  std::vector<int> take_wakeups();
+  const char* name(int slot) const;
+
+ private:
+  struct Slot {
+    std::atomic<std::uint32_t> claimed;
+    char name[MAX_NAME + 1];
+    std::atomic<std::uint32_t> max;
+    std::atomic<std::uint64_t> counts;   // (in_use << 32) | in_pool
+    std::atomic<std::uint64_t> waiting;  // bit per worker with queued clients
+  };
+  struct Segment {
+    std::atomic<std::uint32_t> lock;
+    Slot slots[MAX_BACKENDS];
+  };
+
+  SharedPoolBudget(Segment* segment, std::vector<int> wake_fds) : segment_(segment), wake_fds_(std::move(wake_fds)) {}
+  void wake_waiters(int slot);
+
+  Segment* segment_;
+  std::vector<int> wake_fds_;  // per worker
+  std::size_t worker_id_ = 0;
+};
+
+}  // namespace pool
+}  // namespace pgpooler
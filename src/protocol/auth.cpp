@@ -0,0 +1,149 @@
+#include "protocol/auth.hpp"
+#include "common/digest.hpp"
+#include <random>
+
+namespace pgpooler {
+namespace protocol {
+
+namespace {
+
+void put_u32(std::vector<std::uint8_t>& out, std::uint32_t v) {
+  out.push_back(static_cast<std::uint8_t>((v >> 24) & 0xff));
+  out.push_back(static_cast<std::uint8_t>((v >> 16) & 0xff));
+  out.push_back(static_cast<std::uint8_t>((v >> 8) & 0xff));
+  out.push_back(static_cast<std::uint8_t>(v & 0xff));
+}
+
+void set_u32(std::vector<std::uint8_t>& out, size_t offset, std::uint32_t v) {
+  out[offset] = static_cast<std::uint8_t>((v >> 24) & 0xff);
+  out[offset + 1] = static_cast<std::uint8_t>((v >> 16) & 0xff);
+  out[offset + 2] = static_cast<std::uint8_t>((v >> 8) & 0xff);
+  out[offset + 3] = static_cast<std::uint8_t>(v & 0xff);
+}
+
+void put_cstring(std::vector<std::uint8_t>& out, const std::string& s) {
+  out.insert(out.end(), s.begin(), s.end());
+  out.push_back('\0');
+}
+
+/** Value of attribute `key=` in a comma-separated SCRAM message, or empty. */
+std::string scram_attribute(const std::string& msg, char key) {
+  size_t pos = 0;
+  while (pos < msg.size()) {
+    size_t end = msg.find(',', pos);
+    if (end == std::string::npos) end = msg.size();
+    if (end - pos >= 2 && msg[pos] == key && msg[pos + 1] == '=') return msg.substr(pos + 2, end - pos - 2);
+    pos = end + 1;
+  }
+  return {};
+}
+
+}  // namespace
+
+std::vector<std::uint8_t> build_startup_message(const std::string& user, const std::string& database,
+                                                const std::string& application_name) {
+  std::vector<std::uint8_t> out;
+  put_u32(out, 0);           // length, set below
+  put_u32(out, 196608);      // protocol 3.0
+  put_cstring(out, "user");
+  put_cstring(out, user);
+  if (!database.empty()) {
+    put_cstring(out, "database");
+    put_cstring(out, database);
+  }
+  if (!application_name.empty()) {
+    put_cstring(out, "application_name");
+    put_cstring(out, application_name);
+  }
+  out.push_back('\0');
+  set_u32(out, 0, static_cast<std::uint32_t>(out.size()));
+  return out;
+}
+
+std::vector<std::uint8_t> build_password_message(const std::string& password) {
+  std::vector<std::uint8_t> out{'p'};
+  put_u32(out, static_cast<std::uint32_t>(4 + password.size() + 1));
+  put_cstring(out, password);
+  return out;
+}
+
+std::string md5_password_response(const std::string& user, const std::string& password, const std::uint8_t salt[4]) {
+  std::string inner = pgpooler::common::md5_hex(password + user);
+  inner.append(reinterpret_cast<const char*>(salt), 4);
+  return "md5" + pgpooler::common::md5_hex(inner);
+}
+
+std::vector<std::uint8_t> build_sasl_initial_response(const std::string& mechanism, const std::string& data) {
+  std::vector<std::uint8_t> out{'p'};
+  put_u32(out, 0);
+  put_cstring(out, mechanism);
+  put_u32(out, static_cast<std::uint32_t>(data.size()));
+  out.insert(out.end(), data.begin(), data.end());
+  set_u32(out, 1, static_cast<std::uint32_t>(out.size() - 1));
+  return out;
+}
+
+std::vector<std::uint8_t> build_sasl_response(const std::string& data) {
+  std::vector<std::uint8_t> out{'p'};
+  put_u32(out, static_cast<std::uint32_t>(4 + data.size()));
+  out.insert(out.end(), data.begin(), data.end());
+  return out;
+}
+
+ScramClient::ScramClient(std::string password) : password_(std::move(password)) {}
+
+std::string ScramClient::client_first() {
+  std::random_device rd;
+  std::uint8_t raw[18];
+  for (auto& b : raw) b = static_cast<std::uint8_t>(rd());
+  client_nonce_ = pgpooler::common::base64_encode(raw, sizeof(raw));
+  // PostgreSQL takes the user name from the startup packet; the SCRAM user name is left empty.
+  client_first_bare_ = "n=,r=" + client_nonce_;
+  return "n,," + client_first_bare_;
+}
+
+std::optional<std::string> ScramClient::client_final(const std::string& server_first) {
+  using namespace pgpooler::common;
+  const std::string nonce = scram_attribute(server_first, 'r');
+  const std::string salt_b64 = scram_attribute(server_first, 's');
+  const std::string iter_str = scram_attribute(server_first, 'i');
+  if (nonce.size() <= client_nonce_.size() || nonce.compare(0, client_nonce_.size(), client_nonce_) != 0)
+    return std::nullopt;
+  auto salt = base64_decode(salt_b64);
+  unsigned long iterations = 0;
+  try {
+    iterations = std::stoul(iter_str);
+  } catch (...) {
+    return std::nullopt;
+  }
+  if (!salt || iterations == 0) return std::nullopt;
+
+  const Sha256Digest salted = pbkdf2_sha256(password_, *salt, static_cast<unsigned>(iterations));
+  const std::string client_key_label = "Client Key";
+  const std::string server_key_label = "Server Key";
+  const Sha256Digest client_key = hmac_sha256(salted.data(), salted.size(),
+                                              reinterpret_cast<const std::uint8_t*>(client_key_label.data()),
+                                              client_key_label.size());
+  const Sha256Digest stored_key = sha256(client_key.data(), client_key.size());
+  const Sha256Digest server_key = hmac_sha256(salted.data(), salted.size(),
+                                              reinterpret_cast<const std::uint8_t*>(server_key_label.data()),
+                                              server_key_label.size());
+
+  const std::string without_proof = "c=biws,r=" + nonce;  // biws = base64("n,,")
+  const std::string auth_message = client_first_bare_ + "," + server_first + "," + without_proof;
+  const auto* am = reinterpret_cast<const std::uint8_t*>(auth_message.data());
+  const Sha256Digest client_signature = hmac_sha256(stored_key.data(), stored_key.size(), am, auth_message.size());
+  Sha256Digest proof;
+  for (size_t i = 0; i < proof.size(); ++i) proof[i] = client_key[i] ^ client_signature[i];
+  const Sha256Digest server_signature = hmac_sha256(server_key.data(), server_key.size(), am, auth_message.size());
+  expected_server_signature_.assign(server_signature.begin(), server_signature.end());
+  return without_proof + ",p=" + base64_encode(proof.data(), proof.size());
+}
+
+bool ScramClient::verify_server_final(const std::string& server_final) const {
+  auto sig = pgpooler::common::base64_decode(scram_attribute(server_final, 'v'));
+  return sig && !expected_server_signature_.empty() && *sig == expected_server_signature_;
+}
+
+}  // namespace protocol
+}  // namespace pgpooler
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace pgpooler {
+namespace protocol {
+
+/** Client side of backend authentication, for connections the pooler opens on its own behalf (e.g. the replica
+ * lag probe). Client sessions never use this: their authentication is forwarded as is. */
+
+/** AuthenticationRequest ('R') codes the pooler answers. */
+constexpr std::uint32_t AUTH_OK = 0;
+constexpr std::uint32_t AUTH_CLEARTEXT_PASSWORD = 3;
+constexpr std::uint32_t AUTH_MD5_PASSWORD = 5;
+constexpr std::uint32_t AUTH_SASL = 10;
+constexpr std::uint32_t AUTH_SASL_CONTINUE = 11;
+constexpr std::uint32_t AUTH_SASL_FINAL = 12;
+
+/** StartupMessage (protocol 3.0) with user, database and application_name (omitted if empty). */
+std::vector<std::uint8_t> build_startup_message(const std::string& user, const std::string& database,
+                                                const std::string& application_name);
+
+/** PasswordMessage ('p') carrying a nul-terminated string (cleartext or md5 response). */
+std::vector<std::uint8_t> build_password_message(const std::string& password);
+
+/** md5 auth response: "md5" + md5hex(md5hex(password + user) + salt). */
+std::string md5_password_response(const std::string& user, const std::string& password, const std::uint8_t salt[4]);
+
+/** SASLInitialResponse ('p'): mechanism name, then Int32 length and the client-first-message. */
+std::vector<std::uint8_t> build_sasl_initial_response(const std::string& mechanism, const std::string& data);
+
+/** SASLResponse ('p'): raw client-final-message. */
+std::vector<std::uint8_t> build_sasl_response(const std::string& data);
+
+/** SCRAM-SHA-256 exchange (RFC 5802/7677, no channel binding), as PostgreSQL runs it. */
+class ScramClient {
+ public:
+  explicit ScramClient(std::string password);
+
+  static constexpr const char* MECHANISM = "SCRAM-SHA-256";
+
+  /** client-first-message for SASLInitialResponse. */
+  std::string client_first();
+  /** client-final-message for the server-first-message from AuthenticationSASLContinue; nullopt if malformed
+   * (e.g. the server nonce does not extend ours). */
+  std::optional<std::string> client_final(const std::string& server_first);
+  /** AuthenticationSASLFinal data carries the expected server signature. */
+  bool verify_server_final(const std::string& server_final) const;
+
+ private:
+  std::string password_;
+  std::string client_nonce_;
+  std::string client_first_bare_;
+  std::vector<std::uint8_t> expected_server_signature_;
+};
+
+}  // namespace protocol
+}  // namespace pgpooler
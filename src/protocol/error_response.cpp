@@ -16,14 +16,14 @@ void append_field(std::vector<std::uint8_t>& out, char tag, const std::string& v
 }  // namespace
 
 std::vector<std::uint8_t> build_error_response(
-    const std::string& sqlstate, const std::string& message) {
+    const std::string& sqlstate, const std::string& message, const std::string& severity) {
   std::vector<std::uint8_t> body;
-  append_field(body, 'S', "FATAL");
+  append_field(body, 'S', severity);
   append_field(body, 'C', sqlstate);
   append_field(body, 'M', message);
   body.push_back(0);
 
-  std::uint32_t len = static_cast<std::uint32_t>(body.size());
+  std::uint32_t len = static_cast<std::uint32_t>(body.size() + 4);  // the length counts itself
   std::vector<std::uint8_t> out;
   out.reserve(1 + 4 + body.size());
   out.push_back(0x45);  // 'E'
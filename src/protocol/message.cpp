@@ -16,6 +16,23 @@ std::uint32_t read_be32(const unsigned char* p) {
          static_cast<std::uint32_t>(p[3]);
 }
 
+/** Type byte + placeholder length; finish_message() fills the length once the body is appended. */
+std::vector<std::uint8_t> start_message(unsigned char type, size_t body_hint) {
+  std::vector<std::uint8_t> out;
+  out.reserve(5 + body_hint);
+  out.push_back(type);
+  out.insert(out.end(), 4, 0);
+  return out;
+}
+
+void finish_message(std::vector<std::uint8_t>& out) {
+  const std::uint32_t len = static_cast<std::uint32_t>(out.size() - 1);
+  out[1] = static_cast<std::uint8_t>((len >> 24) & 0xff);
+  out[2] = static_cast<std::uint8_t>((len >> 16) & 0xff);
+  out[3] = static_cast<std::uint8_t>((len >> 8) & 0xff);
+  out[4] = static_cast<std::uint8_t>(len & 0xff);
+}
+
 }  // namespace
 
 namespace {
@@ -93,6 +110,144 @@ std::optional<unsigned char> get_ready_for_query_state(const std::vector<std::ui
   return state;
 }
 
+bool get_query_text(const std::vector<std::uint8_t>& msg, const char** text, size_t* len) {
+  if (msg.size() < 6 || msg[0] != 'Q' || msg.back() != '\0') return false;
+  *text = reinterpret_cast<const char*>(&msg[5]);
+  *len = msg.size() - 6;
+  return true;
+}
+
+bool get_parse_fields(const std::vector<std::uint8_t>& msg, std::string& statement_name,
+                      const char** query, size_t* query_len) {
+  if (msg.size() < 7 || msg[0] != 'P') return false;
+  auto name_end = std::find(msg.begin() + 5, msg.end(), '\0');
+  if (name_end == msg.end()) return false;
+  auto query_begin = name_end + 1;
+  auto query_end = std::find(query_begin, msg.end(), '\0');
+  if (query_end == msg.end()) return false;
+  statement_name.assign(msg.begin() + 5, name_end);
+  *query = reinterpret_cast<const char*>(&*query_begin);
+  *query_len = static_cast<size_t>(query_end - query_begin);
+  return true;
+}
+
+bool get_bind_fields(const std::vector<std::uint8_t>& msg, std::string& portal, std::string& statement_name,
+                     size_t* statement_offset) {
+  if (msg.size() < 7 || msg[0] != 'B') return false;
+  auto portal_end = std::find(msg.begin() + 5, msg.end(), '\0');
+  if (portal_end == msg.end()) return false;
+  auto stmt_begin = portal_end + 1;
+  auto stmt_end = std::find(stmt_begin, msg.end(), '\0');
+  if (stmt_end == msg.end()) return false;
+  portal.assign(msg.begin() + 5, portal_end);
+  statement_name.assign(stmt_begin, stmt_end);
+  *statement_offset = static_cast<size_t>(stmt_begin - msg.begin());
+  return true;
+}
+
+bool get_target_fields(const std::vector<std::uint8_t>& msg, unsigned char* kind, std::string& name) {
+  if (msg.size() < 7 || (msg[0] != 'D' && msg[0] != 'C') || msg.back() != '\0') return false;
+  *kind = msg[5];
+  name.assign(msg.begin() + 6, msg.end() - 1);
+  return true;
+}
+
+std::vector<std::uint8_t> replace_cstring(const std::vector<std::uint8_t>& msg, size_t offset,
+                                          const std::string& value) {
+  auto old_end = std::find(msg.begin() + static_cast<std::ptrdiff_t>(offset), msg.end(), '\0');
+  std::vector<std::uint8_t> out = start_message(msg[0], msg.size() + value.size());
+  out.insert(out.end(), msg.begin() + 5, msg.begin() + static_cast<std::ptrdiff_t>(offset));
+  out.insert(out.end(), value.begin(), value.end());
+  out.insert(out.end(), old_end, msg.end());
+  finish_message(out);
+  return out;
+}
+
+std::vector<std::uint8_t> build_empty_message(unsigned char type) {
+  std::vector<std::uint8_t> out = start_message(type, 0);
+  finish_message(out);
+  return out;
+}
+
+std::vector<std::uint8_t> build_parse_message(const std::string& statement_name, const std::uint8_t* rest,
+                                              size_t rest_len) {
+  std::vector<std::uint8_t> out = start_message('P', statement_name.size() + 1 + rest_len);
+  out.insert(out.end(), statement_name.begin(), statement_name.end());
+  out.push_back('\0');
+  out.insert(out.end(), rest, rest + rest_len);
+  finish_message(out);
+  return out;
+}
+
+std::vector<std::uint8_t> build_close_message(unsigned char kind, const std::string& name) {
+  std::vector<std::uint8_t> out = start_message('C', 1 + name.size() + 1);
+  out.push_back(kind);
+  out.insert(out.end(), name.begin(), name.end());
+  out.push_back('\0');
+  finish_message(out);
+  return out;
+}
+
+bool get_cancel_request_key(const std::vector<std::uint8_t>& msg, std::uint32_t* pid, std::uint32_t* secret) {
+  if (msg.size() != 16 || read_be32(msg.data()) != 16 || read_be32(msg.data() + 4) != CANCEL_REQUEST_CODE)
+    return false;
+  *pid = read_be32(msg.data() + 8);
+  *secret = read_be32(msg.data() + 12);
+  return true;
+}
+
+std::vector<std::uint8_t> build_cancel_request(std::uint32_t pid, std::uint32_t secret) {
+  std::vector<std::uint8_t> out;
+  out.reserve(16);
+  for (std::uint32_t v : {16u, CANCEL_REQUEST_CODE, pid, secret})
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<std::uint8_t>((v >> shift) & 0xff));
+  return out;
+}
+
+std::vector<std::uint8_t> build_backend_key_data(std::uint32_t pid, std::uint32_t secret) {
+  std::vector<std::uint8_t> out = start_message('K', 8);
+  for (std::uint32_t v : {pid, secret})
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<std::uint8_t>((v >> shift) & 0xff));
+  finish_message(out);
+  return out;
+}
+
+bool find_backend_key_data(const std::vector<std::uint8_t>& messages, std::uint32_t* pid, std::uint32_t* secret) {
+  size_t i = 0;
+  while (i + 5 <= messages.size()) {
+    const std::uint32_t len = read_be32(&messages[i + 1]);
+    if (len < 4 || i + 1 + len > messages.size()) return false;
+    if (messages[i] == 'K' && len == 12) {
+      *pid = read_be32(&messages[i + 5]);
+      *secret = read_be32(&messages[i + 9]);
+      return true;
+    }
+    i += 1 + len;
+  }
+  return false;
+}
+
+std::vector<std::uint8_t> replace_backend_key_data(const std::vector<std::uint8_t>& messages, std::uint32_t pid,
+                                                   std::uint32_t secret) {
+  std::vector<std::uint8_t> out;
+  out.reserve(messages.size());
+  size_t i = 0;
+  while (i + 5 <= messages.size()) {
+    const std::uint32_t len = read_be32(&messages[i + 1]);
+    if (len < 4 || i + 1 + len > messages.size()) break;
+    if (messages[i] == 'K') {
+      std::vector<std::uint8_t> key = build_backend_key_data(pid, secret);
+      out.insert(out.end(), key.begin(), key.end());
+    } else {
+      out.insert(out.end(), messages.begin() + static_cast<std::ptrdiff_t>(i),
+                 messages.begin() + static_cast<std::ptrdiff_t>(i + 1 + len));
+    }
+    i += 1 + len;
+  }
+  out.insert(out.end(), messages.begin() + static_cast<std::ptrdiff_t>(i), messages.end());
+  return out;
+}
+
 std::vector<std::uint8_t> build_query_message(const std::string& query) {
   const std::uint32_t len = 4 + static_cast<std::uint32_t>(query.size()) + 1;  // length field + string + nul
   std::vector<std::uint8_t> out;
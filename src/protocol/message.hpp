@@ -40,6 +40,52 @@ constexpr unsigned char TXSTATE_FAILED = 'E';
 /** If msg is ReadyForQuery (type 'Z', length 5), returns the state byte ('I'/'T'/'E'). Otherwise nullopt. */
 std::optional<unsigned char> get_ready_for_query_state(const std::vector<std::uint8_t>& msg);
 
+/** Query ('Q'): points text/len at the SQL text (without the trailing nul). Returns false if malformed. */
+bool get_query_text(const std::vector<std::uint8_t>& msg, const char** text, size_t* len);
+
+/** Parse ('P'): statement name and query text (without nul). Returns false if malformed. */
+bool get_parse_fields(const std::vector<std::uint8_t>& msg, std::string& statement_name,
+                      const char** query, size_t* query_len);
+
+/** Bind ('B'): portal and source statement names; statement_offset = index of the statement name in msg. */
+bool get_bind_fields(const std::vector<std::uint8_t>& msg, std::string& portal, std::string& statement_name,
+                     size_t* statement_offset);
+
+/** Describe ('D') / Close ('C'): target kind ('S' statement, 'P' portal) and its name. */
+bool get_target_fields(const std::vector<std::uint8_t>& msg, unsigned char* kind, std::string& name);
+
+/** Copy of msg with the nul-terminated string at offset replaced by value (length field updated). */
+std::vector<std::uint8_t> replace_cstring(const std::vector<std::uint8_t>& msg, size_t offset,
+                                          const std::string& value);
+
+/** Typed message without body, e.g. ParseComplete ('1') or CloseComplete ('3'). */
+std::vector<std::uint8_t> build_empty_message(unsigned char type);
+
+/** Parse ('P') named statement_name; rest is the Parse payload after the name (query, parameter types). */
+std::vector<std::uint8_t> build_parse_message(const std::string& statement_name, const std::uint8_t* rest,
+                                              size_t rest_len);
+
+/** Close ('C') of a statement ('S') or portal ('P'). */
+std::vector<std::uint8_t> build_close_message(unsigned char kind, const std::string& name);
+
+/** CancelRequest: length-prefixed (16), code 80877102, Int32 process id, Int32 secret key. */
+constexpr std::uint32_t CANCEL_REQUEST_CODE = 80877102;
+
+/** If msg is a CancelRequest, fills pid/secret and returns true. */
+bool get_cancel_request_key(const std::vector<std::uint8_t>& msg, std::uint32_t* pid, std::uint32_t* secret);
+
+std::vector<std::uint8_t> build_cancel_request(std::uint32_t pid, std::uint32_t secret);
+
+/** BackendKeyData ('K'): Int32 process id, Int32 secret key. */
+std::vector<std::uint8_t> build_backend_key_data(std::uint32_t pid, std::uint32_t secret);
+
+/** Finds BackendKeyData in a run of typed messages (e.g. a cached startup response). */
+bool find_backend_key_data(const std::vector<std::uint8_t>& messages, std::uint32_t* pid, std::uint32_t* secret);
+
+/** Copy of a run of typed messages with every BackendKeyData replaced by (pid, secret). */
+std::vector<std::uint8_t> replace_backend_key_data(const std::vector<std::uint8_t>& messages, std::uint32_t pid,
+                                                   std::uint32_t secret);
+
 /** Build a simple Query message (type 'Q'): length (4) + query string (null-terminated). */
 std::vector<std::uint8_t> build_query_message(const std::string& query);
 
@@ -0,0 +1,289 @@
+#include "protocol/sql_classifier.hpp"
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <vector>
+
+namespace pgpooler {
+namespace protocol {
+
+namespace {
+
+/** Minimal SQL tokenizer: yields upper-cased words and statement separators, skips everything else. */
+class Lexer {
+ public:
+  enum class Kind { Word, Semicolon, Other, End };
+
+  Lexer(const char* p, std::size_t n) : p_(p), end_(p + n) {}
+
+  /** Report comments containing marker through hint_seen(). */
+  void watch_comments_for(const char* marker) { marker_ = marker; }
+  bool hint_seen() const { return hint_seen_; }
+
+  /** Next token; for Kind::Word the upper-cased text is in word(). */
+  Kind next() {
+    skip_space_and_comments();
+    if (p_ >= end_) return Kind::End;
+    char c = *p_;
+    if (c == ';') {
+      ++p_;
+      return Kind::Semicolon;
+    }
+    if (c == '\'') {
+      skip_string(false);
+      return Kind::Other;
+    }
+    if (c == '"') {
+      skip_quoted_identifier();
+      return Kind::Other;
+    }
+    if (c == '$' && try_skip_dollar_quote()) return Kind::Other;
+    if (std::isalpha(static_cast<unsigned char>(c)) || c == '_' || static_cast<unsigned char>(c) >= 0x80) {
+      const char* start = p_;
+      while (p_ < end_ && (std::isalnum(static_cast<unsigned char>(*p_)) || *p_ == '_' || *p_ == '$' ||
+                           static_cast<unsigned char>(*p_) >= 0x80))
+        ++p_;
+      if (p_ - start == 1 && (*start == 'E' || *start == 'e') && p_ < end_ && *p_ == '\'') {
+        skip_string(true);
+        return Kind::Other;
+      }
+      word_.assign(start, p_);
+      for (auto& ch : word_) ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+      return Kind::Word;
+    }
+    ++p_;
+    return Kind::Other;
+  }
+
+  const std::string& word() const { return word_; }
+
+ private:
+  void skip_space_and_comments() {
+    while (p_ < end_) {
+      if (std::isspace(static_cast<unsigned char>(*p_))) {
+        ++p_;
+      } else if (*p_ == '-' && p_ + 1 < end_ && p_[1] == '-') {
+        const char* start = p_;
+        while (p_ < end_ && *p_ != '\n') ++p_;
+        check_comment(start);
+      } else if (*p_ == '/' && p_ + 1 < end_ && p_[1] == '*') {
+        const char* start = p_;
+        int depth = 0;  // block comments nest in PostgreSQL
+        while (p_ < end_) {
+          if (*p_ == '/' && p_ + 1 < end_ && p_[1] == '*') {
+            ++depth;
+            p_ += 2;
+          } else if (*p_ == '*' && p_ + 1 < end_ && p_[1] == '/') {
+            p_ += 2;
+            if (--depth == 0) break;
+          } else {
+            ++p_;
+          }
+        }
+        check_comment(start);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void check_comment(const char* start) {
+    if (!marker_ || hint_seen_) return;
+    const char* m_end = marker_ + std::char_traits<char>::length(marker_);
+    hint_seen_ = std::search(start, p_, marker_, m_end) != p_;
+  }
+
+  void skip_string(bool backslash_escapes) {
+    ++p_;  // opening quote
+    while (p_ < end_) {
+      if (backslash_escapes && *p_ == '\\' && p_ + 1 < end_) {
+        p_ += 2;
+      } else if (*p_ == '\'') {
+        ++p_;
+        if (p_ < end_ && *p_ == '\'') {
+          ++p_;  // '' escape
+          continue;
+        }
+        return;
+      } else {
+        ++p_;
+      }
+    }
+  }
+
+  void skip_quoted_identifier() {
+    ++p_;
+    while (p_ < end_) {
+      if (*p_ == '"') {
+        ++p_;
+        if (p_ < end_ && *p_ == '"') {
+          ++p_;
+          continue;
+        }
+        return;
+      }
+      ++p_;
+    }
+  }
+
+  /** $tag$ ... $tag$ (tag may be empty). Positional parameters ($1) are not dollar quotes. */
+  bool try_skip_dollar_quote() {
+    const char* q = p_ + 1;
+    while (q < end_ && (std::isalnum(static_cast<unsigned char>(*q)) || *q == '_')) {
+      if (q == p_ + 1 && std::isdigit(static_cast<unsigned char>(*q))) return false;
+      ++q;
+    }
+    if (q >= end_ || *q != '$') return false;
+    const char* tag = p_;
+    const std::size_t tag_len = static_cast<std::size_t>(q + 1 - p_);
+    const char* close = std::search(q + 1, end_, tag, tag + tag_len);
+    p_ = (close == end_) ? end_ : close + tag_len;
+    return true;
+  }
+
+  const char* p_;
+  const char* end_;
+  std::string word_;
+  const char* marker_ = nullptr;
+  bool hint_seen_ = false;
+};
+
+bool is_session_advisory_lock(const std::string& w) {
+  return w == "PG_ADVISORY_LOCK" || w == "PG_ADVISORY_LOCK_SHARED" ||
+         w == "PG_TRY_ADVISORY_LOCK" || w == "PG_TRY_ADVISORY_LOCK_SHARED";
+}
+
+SessionStateEffect classify_statement(const std::vector<std::string>& w) {
+  if (w.empty()) return SessionStateEffect::None;
+  SessionStateEffect effect = SessionStateEffect::None;
+  const std::string& head = w[0];
+  const std::string none;
+  const std::string& w1 = w.size() > 1 ? w[1] : none;
+  const std::string& w2 = w.size() > 2 ? w[2] : none;
+
+  if (head == "SET") {
+    if (w1 == "LOCAL" || w1 == "TRANSACTION" || w1 == "CONSTRAINTS") {
+      effect = SessionStateEffect::None;
+    } else if (w1 == "ROLE" || (w1 == "SESSION" && w2 == "AUTHORIZATION")) {
+      return SessionStateEffect::Full;
+    } else {
+      effect = SessionStateEffect::Settings;
+    }
+  } else if (head == "RESET") {
+    effect = SessionStateEffect::Settings;
+  } else if (head == "PREPARE" || head == "LISTEN" || head == "LOAD" || head == "DO" || head == "CALL") {
+    // DO / CALL: the body is not looked into (dollar quotes are skipped) and may change anything.
+    return SessionStateEffect::Full;
+  } else if (head == "CREATE") {
+    std::size_t i = 1;
+    if (i + 1 < w.size() && w[i] == "OR" && w[i + 1] == "REPLACE") i += 2;
+    if (i < w.size() && (w[i] == "GLOBAL" || w[i] == "LOCAL")) ++i;
+    if (i < w.size() && (w[i] == "TEMP" || w[i] == "TEMPORARY")) return SessionStateEffect::Full;
+  } else if (head == "DECLARE") {
+    for (std::size_t i = 1; i + 1 < w.size(); ++i)
+      if (w[i] == "WITH" && w[i + 1] == "HOLD") return SessionStateEffect::Full;
+  }
+
+  for (std::size_t i = 0; i < w.size(); ++i) {
+    if (is_session_advisory_lock(w[i])) return SessionStateEffect::Full;
+    if (w[i] == "INTO" && i + 1 < w.size() && (w[i + 1] == "TEMP" || w[i + 1] == "TEMPORARY"))
+      return SessionStateEffect::Full;
+    if (w[i] == "SET_CONFIG") effect = max_effect(effect, SessionStateEffect::Settings);
+  }
+  return effect;
+}
+
+/** Functions that write, take locks or change session state even inside a SELECT. */
+bool is_writing_function(const std::string& w) {
+  static const char* const names[] = {"NEXTVAL", "SETVAL", "SET_CONFIG", "PG_NOTIFY", "TXID_CURRENT",
+                                      "PG_CURRENT_XACT_ID", "LO_CREATE", "LO_IMPORT", "LO_UNLINK",
+                                      "PG_CANCEL_BACKEND", "PG_TERMINATE_BACKEND"};
+  for (const char* n : names)
+    if (w == n) return true;
+  return w.compare(0, 12, "PG_ADVISORY_") == 0 || w.compare(0, 16, "PG_TRY_ADVISORY_") == 0;
+}
+
+bool statement_is_read_only(const std::vector<std::string>& w) {
+  if (w.empty()) return true;  // empty statement (e.g. trailing ';')
+  const std::string& head = w[0];
+  if (head == "SHOW") return true;
+  if (head != "SELECT" && head != "VALUES" && head != "TABLE" && head != "WITH") return false;
+  for (std::size_t i = 0; i < w.size(); ++i) {
+    const std::string& x = w[i];
+    if (x == "INTO" || x == "INSERT" || x == "UPDATE" || x == "DELETE" || x == "MERGE" || x == "COPY")
+      return false;  // SELECT INTO, DML in a CTE
+    if (x == "FOR" && i + 1 < w.size() &&
+        (w[i + 1] == "UPDATE" || w[i + 1] == "SHARE" || w[i + 1] == "NO" || w[i + 1] == "KEY"))
+      return false;  // row locks
+    if (is_writing_function(x)) return false;
+  }
+  return true;
+}
+
+bool statement_drops_prepared(const std::vector<std::string>& w) {
+  if (w.size() == 2 && w[0] == "DISCARD" && w[1] == "ALL") return true;
+  if (w.empty() || w[0] != "DEALLOCATE") return false;
+  return (w.size() == 2 && w[1] == "ALL") || (w.size() == 3 && w[1] == "PREPARE" && w[2] == "ALL");
+}
+
+}  // namespace
+
+SessionStateEffect classify_session_state_effect(const char* sql, std::size_t len) {
+  Lexer lexer(sql, len);
+  SessionStateEffect effect = SessionStateEffect::None;
+  std::vector<std::string> words;
+  for (;;) {
+    Lexer::Kind k = lexer.next();
+    if (k == Lexer::Kind::Word) {
+      words.push_back(lexer.word());
+      continue;
+    }
+    if (k == Lexer::Kind::Other) continue;
+    effect = max_effect(effect, classify_statement(words));
+    if (effect == SessionStateEffect::Full || k == Lexer::Kind::End) break;
+    words.clear();
+  }
+  return effect;
+}
+
+bool is_read_only_query(const char* sql, std::size_t len) {
+  Lexer lexer(sql, len);
+  lexer.watch_comments_for(PRIMARY_HINT);
+  std::vector<std::string> words;
+  bool any = false;
+  for (;;) {
+    Lexer::Kind k = lexer.next();
+    if (k == Lexer::Kind::Word) {
+      words.push_back(lexer.word());
+      continue;
+    }
+    if (k == Lexer::Kind::Other) continue;
+    if (!statement_is_read_only(words)) return false;
+    any = any || !words.empty();
+    if (k == Lexer::Kind::End) break;
+    words.clear();
+  }
+  return any && !lexer.hint_seen();
+}
+
+bool drops_all_prepared_statements(const char* sql, std::size_t len) {
+  Lexer lexer(sql, len);
+  std::vector<std::string> words;
+  for (;;) {
+    Lexer::Kind k = lexer.next();
+    if (k == Lexer::Kind::Word) {
+      words.push_back(lexer.word());
+      continue;
+    }
+    if (k == Lexer::Kind::Other) {
+      words.emplace_back();  // keeps "DEALLOCATE name" from matching
+      continue;
+    }
+    if (statement_drops_prepared(words)) return true;
+    if (k == Lexer::Kind::End) return false;
+    words.clear();
+  }
+}
+
+}  // namespace protocol
+}  // namespace pgpooler
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace pgpooler {
+namespace protocol {
+
+/** How much server-side session state a statement leaves behind, ordered by the reset it needs. */
+enum class SessionStateEffect : std::uint8_t {
+  /** Plain queries (SELECT, DML, SET LOCAL...): nothing survives the transaction, no reset needed. */
+  None,
+  /** SET / RESET / set_config(): session GUCs changed, server_reset_query (e.g. RESET ALL) is enough. */
+  Settings,
+  /** PREPARE, LISTEN, temp tables, session advisory locks, WITH HOLD cursors, SET ROLE, DO, CALL...: DISCARD ALL. */
+  Full
+};
+
+/** The stronger of two effects. */
+inline SessionStateEffect max_effect(SessionStateEffect a, SessionStateEffect b) {
+  return static_cast<std::uint8_t>(a) >= static_cast<std::uint8_t>(b) ? a : b;
+}
+
+/** Light lexer over SQL text (skips comments, string literals, dollar quotes, quoted identifiers),
+ * classifies every ';'-separated statement and returns the strongest effect. Not a parser: DO and CALL are Full,
+ * other unknown statements are None, so functions that change state internally are only caught via
+ * ParameterStatus (reported GUCs only). */
+SessionStateEffect classify_session_state_effect(const char* sql, std::size_t len);
+
+inline SessionStateEffect classify_session_state_effect(const std::string& sql) {
+  return classify_session_state_effect(sql.data(), sql.size());
+}
+
+/** True if the SQL drops all prepared statements of the session (DISCARD ALL, DEALLOCATE [PREPARE] ALL). */
+bool drops_all_prepared_statements(const char* sql, std::size_t len);
+
+inline bool drops_all_prepared_statements(const std::string& sql) {
+  return drops_all_prepared_statements(sql.data(), sql.size());
+}
+
+/** Text that, inside any SQL comment, keeps the statement on the primary under read/write splitting. */
+constexpr const char* PRIMARY_HINT = "pgpooler:primary";
+
+/** True if the SQL only reads and may run on a replica: every ';'-separated statement is SELECT, VALUES, TABLE,
+ * SHOW or WITH ... SELECT, without SELECT INTO, FOR UPDATE/SHARE, DML in a CTE, or calls that write or take
+ * locks (nextval, setval, set_config, advisory locks, ...), and no comment contains PRIMARY_HINT.
+ * Conservative: anything it does not recognise is not read-only. */
+bool is_read_only_query(const char* sql, std::size_t len);
+
+inline bool is_read_only_query(const std::string& sql) { return is_read_only_query(sql.data(), sql.size()); }
+
+}  // namespace protocol
+}  // namespace pgpooler
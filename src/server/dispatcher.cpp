@@ -1,11 +1,20 @@
 #include "server/dispatcher.hpp"
 #include "server/fd_send.hpp"
+#include "server/handoff_queue.hpp"
+#include "server/lag_monitor.hpp"
+#include "server/peer_channel.hpp"
+#include "server/reload.hpp"
 #include "common/log.hpp"
+#include "common/stats.hpp"
+#include "common/timer_wheel.hpp"
 #include "config/config.hpp"
 #include "pool/backend_connection_pool.hpp"
 #include "pool/connection_wait_queue.hpp"
+#include "pool/shared_pool_budget.hpp"
 #include "protocol/message.hpp"
+#include "session/cancel_registry.hpp"
 #include "session/client_session.hpp"
+#include "session/response_spool.hpp"
 #include <event2/buffer.h>
 #include <event2/event.h>
 #include <event2/listener.h>
@@ -15,13 +24,19 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
 #endif
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <functional>
+#include <list>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 
 namespace pgpooler {
@@ -29,41 +44,160 @@ namespace server {
 
 namespace {
 
+struct DispatcherStub;
+
 struct DispatcherCtx {
   event_base* base = nullptr;
-  std::vector<int> worker_fds;
-  std::map<std::string, std::size_t> backend_to_worker;
+  std::vector<std::unique_ptr<HandoffQueue>> workers;
+  std::map<std::string, std::vector<std::size_t>> backend_to_worker;
   pgpooler::config::BackendResolver resolver;
+  /** Hot key detection (hot_key_rate > 0): handoffs per key and per worker in the current and the previous
+   * second; a key's rate is the larger of the two counts. */
+  unsigned hot_key_rate = 0;
+  std::chrono::steady_clock::time_point window_start;
+  std::unordered_map<std::string, unsigned> key_handoffs;
+  std::unordered_map<std::string, unsigned> key_handoffs_prev;
+  std::vector<unsigned> worker_handoffs;
+  std::vector<unsigned> worker_handoffs_prev;
+  /** TCP_DEFER_ACCEPT is on: accepted sockets usually have the startup already, read it in the accept callback. */
+  bool speculative_read = false;
+  /** Released stubs with their evbuffer and event, reused by the next accepts. */
+  std::vector<DispatcherStub*> free_stubs;
 };
 
+std::uint64_t mix64(std::uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/** 64-bit FNV-1a with a final mix, for rendezvous hashing of pool keys over workers. */
+std::uint64_t key_hash(const std::string& s) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return mix64(h);
+}
+
+/** Worker for a new client of backend_name. A backend served by several workers: rendezvous (highest random
+ * weight) hashing of (backend, user, database), so a pool key always lands on the same worker and its pool, and
+ * adding or removing a worker only moves the keys of that worker. A hot key (over hot_key_rate handoffs a second)
+ * goes to the least loaded worker instead: fewest handoffs recently plus handoffs it has not picked up yet. */
+std::size_t choose_worker(DispatcherCtx* ctx, const std::string& backend_name, const std::string& user,
+                          const std::string& database) {
+  auto it = ctx->backend_to_worker.find(backend_name);
+  if (it == ctx->backend_to_worker.end() || it->second.empty()) return 0;
+  const std::vector<std::size_t>& workers = it->second;
+  if (workers.size() == 1) return workers.front();
+
+  std::string key;
+  key.reserve(backend_name.size() + user.size() + database.size() + 2);
+  key.append(backend_name).push_back('\0');
+  key.append(user).push_back('\0');
+  key.append(database);
+  const std::uint64_t h = key_hash(key);
+  std::size_t chosen = workers.front();
+  std::uint64_t best = 0;
+  for (std::size_t w : workers) {
+    const std::uint64_t score = mix64(h ^ (0x9e3779b97f4a7c15ull * (w + 1)));
+    if (score >= best) {
+      best = score;
+      chosen = w;
+    }
+  }
+  if (ctx->hot_key_rate == 0) return chosen;
+
+  const auto now = std::chrono::steady_clock::now();
+  if (now - ctx->window_start >= std::chrono::seconds(1)) {
+    const bool adjacent = now - ctx->window_start < std::chrono::seconds(2);
+    ctx->key_handoffs_prev.clear();
+    if (adjacent) ctx->key_handoffs_prev.swap(ctx->key_handoffs);
+    ctx->key_handoffs.clear();
+    ctx->worker_handoffs_prev = adjacent ? ctx->worker_handoffs : std::vector<unsigned>(ctx->workers.size(), 0);
+    ctx->worker_handoffs.assign(ctx->workers.size(), 0);
+    ctx->window_start = now;
+  }
+  unsigned& count = ctx->key_handoffs[key];
+  ++count;
+  auto prev = ctx->key_handoffs_prev.find(key);
+  const unsigned rate = std::max(count, prev == ctx->key_handoffs_prev.end() ? 0u : prev->second);
+  if (rate > ctx->hot_key_rate) {
+    auto load = [ctx](std::size_t w) {
+      return (w < ctx->worker_handoffs.size() ? ctx->worker_handoffs[w] : 0u) +
+             (w < ctx->worker_handoffs_prev.size() ? ctx->worker_handoffs_prev[w] : 0u) +
+             (w < ctx->workers.size() ? ctx->workers[w]->depth() : 0u);
+    };
+    for (std::size_t w : workers)
+      if (load(w) < load(chosen)) chosen = w;
+  }
+  if (chosen < ctx->worker_handoffs.size()) ++ctx->worker_handoffs[chosen];
+  return chosen;
+}
+
 struct DispatcherStub {
   evutil_socket_t client_fd = -1;
   evbuffer* input = nullptr;
-  event* read_ev = nullptr;
+  event* read_ev = nullptr;  // created on the first wait for input, kept across reuse
   std::string client_addr;
   DispatcherCtx* dispatch_ctx = nullptr;
 };
 
+/** Stubs kept for reuse; more are freed. */
+constexpr std::size_t MAX_FREE_STUBS = 1024;
+
 void stub_read_cb(evutil_socket_t fd, short what, void* ctx);
 
-void stub_destroy(DispatcherStub* stub, event_base* base) {
-  if (!stub) return;
-  if (stub->read_ev) {
-    event_del(stub->read_ev);
-    event_free(stub->read_ev);
-    stub->read_ev = nullptr;
-  }
-  if (stub->input) {
-    evbuffer_free(stub->input);
-    stub->input = nullptr;
+void stub_free(DispatcherStub* stub) {
+  if (stub->read_ev) event_free(stub->read_ev);
+  if (stub->input) evbuffer_free(stub->input);
+  delete stub;
+}
+
+/** A stub for client_fd: from the free list, or a new one. nullptr if its evbuffer cannot be allocated. */
+DispatcherStub* stub_acquire(DispatcherCtx* dispatch_ctx, evutil_socket_t client_fd) {
+  DispatcherStub* stub = nullptr;
+  if (!dispatch_ctx->free_stubs.empty()) {
+    stub = dispatch_ctx->free_stubs.back();
+    dispatch_ctx->free_stubs.pop_back();
+  } else {
+    stub = new DispatcherStub();
+    stub->input = evbuffer_new();
+    if (!stub->input) {
+      stub_free(stub);
+      return nullptr;
+    }
   }
+  stub->client_fd = client_fd;
+  stub->dispatch_ctx = dispatch_ctx;
+  return stub;
+}
+
+/** Done with the stub: closes the client fd unless it was handed off (client_fd = -1), recycles the stub. */
+void stub_release(DispatcherStub* stub) {
+  if (!stub) return;
+  if (stub->read_ev) event_del(stub->read_ev);
+  evbuffer_drain(stub->input, evbuffer_get_length(stub->input));
   if (stub->client_fd >= 0) {
     evutil_closesocket(stub->client_fd);
     stub->client_fd = -1;
   }
-  delete stub;
+  stub->client_addr.clear();
+  DispatcherCtx* dispatch_ctx = stub->dispatch_ctx;
+  if (dispatch_ctx->free_stubs.size() < MAX_FREE_STUBS)
+    dispatch_ctx->free_stubs.push_back(stub);
+  else
+    stub_free(stub);
 }
 
+/** Read what the client sent and act on it: answer SSLRequest, hand a complete startup off, pass a Cancel
+ * request on. True if the stub still waits for more input; false once it is released. */
+bool stub_handle_input(DispatcherStub* stub);
+
 void on_dispatch_accept(struct evconnlistener* /*listener*/, evutil_socket_t client_fd,
                         struct sockaddr* address, int /*socklen*/, void* ctx) {
   auto* dispatch_ctx = static_cast<DispatcherCtx*>(ctx);
@@ -79,34 +213,39 @@ void on_dispatch_accept(struct evconnlistener* /*listener*/, evutil_socket_t cli
   pgpooler::log::info("dispatcher: new connection fd=" + std::to_string(client_fd) +
                       (addr_buf[0] ? std::string(" from ") + addr_buf : ""));
 
-  auto* stub = new DispatcherStub();
-  stub->client_fd = client_fd;
-  stub->client_addr = addr_buf[0] ? addr_buf : "";
-  stub->dispatch_ctx = dispatch_ctx;
-  stub->input = evbuffer_new();
-  if (!stub->input) {
+  DispatcherStub* stub = stub_acquire(dispatch_ctx, client_fd);
+  if (!stub) {
     pgpooler::log::error("dispatcher: evbuffer_new failed for fd=" + std::to_string(client_fd));
-    stub_destroy(stub, base);
     evutil_closesocket(client_fd);
     return;
   }
-  stub->read_ev = event_new(base, client_fd, EV_READ | EV_PERSIST, stub_read_cb, stub);
+  stub->client_addr = addr_buf[0] ? addr_buf : "";
+  /* With TCP_DEFER_ACCEPT the socket is accepted once data arrived: the startup is most likely complete. */
+  if (dispatch_ctx->speculative_read && !stub_handle_input(stub)) return;
   if (!stub->read_ev) {
-    stub_destroy(stub, base);
-    return;
+    stub->read_ev = event_new(base, client_fd, EV_READ | EV_PERSIST, stub_read_cb, stub);
+    if (!stub->read_ev) {
+      stub_release(stub);
+      return;
+    }
+  } else {
+    event_assign(stub->read_ev, base, client_fd, EV_READ | EV_PERSIST, stub_read_cb, stub);
   }
-  event_assign(stub->read_ev, base, client_fd, EV_READ | EV_PERSIST, stub_read_cb, stub);
   event_add(stub->read_ev, nullptr);
 }
 
-void stub_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
-  auto* stub = static_cast<DispatcherStub*>(ctx);
+void stub_read_cb(evutil_socket_t /*fd*/, short /*what*/, void* ctx) {
+  (void)stub_handle_input(static_cast<DispatcherStub*>(ctx));
+}
+
+bool stub_handle_input(DispatcherStub* stub) {
+  const evutil_socket_t fd = stub->client_fd;
   int n = evbuffer_read(stub->input, fd, -1);
   if (n <= 0) {
-    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
     pgpooler::log::debug("dispatcher: client fd=" + std::to_string(fd) + " eof/error n=" + std::to_string(n));
-    stub_destroy(stub, event_get_base(stub->read_ev));
-    return;
+    stub_release(stub);
+    return false;
   }
   size_t avail = evbuffer_get_length(stub->input);
   if (avail >= 8) {
@@ -122,39 +261,47 @@ void stub_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
         ssize_t sent = send(fd, &no_ssl, 1, MSG_NOSIGNAL);
         if (sent != 1) {
           pgpooler::log::warn("dispatcher: failed to send SSL N to fd=" + std::to_string(fd));
-          stub_destroy(stub, event_get_base(stub->read_ev));
-          return;
+          stub_release(stub);
+          return false;
         }
         pgpooler::log::debug("dispatcher: sent SSL N to fd=" + std::to_string(fd) + ", waiting for Startup");
-        return;
+        // A client that sent its Startup right behind the SSLRequest gets no further read event for it.
       }
     }
   }
   size_t need = protocol::first_client_packet_length(stub->input);
-  if (need == 0) return;
+  if (need == 0) return true;
   pgpooler::log::debug("dispatcher: first packet complete fd=" + std::to_string(fd) + " len=" + std::to_string(need));
 
   std::vector<std::uint8_t> packet(need);
   size_t removed = evbuffer_remove(stub->input, packet.data(), need);
   if (removed != need) {
-    stub_destroy(stub, event_get_base(stub->read_ev));
-    return;
+    stub_release(stub);
+    return false;
   }
 
-  constexpr std::uint32_t CANCEL_REQUEST_CODE = 80877102;
-  if (packet.size() >= 8) {
-    std::uint32_t len = (static_cast<std::uint32_t>(packet[0]) << 24) | (static_cast<std::uint32_t>(packet[1]) << 16) |
-                        (static_cast<std::uint32_t>(packet[2]) << 8) | static_cast<std::uint32_t>(packet[3]);
-    std::uint32_t code = (static_cast<std::uint32_t>(packet[4]) << 24) | (static_cast<std::uint32_t>(packet[5]) << 16) |
-                         (static_cast<std::uint32_t>(packet[6]) << 8) | static_cast<std::uint32_t>(packet[7]);
-    if (len == 16 && code == CANCEL_REQUEST_CODE) {
-      pgpooler::log::debug("dispatcher: Cancel request (unsupported), closing fd=" + std::to_string(fd));
-      stub_destroy(stub, event_get_base(stub->read_ev));
-      return;
+  std::uint32_t cancel_pid = 0;
+  std::uint32_t cancel_secret = 0;
+  if (protocol::get_cancel_request_key(packet, &cancel_pid, &cancel_secret)) {
+    /* Synthetic keys carry the owning worker; the worker's session layer finds the session and cancels. */
+    int owner = pgpooler::session::cancel_key_worker(cancel_pid);
+    DispatcherCtx* dispatch_ctx = stub->dispatch_ctx;
+    if (!dispatch_ctx || owner < 0 || static_cast<std::size_t>(owner) >= dispatch_ctx->workers.size()) {
+      pgpooler::log::debug("dispatcher: Cancel request with unknown key, closing fd=" + std::to_string(fd));
+      stub_release(stub);
+      return false;
     }
+    stub->client_fd = -1;  // the queue owns it now
+    if (!dispatch_ctx->workers[static_cast<std::size_t>(owner)]->push(static_cast<int>(fd), packet))
+      pgpooler::log::warn("dispatcher: failed to pass Cancel request to worker " + std::to_string(owner));
+    else
+      pgpooler::log::debug("dispatcher: Cancel request fd=" + std::to_string(fd) + " -> worker " + std::to_string(owner));
+    stub_release(stub);
+    return false;
   }
 
   std::vector<std::uint8_t> startup_msg;
+  std::uint8_t startup_offset = 0;
   if (packet.size() >= 8) {
     std::uint32_t len = (static_cast<std::uint32_t>(packet[0]) << 24) | (static_cast<std::uint32_t>(packet[1]) << 16) |
                         (static_cast<std::uint32_t>(packet[2]) << 8) | static_cast<std::uint32_t>(packet[3]);
@@ -162,6 +309,7 @@ void stub_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
                          (static_cast<std::uint32_t>(packet[6]) << 8) | static_cast<std::uint32_t>(packet[7]);
     if (len == 8 && code == 80877103) {
       startup_msg.assign(packet.begin() + 8, packet.end());
+      startup_offset = 8;
     } else {
       startup_msg = packet;
     }
@@ -175,55 +323,59 @@ void stub_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
 
   if (user_s.empty()) {
     pgpooler::log::warn("dispatcher: missing user in startup (not a valid Startup or Cancel?), closing fd=" + std::to_string(fd));
-    stub_destroy(stub, event_get_base(stub->read_ev));
-    return;
+    stub_release(stub);
+    return false;
   }
 
-  auto* base = event_get_base(stub->read_ev);
   DispatcherCtx* dispatch_ctx = stub->dispatch_ctx;
   if (!dispatch_ctx) {
-    stub_destroy(stub, base);
-    return;
+    stub_release(stub);
+    return false;
   }
 
-  auto resolved = dispatch_ctx->resolver(user_s, database_s);
+  auto resolved = dispatch_ctx->resolver(user_s, database_s, [&startup_msg](const std::string& name) {
+    return protocol::extract_startup_parameter(startup_msg, name.c_str());
+  });
   if (!resolved) {
     pgpooler::log::warn("dispatcher: no route for user=" + user_s + " database=" + database_s);
-    stub_destroy(stub, base);
-    return;
+    stub_release(stub);
+    return false;
   }
 
-  auto it = dispatch_ctx->backend_to_worker.find(resolved->name);
-  std::size_t worker_id = (it != dispatch_ctx->backend_to_worker.end()) ? it->second : 0;
-  if (worker_id >= dispatch_ctx->worker_fds.size()) {
+  std::size_t worker_id = choose_worker(dispatch_ctx, resolved->name, user_s, database_s);
+  if (worker_id >= dispatch_ctx->workers.size()) {
     worker_id = 0;
   }
-  int worker_fd = dispatch_ctx->worker_fds[worker_id];
+  HandoffQueue& worker = *dispatch_ctx->workers[worker_id];
   pgpooler::log::info("dispatcher: routing user=" + user_s + " database=" + database_s +
                       " -> backend=" + resolved->name + " worker=" + std::to_string(worker_id) +
                       " fd=" + std::to_string(stub->client_fd));
 
   evutil_socket_t client_fd = stub->client_fd;
   stub->client_fd = -1;
-  event_del(stub->read_ev);
-  event_free(stub->read_ev);
-  stub->read_ev = nullptr;
-  evbuffer_free(stub->input);
-  stub->input = nullptr;
-  delete stub;
-
-  if (!send_fd_and_payload(worker_fd, static_cast<int>(client_fd), packet)) {
-    int err = errno;
-    std::string msg = "dispatcher: send_fd_and_payload failed for worker=" + std::to_string(worker_id) +
-        " errno=" + std::to_string(err) + " (" + (err ? std::strerror(err) : "?") + ")";
-    if (err == EPIPE || err == ECONNRESET || err == ENOTCONN)
-      msg += " (worker process may have exited; check worker startup/errors)";
-    pgpooler::log::error(msg);
-    evutil_closesocket(client_fd);
-    return;
+  stub_release(stub);
+
+  std::vector<std::uint8_t> payload;
+  if (resolved->origin.config_fingerprint != 0) {
+    HandoffRoute route;
+    route.origin = resolved->origin;
+    route.user = std::move(user_s);
+    route.database = std::move(database_s);
+    route.startup_offset = startup_offset;
+    payload = encode_handoff_route(route, packet);
+  } else {
+    payload = std::move(packet);
+  }
+  if (!worker.push(static_cast<int>(client_fd), payload)) {
+    pgpooler::log::error("dispatcher: handoff to worker=" + std::to_string(worker_id) + " failed (" +
+                         (worker.dead() ? "worker process may have exited; check worker startup/errors"
+                                        : "queue full, " + std::to_string(worker.depth()) + " pending") +
+                         "), closing fd=" + std::to_string(client_fd));
+    return false;
   }
-  pgpooler::log::debug("dispatcher: handed off client fd=" + std::to_string(client_fd) + " to worker " + std::to_string(worker_id));
-  evutil_closesocket(client_fd);
+  pgpooler::log::debug("dispatcher: queued client fd=" + std::to_string(client_fd) + " for worker " +
+                       std::to_string(worker_id) + " depth=" + std::to_string(worker.depth()));
+  return false;
 }
 
 void dispatcher_listener_error_cb(struct evconnlistener* /*listener*/, void* /*ctx*/) {}
@@ -235,13 +387,23 @@ void run_dispatcher(
     const std::string& listen_host,
     std::uint16_t listen_port,
     const std::vector<int>& worker_socket_fds,
-    const std::map<std::string, std::size_t>& backend_to_worker,
-    pgpooler::config::BackendResolver resolver) {
+    const std::map<std::string, std::vector<std::size_t>>& backend_to_worker,
+    pgpooler::config::BackendResolver resolver,
+    unsigned hot_key_rate,
+    std::size_t dispatcher_id,
+    bool reuse_port,
+    int incoming_cpu,
+    unsigned defer_accept_sec) {
   DispatcherCtx ctx;
   ctx.base = base;
-  ctx.worker_fds = worker_socket_fds;
+  for (std::size_t i = 0; i < worker_socket_fds.size(); ++i)
+    ctx.workers.push_back(std::make_unique<HandoffQueue>(base, worker_socket_fds[i], i));
   ctx.backend_to_worker = backend_to_worker;
   ctx.resolver = std::move(resolver);
+  ctx.hot_key_rate = hot_key_rate;
+  ctx.speculative_read = defer_accept_sec > 0;
+  ctx.worker_handoffs.assign(worker_socket_fds.size(), 0);
+  ctx.worker_handoffs_prev.assign(worker_socket_fds.size(), 0);
   struct sockaddr_in sin;
   std::memset(&sin, 0, sizeof(sin));
   sin.sin_family = AF_INET;
@@ -252,20 +414,50 @@ void run_dispatcher(
     sin.sin_addr.s_addr = htonl(INADDR_ANY);
   }
 
+  if (incoming_cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(incoming_cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+      pgpooler::log::warn("dispatcher " + std::to_string(dispatcher_id) + ": cannot pin to CPU " +
+                          std::to_string(incoming_cpu) + ": " + std::strerror(errno));
+  }
   evconnlistener* listener = evconnlistener_new_bind(
       base, on_dispatch_accept, &ctx,
-      LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
+      LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | (reuse_port ? LEV_OPT_REUSEABLE_PORT : 0),
       -1, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin));
   if (!listener) {
     pgpooler::log::error("dispatcher: failed to bind " + listen_host + ":" + std::to_string(listen_port));
     return;
   }
   evconnlistener_set_error_cb(listener, dispatcher_listener_error_cb);
+#ifdef SO_INCOMING_CPU
+  if (incoming_cpu >= 0) {
+    // Among the SO_REUSEPORT listeners the kernel prefers the one whose incoming CPU is the CPU handling the SYN.
+    int cpu = incoming_cpu;
+    if (setsockopt(evconnlistener_get_fd(listener), SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
+      pgpooler::log::warn("dispatcher " + std::to_string(dispatcher_id) + ": SO_INCOMING_CPU failed: " +
+                          std::strerror(errno));
+  }
+#endif
+  if (defer_accept_sec > 0) {
+#ifdef TCP_DEFER_ACCEPT
+    int secs = static_cast<int>(defer_accept_sec);
+    if (setsockopt(evconnlistener_get_fd(listener), IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) != 0)
+      pgpooler::log::warn("dispatcher " + std::to_string(dispatcher_id) + ": TCP_DEFER_ACCEPT failed: " +
+                          std::strerror(errno));
+#else
+    pgpooler::log::warn("dispatcher " + std::to_string(dispatcher_id) + ": TCP_DEFER_ACCEPT is not supported here");
+#endif
+  }
 
-  pgpooler::log::info("dispatcher listening on " + listen_host + ":" + std::to_string(listen_port) +
-                      " (workers=" + std::to_string(worker_socket_fds.size()) + ")");
+  pgpooler::log::info("dispatcher " + std::to_string(dispatcher_id) + " listening on " + listen_host + ":" +
+                      std::to_string(listen_port) + " (workers=" + std::to_string(worker_socket_fds.size()) +
+                      (incoming_cpu >= 0 ? ", cpu " + std::to_string(incoming_cpu) : std::string()) + ")");
   event_base_dispatch(base);
   evconnlistener_free(listener);
+  for (DispatcherStub* stub : ctx.free_stubs) stub_free(stub);
+  ctx.workers.clear();
 }
 
 namespace {
@@ -278,32 +470,75 @@ std::string resolve_path(const std::string& base_file, const std::string& path)
   return base_file.substr(0, pos + 1) + path;
 }
 
+struct WorkerCtx;
+
+/** Socket from one dispatcher process. */
+struct DispatcherLink {
+  WorkerCtx* wctx = nullptr;
+  int fd = -1;
+  event* read_ev = nullptr;
+  WorkerRecvState recv_state;
+  std::uint32_t received = 0;  // frames read, acknowledged to the dispatcher (its queue depth)
+};
+
 struct WorkerCtx {
   event_base* base = nullptr;
-  int worker_socket_fd = -1;
+  std::list<DispatcherLink> links;
   int worker_id = -1;
+  const pgpooler::config::RoutingState* routing_state = nullptr;
   pgpooler::config::BackendResolver resolver;
   pgpooler::config::PoolManager* pool_manager = nullptr;
   pgpooler::pool::BackendConnectionPool* connection_pool = nullptr;
   pgpooler::pool::ConnectionWaitQueue* wait_queue = nullptr;
-  WorkerRecvState recv_state;
+  pgpooler::common::TimerWheel* timer_wheel = nullptr;
+  pgpooler::pool::SharedPoolBudget* budget = nullptr;
 };
 
-void worker_socket_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
+/** Another worker freed connection slots of backends we have clients queued for: wake as many as fit. */
+void budget_wakeup_cb(evutil_socket_t /*fd*/, short /*what*/, void* ctx) {
   auto* wctx = static_cast<WorkerCtx*>(ctx);
+  for (int slot : wctx->budget->take_wakeups())
+    wctx->wait_queue->wake_backend(wctx->budget->name(slot), wctx->budget->room(slot));
+}
+
+void worker_socket_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
+  auto* link = static_cast<DispatcherLink*>(ctx);
+  WorkerCtx* wctx = link->wctx;
+  const std::uint32_t received_before = link->received;
   for (;;) {
-    auto result = try_recv_fd_and_payload(static_cast<int>(fd), wctx->recv_state);
+    auto result = try_recv_fd_and_payload(static_cast<int>(fd), link->recv_state);
     if (!result) break;
+    ++link->received;
     int client_fd = result->first;
     std::vector<std::uint8_t> payload = std::move(result->second);
     if (client_fd < 0) continue;
     evutil_make_socket_nonblocking(client_fd);
     pgpooler::log::info("worker " + std::to_string(wctx->worker_id) + ": received client fd=" + std::to_string(client_fd) + " payload_len=" + std::to_string(payload.size()));
+    std::optional<HandoffRoute> route;
+    std::vector<std::uint8_t> packet;
+    if (!decode_handoff_route(payload, route, packet)) {
+      pgpooler::log::warn("worker " + std::to_string(wctx->worker_id) + ": malformed route header, closing fd=" + std::to_string(client_fd));
+      evutil_closesocket(client_fd);
+      continue;
+    }
+    /* Routed by the dispatcher from the same config files: take its decision instead of resolving again. */
+    std::optional<pgpooler::session::PreRouted> pre_routed;
+    if (route) {
+      if (auto resolved = pgpooler::config::replay_route(wctx->routing_state, route->origin)) {
+        pre_routed.emplace();
+        pre_routed->resolved = std::move(*resolved);
+        pre_routed->user = std::move(route->user);
+        pre_routed->database = std::move(route->database);
+        pre_routed->startup_offset = route->startup_offset;
+      } else {
+        pgpooler::log::debug("worker " + std::to_string(wctx->worker_id) + ": route of fd=" + std::to_string(client_fd) + " is from another config, resolving again");
+      }
+    }
     try {
       (void)new pgpooler::session::ClientSession(
           wctx->base, client_fd, "dispatcher",
-          wctx->resolver, wctx->pool_manager, wctx->connection_pool, wctx->wait_queue,
-          &payload, wctx->worker_id);
+          wctx->resolver, wctx->pool_manager, wctx->connection_pool, wctx->wait_queue, wctx->timer_wheel,
+          &packet, wctx->worker_id, pre_routed ? &*pre_routed : nullptr);
       pgpooler::log::debug("worker: session created for fd=" + std::to_string(client_fd));
     } catch (const std::exception& e) {
       pgpooler::log::error("worker: session create failed fd=" + std::to_string(client_fd) + ": " + e.what());
@@ -313,17 +548,32 @@ void worker_socket_read_cb(evutil_socket_t fd, short /*what*/, void* ctx) {
       evutil_closesocket(client_fd);
     }
   }
+  if (link->received != received_before) {
+    const std::uint8_t ack[4] = {static_cast<std::uint8_t>(link->received >> 24),
+                                 static_cast<std::uint8_t>(link->received >> 16),
+                                 static_cast<std::uint8_t>(link->received >> 8),
+                                 static_cast<std::uint8_t>(link->received)};
+    ssize_t n = send(static_cast<int>(fd), ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)n;  // a full buffer only delays the count until the next read
+  }
+  char c;
+  if (recv(static_cast<int>(fd), &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {  // that dispatcher exited
+    pgpooler::log::warn("worker " + std::to_string(wctx->worker_id) + ": dispatcher socket fd=" + std::to_string(fd) + " closed");
+    event_del(link->read_ev);
+  }
 }
 
 }  // namespace
 
 void run_worker(
     std::size_t worker_id,
-    int worker_socket_fd,
+    const std::vector<int>& worker_socket_fds,
     const std::vector<std::string>& backend_names,
     const std::string& resolve_base_path,
     const std::string& backends_path,
-    const std::string& routing_path) {
+    const std::string& routing_path,
+    pgpooler::pool::SharedPoolBudget* budget,
+    const std::vector<int>& peer_fds) {
   std::cerr << "worker " << worker_id << ": starting (backends=";
   for (size_t i = 0; i < backend_names.size(); ++i) { std::cerr << (i ? "," : "") << backend_names[i]; }
   std::cerr << ")" << std::endl;
@@ -373,6 +623,30 @@ void run_worker(
       }
     }
   }
+  PoolShares pool_shares;  // split budget only: with a shared one every worker checks the full pool_size
+  if (!budget) {
+    for (const auto& name : backend_names) {
+      std::size_t index = 0;
+      std::size_t count = 0;
+      for (std::size_t w = 0; w < app_cfg.workers.size(); ++w) {
+        const auto& names = app_cfg.workers[w].backends;
+        if (std::find(names.begin(), names.end(), name) == names.end()) continue;
+        if (w < worker_id) ++index;
+        ++count;
+      }
+      if (count > 1) pool_shares[name] = {index, count};
+    }
+  }
+  for (const auto& be : filtered) {
+    auto it = pool_shares.find(be.name);
+    if (it == pool_shares.end() || be.pool_size == 0) continue;
+    pgpooler::log::info("worker " + std::to_string(worker_id) + ": backend " + be.name + " is served by " +
+                        std::to_string(it->second.second) + " workers, pool_size " +
+                        std::to_string(pgpooler::config::worker_pool_size(be.pool_size, it->second.first,
+                                                                          it->second.second)) +
+                        " of " + std::to_string(be.pool_size));
+  }
+  apply_pool_shares(filtered, pool_shares);
   if (filtered.empty()) {
     std::string msg = "worker " + std::to_string(worker_id) + ": no matching backends (wanted: " + abs_backends + ")";
     std::cerr << msg << std::endl;
@@ -380,12 +654,11 @@ void run_worker(
     return;
   }
 
-  pgpooler::config::Router* router_ptr = nullptr;
-  pgpooler::config::Router router(backends_cfg.backends, routing_cfg.defaults, routing_cfg.routing);
-  if (!routing_cfg.routing.empty()) router_ptr = &router;
-  pgpooler::config::BackendResolver resolver =
-      pgpooler::config::make_resolver(backends_cfg.backends, routing_cfg, router_ptr);
+  pgpooler::config::RoutingState routing_state(
+      pgpooler::config::make_routing_snapshot(std::move(backends_cfg), std::move(routing_cfg)));
+  pgpooler::config::BackendResolver resolver = pgpooler::config::make_resolver(&routing_state);
 
+  pgpooler::session::ResponseSpool::set_spill_directory(resolve_path(resolve_base_path, app_cfg.spill_directory));
   pgpooler::config::PoolManager pool_manager(filtered);
   pgpooler::pool::BackendConnectionPool connection_pool;
 
@@ -397,29 +670,100 @@ void run_worker(
     return;
   }
   pgpooler::pool::ConnectionWaitQueue wait_queue(base);
-
-  evutil_make_socket_nonblocking(worker_socket_fd);
+  pgpooler::common::TimerWheel timer_wheel(base);
 
   WorkerCtx wctx;
   wctx.base = base;
-  wctx.worker_socket_fd = worker_socket_fd;
   wctx.worker_id = static_cast<int>(worker_id);
   wctx.resolver = std::move(resolver);
+  wctx.routing_state = &routing_state;
   wctx.pool_manager = &pool_manager;
   wctx.connection_pool = &connection_pool;
   wctx.wait_queue = &wait_queue;
+  wctx.timer_wheel = &timer_wheel;
+  wctx.budget = budget;
+
+  event* budget_ev = nullptr;
+  if (budget) {
+    budget->set_worker(worker_id);
+    pool_manager.use_shared_budget(budget);
+    wait_queue.set_waiting_hook([&pool_manager](const std::string& name, bool waiting) {
+      pool_manager.set_waiting(name, waiting);
+    });
+    budget_ev = event_new(base, budget->wake_fd(), EV_READ | EV_PERSIST, budget_wakeup_cb, &wctx);
+    if (budget_ev) event_add(budget_ev, nullptr);
+    pgpooler::log::info("worker " + std::to_string(worker_id) + ": pool_size of its backends shared with the other workers");
+  }
+  std::unique_ptr<PeerChannel> peer_channel;
+  if (budget) {
+    std::map<std::string, std::vector<std::size_t>> backend_peers;
+    for (const auto& name : backend_names) {
+      for (std::size_t w = 0; w < app_cfg.workers.size() && w < peer_fds.size(); ++w) {
+        const auto& names = app_cfg.workers[w].backends;
+        if (peer_fds[w] >= 0 && std::find(names.begin(), names.end(), name) != names.end())
+          backend_peers[name].push_back(w);
+      }
+    }
+    if (!backend_peers.empty()) {
+      peer_channel = std::make_unique<PeerChannel>(base, peer_fds, std::move(backend_peers), &pool_manager,
+                                                   &connection_pool, &wait_queue,
+                                                   "worker " + std::to_string(worker_id) + ": ");
+      PeerChannel* channel = peer_channel.get();
+      wait_queue.set_key_waiting_hook([channel](const std::string& name, const std::string& user,
+                                                const std::string& database, bool waiting) {
+        channel->on_key_waiting(name, user, database, waiting);
+      });
+      wait_queue.set_unclaimed_hook([channel](const std::string& name, const std::string& user,
+                                              const std::string& database) {
+        channel->on_unclaimed(name, user, database);
+      });
+    }
+  }
+  if (!peer_channel) {
+    for (int fd : peer_fds)
+      if (fd >= 0) close(fd);
+  }
 
-  event* read_ev = event_new(base, worker_socket_fd, EV_READ | EV_PERSIST, worker_socket_read_cb, &wctx);
-  if (!read_ev) {
-    std::cerr << "worker " << worker_id << ": event_new(worker_socket) failed" << std::endl;
-    event_base_free(base);
-    return;
+  for (int fd : worker_socket_fds) {
+    evutil_make_socket_nonblocking(fd);
+    wctx.links.emplace_back();
+    DispatcherLink& link = wctx.links.back();
+    link.wctx = &wctx;
+    link.fd = fd;
+    link.read_ev = event_new(base, fd, EV_READ | EV_PERSIST, worker_socket_read_cb, &link);
+    if (!link.read_ev) {
+      std::cerr << "worker " << worker_id << ": event_new(worker_socket) failed" << std::endl;
+      for (auto& l : wctx.links)
+        if (l.read_ev) event_free(l.read_ev);
+      event_base_free(base);
+      return;
+    }
+    event_add(link.read_ev, nullptr);
   }
-  event_add(read_ev, nullptr);
+
+  ReloadCtx reload_ctx;
+  reload_ctx.backends_path = abs_backends;
+  reload_ctx.routing_path = abs_routing;
+  reload_ctx.routing = &routing_state;
+  reload_ctx.pool_manager = &pool_manager;
+  reload_ctx.connection_pool = &connection_pool;
+  reload_ctx.wait_queue = &wait_queue;
+  reload_ctx.backend_names = backend_names;
+  reload_ctx.pool_shares = pool_shares;
+  reload_ctx.log_prefix = "worker " + std::to_string(worker_id) + ": ";
+  struct event* reload_ev = add_reload_signal(base, &reload_ctx);
+  auto lag_monitor = std::make_unique<LagMonitor>(base, &routing_state, &pool_manager, reload_ctx.log_prefix);
+  pgpooler::stats::start_periodic_log(base, app_cfg.stats_interval_sec, "[worker " + std::to_string(worker_id) + "] ");
 
   pgpooler::log::info("worker " + std::to_string(worker_id) + " ready (backends: " + std::to_string(filtered.size()) + ")");
   event_base_dispatch(base);
-  event_free(read_ev);
+  lag_monitor.reset();
+  wait_queue.set_key_waiting_hook(nullptr);
+  wait_queue.set_unclaimed_hook(nullptr);
+  peer_channel.reset();
+  if (reload_ev) event_free(reload_ev);
+  if (budget_ev) event_free(budget_ev);
+  for (auto& link : wctx.links) event_free(link.read_ev);
   event_base_free(base);
 }
 
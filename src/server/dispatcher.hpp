@@ -11,26 +11,46 @@
 struct evbuffer;
 
 namespace pgpooler {
+namespace pool {
+class SharedPoolBudget;
+}
 namespace server {
 
-/** Runs the dispatcher loop: accept TCP, read first packet, resolve, send fd to worker. Does not return until event_base stops. */
+/** Runs the dispatcher loop: accept TCP, read first packet, resolve, send fd to worker. Does not return until event_base stops.
+ * backend_to_worker: workers serving each backend; several = spread by (backend, user, database), hot keys
+ * (over hot_key_rate handoffs a second, 0 = off) to the least loaded of them.
+ * Several dispatcher processes: each binds its own listener with reuse_port (SO_REUSEPORT, the kernel spreads
+ * accepts); incoming_cpu >= 0 pins the process to that CPU and sets SO_INCOMING_CPU so connections handled by
+ * that CPU prefer this listener.
+ * defer_accept_sec > 0: TCP_DEFER_ACCEPT on the listener (the kernel completes accept once the client sent data,
+ * or after that many seconds) and the first packet is read right in the accept callback. */
 void run_dispatcher(
     struct event_base* base,
     const std::string& listen_host,
     std::uint16_t listen_port,
     const std::vector<int>& worker_socket_fds,
-    const std::map<std::string, std::size_t>& backend_to_worker,
-    pgpooler::config::BackendResolver resolver);
+    const std::map<std::string, std::vector<std::size_t>>& backend_to_worker,
+    pgpooler::config::BackendResolver resolver,
+    unsigned hot_key_rate = 0,
+    std::size_t dispatcher_id = 0,
+    bool reuse_port = false,
+    int incoming_cpu = -1,
+    unsigned defer_accept_sec = 0);
 
-/** Runs one worker: receives fd+payload from dispatcher, creates sessions. Does not return until event_base stops.
- * backend_names: backends this worker serves. Paths for loading config (worker re-loads backends/routing). */
+/** Runs one worker: receives fd+payload from the dispatchers (one socket each), creates sessions. Does not return
+ * until event_base stops.
+ * backend_names: backends this worker serves. Paths for loading config (worker re-loads backends/routing).
+ * budget: pool_size shared with the other workers (created before fork); nullptr = split into per-worker shares.
+ * peer_fds: socket to worker i at index i (-1 if none), for handing idle connections over (PeerChannel). */
 void run_worker(
     std::size_t worker_id,
-    int worker_socket_fd,
+    const std::vector<int>& worker_socket_fds,
     const std::vector<std::string>& backend_names,
     const std::string& resolve_base_path,
     const std::string& backends_path,
-    const std::string& routing_path);
+    const std::string& routing_path,
+    pgpooler::pool::SharedPoolBudget* budget = nullptr,
+    const std::vector<int>& peer_fds = {});
 
 }  // namespace server
 }  // namespace pgpooler
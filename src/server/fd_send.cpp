@@ -1,7 +1,9 @@
 #include "server/fd_send.hpp"
+#include "common/log.hpp"
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <stdexcept>
@@ -19,117 +21,168 @@
 namespace pgpooler {
 namespace server {
 
-bool send_fd_and_payload(int socket_fd, int client_fd, const std::vector<std::uint8_t>& payload) {
-  std::uint32_t len = static_cast<std::uint32_t>(payload.size());
-  if (len != payload.size()) return false;
-  char len_buf[4];
-  len_buf[0] = static_cast<char>((len >> 24) & 0xff);
-  len_buf[1] = static_cast<char>((len >> 16) & 0xff);
-  len_buf[2] = static_cast<char>((len >> 8) & 0xff);
-  len_buf[3] = static_cast<char>(len & 0xff);
+namespace {
 
+constexpr std::uint32_t MAX_FRAME_PAYLOAD = 1024 * 1024;
+constexpr std::size_t RECV_CHUNK = 64 * 1024;
+
+/** Frames and descriptors no longer line up: a descriptor must not reach another frame's owner. Close every
+ * queued descriptor and drop the buffered bytes. */
+void drop_out_of_sync(WorkerRecvState& state, const char* why) {
+  pgpooler::log::warn(std::string("fd channel: ") + why + ", dropping " + std::to_string(state.buf.size() - state.off) +
+                      " buffered bytes and " + std::to_string(state.fds.size()) + " descriptors");
+  for (int fd : state.fds) close(fd);
+  state.fds.clear();
+  state.buf.clear();
+  state.off = 0;
+}
+
+}  // namespace
+
+bool append_frame(std::vector<std::uint8_t>& out, bool has_fd, const std::vector<std::uint8_t>& payload) {
+  if (payload.size() > MAX_FRAME_PAYLOAD) return false;
+  const std::uint32_t word = static_cast<std::uint32_t>(payload.size()) | (has_fd ? FRAME_HAS_FD : 0u);
+  out.push_back(static_cast<std::uint8_t>((word >> 24) & 0xff));
+  out.push_back(static_cast<std::uint8_t>((word >> 16) & 0xff));
+  out.push_back(static_cast<std::uint8_t>((word >> 8) & 0xff));
+  out.push_back(static_cast<std::uint8_t>(word & 0xff));
+  out.insert(out.end(), payload.begin(), payload.end());
+  return true;
+}
+
+ssize_t send_frames(int socket_fd, const std::uint8_t* data, std::size_t len, const int* fds, std::size_t nfds) {
   struct msghdr msg = {};
-  struct iovec iov[2];
-  iov[0].iov_base = len_buf;
-  iov[0].iov_len = 4;
-  iov[1].iov_base = const_cast<std::uint8_t*>(payload.data());
-  iov[1].iov_len = payload.size();
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 2;
-
-  char cmsg_buf[CMSG_SPACE(sizeof(int))];
-  msg.msg_control = cmsg_buf;
-  msg.msg_controllen = sizeof(cmsg_buf);
-  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  *reinterpret_cast<int*>(CMSG_DATA(cmsg)) = client_fd;
-  msg.msg_controllen = cmsg->cmsg_len;
-
-  ssize_t n = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
-  if (n < 0 || static_cast<size_t>(n) != 4 + payload.size()) {
-    return false;
+  struct iovec iov;
+  iov.iov_base = const_cast<std::uint8_t*>(data);
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  alignas(struct cmsghdr) char cmsg_buf[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_SEND)];
+  if (nfds > MAX_FDS_PER_SEND) nfds = MAX_FDS_PER_SEND;
+  if (nfds > 0) {
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+  return sendmsg(socket_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+std::vector<std::uint8_t> encode_handoff_route(const HandoffRoute& route, const std::vector<std::uint8_t>& packet) {
+  std::vector<std::uint8_t> out;
+  out.reserve(15 + route.origin.target.size() + route.user.size() + route.database.size() + 3 + packet.size());
+  out.push_back('R');
+  out.push_back(HandoffRoute::VERSION);
+  for (int shift = 56; shift >= 0; shift -= 8)
+    out.push_back(static_cast<std::uint8_t>(route.origin.config_fingerprint >> shift));
+  for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<std::uint8_t>(route.origin.rule >> shift));
+  out.push_back(route.startup_offset);
+  for (const std::string* s : {&route.origin.target, &route.user, &route.database}) {
+    out.insert(out.end(), s->begin(), s->end());
+    out.push_back(0);
+  }
+  out.insert(out.end(), packet.begin(), packet.end());
+  return out;
+}
+
+bool decode_handoff_route(const std::vector<std::uint8_t>& payload, std::optional<HandoffRoute>& route,
+                          std::vector<std::uint8_t>& packet) {
+  route.reset();
+  if (payload.empty() || payload[0] != 'R') {
+    packet = payload;
+    return true;
+  }
+  if (payload.size() < 15 || payload[1] != HandoffRoute::VERSION) return false;
+  HandoffRoute r;
+  for (std::size_t i = 2; i < 10; ++i) r.origin.config_fingerprint = (r.origin.config_fingerprint << 8) | payload[i];
+  r.origin.rule = 0;
+  for (std::size_t i = 10; i < 14; ++i) r.origin.rule = (r.origin.rule << 8) | payload[i];
+  r.startup_offset = payload[14];
+  std::size_t offset = 15;
+  for (std::string* s : {&r.origin.target, &r.user, &r.database}) {
+    auto begin = payload.begin() + static_cast<std::ptrdiff_t>(offset);
+    auto end = std::find(begin, payload.end(), 0);
+    if (end == payload.end()) return false;
+    s->assign(begin, end);
+    offset = static_cast<std::size_t>(end - payload.begin()) + 1;
   }
+  packet.assign(payload.begin() + static_cast<std::ptrdiff_t>(offset), payload.end());
+  if (r.startup_offset > packet.size()) return false;
+  route = std::move(r);
   return true;
 }
 
 std::optional<std::pair<int, std::vector<std::uint8_t>>> try_recv_fd_and_payload(int socket_fd, WorkerRecvState& state) {
-  if (state.pending_fd >= 0 && state.payload.size() >= state.payload_len) {
-    int fd = state.pending_fd;
-    state.pending_fd = -1;
-    state.payload_len = 0;
-    std::vector<std::uint8_t> payload = std::move(state.payload);
-    state.payload.clear();
-    return std::make_pair(fd, std::move(payload));
-  }
+  for (;;) {
+    const std::size_t avail = state.buf.size() - state.off;
+    if (avail >= 4) {
+      const std::uint8_t* p = state.buf.data() + state.off;
+      const std::uint32_t word = (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+                                 (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+      const std::uint32_t payload_len = word & ~FRAME_HAS_FD;
+      if (payload_len > MAX_FRAME_PAYLOAD) {  // out of sync: nothing after this can be parsed
+        drop_out_of_sync(state, "frame length out of range");
+        return std::nullopt;
+      }
+      if (avail >= 4 + static_cast<std::size_t>(payload_len)) {
+        int fd = -1;
+        if (word & FRAME_HAS_FD) {
+          if (state.fds.empty()) {  // its descriptor was lost: the ones queued later belong to later frames
+            drop_out_of_sync(state, "frame without its descriptor");
+            return std::nullopt;
+          }
+          fd = state.fds.front();
+          state.fds.pop_front();
+        }
+        std::vector<std::uint8_t> payload(p + 4, p + 4 + payload_len);
+        state.off += 4 + payload_len;
+        if (state.off == state.buf.size()) {
+          state.buf.clear();
+          state.off = 0;
+        }
+        return std::make_pair(fd, std::move(payload));
+      }
+    }
 
-  if (state.pending_fd < 0) {
-    std::uint8_t len_buf[4];
-    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    if (state.off > 0) {
+      state.buf.erase(state.buf.begin(), state.buf.begin() + static_cast<std::ptrdiff_t>(state.off));
+      state.off = 0;
+    }
+    const std::size_t old_size = state.buf.size();
+    state.buf.resize(old_size + RECV_CHUNK);
+    alignas(struct cmsghdr) char cmsg_buf[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_SEND)];
     struct msghdr msg = {};
     struct iovec iov;
-    iov.iov_base = len_buf;
-    iov.iov_len = 4;
+    iov.iov_base = state.buf.data() + old_size;
+    iov.iov_len = RECV_CHUNK;
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
     msg.msg_control = cmsg_buf;
     msg.msg_controllen = sizeof(cmsg_buf);
 
     ssize_t n = recvmsg(socket_fd, &msg, MSG_DONTWAIT);
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) return std::nullopt;
-      return std::nullopt;
-    }
-    if (n == 0) return std::nullopt;
-    if (n != 4) return std::nullopt;
+    state.buf.resize(old_size + (n > 0 ? static_cast<std::size_t>(n) : 0));
+    if (n <= 0) return std::nullopt;  // EAGAIN, EOF or error
 
-    int received_fd = -1;
     for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
-        received_fd = *reinterpret_cast<int*>(CMSG_DATA(cmsg));
-        break;
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+      const std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (std::size_t i = 0; i < count; ++i) {
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        state.fds.push_back(fd);
       }
     }
-    if (received_fd < 0) return std::nullopt;
-
-    std::uint32_t payload_len = (static_cast<std::uint32_t>(static_cast<unsigned char>(len_buf[0])) << 24) |
-                                (static_cast<std::uint32_t>(static_cast<unsigned char>(len_buf[1])) << 16) |
-                                (static_cast<std::uint32_t>(static_cast<unsigned char>(len_buf[2])) << 8) |
-                                static_cast<std::uint32_t>(static_cast<unsigned char>(len_buf[3]));
-    if (payload_len > 1024 * 1024) {
-      close(received_fd);
+    if (msg.msg_flags & MSG_CTRUNC) {
+      // The kernel dropped descriptors it could not install (RLIMIT_NOFILE): the rest no longer match frames.
+      drop_out_of_sync(state, "descriptors truncated (MSG_CTRUNC)");
       return std::nullopt;
     }
-    state.pending_fd = received_fd;
-    state.payload_len = payload_len;
-    state.payload.clear();
-    state.payload.reserve(payload_len);
   }
-
-  while (state.payload.size() < state.payload_len) {
-    std::uint8_t buf[4096];
-    size_t to_read = state.payload_len - state.payload.size();
-    if (to_read > sizeof(buf)) to_read = sizeof(buf);
-    ssize_t n = recv(socket_fd, buf, to_read, MSG_DONTWAIT | MSG_NOSIGNAL);
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) return std::nullopt;
-      close(state.pending_fd);
-      state.pending_fd = -1;
-      state.payload_len = 0;
-      state.payload.clear();
-      return std::nullopt;
-    }
-    if (n == 0) return std::nullopt;
-    state.payload.insert(state.payload.end(), buf, buf + n);
-  }
-
-  int fd = state.pending_fd;
-  state.pending_fd = -1;
-  state.payload_len = 0;
-  std::vector<std::uint8_t> payload = std::move(state.payload);
-  state.payload.clear();
-  return std::make_pair(fd, std::move(payload));
 }
 
 }  // namespace server
@@ -1,24 +1,63 @@
 #pragma once
 
+#include "config/config.hpp"
+#include <sys/types.h>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <optional>
+#include <string>
 #include <utility>
 #include <vector>
 
 namespace pgpooler {
 namespace server {
 
-/** Send a client fd and a data payload to the worker over a Unix stream socket (SCM_RIGHTS). Returns true on success. */
-bool send_fd_and_payload(int socket_fd, int client_fd, const std::vector<std::uint8_t>& payload);
+/** Frames on the Unix stream sockets between processes: 4-byte big-endian length + payload. The top bit of the
+ * length marks a frame that carries a descriptor. Descriptors travel as SCM_RIGHTS with some sendmsg at or before
+ * their frame's first byte, in frame order, so one sendmsg may carry several frames and several descriptors. */
+constexpr std::uint32_t FRAME_HAS_FD = 0x80000000u;
+/** Descriptors in one SCM_RIGHTS message (the kernel's SCM_MAX_FD). */
+constexpr std::size_t MAX_FDS_PER_SEND = 253;
 
-/** Non-blocking receive state for worker (one message may be split across reads). */
+/** Append one frame (header + payload) to out. False if the payload is too long for a frame. */
+bool append_frame(std::vector<std::uint8_t>& out, bool has_fd, const std::vector<std::uint8_t>& payload);
+
+/** One non-blocking sendmsg of len bytes with fds attached (nfds <= MAX_FDS_PER_SEND). Bytes sent or -1 (errno). */
+ssize_t send_frames(int socket_fd, const std::uint8_t* data, std::size_t len, const int* fds, std::size_t nfds);
+
+/** Route header in front of a dispatcher handoff payload: the dispatcher's routing decision, so the worker
+ * neither parses the startup packet nor matches the routing rules again.
+ *   'R' version(1) fingerprint(8) rule(4) startup_offset(1) target\0 user\0 database\0, then the first packet.
+ * A payload starting with 0 (the high byte of a packet length) is a bare first packet (Cancel requests). */
+struct HandoffRoute {
+  static constexpr std::uint8_t VERSION = 1;
+  pgpooler::config::RouteOrigin origin;
+  std::string user;
+  std::string database;
+  std::uint8_t startup_offset = 0;  // bytes of SSLRequest in front of the startup packet
+};
+
+/** Route header + first packet. */
+std::vector<std::uint8_t> encode_handoff_route(const HandoffRoute& route, const std::vector<std::uint8_t>& packet);
+
+/** Split a handoff payload into its route (left empty if it has none) and the first packet. False if the header
+ * is truncated or of another version. */
+bool decode_handoff_route(const std::vector<std::uint8_t>& payload, std::optional<HandoffRoute>& route,
+                          std::vector<std::uint8_t>& packet);
+
+/** Non-blocking receive state for worker (frames may be split across reads, or several arrive in one). */
 struct WorkerRecvState {
-  int pending_fd = -1;
-  std::uint32_t payload_len = 0;
-  std::vector<std::uint8_t> payload;
+  std::vector<std::uint8_t> buf;  // received bytes; frames are parsed from off
+  std::size_t off = 0;
+  std::deque<int> fds;  // received descriptors not yet matched to their frames
 };
 
-/** Try to receive one fd+payload. Returns the pair when a full message is received; nullopt if need more data or error. Updates state for partial receives. */
+/** Try to receive one fd+payload. Returns the pair when a full message is received (fd -1 if it carried none);
+ * nullopt if need more data or error. Reads as much as the socket has, so later calls may return frames without
+ * a syscall. Descriptors truncated by the kernel (MSG_CTRUNC, e.g. at RLIMIT_NOFILE) or a descriptor-carrying
+ * frame with none queued mean frames and descriptors no longer line up: the buffered bytes are dropped and the
+ * queued descriptors closed, as for a malformed length. */
 std::optional<std::pair<int, std::vector<std::uint8_t>>> try_recv_fd_and_payload(int socket_fd, WorkerRecvState& state);
 
 }  // namespace server
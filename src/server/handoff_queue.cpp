@@ -0,0 +1,133 @@
+#include "server/handoff_queue.hpp"
+#include "common/log.hpp"
+#include "server/fd_send.hpp"
+#include <event2/event.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+namespace pgpooler {
+namespace server {
+
+HandoffQueue::HandoffQueue(struct event_base* base, int socket_fd, std::size_t worker_id)
+    : base_(base), fd_(socket_fd), worker_id_(worker_id) {
+  evutil_make_socket_nonblocking(fd_);
+  flush_ev_ = event_new(base_, -1, 0, flush_cb, this);
+  write_ev_ = event_new(base_, fd_, EV_WRITE, flush_cb, this);
+  ack_ev_ = event_new(base_, fd_, EV_READ | EV_PERSIST, ack_cb, this);
+  if (ack_ev_) event_add(ack_ev_, nullptr);
+}
+
+HandoffQueue::~HandoffQueue() {
+  if (flush_ev_) event_free(flush_ev_);
+  if (write_ev_) event_free(write_ev_);
+  if (ack_ev_) event_free(ack_ev_);
+  for (int fd : fds_) close(fd);
+}
+
+bool HandoffQueue::push(int client_fd, const std::vector<std::uint8_t>& payload) {
+  if (dead_ || frame_ends_.size() >= MAX_QUEUED || !flush_ev_ || !write_ev_) {
+    if (client_fd >= 0) close(client_fd);
+    return false;
+  }
+  const std::size_t start = out_.size();
+  if (!append_frame(out_, client_fd >= 0, payload)) {
+    if (client_fd >= 0) close(client_fd);
+    return false;
+  }
+  if (client_fd >= 0) {
+    fds_.push_back(client_fd);
+    fd_frames_.push_back(start);
+  }
+  frame_ends_.push_back(out_.size());
+  ++pushed_;
+  if (!flush_scheduled_ && !event_pending(write_ev_, EV_WRITE, nullptr)) {
+    flush_scheduled_ = true;
+    event_active(flush_ev_, EV_TIMEOUT, 0);
+  }
+  return true;
+}
+
+void HandoffQueue::flush_cb(evutil_socket_t /*fd*/, short /*what*/, void* arg) {
+  auto* self = static_cast<HandoffQueue*>(arg);
+  self->flush_scheduled_ = false;
+  self->flush();
+}
+
+void HandoffQueue::flush() {
+  while (out_off_ < out_.size()) {
+    /* Bytes of a frame must not arrive before its fd: stop short of the first frame whose fd does not fit. */
+    const std::size_t nfds = std::min(fds_.size(), MAX_FDS_PER_SEND);
+    const std::size_t limit = nfds < fds_.size() ? fd_frames_[nfds] : out_.size();
+    std::vector<int> batch(fds_.begin(), fds_.begin() + static_cast<std::ptrdiff_t>(nfds));
+    ssize_t n = send_frames(fd_, out_.data() + out_off_, limit - out_off_, batch.data(), nfds);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        compact();
+        event_add(write_ev_, nullptr);
+        return;
+      }
+      if (errno == EINTR) continue;
+      fail(std::strerror(errno));
+      return;
+    }
+    for (std::size_t i = 0; i < nfds; ++i) {  // the worker holds its own copies now
+      close(fds_.front());
+      fds_.pop_front();
+      fd_frames_.pop_front();
+    }
+    out_off_ += static_cast<std::size_t>(n);
+    while (!frame_ends_.empty() && frame_ends_.front() <= out_off_) frame_ends_.pop_front();
+  }
+  out_.clear();
+  out_off_ = 0;
+}
+
+void HandoffQueue::compact() {
+  if (out_off_ == 0) return;
+  out_.erase(out_.begin(), out_.begin() + static_cast<std::ptrdiff_t>(out_off_));
+  for (auto& offset : fd_frames_) offset = offset > out_off_ ? offset - out_off_ : 0;
+  for (auto& offset : frame_ends_) offset -= out_off_;
+  out_off_ = 0;
+}
+
+void HandoffQueue::ack_cb(evutil_socket_t fd, short /*what*/, void* arg) {
+  auto* self = static_cast<HandoffQueue*>(arg);
+  for (;;) {
+    ssize_t n = recv(fd, self->ack_buf_ + self->ack_len_, sizeof(self->ack_buf_) - self->ack_len_, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      self->fail(n == 0 ? "closed" : std::strerror(errno));
+      return;
+    }
+    self->ack_len_ += static_cast<std::size_t>(n);
+    if (self->ack_len_ < sizeof(self->ack_buf_)) continue;
+    self->acked_ = (static_cast<std::uint32_t>(self->ack_buf_[0]) << 24) |
+                   (static_cast<std::uint32_t>(self->ack_buf_[1]) << 16) |
+                   (static_cast<std::uint32_t>(self->ack_buf_[2]) << 8) | static_cast<std::uint32_t>(self->ack_buf_[3]);
+    self->ack_len_ = 0;
+  }
+}
+
+void HandoffQueue::fail(const char* what) {
+  if (dead_) return;
+  dead_ = true;
+  pgpooler::log::error("dispatcher: worker " + std::to_string(worker_id_) + " socket " + what + ", dropping " +
+                       std::to_string(frame_ends_.size()) + " queued handoffs (worker process may have exited)");
+  event_del(ack_ev_);
+  event_del(write_ev_);
+  for (int fd : fds_) close(fd);
+  fds_.clear();
+  fd_frames_.clear();
+  frame_ends_.clear();
+  out_.clear();
+  out_off_ = 0;
+  acked_ = pushed_;
+}
+
+}  // namespace server
+}  // namespace pgpooler
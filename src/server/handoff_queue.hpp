@@ -0,0 +1,66 @@
+#pragma once
+
+#include <event2/util.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+struct event;
+struct event_base;
+
+namespace pgpooler {
+namespace server {
+
+/** Dispatcher side of one worker socket: client fds and payloads are queued and written without blocking.
+ * Everything queued during one event loop iteration goes out in one sendmsg (several frames, their fds in one
+ * SCM_RIGHTS message, up to MAX_FDS_PER_SEND); what the socket does not take waits for EV_WRITE, so a busy worker
+ * does not stall the dispatcher. The worker acknowledges with the number of frames it has read (4 bytes,
+ * big-endian, counting from 0 mod 2^32), which gives depth(): handoffs this worker has not picked up yet. */
+class HandoffQueue {
+ public:
+  /** Frames queued (not yet written to the socket) before push() refuses more. */
+  static constexpr std::size_t MAX_QUEUED = 4096;
+
+  HandoffQueue(struct event_base* base, int socket_fd, std::size_t worker_id);
+  ~HandoffQueue();
+  HandoffQueue(const HandoffQueue&) = delete;
+  HandoffQueue& operator=(const HandoffQueue&) = delete;
+
+  /** Queue payload with client_fd (-1: none); the queue owns client_fd from now on and closes it once sent.
+   * False (client_fd closed) if the worker is gone or the queue is full. */
+  bool push(int client_fd, const std::vector<std::uint8_t>& payload);
+  /** Handoffs pushed and not yet read by the worker. */
+  std::uint32_t depth() const { return pushed_ - acked_; }
+  /** The worker closed its end. */
+  bool dead() const { return dead_; }
+
+ private:
+  static void flush_cb(evutil_socket_t fd, short what, void* arg);
+  static void ack_cb(evutil_socket_t fd, short what, void* arg);
+  void flush();
+  /** Drop the bytes already sent from out_ (offsets shift accordingly). */
+  void compact();
+  void fail(const char* what);
+
+  struct event_base* base_;
+  int fd_;
+  std::size_t worker_id_;
+  struct event* flush_ev_ = nullptr;  // activated once per loop iteration with frames queued
+  struct event* write_ev_ = nullptr;  // EV_WRITE when the socket buffer is full
+  struct event* ack_ev_ = nullptr;
+  bool flush_scheduled_ = false;
+  std::vector<std::uint8_t> out_;
+  std::size_t out_off_ = 0;
+  std::deque<int> fds_;                 // not yet sent
+  std::deque<std::size_t> fd_frames_;   // offset in out_ of each queued fd's frame
+  std::deque<std::size_t> frame_ends_;  // offset in out_ past each queued frame
+  std::uint32_t pushed_ = 0;
+  std::uint32_t acked_ = 0;
+  std::uint8_t ack_buf_[4] = {};
+  std::size_t ack_len_ = 0;
+  bool dead_ = false;
+};
+
+}  // namespace server
+}  // namespace pgpooler
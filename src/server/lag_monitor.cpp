@@ -0,0 +1,399 @@
+#include "server/lag_monitor.hpp"
+#include "common/log.hpp"
+#include "common/stats.hpp"
+#include "protocol/auth.hpp"
+#include "protocol/message.hpp"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <netdb.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace pgpooler {
+namespace server {
+
+namespace {
+
+/** Replay position, age of the last replayed transaction (since server start if none), current WAL position
+ * (primary only, for read-your-writes), receive position and whether the WAL receiver streams. Without
+ * pg_read_all_stats the receiver's status is hidden; a running receiver then counts as streaming. */
+const char* const LAG_QUERY =
+    "SELECT pg_last_wal_replay_lsn(), "
+    "EXTRACT(EPOCH FROM now() - COALESCE(pg_last_xact_replay_timestamp(), pg_postmaster_start_time())), "
+    "CASE WHEN pg_is_in_recovery() THEN NULL ELSE pg_current_wal_lsn() END, pg_last_wal_receive_lsn(), "
+    "(SELECT COALESCE(status, 'streaming') = 'streaming' FROM pg_stat_wal_receiver)";
+
+std::uint32_t read_u32(const std::uint8_t* p) {
+  return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+         (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+}
+
+/** Columns of a DataRow ('D'); nullopt for NULL. */
+std::vector<std::optional<std::string>> data_row_columns(const std::vector<std::uint8_t>& msg) {
+  std::vector<std::optional<std::string>> cols;
+  if (msg.size() < 7) return cols;
+  const unsigned n = (static_cast<unsigned>(msg[5]) << 8) | msg[6];
+  size_t pos = 7;
+  for (unsigned i = 0; i < n && pos + 4 <= msg.size(); ++i) {
+    const auto len = static_cast<std::int32_t>(read_u32(msg.data() + pos));
+    pos += 4;
+    if (len < 0) {
+      cols.emplace_back(std::nullopt);
+      continue;
+    }
+    if (pos + static_cast<size_t>(len) > msg.size()) break;
+    cols.emplace_back(std::string(reinterpret_cast<const char*>(msg.data() + pos), static_cast<size_t>(len)));
+    pos += static_cast<size_t>(len);
+  }
+  return cols;
+}
+
+/** 'M' field of an ErrorResponse. */
+std::string error_message(const std::vector<std::uint8_t>& msg) {
+  for (size_t pos = 5; pos < msg.size() && msg[pos] != 0;) {
+    const char tag = static_cast<char>(msg[pos++]);
+    const size_t end = std::find(msg.begin() + static_cast<std::ptrdiff_t>(pos), msg.end(), 0) - msg.begin();
+    if (tag == 'M') return std::string(msg.begin() + static_cast<std::ptrdiff_t>(pos),
+                                       msg.begin() + static_cast<std::ptrdiff_t>(end));
+    pos = end + 1;
+  }
+  return "error";
+}
+
+struct DeferredFree {
+  struct bufferevent* bev;
+};
+
+void deferred_free_cb(evutil_socket_t, short, void* arg) {
+  auto* d = static_cast<DeferredFree*>(arg);
+  bufferevent_free(d->bev);
+  delete d;
+}
+
+}  // namespace
+
+std::optional<std::uint64_t> parse_lsn(const std::string& s) {
+  // Two groups of 1..8 hex digits; sscanf("%X") would also take signs, "0x" and leading spaces.
+  std::uint64_t halves[2] = {0, 0};
+  std::size_t pos = 0;
+  for (int h = 0; h < 2; ++h) {
+    if (h == 1 && (pos >= s.size() || s[pos++] != '/')) return std::nullopt;
+    const std::size_t start = pos;
+    for (; pos < s.size() && std::isxdigit(static_cast<unsigned char>(s[pos])); ++pos) {
+      const char c = s[pos];
+      const unsigned digit = std::isdigit(static_cast<unsigned char>(c)) ? static_cast<unsigned>(c - '0')
+                                                                          : static_cast<unsigned>((c | 0x20) - 'a' + 10);
+      halves[h] = (halves[h] << 4) | digit;
+    }
+    if (pos == start || pos - start > 8) return std::nullopt;
+  }
+  if (pos != s.size()) return std::nullopt;
+  return (halves[0] << 32) | halves[1];
+}
+
+class LagMonitor::Probe {
+ public:
+  Probe(struct event_base* base, pgpooler::config::PoolManager* pool_manager, pgpooler::config::BackendEntry be,
+        std::string log_prefix)
+      : base_(base), pool_manager_(pool_manager), be_(std::move(be)), log_prefix_(std::move(log_prefix)) {
+    timer_ = event_new(base_, -1, EV_PERSIST, timer_cb, this);
+    const double interval = be_.lag_probe.interval_sec;
+    struct timeval tv;
+    tv.tv_sec = static_cast<long>(interval);
+    tv.tv_usec = static_cast<long>((interval - std::floor(interval)) * 1e6);
+    if (timer_) event_add(timer_, &tv);
+    connect();
+  }
+
+  ~Probe() {
+    if (timer_) event_free(timer_);
+    if (bev_) bufferevent_free(bev_);
+    pool_manager_->set_lagging(be_.name, false);
+    pgpooler::stats::clear_replica_lag(be_.name);
+  }
+
+  const pgpooler::config::BackendEntry& backend() const { return be_; }
+
+ private:
+  enum class State { Disconnected, Connecting, Authenticating, Idle, Querying };
+
+  static void timer_cb(evutil_socket_t, short, void* arg) { static_cast<Probe*>(arg)->tick(); }
+  static void read_cb(struct bufferevent*, void* arg) { static_cast<Probe*>(arg)->on_read(); }
+  static void event_cb(struct bufferevent*, short what, void* arg) { static_cast<Probe*>(arg)->on_event(what); }
+
+  void tick() {
+    switch (state_) {
+      case State::Disconnected:
+        connect();
+        break;
+      case State::Idle:
+        send_query();
+        break;
+      default:
+        fail("no answer within the probe interval");
+        break;
+    }
+  }
+
+  void connect() {
+    char port_buf[16];
+    snprintf(port_buf, sizeof(port_buf), "%u", be_.port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = nullptr;
+    int err = getaddrinfo(be_.host.c_str(), port_buf, &hints, &res);
+    if (err != 0 || !res) {
+      fail("could not resolve host: " + std::string(gai_strerror(err)));
+      return;
+    }
+    bev_ = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev_) {
+      freeaddrinfo(res);
+      fail("bufferevent_socket_new failed");
+      return;
+    }
+    bufferevent_setcb(bev_, read_cb, nullptr, event_cb, this);
+    bufferevent_enable(bev_, EV_READ);
+    state_ = State::Connecting;
+    const int rc = bufferevent_socket_connect(bev_, res->ai_addr, static_cast<int>(res->ai_addrlen));
+    freeaddrinfo(res);
+    if (rc != 0) fail("connect failed");
+  }
+
+  void on_event(short what) {
+    if (what & BEV_EVENT_CONNECTED) {
+      state_ = State::Authenticating;
+      const std::string& db = be_.lag_probe.database.empty() ? be_.lag_probe.user : be_.lag_probe.database;
+      send(pgpooler::protocol::build_startup_message(be_.lag_probe.user, db, "pgpooler_lag_probe"));
+      return;
+    }
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) fail("connection lost");
+  }
+
+  void on_read() {
+    struct evbuffer* input = bufferevent_get_input(bev_);
+    while (bev_ && pgpooler::protocol::try_extract_typed_message(input, msg_)) on_message();
+  }
+
+  void on_message() {
+    const unsigned char type = pgpooler::protocol::get_message_type(msg_);
+    if (type == 'E') {
+      fail(error_message(msg_));
+      return;
+    }
+    if (state_ == State::Authenticating && type == 'R') {
+      on_auth_request();
+      return;
+    }
+    if (state_ == State::Querying && type == 'D') {
+      const auto cols = data_row_columns(msg_);
+      row_seen_ = true;
+      replay_lsn_.reset();
+      current_lsn_.reset();
+      std::optional<std::uint64_t> receive_lsn;
+      if (cols.size() >= 1 && cols[0]) replay_lsn_ = parse_lsn(*cols[0]);
+      if (cols.size() >= 3 && cols[2]) current_lsn_ = parse_lsn(*cols[2]);
+      if (cols.size() >= 4 && cols[3]) receive_lsn = parse_lsn(*cols[3]);
+      const bool streaming = cols.size() >= 5 && cols[4] && *cols[4] == "t";
+      double replay_age = 0;
+      if (cols.size() >= 2 && cols[1]) {
+        try {
+          replay_age = std::max(0.0, std::stod(*cols[1]));
+        } catch (...) {
+          replay_age = 0;
+        }
+      }
+      // Caught up: everything received is replayed and more is streaming in (an idle primary would otherwise
+      // make the replay age grow forever). A stopped or reconnecting receiver gets no new WAL, so the replica
+      // is as far behind as its last replayed transaction. Not in recovery (primary): no delay.
+      if (!replay_lsn_ || (streaming && receive_lsn && *receive_lsn == *replay_lsn_))
+        lag_sec_ = 0;
+      else
+        lag_sec_ = replay_age;
+      return;
+    }
+    if (type != pgpooler::protocol::MSG_READY_FOR_QUERY) return;
+    if (state_ == State::Authenticating) {
+      state_ = State::Idle;
+      send_query();  // first measurement right away
+    } else if (state_ == State::Querying) {
+      state_ = State::Idle;
+      if (row_seen_)
+        report();
+      else
+        fail("probe query returned no row");
+    }
+  }
+
+  void on_auth_request() {
+    if (msg_.size() < 9) {
+      fail("malformed authentication request");
+      return;
+    }
+    const std::uint32_t code = read_u32(msg_.data() + 5);
+    const auto& cfg = be_.lag_probe;
+    switch (code) {
+      case pgpooler::protocol::AUTH_OK:
+        return;
+      case pgpooler::protocol::AUTH_CLEARTEXT_PASSWORD:
+        send(pgpooler::protocol::build_password_message(cfg.password));
+        return;
+      case pgpooler::protocol::AUTH_MD5_PASSWORD:
+        if (msg_.size() < 13) break;
+        send(pgpooler::protocol::build_password_message(
+            pgpooler::protocol::md5_password_response(cfg.user, cfg.password, msg_.data() + 9)));
+        return;
+      case pgpooler::protocol::AUTH_SASL: {
+        bool scram = false;
+        for (size_t pos = 9; pos < msg_.size() && msg_[pos] != 0;) {
+          const char* name = reinterpret_cast<const char*>(msg_.data() + pos);
+          if (std::strcmp(name, pgpooler::protocol::ScramClient::MECHANISM) == 0) scram = true;
+          pos += std::strlen(name) + 1;
+        }
+        if (!scram) break;
+        scram_ = std::make_unique<pgpooler::protocol::ScramClient>(cfg.password);
+        send(pgpooler::protocol::build_sasl_initial_response(pgpooler::protocol::ScramClient::MECHANISM,
+                                                             scram_->client_first()));
+        return;
+      }
+      case pgpooler::protocol::AUTH_SASL_CONTINUE: {
+        if (!scram_) break;
+        auto final_msg = scram_->client_final(std::string(msg_.begin() + 9, msg_.end()));
+        if (!final_msg) {
+          fail("malformed SCRAM server-first-message");
+          return;
+        }
+        send(pgpooler::protocol::build_sasl_response(*final_msg));
+        return;
+      }
+      case pgpooler::protocol::AUTH_SASL_FINAL:
+        if (!scram_ || !scram_->verify_server_final(std::string(msg_.begin() + 9, msg_.end()))) {
+          fail("SCRAM server signature mismatch");
+          return;
+        }
+        scram_.reset();
+        return;
+      default:
+        break;
+    }
+    fail("unsupported authentication request " + std::to_string(code));
+  }
+
+  void send(const std::vector<std::uint8_t>& bytes) {
+    if (bev_) bufferevent_write(bev_, bytes.data(), bytes.size());
+  }
+
+  void send_query() {
+    state_ = State::Querying;
+    row_seen_ = false;
+    query_sent_at_ = std::chrono::steady_clock::now();
+    send(pgpooler::protocol::build_query_message(LAG_QUERY));
+  }
+
+  void report() {
+    const double max_lag = be_.lag_probe.max_lag_sec;
+    const bool lagging = max_lag > 0 && lag_sec_ > max_lag;
+    char lag_buf[32];
+    snprintf(lag_buf, sizeof(lag_buf), "%.3f", lag_sec_);
+    char max_buf[32];
+    snprintf(max_buf, sizeof(max_buf), "%.3f", max_lag);
+    const std::string lsn = replay_lsn_ ? std::to_string(*replay_lsn_) : "none";
+    const std::string current = current_lsn_ ? std::to_string(*current_lsn_) : "none";
+    pgpooler::log::debug(log_prefix_ + "lag probe: backend=" + be_.name + " lag=" + lag_buf + "s replay_lsn=" + lsn +
+                         " current_lsn=" + current);
+    pool_manager_->set_wal_position(be_.name, replay_lsn_, current_lsn_, query_sent_at_);
+    if (lagging != lagging_ || down_) {
+      if (lagging)
+        pgpooler::log::warn(log_prefix_ + "lag probe: backend=" + be_.name + " lags " + lag_buf +
+                            "s (max_lag " + max_buf + "s), taking it out of routing");
+      else
+        pgpooler::log::info(log_prefix_ + "lag probe: backend=" + be_.name + " caught up (lag " + lag_buf +
+                            "s), routing to it again");
+    }
+    lagging_ = lagging;
+    down_ = false;
+    pool_manager_->set_lagging(be_.name, lagging);
+    pgpooler::stats::set_replica_lag(be_.name, lag_sec_, lagging);
+  }
+
+  /** Probe failed: the backend counts as lagging until a probe succeeds. Reconnects on the next tick. */
+  void fail(const std::string& reason) {
+    if (!down_)
+      pgpooler::log::warn(log_prefix_ + "lag probe: backend=" + be_.name + " probe failed (" + reason +
+                          "), taking it out of routing");
+    down_ = true;
+    lagging_ = true;
+    state_ = State::Disconnected;
+    scram_.reset();
+    if (bev_) {  // may run inside the bufferevent's own callback
+      bufferevent_setcb(bev_, nullptr, nullptr, nullptr, nullptr);
+      bufferevent_disable(bev_, EV_READ | EV_WRITE);
+      event_base_once(base_, -1, EV_TIMEOUT, deferred_free_cb, new DeferredFree{bev_}, nullptr);
+      bev_ = nullptr;
+    }
+    pool_manager_->set_lagging(be_.name, true);
+    pgpooler::stats::set_replica_lag(be_.name, -1, true);
+  }
+
+  struct event_base* base_;
+  pgpooler::config::PoolManager* pool_manager_;
+  pgpooler::config::BackendEntry be_;
+  std::string log_prefix_;
+  struct event* timer_ = nullptr;
+  struct bufferevent* bev_ = nullptr;
+  State state_ = State::Disconnected;
+  std::vector<std::uint8_t> msg_;
+  std::unique_ptr<pgpooler::protocol::ScramClient> scram_;
+  bool row_seen_ = false;
+  std::optional<std::uint64_t> replay_lsn_;
+  std::optional<std::uint64_t> current_lsn_;
+  std::chrono::steady_clock::time_point query_sent_at_;
+  double lag_sec_ = 0;
+  bool lagging_ = false;
+  bool down_ = false;
+};
+
+LagMonitor::LagMonitor(struct event_base* base, const pgpooler::config::RoutingState* routing,
+                       pgpooler::config::PoolManager* pool_manager, std::string log_prefix)
+    : base_(base), routing_(routing), pool_manager_(pool_manager), log_prefix_(std::move(log_prefix)) {
+  sync();
+  sync_ev_ = event_new(base_, -1, EV_PERSIST, sync_cb, this);
+  struct timeval tv = {1, 0};
+  if (sync_ev_) event_add(sync_ev_, &tv);
+}
+
+LagMonitor::~LagMonitor() {
+  if (sync_ev_) event_free(sync_ev_);
+}
+
+void LagMonitor::sync_cb(evutil_socket_t, short, void* arg) { static_cast<LagMonitor*>(arg)->sync(); }
+
+void LagMonitor::sync() {
+  std::shared_ptr<const pgpooler::config::RoutingSnapshot> current = routing_->current();
+  if (current == synced_) return;
+  synced_ = current;
+  std::map<std::string, std::unique_ptr<Probe>> next;
+  for (const auto& be : current->backends_cfg.backends) {
+    if (be.lag_probe.interval_sec <= 0 || !pool_manager_->has_backend(be.name)) continue;
+    auto it = probes_.find(be.name);
+    if (it != probes_.end() && it->second->backend().host == be.host && it->second->backend().port == be.port &&
+        it->second->backend().lag_probe == be.lag_probe) {
+      next[be.name] = std::move(it->second);
+      continue;
+    }
+    pgpooler::log::info(log_prefix_ + "lag probe: backend=" + be.name + " every " +
+                        std::to_string(be.lag_probe.interval_sec) + "s");
+    next[be.name] = std::make_unique<Probe>(base_, pool_manager_, be, log_prefix_);
+  }
+  probes_ = std::move(next);  // probes left behind are dropped
+}
+
+}  // namespace server
+}  // namespace pgpooler
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "config/config.hpp"
+#include <event2/util.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+struct event;
+struct event_base;
+
+namespace pgpooler {
+namespace server {
+
+/** "16/B374D848" -> 0x16B374D848; nullopt if malformed. */
+std::optional<std::uint64_t> parse_lsn(const std::string& s);
+
+/** Replica lag probing for the backends this process keeps pools for (lag_probe: in backends.yaml).
+ * Each probed backend gets one dedicated connection (outside the pool and its pool_size), authenticated with the
+ * probe's own user (trust, cleartext, md5 or SCRAM-SHA-256), that runs every interval:
+ *   SELECT pg_last_wal_replay_lsn(), <age of the last replayed transaction>, pg_last_wal_receive_lsn(), ...
+ * (plus pg_current_wal_lsn() on a primary, for read-your-writes). The delay is 0 while everything received is
+ * replayed and the WAL receiver streams; with the receiver stopped or reconnecting it is the replay age, so a
+ * replica cut off from its primary ends up lagging. The positions go to PoolManager.
+ * A delay above max_lag, an error, a lost connection or no answer within the interval mark the backend lagging
+ * in PoolManager (groups and read routing skip it) until a probe reports it caught up. Lag is exported as a
+ * stats gauge. The probe set follows the routing snapshot, so config reloads add and drop probes. */
+class LagMonitor {
+ public:
+  LagMonitor(struct event_base* base, const pgpooler::config::RoutingState* routing,
+             pgpooler::config::PoolManager* pool_manager, std::string log_prefix);
+  ~LagMonitor();
+  LagMonitor(const LagMonitor&) = delete;
+  LagMonitor& operator=(const LagMonitor&) = delete;
+
+ private:
+  class Probe;
+
+  static void sync_cb(evutil_socket_t fd, short what, void* arg);
+  /** Create/replace/drop probes to match the current routing snapshot. */
+  void sync();
+
+  struct event_base* base_;
+  const pgpooler::config::RoutingState* routing_;
+  pgpooler::config::PoolManager* pool_manager_;
+  std::string log_prefix_;
+  struct event* sync_ev_ = nullptr;
+  std::shared_ptr<const pgpooler::config::RoutingSnapshot> synced_;
+  std::map<std::string, std::unique_ptr<Probe>> probes_;
+};
+
+}  // namespace server
+}  // namespace pgpooler
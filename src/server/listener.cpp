@@ -31,7 +31,8 @@ void on_accept(struct evconnlistener* listener, evutil_socket_t client_fd,
       accept_ctx->resolver,
       accept_ctx->pool_manager,
       accept_ctx->connection_pool,
-      accept_ctx->wait_queue);
+      accept_ctx->wait_queue,
+      accept_ctx->timer_wheel);
 }
 
 void on_listener_error(struct evconnlistener* /*listener*/, void* /*ctx*/) {}
@@ -41,8 +42,10 @@ void on_listener_error(struct evconnlistener* /*listener*/, void* /*ctx*/) {}
 Listener::Listener(struct event_base* base, const char* listen_host, std::uint16_t listen_port,
                    BackendResolver resolver, pgpooler::config::PoolManager* pool_manager,
                    pgpooler::pool::BackendConnectionPool* connection_pool,
-                   pgpooler::pool::ConnectionWaitQueue* wait_queue)
-    : port_(listen_port), accept_ctx_{base, std::move(resolver), pool_manager, connection_pool, wait_queue} {
+                   pgpooler::pool::ConnectionWaitQueue* wait_queue,
+                   pgpooler::common::TimerWheel* timer_wheel)
+    : port_(listen_port),
+      accept_ctx_{base, std::move(resolver), pool_manager, connection_pool, wait_queue, timer_wheel} {
   struct sockaddr_in sin;
   std::memset(&sin, 0, sizeof(sin));
   sin.sin_family = AF_INET;
@@ -0,0 +1,334 @@
+#include "server/peer_channel.hpp"
+#include "common/log.hpp"
+#include "pool/backend_connection_pool.hpp"
+#include "pool/connection_wait_queue.hpp"
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+namespace pgpooler {
+namespace server {
+
+namespace {
+
+constexpr std::uint8_t MSG_WANT = 'W';
+constexpr std::uint8_t MSG_UNWANT = 'w';
+constexpr std::uint8_t MSG_DONATE = 'D';
+
+std::vector<std::uint8_t> encode_key(std::uint8_t type, const std::string& backend_name, const std::string& user,
+                                     const std::string& database) {
+  std::vector<std::uint8_t> out;
+  out.reserve(4 + backend_name.size() + user.size() + database.size());
+  out.push_back(type);
+  for (const std::string* s : {&backend_name, &user, &database}) {
+    out.insert(out.end(), s->begin(), s->end());
+    out.push_back(0);
+  }
+  return out;
+}
+
+/** NUL-terminated string at offset; advances offset. False if the terminator is missing. */
+bool read_cstr(const std::vector<std::uint8_t>& payload, std::size_t& offset, std::string& out) {
+  auto end = std::find(payload.begin() + static_cast<std::ptrdiff_t>(offset), payload.end(), 0);
+  if (end == payload.end()) return false;
+  out.assign(payload.begin() + static_cast<std::ptrdiff_t>(offset), end);
+  offset = static_cast<std::size_t>(end - payload.begin()) + 1;
+  return true;
+}
+
+}  // namespace
+
+PeerChannel::PeerChannel(struct event_base* base, std::vector<int> peer_fds,
+                         std::map<std::string, std::vector<std::size_t>> backend_peers,
+                         pgpooler::config::PoolManager* pool_manager,
+                         pgpooler::pool::BackendConnectionPool* connection_pool,
+                         pgpooler::pool::ConnectionWaitQueue* wait_queue, std::string log_prefix)
+    : base_(base),
+      backend_peers_(std::move(backend_peers)),
+      pool_manager_(pool_manager),
+      connection_pool_(connection_pool),
+      wait_queue_(wait_queue),
+      log_prefix_(std::move(log_prefix)) {
+  for (std::size_t i = 0; i < peer_fds.size(); ++i) {
+    if (peer_fds[i] < 0) continue;
+    Peer& peer = peers_[i];
+    peer.channel = this;
+    peer.index = i;
+    peer.fd = peer_fds[i];
+    evutil_make_socket_nonblocking(peer.fd);
+    peer.ev = event_new(base_, peer.fd, EV_READ | EV_PERSIST, read_cb, &peer);
+    if (peer.ev) event_add(peer.ev, nullptr);
+    peer.write_ev = event_new(base_, peer.fd, EV_WRITE, write_cb, &peer);
+  }
+  donate_ev_ = event_new(base_, -1, 0, donate_cb, this);
+}
+
+PeerChannel::~PeerChannel() {
+  if (donate_ev_) event_free(donate_ev_);
+  for (auto& kv : peers_) {
+    if (kv.second.ev) event_free(kv.second.ev);
+    if (kv.second.write_ev) event_free(kv.second.write_ev);
+    for (OutFrame& frame : kv.second.frames)
+      if (frame.donated) bufferevent_free(frame.donated->bev);
+    close(kv.second.fd);
+  }
+}
+
+void PeerChannel::on_key_waiting(const std::string& backend_name, const std::string& user,
+                                 const std::string& database, bool waiting) {
+  auto it = backend_peers_.find(backend_name);
+  if (it == backend_peers_.end()) return;
+  const auto msg = encode_key(waiting ? MSG_WANT : MSG_UNWANT, backend_name, user, database);
+  for (std::size_t index : it->second) {
+    auto peer = peers_.find(index);
+    if (peer == peers_.end()) continue;
+    enqueue(peer->second, msg, Key{backend_name, user, database}, std::nullopt);
+  }
+}
+
+void PeerChannel::on_unclaimed(const std::string& backend_name, const std::string& user,
+                               const std::string& database) {
+  Key key{backend_name, user, database};
+  if (!wanted(key)) return;
+  unclaimed_.insert(std::move(key));
+  if (donate_ev_) event_active(donate_ev_, EV_TIMEOUT, 0);
+}
+
+void PeerChannel::read_cb(evutil_socket_t fd, short /*what*/, void* arg) {
+  auto* peer = static_cast<Peer*>(arg);
+  for (;;) {
+    auto result = try_recv_fd_and_payload(static_cast<int>(fd), peer->recv);
+    if (!result) break;
+    peer->channel->handle(*peer, result->first, result->second);
+  }
+  char c;
+  if (recv(static_cast<int>(fd), &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)  // the sibling exited
+    peer->channel->fail_peer(*peer, "gone");
+}
+
+void PeerChannel::write_cb(evutil_socket_t /*fd*/, short /*what*/, void* arg) {
+  auto* peer = static_cast<Peer*>(arg);
+  peer->channel->flush(*peer);
+}
+
+void PeerChannel::donate_cb(evutil_socket_t /*fd*/, short /*what*/, void* arg) {
+  auto* self = static_cast<PeerChannel*>(arg);
+  std::set<Key> keys = std::move(self->unclaimed_);
+  self->unclaimed_.clear();
+  for (const Key& key : keys) {
+    for (auto& kv : self->peers_) {
+      if (kv.second.wants.count(key) == 0) continue;
+      self->donate(kv.second, key);
+      break;  // one connection went idle: one donation
+    }
+  }
+}
+
+void PeerChannel::handle(Peer& peer, int fd, const std::vector<std::uint8_t>& payload) {
+  Key key;
+  std::size_t offset = 1;
+  if (payload.empty() || !read_cstr(payload, offset, std::get<0>(key)) ||
+      !read_cstr(payload, offset, std::get<1>(key)) || !read_cstr(payload, offset, std::get<2>(key))) {
+    pgpooler::log::warn(log_prefix_ + "peer channel: malformed message from worker " + std::to_string(peer.index));
+    if (fd >= 0) close(fd);
+    return;
+  }
+  switch (payload[0]) {
+    case MSG_WANT:
+      peer.wants.insert(key);
+      pool_manager_->set_wanted_by_peer(std::get<0>(key), std::get<1>(key), std::get<2>(key), true);
+      donate(peer, key);
+      break;
+    case MSG_UNWANT:
+      peer.wants.erase(key);
+      if (!wanted(key))
+        pool_manager_->set_wanted_by_peer(std::get<0>(key), std::get<1>(key), std::get<2>(key), false);
+      break;
+    case MSG_DONATE:
+      if (fd >= 0) {
+        adopt(key, fd, payload, offset);
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+  if (fd >= 0) close(fd);
+}
+
+void PeerChannel::adopt(const Key& key, int fd, const std::vector<std::uint8_t>& payload, std::size_t offset) {
+  const std::string& backend_name = std::get<0>(key);
+  if (payload.size() < offset + 9 || !pool_manager_->adopt_backend(backend_name)) {
+    pgpooler::log::warn(log_prefix_ + "peer channel: cannot adopt connection backend=" + backend_name);
+    close(fd);
+    return;
+  }
+  const auto dirty = static_cast<protocol::SessionStateEffect>(payload[offset]);
+  std::int64_t ticks = 0;
+  for (std::size_t i = 0; i < 8; ++i) ticks = (ticks << 8) | payload[offset + 1 + i];
+  // steady_clock is CLOCK_MONOTONIC, the same in every process of the host.
+  const std::chrono::steady_clock::time_point created_at{std::chrono::steady_clock::duration(ticks)};
+  std::vector<std::uint8_t> startup_response(payload.begin() + static_cast<std::ptrdiff_t>(offset + 9),
+                                             payload.end());
+  evutil_make_socket_nonblocking(fd);
+  struct bufferevent* bev = bufferevent_socket_new(base_, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    close(fd);
+    if (pool_manager_->take_backend(backend_name)) pool_manager_->release(backend_name);
+    return;
+  }
+  connection_pool_->put(backend_name, std::get<1>(key), std::get<2>(key), bev, std::move(startup_response),
+                        created_at, dirty);
+  pgpooler::log::info(log_prefix_ + "peer channel: adopted idle connection backend=" + backend_name + " user=" +
+                      std::get<1>(key) + " database=" + std::get<2>(key));
+  wait_queue_->on_connection_available(backend_name, std::get<1>(key), std::get<2>(key));
+}
+
+bool PeerChannel::donate(Peer& peer, const Key& key) {
+  const std::string& backend_name = std::get<0>(key);
+  auto idle = connection_pool_->take_one_to_close(backend_name, std::get<1>(key), std::get<2>(key));
+  if (!idle) return false;
+  std::vector<std::uint8_t> msg = encode_key(MSG_DONATE, backend_name, std::get<1>(key), std::get<2>(key));
+  const auto dirty = idle->prepared_statements.size() == 0 ? idle->dirty : protocol::SessionStateEffect::Full;
+  msg.push_back(static_cast<std::uint8_t>(dirty));
+  const std::int64_t ticks = idle->created_at.time_since_epoch().count();
+  for (int shift = 56; shift >= 0; shift -= 8) msg.push_back(static_cast<std::uint8_t>(ticks >> shift));
+  msg.insert(msg.end(), idle->cached_startup_response.begin(), idle->cached_startup_response.end());
+  if (!enqueue(peer, msg, key, std::move(idle))) {
+    pgpooler::log::warn(log_prefix_ + "peer channel: handing a connection to worker " + std::to_string(peer.index) +
+                        " failed, keeping it backend=" + backend_name);
+    return false;
+  }
+  return true;
+}
+
+bool PeerChannel::enqueue(Peer& peer, const std::vector<std::uint8_t>& msg, const Key& key,
+                          std::optional<pgpooler::pool::IdleConnection> donated) {
+  auto keep = [&] {
+    if (!donated) return;
+    connection_pool_->put(std::get<0>(key), std::get<1>(key), std::get<2>(key), donated->bev,
+                          std::move(donated->cached_startup_response), donated->created_at, donated->dirty,
+                          std::move(donated->prepared_statements));
+  };
+  if (peer.dead || !peer.write_ev) {
+    keep();
+    return false;
+  }
+  OutFrame frame;
+  frame.start = peer.out.size();
+  if (!append_frame(peer.out, donated.has_value(), msg)) {
+    keep();
+    return false;
+  }
+  frame.end = peer.out.size();
+  frame.fd = donated ? bufferevent_getfd(donated->bev) : -1;
+  frame.key = key;
+  frame.donated = std::move(donated);
+  peer.frames.push_back(std::move(frame));
+  if (!event_pending(peer.write_ev, EV_WRITE, nullptr)) flush(peer);
+  return true;
+}
+
+void PeerChannel::flush(Peer& peer) {
+  while (peer.out_off < peer.out.size()) {
+    /* Bytes of a frame must not arrive before its fd: stop short of the first frame whose fd does not fit. */
+    std::vector<int> fds;
+    std::size_t limit = peer.out.size();
+    for (const OutFrame& frame : peer.frames) {
+      if (frame.fd < 0 || frame.fd_sent) continue;
+      if (fds.size() == MAX_FDS_PER_SEND) {
+        limit = frame.start;
+        break;
+      }
+      fds.push_back(frame.fd);
+    }
+    ssize_t n = send_frames(peer.fd, peer.out.data() + peer.out_off, limit - peer.out_off, fds.data(), fds.size());
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        compact(peer);
+        event_add(peer.write_ev, nullptr);
+        return;
+      }
+      if (errno == EINTR) continue;
+      fail_peer(peer, std::strerror(errno));
+      return;
+    }
+    std::size_t marked = 0;
+    for (OutFrame& frame : peer.frames) {
+      if (marked == fds.size()) break;
+      if (frame.fd < 0 || frame.fd_sent) continue;
+      frame.fd_sent = true;
+      ++marked;
+    }
+    peer.out_off += static_cast<std::size_t>(n);
+    while (!peer.frames.empty() && peer.frames.front().end <= peer.out_off) {
+      frame_sent(peer, peer.frames.front());
+      peer.frames.pop_front();
+    }
+  }
+  peer.out.clear();
+  peer.out_off = 0;
+}
+
+void PeerChannel::compact(Peer& peer) {
+  if (peer.out_off == 0) return;
+  peer.out.erase(peer.out.begin(), peer.out.begin() + static_cast<std::ptrdiff_t>(peer.out_off));
+  for (OutFrame& frame : peer.frames) {
+    frame.start = frame.start > peer.out_off ? frame.start - peer.out_off : 0;
+    frame.end -= peer.out_off;
+  }
+  peer.out_off = 0;
+}
+
+void PeerChannel::frame_sent(Peer& peer, OutFrame& frame) {
+  if (!frame.donated) return;
+  const std::string& backend_name = std::get<0>(frame.key);
+  bufferevent_free(frame.donated->bev);  // the peer has its own descriptor now; idle: no callbacks set
+  frame.donated.reset();
+  pool_manager_->hand_over_backend(backend_name);
+  pgpooler::log::info(log_prefix_ + "peer channel: handed idle connection to worker " + std::to_string(peer.index) +
+                      " backend=" + backend_name + " user=" + std::get<1>(frame.key) + " database=" +
+                      std::get<2>(frame.key));
+}
+
+void PeerChannel::fail_peer(Peer& peer, const std::string& what) {
+  if (peer.dead) return;
+  peer.dead = true;
+  pgpooler::log::warn(log_prefix_ + "peer channel: worker " + std::to_string(peer.index) + " " + what +
+                      ", dropping " + std::to_string(peer.frames.size()) + " queued messages");
+  event_del(peer.ev);
+  event_del(peer.write_ev);
+  peer.wants.clear();
+  std::deque<OutFrame> frames = std::move(peer.frames);  // waking a waiter below may come back here
+  peer.frames.clear();
+  peer.out.clear();
+  peer.out_off = 0;
+  for (OutFrame& frame : frames) {
+    if (!frame.donated) continue;
+    const std::string& backend_name = std::get<0>(frame.key);
+    if (frame.fd_sent) {
+      // The descriptor may have reached the peer, the frame did not: nobody can use the connection.
+      bufferevent_free(frame.donated->bev);
+      if (pool_manager_->take_backend(backend_name)) pool_manager_->release(backend_name);
+    } else {
+      connection_pool_->put(backend_name, std::get<1>(frame.key), std::get<2>(frame.key), frame.donated->bev,
+                            std::move(frame.donated->cached_startup_response), frame.donated->created_at,
+                            frame.donated->dirty, std::move(frame.donated->prepared_statements));
+      wait_queue_->on_connection_available(backend_name, std::get<1>(frame.key), std::get<2>(frame.key));
+    }
+  }
+}
+
+bool PeerChannel::wanted(const Key& key) const {
+  for (const auto& kv : peers_)
+    if (kv.second.wants.count(key)) return true;
+  return false;
+}
+
+}  // namespace server
+}  // namespace pgpooler
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "config/config.hpp"
+#include "pool/backend_connection_pool.hpp"
+#include "server/fd_send.hpp"
+#include <event2/util.h>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+struct event;
+struct event_base;
+
+namespace pgpooler {
+namespace pool {
+class ConnectionWaitQueue;
+}  // namespace pool
+namespace server {
+
+/** Idle connection migration between workers serving the same backend (shared pool budget only: the connection
+ * keeps its slot in the shared counters while it moves).
+ * Each pair of such workers has a Unix socket pair (created by the parent before fork). Messages are
+ * fd_send frames:
+ *   'W' / 'w' backend\0 user\0 database\0      clients started / stopped waiting for this key here
+ *   'D' backend\0 user\0 database\0 dirty created_at(8) startup_response, with the connection's fd
+ * A worker told that a sibling waits for a key hands it one idle connection of that key at once, and then every
+ * connection of that key that goes idle with no local waiter, until the sibling sends 'w'. The receiver puts
+ * the connection into its pool and wakes its waiter. Prepared statements do not travel: a connection that has
+ * any is sent as dirty (reset with DISCARD ALL on take).
+ * Frames to a peer are queued and written without blocking (EV_WRITE when the socket is full). A donated
+ * connection stays with the donor until its whole frame is written; if the peer goes away before that, it is
+ * pooled again (descriptor not sent yet) or closed. */
+class PeerChannel {
+ public:
+  /** peer_fds: socket to worker i at index i, -1 if none. backend_peers: backend -> the other workers serving it. */
+  PeerChannel(struct event_base* base, std::vector<int> peer_fds,
+              std::map<std::string, std::vector<std::size_t>> backend_peers,
+              pgpooler::config::PoolManager* pool_manager, pgpooler::pool::BackendConnectionPool* connection_pool,
+              pgpooler::pool::ConnectionWaitQueue* wait_queue, std::string log_prefix);
+  ~PeerChannel();
+  PeerChannel(const PeerChannel&) = delete;
+  PeerChannel& operator=(const PeerChannel&) = delete;
+
+  /** Wait queue hook: the first client here started (or the last one stopped) waiting for the key. */
+  void on_key_waiting(const std::string& backend_name, const std::string& user, const std::string& database,
+                      bool waiting);
+  /** Wait queue hook: a connection of the key went idle and nobody here waits for it. */
+  void on_unclaimed(const std::string& backend_name, const std::string& user, const std::string& database);
+
+ private:
+  using Key = std::tuple<std::string, std::string, std::string>;  // backend, user, database
+  /** A frame queued for a peer. */
+  struct OutFrame {
+    std::size_t start = 0;  // offsets in Peer::out
+    std::size_t end = 0;
+    int fd = -1;  // descriptor to attach, -1 = none
+    bool fd_sent = false;
+    Key key;
+    std::optional<pgpooler::pool::IdleConnection> donated;  // 'D': owned here until the frame is written
+  };
+  struct Peer {
+    PeerChannel* channel = nullptr;
+    std::size_t index = 0;
+    int fd = -1;
+    struct event* ev = nullptr;
+    struct event* write_ev = nullptr;  // EV_WRITE when the socket buffer is full
+    WorkerRecvState recv;
+    std::set<Key> wants;
+    std::vector<std::uint8_t> out;
+    std::size_t out_off = 0;
+    std::deque<OutFrame> frames;
+    bool dead = false;
+  };
+
+  static void read_cb(evutil_socket_t fd, short what, void* arg);
+  static void write_cb(evutil_socket_t fd, short what, void* arg);
+  static void donate_cb(evutil_socket_t fd, short what, void* arg);
+  void handle(Peer& peer, int fd, const std::vector<std::uint8_t>& payload);
+  void adopt(const Key& key, int fd, const std::vector<std::uint8_t>& payload, std::size_t offset);
+  /** Queue one idle connection of key for peer. False if there is none or the peer is gone (it stays here). */
+  bool donate(Peer& peer, const Key& key);
+  /** Queue msg (with the donated connection's descriptor, if any) and write what the socket takes. */
+  bool enqueue(Peer& peer, const std::vector<std::uint8_t>& msg, const Key& key,
+               std::optional<pgpooler::pool::IdleConnection> donated);
+  void flush(Peer& peer);
+  /** Drop the bytes already written from peer.out (frame offsets shift accordingly). */
+  void compact(Peer& peer);
+  /** The whole frame is written: a donated connection now belongs to the peer. */
+  void frame_sent(Peer& peer, OutFrame& frame);
+  /** The peer's socket failed or closed: stop talking to it; queued donations are pooled again or closed. */
+  void fail_peer(Peer& peer, const std::string& what);
+  bool wanted(const Key& key) const;
+
+  struct event_base* base_;
+  std::map<std::string, std::vector<std::size_t>> backend_peers_;
+  pgpooler::config::PoolManager* pool_manager_;
+  pgpooler::pool::BackendConnectionPool* connection_pool_;
+  pgpooler::pool::ConnectionWaitQueue* wait_queue_;
+  std::string log_prefix_;
+  std::map<std::size_t, Peer> peers_;
+  /** Keys that went idle unclaimed; donated on the next loop iteration (the session that pooled the connection
+   * may still take it back for a request it holds). */
+  std::set<Key> unclaimed_;
+  struct event* donate_ev_ = nullptr;
+};
+
+}  // namespace server
+}  // namespace pgpooler
@@ -0,0 +1,106 @@
+#include "server/reload.hpp"
+#include "common/log.hpp"
+#include "pool/backend_connection_pool.hpp"
+#include "pool/connection_wait_queue.hpp"
+#include <event2/event.h>
+#include <algorithm>
+#include <memory>
+#include <signal.h>
+#include <utility>
+
+namespace pgpooler {
+namespace server {
+
+namespace {
+
+bool serves(const ReloadCtx& ctx, const std::string& backend_name) {
+  return ctx.backend_names.empty() ||
+         std::find(ctx.backend_names.begin(), ctx.backend_names.end(), backend_name) != ctx.backend_names.end();
+}
+
+const pgpooler::config::BackendEntry* find_backend(const std::vector<pgpooler::config::BackendEntry>& backends,
+                                                   const std::string& name) {
+  for (const auto& b : backends)
+    if (b.name == name) return &b;
+  return nullptr;
+}
+
+void reload_signal_cb(evutil_socket_t, short, void* arg) {
+  auto* ctx = static_cast<ReloadCtx*>(arg);
+  pgpooler::log::info(ctx->log_prefix + "SIGHUP: reloading config");
+  reload_config(*ctx);
+  for (pid_t pid : ctx->forward_to) kill(pid, SIGHUP);
+}
+
+}  // namespace
+
+void apply_pool_shares(std::vector<pgpooler::config::BackendEntry>& backends, const PoolShares& shares) {
+  for (auto& be : backends) {
+    auto it = shares.find(be.name);
+    if (it != shares.end())
+      be.pool_size = pgpooler::config::worker_pool_size(be.pool_size, it->second.first, it->second.second);
+  }
+}
+
+bool reload_config(ReloadCtx& ctx) {
+  pgpooler::config::BackendsConfig backends_cfg;
+  if (!pgpooler::config::load_backends_config(ctx.backends_path, backends_cfg)) {
+    pgpooler::log::error(ctx.log_prefix + "reload: cannot load backends config from " + ctx.backends_path +
+                         ", keeping current config");
+    return false;
+  }
+  pgpooler::config::RoutingConfig routing_cfg;
+  if (!pgpooler::config::load_routing_config(ctx.routing_path, routing_cfg)) {
+    pgpooler::log::error(ctx.log_prefix + "reload: cannot load routing config from " + ctx.routing_path +
+                         ", keeping current config");
+    return false;
+  }
+  const std::size_t rules = routing_cfg.routing.size();
+  std::shared_ptr<const pgpooler::config::RoutingSnapshot> next =
+      pgpooler::config::make_routing_snapshot(std::move(backends_cfg), std::move(routing_cfg));
+  std::shared_ptr<const pgpooler::config::RoutingSnapshot> prev = ctx.routing->current();
+
+  /* Only host/port decide whether pooled connections are still valid; other settings apply to new sessions. */
+  std::vector<std::string> retired;
+  for (const auto& old_be : prev->backends_cfg.backends) {
+    if (!serves(ctx, old_be.name)) continue;
+    const auto* new_be = find_backend(next->backends_cfg.backends, old_be.name);
+    if (!new_be || new_be->host != old_be.host || new_be->port != old_be.port) retired.push_back(old_be.name);
+  }
+
+  ctx.routing->publish(next);
+
+  if (ctx.pool_manager) {
+    std::vector<pgpooler::config::BackendEntry> served;
+    for (const auto& be : next->backends_cfg.backends)
+      if (serves(ctx, be.name)) served.push_back(be);
+    apply_pool_shares(served, ctx.pool_shares);
+    ctx.pool_manager->reconfigure(served);
+  }
+  std::string retired_list;
+  for (const auto& name : retired) {
+    retired_list += (retired_list.empty() ? "" : ",") + name;
+    if (!ctx.connection_pool) continue;
+    for (const auto& key : ctx.connection_pool->retire_backend(name)) {
+      if (ctx.pool_manager && ctx.pool_manager->take_backend(name)) ctx.pool_manager->release(name);
+      if (ctx.wait_queue) ctx.wait_queue->on_connection_available(name, key.first, key.second);
+    }
+  }
+  pgpooler::log::info(ctx.log_prefix + "config reloaded: backends " +
+                      std::to_string(next->backends_cfg.backends.size()) + ", routing rules " +
+                      std::to_string(rules) + (retired.empty() ? "" : ", retired backends: " + retired_list));
+  return true;
+}
+
+struct event* add_reload_signal(struct event_base* base, ReloadCtx* ctx) {
+  struct event* ev = evsignal_new(base, SIGHUP, reload_signal_cb, ctx);
+  if (!ev) return nullptr;
+  if (evsignal_add(ev, nullptr) != 0) {
+    event_free(ev);
+    return nullptr;
+  }
+  return ev;
+}
+
+}  // namespace server
+}  // namespace pgpooler
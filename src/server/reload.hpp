@@ -0,0 +1,55 @@
+#pragma once
+
+#include "config/config.hpp"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+struct event;
+struct event_base;
+
+namespace pgpooler {
+namespace pool {
+class BackendConnectionPool;
+class ConnectionWaitQueue;
+}
+namespace server {
+
+/** Worker: backend -> (index of this worker among the workers serving it, number of those workers). */
+using PoolShares = std::map<std::string, std::pair<std::size_t, std::size_t>>;
+
+/** Cut pool_size of the backends to this worker's share (config::worker_pool_size). */
+void apply_pool_shares(std::vector<pgpooler::config::BackendEntry>& backends, const PoolShares& shares);
+
+/** What a config reload rebuilds in one process (single process, dispatcher or worker). */
+struct ReloadCtx {
+  /** Absolute paths of backends.yaml and routing.yaml (pgpooler.yaml itself is not re-read). */
+  std::string backends_path;
+  std::string routing_path;
+  pgpooler::config::RoutingState* routing = nullptr;
+  /** Pools of this process; nullptr in the dispatcher (it only routes). */
+  pgpooler::config::PoolManager* pool_manager = nullptr;
+  pgpooler::pool::BackendConnectionPool* connection_pool = nullptr;
+  pgpooler::pool::ConnectionWaitQueue* wait_queue = nullptr;
+  /** Backends this process keeps pools for (worker); empty = all. */
+  std::vector<std::string> backend_names;
+  /** Worker: pool_size shares of backends served by several workers. */
+  PoolShares pool_shares;
+  /** Dispatcher: workers to pass SIGHUP on to once its own reload is done. */
+  std::vector<pid_t> forward_to;
+  std::string log_prefix;
+};
+
+/** Re-read backends/routing, build a new routing snapshot and publish it. Pools of unchanged backends are kept;
+ * backends whose host/port changed or that were removed are retired: idle connections closed, connections in use
+ * closed when their sessions return them. On a load error the current config stays. */
+bool reload_config(ReloadCtx& ctx);
+
+/** SIGHUP -> reload_config(*ctx). Returns the signal event (caller frees it) or nullptr. */
+struct event* add_reload_signal(struct event_base* base, ReloadCtx* ctx);
+
+}  // namespace server
+}  // namespace pgpooler
@@ -0,0 +1,106 @@
+#include "session/cancel_registry.hpp"
+#include "common/log.hpp"
+#include "protocol/message.hpp"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <netdb.h>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace pgpooler {
+namespace session {
+
+namespace {
+
+/** pid = 0 | worker+1 (7 bits) | sequence (24 bits): positive like a real pid, worker recoverable. */
+constexpr unsigned WORKER_SHIFT = 24;
+constexpr std::uint32_t SEQ_MASK = (1u << WORKER_SHIFT) - 1;
+constexpr int MAX_WORKERS = 127;
+
+void cancel_free_cb(evutil_socket_t, short, void* ctx) {
+  bufferevent_free(static_cast<struct bufferevent*>(ctx));
+}
+
+/** Must not free the bufferevent inside its own callback: defer to the next loop iteration. */
+void cancel_close(struct bufferevent* bev) {
+  bufferevent_setcb(bev, nullptr, nullptr, nullptr, nullptr);
+  event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, cancel_free_cb, bev, nullptr);
+}
+
+void cancel_write_cb(struct bufferevent* bev, void*) {
+  if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) cancel_close(bev);
+}
+
+void cancel_event_cb(struct bufferevent* bev, short what, void*) {
+  if (what & BEV_EVENT_CONNECTED) return;
+  if (what & BEV_EVENT_ERROR) pgpooler::log::warn("cancel: connection to backend failed");
+  cancel_close(bev);
+}
+
+}  // namespace
+
+CancelRegistry::Key CancelRegistry::add(ClientSession* session, int worker_id) {
+  std::uint32_t prefix = (worker_id >= 0 && worker_id < MAX_WORKERS) ? static_cast<std::uint32_t>(worker_id + 1) : 0;
+  Key key;
+  do {
+    next_seq_ = (next_seq_ + 1) & SEQ_MASK;
+    if (next_seq_ == 0) next_seq_ = 1;
+    key.pid = (prefix << WORKER_SHIFT) | next_seq_;
+  } while (sessions_.count(key.pid));
+  std::random_device rd;
+  key.secret = rd();
+  sessions_[key.pid] = Entry{key.secret, session};
+  return key;
+}
+
+void CancelRegistry::remove(std::uint32_t pid) {
+  sessions_.erase(pid);
+}
+
+ClientSession* CancelRegistry::find(std::uint32_t pid, std::uint32_t secret) const {
+  auto it = sessions_.find(pid);
+  if (it == sessions_.end() || it->second.secret != secret) return nullptr;
+  return it->second.session;
+}
+
+CancelRegistry& cancel_registry() {
+  static CancelRegistry registry;
+  return registry;
+}
+
+int cancel_key_worker(std::uint32_t pid) {
+  return static_cast<int>(pid >> WORKER_SHIFT) - 1;
+}
+
+void send_cancel_request(struct event_base* base, const std::string& host, std::uint16_t port,
+                         std::uint32_t pid, std::uint32_t secret) {
+  char port_buf[16];
+  snprintf(port_buf, sizeof(port_buf), "%u", port);
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  int err = getaddrinfo(host.c_str(), port_buf, &hints, &res);
+  if (err != 0 || !res) {
+    pgpooler::log::warn("cancel: getaddrinfo failed for " + host + ": " + gai_strerror(err));
+    return;
+  }
+  struct bufferevent* bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    freeaddrinfo(res);
+    return;
+  }
+  bufferevent_setcb(bev, nullptr, cancel_write_cb, cancel_event_cb, nullptr);
+  std::vector<std::uint8_t> msg = protocol::build_cancel_request(pid, secret);
+  bufferevent_write(bev, msg.data(), msg.size());
+  if (bufferevent_socket_connect(bev, res->ai_addr, static_cast<int>(res->ai_addrlen)) != 0) {
+    pgpooler::log::warn("cancel: connect to " + host + " failed");
+    bufferevent_free(bev);
+  }
+  freeaddrinfo(res);
+}
+
+}  // namespace session
+}  // namespace pgpooler
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+struct event_base;
+
+namespace pgpooler {
+namespace session {
+
+class ClientSession;
+
+/** Synthetic BackendKeyData handed to clients and the map back to their sessions (one per process, i.e. per
+ * worker). Clients never see real backend keys: in transaction/statement mode the backend connection and its
+ * key change with every transaction. The worker index is kept in the pid's high bits so the dispatcher can
+ * route a CancelRequest to the owning worker. Call from the event loop thread only. */
+class CancelRegistry {
+ public:
+  struct Key {
+    std::uint32_t pid = 0;
+    std::uint32_t secret = 0;
+  };
+
+  /** New key for session. worker_id: owning worker (-1 = single-process mode). */
+  Key add(ClientSession* session, int worker_id);
+  void remove(std::uint32_t pid);
+  /** Session that owns (pid, secret), or nullptr. */
+  ClientSession* find(std::uint32_t pid, std::uint32_t secret) const;
+
+ private:
+  struct Entry {
+    std::uint32_t secret = 0;
+    ClientSession* session = nullptr;
+  };
+  std::unordered_map<std::uint32_t, Entry> sessions_;
+  std::uint32_t next_seq_ = 0;
+};
+
+CancelRegistry& cancel_registry();
+
+/** Worker index encoded in a synthetic pid (-1 = single-process key). */
+int cancel_key_worker(std::uint32_t pid);
+
+/** Open a connection to host:port, send CancelRequest(pid, secret) and close it. Fire and forget. */
+void send_cancel_request(struct event_base* base, const std::string& host, std::uint16_t port,
+                         std::uint32_t pid, std::uint32_t secret);
+
+}  // namespace session
+}  // namespace pgpooler
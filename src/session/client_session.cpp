@@ -1,16 +1,20 @@
 #include "session/client_session.hpp"
 #include "common/log.hpp"
+#include "common/stats.hpp"
 #include "config/config.hpp"
 #include "pool/backend_connection_pool.hpp"
 #include "pool/connection_wait_queue.hpp"
 #include "protocol/error_response.hpp"
 #include "protocol/message.hpp"
+#include "protocol/sql_classifier.hpp"
+#include "session/cancel_registry.hpp"
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/util.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <algorithm>
 #include <cstring>
 #include <chrono>
 #include <deque>
@@ -75,10 +79,6 @@ void static_backend_read_cb(struct bufferevent* bev, void* ctx) {
   self->on_backend_read();
 }
 
-void flush_once_cb(evutil_socket_t, short, void* ctx) {
-  static_cast<ClientSession*>(ctx)->flush_client_output();
-}
-
 void static_client_write_cb(evutil_socket_t, short, void* ctx) {
   static_cast<ClientSession*>(ctx)->on_client_writable();
 }
@@ -92,6 +92,11 @@ void deferred_free_bev_cb(evutil_socket_t, short, void* ctx) {
   if (h->bev) bufferevent_free(h->bev);
   delete h;
 }
+/** Callbacks are cleared right away: the owner may be gone by the time the free runs. */
+void defer_free_bev(struct event_base* base, struct bufferevent* bev) {
+  bufferevent_setcb(bev, nullptr, nullptr, nullptr, nullptr);
+  event_base_once(base, -1, EV_TIMEOUT, deferred_free_bev_cb, new DeferredFreeBev{bev}, nullptr);
+}
 
 std::string worker_prefix(int worker_id) {
   if (worker_id < 0) return "";
@@ -101,7 +106,9 @@ std::string worker_prefix(int worker_id) {
 }  // namespace
 
 void ClientSession::static_deferred_destroy_cb(evutil_socket_t, short, void* ctx) {
-  static_cast<ClientSession*>(ctx)->destroy();
+  auto* self = static_cast<ClientSession*>(ctx);
+  self->deferred_destroy_pending_ = false;
+  self->destroy();
 }
 
 ClientSession::ClientSession(struct event_base* base, evutil_socket_t client_fd,
@@ -110,14 +117,17 @@ ClientSession::ClientSession(struct event_base* base, evutil_socket_t client_fd,
                              pgpooler::config::PoolManager* pool_manager,
                              pgpooler::pool::BackendConnectionPool* connection_pool,
                              pgpooler::pool::ConnectionWaitQueue* wait_queue,
+                             pgpooler::common::TimerWheel* timer_wheel,
                              const std::vector<std::uint8_t>* initial_data,
-                             int worker_id)
+                             int worker_id,
+                             const PreRouted* pre_routed)
     : base_(base),
       client_addr_(client_addr),
       resolver_(std::move(resolver)),
       pool_manager_(pool_manager),
       wait_queue_(wait_queue),
       connection_pool_(connection_pool),
+      timer_wheel_(timer_wheel),
       client_fd_(client_fd),
       worker_id_(worker_id) {
   client_input_ = evbuffer_new();
@@ -126,7 +136,7 @@ ClientSession::ClientSession(struct event_base* base, evutil_socket_t client_fd,
     destroy();
     return;
   }
-  if (initial_data && !initial_data->empty()) {
+  if (initial_data && !initial_data->empty() && !pre_routed) {
     evbuffer_add(client_input_, initial_data->data(), initial_data->size());
   }
   session_id_ = static_cast<int>(client_fd_);
@@ -138,7 +148,15 @@ ClientSession::ClientSession(struct event_base* base, evutil_socket_t client_fd,
     return;
   }
   event_add(client_read_event_, nullptr);
-  if (initial_data && !initial_data->empty()) {
+  session_timer_.set_callback([this] { on_session_timeout(); });
+  if (pre_routed && initial_data && pre_routed->startup_offset < initial_data->size()) {
+    msg_buf_ = *initial_data;
+    user_ = pre_routed->user;
+    database_ = pre_routed->database;
+    start_routed(pre_routed->resolved,
+                 std::vector<std::uint8_t>(initial_data->begin() + static_cast<std::ptrdiff_t>(pre_routed->startup_offset),
+                                           initial_data->end()));
+  } else if (initial_data && !initial_data->empty()) {
     on_client_read();
   }
 }
@@ -150,7 +168,10 @@ ClientSession::~ClientSession() {
 void ClientSession::handle_client_read_event() {
   int n = evbuffer_read(client_input_, client_fd_, -1);
   if (n <= 0) {
-    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (state_ == State::WaitingForBackend && evbuffer_get_length(client_input_) >= 5) on_client_read();  // resume_held_request
+      return;
+    }
     pgpooler::log::debug("client disconnected (EOF or error) fd=" + std::to_string(client_fd_));
     destroy();
     return;
@@ -166,8 +187,10 @@ void ClientSession::on_client_read() {
 
   if (state_ == State::Forwarding) {
     if (pending_return_to_pool_) {
-      pgpooler::log::debug(worker_prefix(worker_id_) + "session: Forwarding skip (pending_return_to_pool) client_out_buf=" + std::to_string(client_out_buf_.size()), session_id_);
-      return;  // wait for previous response to be sent before sending next request
+      /* Previous response is still draining to a slow client: keep the (idle) connection and send the next
+       * request now instead of waiting for the flush; replies queue behind the old ones in client_out_buf_. */
+      pgpooler::log::debug(worker_prefix(worker_id_) + "session: next request while response drains, keeping backend client_out_buf=" + std::to_string(client_out_buf_.size()), session_id_);
+      pending_return_to_pool_ = false;
     }
     forward_client_to_backend();
     if (bev_backend_) {
@@ -211,25 +234,42 @@ void ClientSession::on_client_read() {
         }
       }
     }
-    auto idle = connection_pool_->take(backend_name_, user_, database_,
-                                       std::chrono::steady_clock::now(),
-                                       server_idle_timeout_sec_, server_lifetime_sec_);
+    if (timer_wheel_) timer_wheel_->cancel(session_timer_);  // a request is waiting for a backend, not idle
+    if (has_route_choice()) {
+      // A read request goes to the primary while every read backend lags or has not replayed the client's writes.
+      bool read = !read_route_.members.empty() && next_request_is_read_only();
+      std::uint64_t min_lsn = 0;
+      if (read && read_your_writes_ && !read_min_lsn(min_lsn)) {
+        read = false;
+        stats::counters().read_your_writes_primary.fetch_add(1, std::memory_order_relaxed);
+      } else if (read && pool_manager_->all_lagging(read_route_.members, min_lsn)) {
+        read = false;
+        if (min_lsn != 0 && !pool_manager_->all_lagging(read_route_.members))
+          stats::counters().read_your_writes_primary.fetch_add(1, std::memory_order_relaxed);
+      }
+      use_route(read, min_lsn);
+    }
+    std::optional<pgpooler::pool::IdleConnection> idle;
+    if (!backend_retired())  // pooled connections belong to the backend's new definition
+      idle = connection_pool_->take(backend_name_, user_, database_, std::chrono::steady_clock::now(),
+                                    server_idle_timeout_sec_, server_lifetime_sec_);
     if (idle) {
       if (!pool_manager_->take_backend(backend_name_)) {
         connection_pool_->put(backend_name_, user_, database_, idle->bev,
-                              std::move(idle->cached_startup_response), idle->created_at);
+                              std::move(idle->cached_startup_response), idle->created_at, idle->dirty,
+                              std::move(idle->prepared_statements));
         return;
       }
-      pgpooler::log::info(worker_prefix(worker_id_) + "session: took from pool backend=" + backend_name_ + " user=" + user_ + " database=" + database_ + " (next query) -> state=SendingDiscardAll sending DISCARD ALL", session_id_);
+      pgpooler::log::info(worker_prefix(worker_id_) + "session: took from pool backend=" + backend_name_ + " user=" + user_ + " database=" + database_ + " (next query), resetting", session_id_);
       pool_acquired_ = true;
       bev_backend_ = idle->bev;
       cached_startup_response_ = std::move(idle->cached_startup_response);
       backend_created_at_ = idle->created_at;
+      backend_dirty_ = idle->dirty;
+      backend_statements_ = std::move(idle->prepared_statements);
       bufferevent_setcb(bev_backend_, static_backend_read_cb, nullptr, static_backend_event_cb, this);
       bufferevent_enable(bev_backend_, EV_READ);
-      std::vector<std::uint8_t> discard = protocol::build_query_message("DISCARD ALL");
-      bufferevent_write(bev_backend_, discard.data(), discard.size());
-      state_ = State::SendingDiscardAll;
+      send_reset_query();
       return;
     }
     if (!pool_manager_->acquire(backend_name_)) {
@@ -238,6 +278,7 @@ void ClientSession::on_client_read() {
       waiting_in_queue_ = true;
       return;
     }
+    pool_acquired_ = true;
     pgpooler::log::debug(worker_prefix(worker_id_) + "session: no idle in pool, connecting to backend -> state=ConnectingToBackend", session_id_);
     connect_to_backend();
     return;
@@ -271,6 +312,13 @@ void ClientSession::on_client_read() {
 
   if (!protocol::try_extract_length_prefixed_message(client_input_, msg_buf_)) return;
 
+  std::uint32_t cancel_pid = 0;
+  std::uint32_t cancel_secret = 0;
+  if (protocol::get_cancel_request_key(msg_buf_, &cancel_pid, &cancel_secret)) {
+    handle_cancel_request(cancel_pid, cancel_secret);
+    return;
+  }
+
   std::vector<std::uint8_t> startup_msg = msg_buf_;
   if (startup_msg.size() >= 8) {
     std::uint32_t len = (static_cast<std::uint32_t>(startup_msg[0]) << 24) |
@@ -290,21 +338,50 @@ void ClientSession::on_client_read() {
   user_ = user_opt ? *user_opt : "";
   database_ = db_opt ? *db_opt : "";
 
-  auto resolved = resolver_(user_, database_);
+  auto resolved = resolver_(user_, database_, [&startup_msg](const std::string& name) {
+    return protocol::extract_startup_parameter(startup_msg, name.c_str());
+  });
   if (!resolved) {
     send_error_and_close("3D000", "no route for user/database");
     return;
   }
-  backend_name_ = resolved->name;
-  backend_host_ = resolved->host;
-  backend_port_ = resolved->port;
-  pool_mode_ = resolved->pool_mode;
-  server_idle_timeout_sec_ = resolved->server_idle_timeout_sec;
-  server_lifetime_sec_ = resolved->server_lifetime_sec;
-  query_wait_timeout_sec_ = resolved->query_wait_timeout_sec;
+  start_routed(*resolved, std::move(startup_msg));
+}
+
+void ClientSession::start_routed(const pgpooler::config::ResolvedBackend& resolved,
+                                 std::vector<std::uint8_t> startup_msg) {
+  pool_mode_ = resolved.pool_mode;
+  server_idle_timeout_sec_ = resolved.server_idle_timeout_sec;
+  server_lifetime_sec_ = resolved.server_lifetime_sec;
+  query_wait_timeout_sec_ = resolved.query_wait_timeout_sec;
+  server_drain_timeout_sec_ = resolved.server_drain_timeout_sec;
+  client_idle_timeout_sec_ = resolved.client_idle_timeout_sec;
+  idle_transaction_timeout_sec_ = resolved.idle_transaction_timeout_sec;
+  query_timeout_sec_ = resolved.query_timeout_sec;
+  server_reset_mode_ = resolved.server_reset_mode;
+  server_reset_tracking_ = resolved.server_reset_tracking;
+  server_reset_query_ = resolved.server_reset_query;
+  max_prepared_statements_ = resolved.max_prepared_statements;
+  client_out_buf_.configure(resolved.client_buffer_memory, resolved.client_buffer_spill);
+  primary_route_ = make_route(resolved.members, resolved.balance);
+  if (primary_route_.members.empty()) {  // a worker without this process's pools: keep the resolved backend
+    primary_route_.members.push_back(pgpooler::config::BackendTarget{resolved.name, resolved.host, resolved.port, 1});
+    primary_route_.generations.push_back(connection_pool_->generation(resolved.name));
+  }
+  if (!resolved.read_members.empty() && pool_mode_ != pgpooler::config::PoolMode::Session) {
+    auto app = protocol::extract_startup_parameter(startup_msg, "application_name");
+    const auto& excluded = resolved.read_exclude_applications;
+    if (!app || std::find(excluded.begin(), excluded.end(), *app) == excluded.end())
+      read_route_ = make_route(resolved.read_members, resolved.read_balance);
+    read_your_writes_ = resolved.read_your_writes && !read_route_.members.empty();
+  }
+  use_route(false);
   pending_startup_ = msg_buf_;
-  client_startup_cache_ = startup_msg;
+  client_startup_cache_ = std::move(startup_msg);
+  acquire_startup_backend();
+}
 
+void ClientSession::acquire_startup_backend() {
   if (pool_mode_ == pgpooler::config::PoolMode::Session) {
     auto idle = connection_pool_->take(backend_name_, user_, database_,
                                       std::chrono::steady_clock::now(),
@@ -312,7 +389,8 @@ void ClientSession::on_client_read() {
     if (idle) {
       if (!pool_manager_->take_backend(backend_name_)) {
         connection_pool_->put(backend_name_, user_, database_, idle->bev,
-                              std::move(idle->cached_startup_response), idle->created_at);
+                              std::move(idle->cached_startup_response), idle->created_at, idle->dirty,
+                              std::move(idle->prepared_statements));
         send_error_and_close("53300", "pool error");
         return;
       }
@@ -321,11 +399,15 @@ void ClientSession::on_client_read() {
       bev_backend_ = idle->bev;
       cached_startup_response_ = std::move(idle->cached_startup_response);
       backend_created_at_ = idle->created_at;
+      backend_dirty_ = idle->dirty;
+      backend_statements_ = std::move(idle->prepared_statements);
       bufferevent_setcb(bev_backend_, static_backend_read_cb, nullptr, static_backend_event_cb, this);
       bufferevent_enable(bev_backend_, EV_READ);
-      client_out_buf_.insert(client_out_buf_.end(), cached_startup_response_.begin(), cached_startup_response_.end());
+      ensure_cancel_key();
+      client_out_buf_.append(protocol::replace_backend_key_data(cached_startup_response_, cancel_pid_, cancel_secret_));
       flush_client_output();
-      state_ = State::Forwarding;
+      if (deferred_destroy_pending_) return;
+      send_reset_query();
       return;
     }
   }
@@ -373,6 +455,12 @@ void ClientSession::connect_to_backend() {
   }
   freeaddrinfo(res);
   backend_created_at_ = std::chrono::steady_clock::now();
+  cached_startup_response_.clear();
+  backend_dirty_ = protocol::SessionStateEffect::None;
+  backend_statements_.clear();
+  pending_requests_.clear();
+  outstanding_syncs_ = 0;
+  backend_tx_state_ = protocol::TXSTATE_IDLE;
 }
 
 void ClientSession::on_backend_connected() {
@@ -389,58 +477,88 @@ void ClientSession::on_backend_read() {
     while (evbuffer_get_length(bin) >= 5) {
       if (!protocol::try_extract_typed_message(bin, msg_buf_)) break;
       unsigned char mt = protocol::get_message_type(msg_buf_);
+      if (client_startup_done_) {  // connection opened for a request (pool had none): the client is past startup
+        cached_startup_response_.insert(cached_startup_response_.end(), msg_buf_.begin(), msg_buf_.end());
+        if (mt == 'E') {
+          client_out_buf_.append(msg_buf_);
+          flush_client_output();
+          if (deferred_destroy_pending_) return;
+        }
+        if (mt == protocol::MSG_READY_FOR_QUERY) {
+          pgpooler::log::debug(worker_prefix(worker_id_) + "session: backend connected for request, forwarding backend=" + backend_name_, session_id_);
+          state_ = State::Forwarding;
+          forward_client_to_backend();
+          return;
+        }
+        continue;
+      }
       size_t out_before = client_out_buf_.size();
       cached_startup_response_.insert(cached_startup_response_.end(), msg_buf_.begin(), msg_buf_.end());
-      client_out_buf_.insert(client_out_buf_.end(), msg_buf_.begin(), msg_buf_.end());
+      if (mt == 'K') {  // the real key stays with the connection, the client gets the session's synthetic one
+        ensure_cancel_key();
+        client_out_buf_.append(protocol::build_backend_key_data(cancel_pid_, cancel_secret_));
+      } else {
+        client_out_buf_.append(msg_buf_);
+      }
       pgpooler::log::debug(worker_prefix(worker_id_) + "session: backend->client msg=" + std::string(msg_type_name(mt)) + " len=" + std::to_string(msg_buf_.size()) + " out_buf " + std::to_string(out_before) + "->" + std::to_string(client_out_buf_.size()), session_id_);
       flush_client_output();
       if (deferred_destroy_pending_) return;
       if (mt == protocol::MSG_READY_FOR_QUERY) {
+        client_startup_done_ = true;
         if (pool_mode_ == pgpooler::config::PoolMode::Session) {
-          auto idle = connection_pool_->take(backend_name_, user_, database_,
-                                             std::chrono::steady_clock::now(),
-                                             server_idle_timeout_sec_, server_lifetime_sec_);
+          std::optional<pgpooler::pool::IdleConnection> idle;
+          if (!backend_retired())
+            idle = connection_pool_->take(backend_name_, user_, database_, std::chrono::steady_clock::now(),
+                                          server_idle_timeout_sec_, server_lifetime_sec_);
           if (idle) {
             pool_manager_->release(backend_name_);
             pool_acquired_ = false;
             {  // Defer free: must not free bev inside its read callback (causes heap corruption)
               struct bufferevent* to_free = bev_backend_;
               bev_backend_ = nullptr;
-              DeferredFreeBev* h = new DeferredFreeBev{to_free};
-              event_base_once(base_, -1, 0, deferred_free_bev_cb, h, nullptr);
+              defer_free_bev(base_, to_free);
             }
             if (!pool_manager_->take_backend(backend_name_)) {
               connection_pool_->put(backend_name_, user_, database_, idle->bev,
-                                    std::move(idle->cached_startup_response), idle->created_at);
+                                    std::move(idle->cached_startup_response), idle->created_at, idle->dirty,
+                              std::move(idle->prepared_statements));
               return;
             }
-            pgpooler::log::info(worker_prefix(worker_id_) + "session: auth done, took from pool backend=" + backend_name_ + " (session mode), sending DISCARD ALL", session_id_);
+            pgpooler::log::info(worker_prefix(worker_id_) + "session: auth done, took from pool backend=" + backend_name_ + " (session mode), resetting", session_id_);
             pool_acquired_ = true;
             bev_backend_ = idle->bev;
             cached_startup_response_ = std::move(idle->cached_startup_response);
             backend_created_at_ = idle->created_at;
+            backend_dirty_ = idle->dirty;
+            backend_statements_ = std::move(idle->prepared_statements);
             bufferevent_setcb(bev_backend_, static_backend_read_cb, nullptr, static_backend_event_cb, this);
             bufferevent_enable(bev_backend_, EV_READ);
-            std::vector<std::uint8_t> discard = protocol::build_query_message("DISCARD ALL");
-            bufferevent_write(bev_backend_, discard.data(), discard.size());
-            state_ = State::SendingDiscardAll;
+            send_reset_query();
             return;
           }
           pgpooler::log::info(worker_prefix(worker_id_) + "session: auth done, using auth connection backend=" + backend_name_ + " (session mode, pool empty)", session_id_);
         }
         if (pool_mode_ != pgpooler::config::PoolMode::Session) {
           pgpooler::log::info(worker_prefix(worker_id_) + "session: auth done, put auth connection to pool backend=" + backend_name_ + " user=" + user_ + " database=" + database_ + " mode=" + (pool_mode_ == pgpooler::config::PoolMode::Transaction ? "transaction" : "statement"), session_id_);
+          if (close_if_backend_retired()) {
+            state_ = State::WaitingForBackend;
+            arm_session_timer();
+            return;
+          }
           bufferevent_setcb(bev_backend_, nullptr, nullptr, nullptr, nullptr);
           connection_pool_->put(backend_name_, user_, database_, bev_backend_,
-                                std::move(cached_startup_response_), backend_created_at_);
+                                std::move(cached_startup_response_), backend_created_at_,
+                                protocol::SessionStateEffect::None);
           pool_manager_->put_backend(backend_name_);
           pool_acquired_ = false;
           bev_backend_ = nullptr;
           state_ = State::WaitingForBackend;
+          arm_session_timer();
           wait_queue_->on_connection_available(backend_name_, user_, database_);
           return;
         }
         state_ = State::Forwarding;
+        arm_session_timer();
         return;
       }
     }
@@ -450,30 +568,58 @@ void ClientSession::on_backend_read() {
     while (evbuffer_get_length(bin) >= 5) {
       if (!protocol::try_extract_typed_message(bin, msg_buf_)) break;
       unsigned char mt = protocol::get_message_type(msg_buf_);
-      pgpooler::log::debug(worker_prefix(worker_id_) + "session: [DISCARD] consumed msg=" + std::string(msg_type_name(mt)) + " len=" + std::to_string(msg_buf_.size()) + " (not forwarded to client)", session_id_);
+      pgpooler::log::debug(worker_prefix(worker_id_) + "session: [reset] consumed msg=" + std::string(msg_type_name(mt)) + " len=" + std::to_string(msg_buf_.size()) + " (not forwarded to client)", session_id_);
       if (deferred_destroy_pending_) return;
       if (mt == protocol::MSG_READY_FOR_QUERY) {
-        pgpooler::log::debug(worker_prefix(worker_id_) + "session: DISCARD ALL done, forwarding backend=" + backend_name_, session_id_);
+        pgpooler::log::debug(worker_prefix(worker_id_) + "session: reset done, forwarding backend=" + backend_name_, session_id_);
         state_ = State::Forwarding;
+        reset_replay_.clear();
         forward_client_to_backend();
-        return;
+        break;
       }
     }
-    return;
+    // Pipelined reset: replies to the client's messages may already follow the reset's ReadyForQuery.
+    if (state_ != State::Forwarding) return;
   }
   if (state_ == State::Forwarding) {
     while (evbuffer_get_length(bin) >= 5) {
       if (!protocol::try_extract_typed_message(bin, msg_buf_)) break;
       unsigned char mt = protocol::get_message_type(msg_buf_);
       size_t out_before = client_out_buf_.size();
-      client_out_buf_.insert(client_out_buf_.end(), msg_buf_.begin(), msg_buf_.end());
-      pgpooler::log::debug(worker_prefix(worker_id_) + "session: backend->client msg=" + std::string(msg_type_name(mt)) + " len=" + std::to_string(msg_buf_.size()) + " out_buf " + std::to_string(out_before) + "->" + std::to_string(client_out_buf_.size()), session_id_);
+      if (!prepared_statements_enabled() || on_pending_reply(mt)) {
+        client_out_buf_.append(msg_buf_);
+        pgpooler::log::debug(worker_prefix(worker_id_) + "session: backend->client msg=" + std::string(msg_type_name(mt)) + " len=" + std::to_string(msg_buf_.size()) + " out_buf " + std::to_string(out_before) + "->" + std::to_string(client_out_buf_.size()), session_id_);
+      } else {
+        pgpooler::log::debug(worker_prefix(worker_id_) + "session: backend reply to injected message swallowed msg=" + std::string(msg_type_name(mt)), session_id_);
+      }
+      if (prepared_statements_enabled()) emit_synthetic_replies();
+      if (mt == 'S') backend_dirty_ = protocol::max_effect(backend_dirty_, protocol::SessionStateEffect::Settings);
       flush_client_output();
       if (deferred_destroy_pending_) return;
+      if (!backend_read_paused_ && client_out_buf_.over_limits()) {
+        // Slow client and the spool is full: hold the backend instead of queueing more (what is already
+        // read is still processed, so the overshoot is one read).
+        pgpooler::log::debug(worker_prefix(worker_id_) + "session: client_out_buf=" + std::to_string(client_out_buf_.size()) + " over buffer limits, pausing backend reads", session_id_);
+        bufferevent_disable(bev_backend_, EV_READ);
+        backend_read_paused_ = true;
+      }
       if (mt == protocol::MSG_READY_FOR_QUERY) {
         auto state_byte = protocol::get_ready_for_query_state(msg_buf_);
-        bool return_now = (pool_mode_ == pgpooler::config::PoolMode::Statement) ||
-                          (pool_mode_ == pgpooler::config::PoolMode::Transaction && state_byte == protocol::TXSTATE_IDLE);
+        if (outstanding_syncs_ > 0) --outstanding_syncs_;
+        if (record_latency_ && outstanding_syncs_ == 0) {
+          const auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                                request_sent_at_).count();
+          pool_manager_->record_latency(backend_name_, static_cast<std::uint64_t>(us));
+        }
+        if (state_byte) backend_tx_state_ = *state_byte;
+        // Each answered batch restarts query_timeout for the next one.
+        session_timer_kind_ = TimerKind::None;
+        query_cancel_sent_ = false;
+        arm_session_timer();
+        // Pipelined batches: the connection is free only when every Sync/Query sent so far is answered.
+        bool return_now = outstanding_syncs_ == 0 &&
+                          ((pool_mode_ == pgpooler::config::PoolMode::Statement) ||
+                           (pool_mode_ == pgpooler::config::PoolMode::Transaction && state_byte == protocol::TXSTATE_IDLE));
         if (return_now) {
           if (!pending_return_to_pool_) {
             pgpooler::log::info(worker_prefix(worker_id_) + "session: returning connection to pool backend=" + backend_name_ + " user=" + user_ + " database=" + database_, session_id_);
@@ -508,9 +654,18 @@ void ClientSession::on_backend_event(short what) {
           pool_manager_->release(backend_name_);
           pool_acquired_ = false;
         }
-        DeferredFreeBev* h = new DeferredFreeBev{to_free};
-        event_base_once(base_, -1, 0, deferred_free_bev_cb, h, nullptr);
+        defer_free_bev(base_, to_free);
+      }
+      if (!reset_replay_.empty()) {
+        evbuffer_prepend(client_input_, reset_replay_.data(), reset_replay_.size());
+        reset_replay_.clear();
+        skip_until_sync_ = replay_skip_until_sync_;
       }
+      backend_statements_.clear();
+      for (const auto& req : pending_requests_)  // the replayed Parses register their names again
+        if (!req.client_statement.empty() && req.type != 'E') client_statements_.erase(req.client_statement);
+      pending_requests_.clear();
+      outstanding_syncs_ = 0;
       state_ = State::WaitingForBackend;
       on_client_read();
       return;
@@ -524,23 +679,313 @@ void ClientSession::on_backend_event(short what) {
 void ClientSession::forward_client_to_backend() {
   if (!bev_backend_) return;
   size_t forwarded = 0;
+  backend_out_buf_.clear();
   while (evbuffer_get_length(client_input_) >= 5) {
+    // On the read backend, a request that may write waits for the primary (after this connection is returned).
+    if (!client_mid_request_ && (on_read_route_ || (read_your_writes_ && !request_wrote_)) &&
+        !next_request_is_read_only()) {
+      if (on_read_route_) break;
+      request_wrote_ = true;
+    }
     if (!protocol::try_extract_typed_message(client_input_, msg_buf_)) break;
+    const unsigned char type = protocol::get_message_type(msg_buf_);
+    if (type == 'X') {
+      // The backend outlives the client (pooled or closed by us): its Terminate would end a pooled connection.
+      pgpooler::log::debug(worker_prefix(worker_id_) + "session: client sent Terminate, not forwarded", session_id_);
+      continue;
+    }
+    client_mid_request_ = !(type == 'Q' || type == 'S' || type == 'F');
     if (msg_buf_.size() >= 1) {
       char type = static_cast<char>(msg_buf_[0]);
       pgpooler::log::debug(worker_prefix(worker_id_) + "session: client->backend msg=" + std::string(1, type) + " len=" + std::to_string(msg_buf_.size()) + " backend=" + backend_name_, session_id_);
     }
-    bufferevent_write(bev_backend_, msg_buf_.data(), msg_buf_.size());
+    if (state_ == State::SendingDiscardAll && reset_replay_.empty()) replay_skip_until_sync_ = skip_until_sync_;
+    append_client_message(msg_buf_, backend_out_buf_);
+    if (state_ == State::SendingDiscardAll)
+      reset_replay_.insert(reset_replay_.end(), msg_buf_.begin(), msg_buf_.end());
     forwarded += msg_buf_.size();
   }
+  if (!backend_out_buf_.empty()) bufferevent_write(bev_backend_, backend_out_buf_.data(), backend_out_buf_.size());
   if (forwarded) {
     pgpooler::log::debug(worker_prefix(worker_id_) + "session: forward_client_to_backend total_bytes=" + std::to_string(forwarded) + " client_input_remaining=" + std::to_string(evbuffer_get_length(client_input_)), session_id_);
   }
+  if (prepared_statements_enabled() && state_ == State::Forwarding && !pending_requests_.empty() &&
+      pending_requests_.front().reply == PendingRequest::Reply::Synthetic) {
+    emit_synthetic_replies();
+    flush_client_output();
+    if (deferred_destroy_pending_) return;
+  }
+  arm_session_timer();
+}
+
+void ClientSession::append_client_message(const std::vector<std::uint8_t>& msg, std::vector<std::uint8_t>& out) {
+  const unsigned char type = protocol::get_message_type(msg);
+  if (type == 'S' || type == 'Q' || type == 'F') {  // each is answered by one ReadyForQuery
+    if (record_latency_ && outstanding_syncs_ == 0) request_sent_at_ = std::chrono::steady_clock::now();
+    ++outstanding_syncs_;
+  }
+  if (server_reset_tracking_ && backend_dirty_ != protocol::SessionStateEffect::Full) track_dirty_state(msg);
+  if (prepared_statements_enabled())
+    rewrite_client_message(msg, out);
+  else
+    out.insert(out.end(), msg.begin(), msg.end());
+}
+
+namespace {
+
+/** Server-side name for a client statement: same query + parameter types → same name on every connection.
+ * Only a hint: PreparedStatementCache keeps the bytes behind each name, so a collision gets another name. */
+std::string server_statement_name(const std::vector<std::uint8_t>& parse_rest) {
+  std::uint64_t h = 14695981039346656037ull;  // FNV-1a
+  for (std::uint8_t b : parse_rest) {
+    h ^= b;
+    h *= 1099511628211ULL;
+  }
+  static const char hex[] = "0123456789abcdef";
+  std::string name = "pgpooler_";
+  for (int shift = 60; shift >= 0; shift -= 4) name.push_back(hex[(h >> shift) & 0xf]);
+  return name;
+}
+
+/** True if reply completes the response to a client request of this type. */
+bool is_final_reply(unsigned char request, unsigned char reply) {
+  switch (request) {
+    case 'P': return reply == '1';
+    case 'B': return reply == '2';
+    case 'D': return reply == 'T' || reply == 'n';
+    case 'E': return reply == 'C' || reply == 'I' || reply == 's';
+    case 'C': return reply == '3';
+    case 'S':
+    case 'Q':
+    case 'F': return reply == protocol::MSG_READY_FOR_QUERY;
+    default: return false;
+  }
+}
+
+/** Extended-protocol requests: after an error the server skips them until Sync. */
+bool is_extended_request(unsigned char type) {
+  return type == 'P' || type == 'B' || type == 'D' || type == 'E' || type == 'C';
+}
+
+}  // namespace
+
+bool ClientSession::prepared_statements_enabled() const {
+  return max_prepared_statements_ > 0 && pool_mode_ != pgpooler::config::PoolMode::Session;
+}
+
+std::string ClientSession::backend_statement_name(const std::vector<std::uint8_t>& parse_rest) const {
+  const std::string base = server_statement_name(parse_rest);
+  std::string name = base;
+  for (unsigned i = 1;; ++i) {
+    const auto* body = backend_statements_.find(name);
+    if (!body || *body == parse_rest) return name;
+    name = base + "_" + std::to_string(i);
+  }
+}
+
+void ClientSession::rewrite_client_message(const std::vector<std::uint8_t>& msg, std::vector<std::uint8_t>& out) {
+  using Reply = PendingRequest::Reply;
+  const unsigned char type = protocol::get_message_type(msg);
+  if (skip_until_sync_) {
+    if (type != 'S') return;
+    skip_until_sync_ = false;
+  }
+  if (type == 'P') {
+    std::string name;
+    const char* query = nullptr;
+    size_t query_len = 0;
+    if (protocol::get_parse_fields(msg, name, &query, &query_len) && !name.empty()) {
+      if (client_statements_.count(name)) {
+        pending_requests_.push_back(PendingRequest{'E', Reply::Synthetic, {}, name, {}});
+        skip_until_sync_ = true;
+        return;
+      }
+      ClientStatement stmt;
+      stmt.parse_rest.assign(msg.begin() + static_cast<std::ptrdiff_t>(5 + name.size() + 1), msg.end());
+      stmt.server_name = backend_statement_name(stmt.parse_rest);
+      if (backend_statements_.contains(stmt.server_name)) {
+        backend_statements_.touch(stmt.server_name);
+        pending_requests_.push_back(PendingRequest{'1', Reply::Synthetic, {}, name, {}});
+        pgpooler::log::debug(worker_prefix(worker_id_) + "session: prepared statement \"" + name + "\" -> " + stmt.server_name + " (already on backend)", session_id_);
+      } else {
+        prepare_on_backend(stmt, Reply::Forward, out);
+        pending_requests_.back().client_statement = name;
+        pgpooler::log::debug(worker_prefix(worker_id_) + "session: prepared statement \"" + name + "\" -> " + stmt.server_name, session_id_);
+      }
+      client_statements_[name] = std::move(stmt);
+      return;
+    }
+  } else if (type == 'B') {
+    std::string portal, name;
+    size_t offset = 0;
+    if (protocol::get_bind_fields(msg, portal, name, &offset) && !name.empty()) {
+      auto it = client_statements_.find(name);
+      if (it != client_statements_.end()) {
+        ensure_backend_statement(it->second, out);
+        std::vector<std::uint8_t> rewritten = protocol::replace_cstring(msg, offset, it->second.server_name);
+        out.insert(out.end(), rewritten.begin(), rewritten.end());
+        pending_requests_.push_back(PendingRequest{'B', Reply::Forward, {}, {}, {}});
+        return;
+      }
+    }
+  } else if (type == 'D' || type == 'C') {
+    unsigned char kind = 0;
+    std::string name;
+    if (protocol::get_target_fields(msg, &kind, name) && kind == 'S' && !name.empty()) {
+      auto it = client_statements_.find(name);
+      if (it != client_statements_.end()) {
+        if (type == 'C') {
+          // Stays prepared on the server for other clients; LRU closes it when the cache is full.
+          client_statements_.erase(it);
+          pending_requests_.push_back(PendingRequest{'3', Reply::Synthetic, {}, {}, {}});
+          return;
+        }
+        ensure_backend_statement(it->second, out);
+        std::vector<std::uint8_t> rewritten = protocol::replace_cstring(msg, 6, it->second.server_name);
+        out.insert(out.end(), rewritten.begin(), rewritten.end());
+        pending_requests_.push_back(PendingRequest{'D', Reply::Forward, {}, {}, {}});
+        return;
+      }
+    }
+  } else if (type == 'Q') {
+    const char* sql = nullptr;
+    size_t sql_len = 0;
+    if (protocol::get_query_text(msg, &sql, &sql_len) && protocol::drops_all_prepared_statements(sql, sql_len)) {
+      client_statements_.clear();
+      backend_statements_.clear();
+    }
+  }
+  out.insert(out.end(), msg.begin(), msg.end());
+  if (is_final_reply(type, protocol::MSG_READY_FOR_QUERY) || is_extended_request(type))
+    pending_requests_.push_back(PendingRequest{type, Reply::Forward, {}, {}, {}});
+}
+
+void ClientSession::ensure_backend_statement(ClientStatement& stmt, std::vector<std::uint8_t>& out) {
+  const auto* body = backend_statements_.find(stmt.server_name);
+  if (body && *body == stmt.parse_rest) {
+    backend_statements_.touch(stmt.server_name);
+    return;
+  }
+  if (body) stmt.server_name = backend_statement_name(stmt.parse_rest);  // the name holds other bytes here
+  if (backend_statements_.contains(stmt.server_name)) {
+    backend_statements_.touch(stmt.server_name);
+    return;
+  }
+  pgpooler::log::debug(worker_prefix(worker_id_) + "session: re-preparing " + stmt.server_name + " on backend=" + backend_name_, session_id_);
+  prepare_on_backend(stmt, PendingRequest::Reply::Swallow, out);
+}
+
+void ClientSession::prepare_on_backend(const ClientStatement& stmt, PendingRequest::Reply reply,
+                                       std::vector<std::uint8_t>& out) {
+  auto evicted = backend_statements_.insert(stmt.server_name, stmt.parse_rest, max_prepared_statements_);
+  if (evicted) {
+    std::vector<std::uint8_t> close = protocol::build_close_message('S', evicted->first);
+    out.insert(out.end(), close.begin(), close.end());
+    pending_requests_.push_back(
+        PendingRequest{'C', PendingRequest::Reply::Swallow, evicted->first, {}, std::move(evicted->second)});
+  }
+  std::vector<std::uint8_t> parse = protocol::build_parse_message(stmt.server_name, stmt.parse_rest.data(),
+                                                                  stmt.parse_rest.size());
+  out.insert(out.end(), parse.begin(), parse.end());
+  pending_requests_.push_back(PendingRequest{'P', reply, stmt.server_name, {}, {}});
+}
+
+bool ClientSession::on_pending_reply(unsigned char type) {
+  if (pending_requests_.empty()) return true;
+  if (type == 'N' || type == 'A' || type == 'S') return true;  // asynchronous, not a reply to a request
+  PendingRequest& head = pending_requests_.front();
+  if (type == 'E' && is_extended_request(head.type)) {
+    // Request failed: the server ignores everything up to the next Sync, synthetic replies included.
+    undo_pending_request(head);
+    pending_requests_.pop_front();
+    while (!pending_requests_.empty() && pending_requests_.front().type != 'S') {
+      undo_pending_request(pending_requests_.front());
+      pending_requests_.pop_front();
+    }
+    return true;  // also for an injected Parse: the client's Bind/Describe fails with it
+  }
+  const bool forward = head.reply != PendingRequest::Reply::Swallow;
+  if (is_final_reply(head.type, type)) pending_requests_.pop_front();
+  return forward;
+}
+
+void ClientSession::undo_pending_request(const PendingRequest& req) {
+  // A failed or skipped Parse leaves no statement: later Binds get 26000, not this Parse's error again.
+  if (!req.client_statement.empty() && req.type != 'E') client_statements_.erase(req.client_statement);
+  if (req.statement.empty()) return;
+  if (req.type == 'P') backend_statements_.erase(req.statement);
+  else if (req.type == 'C') backend_statements_.insert(req.statement, req.parse_rest, 0);  // Close skipped: still on the server
+}
+
+void ClientSession::emit_synthetic_replies() {
+  if (state_ != State::Forwarding) return;
+  while (!pending_requests_.empty() && pending_requests_.front().reply == PendingRequest::Reply::Synthetic) {
+    const PendingRequest& head = pending_requests_.front();
+    std::vector<std::uint8_t> reply =
+        head.type == 'E' ? protocol::build_error_response(
+                               "42P05", "prepared statement \"" + head.client_statement + "\" already exists", "ERROR")
+                         : protocol::build_empty_message(head.type);
+    client_out_buf_.append(reply);
+    pending_requests_.pop_front();
+  }
+}
+
+void ClientSession::track_dirty_state(const std::vector<std::uint8_t>& msg) {
+  unsigned char type = protocol::get_message_type(msg);
+  const char* sql = nullptr;
+  size_t sql_len = 0;
+  protocol::SessionStateEffect effect = protocol::SessionStateEffect::None;
+  if (type == 'Q') {
+    if (protocol::get_query_text(msg, &sql, &sql_len)) effect = protocol::classify_session_state_effect(sql, sql_len);
+  } else if (type == 'P') {
+    std::string statement_name;
+    if (protocol::get_parse_fields(msg, statement_name, &sql, &sql_len)) {
+      // Managed statements live under pooler names and need no reset; unmanaged named ones need DISCARD ALL.
+      effect = (statement_name.empty() || prepared_statements_enabled())
+                   ? protocol::classify_session_state_effect(sql, sql_len)
+                   : protocol::SessionStateEffect::Full;
+    }
+  }
+  backend_dirty_ = protocol::max_effect(backend_dirty_, effect);
+}
+
+std::string ClientSession::reset_query_for_backend() const {
+  if (!server_reset_tracking_ || backend_dirty_ == protocol::SessionStateEffect::Full) return "DISCARD ALL";
+  if (backend_dirty_ == protocol::SessionStateEffect::Settings)
+    return server_reset_query_.empty() ? "DISCARD ALL" : server_reset_query_;
+  return {};
+}
+
+void ClientSession::send_reset_query() {
+  std::string reset_query = reset_query_for_backend();
+  if (reset_query.empty()) {
+    pgpooler::log::debug(worker_prefix(worker_id_) + "session: pooled connection is clean, no reset backend=" + backend_name_, session_id_);
+    state_ = State::Forwarding;
+    forward_client_to_backend();
+    return;
+  }
+  pgpooler::log::debug(worker_prefix(worker_id_) + "session: reset query \"" + reset_query + "\" backend=" + backend_name_, session_id_);
+  state_ = State::SendingDiscardAll;
+  reset_replay_.clear();
+  // Everything the client sends from now on runs after the reset.
+  backend_dirty_ = protocol::SessionStateEffect::None;
+  if (protocol::drops_all_prepared_statements(reset_query)) backend_statements_.clear();
+  std::vector<std::uint8_t> out = protocol::build_query_message(reset_query);
+  if (server_reset_mode_ == pgpooler::config::ResetMode::Pipelined) {
+    while (evbuffer_get_length(client_input_) >= 5) {
+      if (!protocol::try_extract_typed_message(client_input_, msg_buf_)) break;
+      reset_replay_.insert(reset_replay_.end(), msg_buf_.begin(), msg_buf_.end());
+      append_client_message(msg_buf_, out);
+    }
+    pgpooler::log::debug(worker_prefix(worker_id_) + "session: reset pipelined with " + std::to_string(reset_replay_.size()) + " client bytes backend=" + backend_name_, session_id_);
+  }
+  bufferevent_write(bev_backend_, out.data(), out.size());
+  arm_session_timer();
 }
 
 void ClientSession::flush_client_output() {
   while (!client_out_buf_.empty() && client_fd_ >= 0) {
-    ssize_t n = send(client_fd_, client_out_buf_.data(), client_out_buf_.size(), 0);
+    ssize_t n = send(client_fd_, client_out_buf_.data(), client_out_buf_.contiguous(), 0);
     if (n <= 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         pgpooler::log::debug(worker_prefix(worker_id_) + "session: flush EAGAIN pending=" + std::to_string(client_out_buf_.size()) + " (will wait EV_WRITE)", session_id_);
@@ -553,16 +998,24 @@ void ClientSession::flush_client_output() {
       pgpooler::log::debug(worker_prefix(worker_id_) + "session: flush send failed n=" + std::to_string(n) + " errno=" + std::to_string(errno), session_id_);
       /* Must not destroy() here: flush can be called from on_backend_read() -> use-after-free and heap corruption. */
       deferred_destroy_pending_ = true;
-      event_base_once(base_, -1, 0, static_deferred_destroy_cb, this, nullptr);
+      event_base_once(base_, -1, EV_TIMEOUT, static_deferred_destroy_cb, this, nullptr);
       return;
     }
-    client_out_buf_.erase(client_out_buf_.begin(), client_out_buf_.begin() + static_cast<size_t>(n));
+    client_out_buf_.consume(static_cast<size_t>(n));
     pgpooler::log::debug(worker_prefix(worker_id_) + "session: flush sent " + std::to_string(n) + " remaining=" + std::to_string(client_out_buf_.size()), session_id_);
   }
-}
-
-void ClientSession::schedule_flush_client() {
-  event_base_once(base_, -1, 0, flush_once_cb, this, nullptr);
+  if (backend_read_paused_ && !client_out_buf_.over_limits()) {
+    backend_read_paused_ = false;
+    if (bev_backend_) bufferevent_enable(bev_backend_, EV_READ);
+    pgpooler::log::debug(worker_prefix(worker_id_) + "session: client_out_buf=" + std::to_string(client_out_buf_.size()) + " within buffer limits, resuming backend reads", session_id_);
+  }
+  if (released_early_ && client_out_buf_.empty()) {
+    released_early_ = false;
+    auto held = std::chrono::steady_clock::now() - released_early_at_;
+    stats::counters().backend_hold_saved_us.fetch_add(
+        static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(held).count()),
+        std::memory_order_relaxed);
+  }
 }
 
 void ClientSession::return_backend_to_pool() {
@@ -572,6 +1025,21 @@ void ClientSession::return_backend_to_pool() {
     flush_client_output();
     if (destroy_scheduled_) return;
   }
+  if (client_out_buf_.within_limits()) {
+    /* Response is complete and fits the spool (or already sits in the socket buffer): the backend is free,
+     * the client is fed from client_out_buf_. */
+    pgpooler::log::debug(worker_prefix(worker_id_) + "session: return_backend_to_pool early, client_out_buf=" + std::to_string(client_out_buf_.size()) + " buffered", session_id_);
+    do_return_backend_to_pool();
+    if (client_out_buf_.empty()) return;
+    stats::counters().early_releases.fetch_add(1, std::memory_order_relaxed);
+    released_early_ = true;
+    released_early_at_ = std::chrono::steady_clock::now();
+    if (!client_write_event_ && client_fd_ >= 0) {
+      client_write_event_ = event_new(base_, client_fd_, EV_WRITE, static_client_write_cb, this);
+      if (client_write_event_) event_add(client_write_event_, nullptr);
+    }
+    return;
+  }
   pending_return_to_pool_ = true;
   pgpooler::log::debug(worker_prefix(worker_id_) + "session: return_backend_to_pool pending_return=1 client_out_buf=" + std::to_string(client_out_buf_.size()) + " (wait EV_WRITE)", session_id_);
   if (!client_write_event_) {
@@ -582,21 +1050,110 @@ void ClientSession::return_backend_to_pool() {
 
 void ClientSession::do_return_backend_to_pool() {
   if (!bev_backend_) return;
+  if (request_wrote_) {  // the write is committed (or rolled back): reads wait for WAL past this point
+    request_wrote_ = false;
+    awaiting_write_lsn_ = true;
+    write_backend_ = backend_name_;
+    write_done_at_ = std::chrono::steady_clock::now();
+  }
   pgpooler::log::debug(worker_prefix(worker_id_) + "session: do_return_backend_to_pool backend=" + backend_name_ + " user=" + user_ + " database=" + database_, session_id_);
   pending_return_to_pool_ = false;
+  backend_read_paused_ = false;  // whoever takes the connection enables EV_READ
+  backend_tx_state_ = protocol::TXSTATE_IDLE;
   if (client_write_event_) {
     event_del(client_write_event_);
     event_free(client_write_event_);
     client_write_event_ = nullptr;
   }
+  if (close_if_backend_retired()) {
+    state_ = State::WaitingForBackend;
+    resume_held_request();
+    return;
+  }
+  if (pool_manager_->wanted_elsewhere(backend_name_, user_, database_)) {
+    /* Shared pool budget: clients of another worker wait for this backend; an idle connection here would keep
+     * its slot from them, so close it. */
+    pgpooler::log::info(worker_prefix(worker_id_) + "session: backend=" + backend_name_ + " is awaited by another worker, closing its connection instead of pooling it", session_id_);
+    defer_free_bev(base_, bev_backend_);
+    bev_backend_ = nullptr;
+    if (pool_acquired_) {
+      pool_manager_->release(backend_name_);
+      pool_acquired_ = false;
+    }
+    backend_statements_.clear();
+    pending_requests_.clear();
+    state_ = State::WaitingForBackend;
+    wait_queue_->on_connection_available(backend_name_, user_, database_);
+    resume_held_request();
+    return;
+  }
   bufferevent_setcb(bev_backend_, nullptr, nullptr, nullptr, nullptr);
+  /* Reset on return: not from SendingDiscardAll — replies to the take-time reset are still in flight. */
+  std::string reset_query;
+  if (server_reset_mode_ == pgpooler::config::ResetMode::Return && state_ != State::SendingDiscardAll)
+    reset_query = reset_query_for_backend();
+  pending_requests_.clear();
+  if (!reset_query.empty()) {
+    if (protocol::drops_all_prepared_statements(reset_query)) backend_statements_.clear();
+    /* Pool slot stays in use until the reset finishes. */
+    connection_pool_->put_resetting(backend_name_, user_, database_, bev_backend_,
+                                    std::move(cached_startup_response_), backend_created_at_,
+                                    std::move(backend_statements_), reset_query, pool_slot_done());
+    backend_statements_.clear();
+    pool_acquired_ = false;
+    bev_backend_ = nullptr;
+    state_ = State::WaitingForBackend;
+    resume_held_request();
+    return;
+  }
   connection_pool_->put(backend_name_, user_, database_, bev_backend_,
-                        std::move(cached_startup_response_), backend_created_at_);
+                        std::move(cached_startup_response_), backend_created_at_, backend_dirty_,
+                        std::move(backend_statements_));
+  backend_statements_.clear();
   pool_manager_->put_backend(backend_name_);
   pool_acquired_ = false;
   bev_backend_ = nullptr;
   state_ = State::WaitingForBackend;
   wait_queue_->on_connection_available(backend_name_, user_, database_);
+  resume_held_request();
+}
+
+void ClientSession::drain_backend_to_pool() {
+  if (!bev_backend_) return;
+  if (close_if_backend_retired()) return;  // closing the connection ends whatever runs on it
+  const unsigned pending_ready = outstanding_syncs_ + (state_ == State::SendingDiscardAll ? 1u : 0u);
+  pgpooler::log::info(worker_prefix(worker_id_) + "session: client gone mid-query or mid-transaction, draining backend=" + backend_name_ + " pending_ready=" + std::to_string(pending_ready) + " tx_state=" + std::string(1, static_cast<char>(backend_tx_state_)), session_id_);
+  if (outstanding_syncs_ > 0) cancel_backend_query();
+  bufferevent_setcb(bev_backend_, nullptr, nullptr, nullptr, nullptr);
+  std::string reset_query;
+  if (server_reset_mode_ == pgpooler::config::ResetMode::Return) reset_query = reset_query_for_backend();
+  if (!reset_query.empty() && protocol::drops_all_prepared_statements(reset_query)) backend_statements_.clear();
+  pending_requests_.clear();
+  connection_pool_->put_draining(backend_name_, user_, database_, bev_backend_,
+                                 std::move(cached_startup_response_), backend_created_at_, backend_dirty_,
+                                 std::move(backend_statements_), pending_ready, reset_query,
+                                 server_drain_timeout_sec_, pool_slot_done(), backend_tx_state_);
+  backend_statements_.clear();
+  pool_acquired_ = false;
+  bev_backend_ = nullptr;
+  outstanding_syncs_ = 0;
+  backend_tx_state_ = protocol::TXSTATE_IDLE;
+}
+
+std::function<void(bool ok)> ClientSession::pool_slot_done() const {
+  /* Runs after the pool finished with the connection; must not touch this session (may be gone). */
+  pgpooler::config::PoolManager* pool_manager = pool_manager_;
+  pgpooler::pool::ConnectionWaitQueue* wait_queue = wait_queue_;
+  std::string backend_name = backend_name_;
+  std::string user = user_;
+  std::string database = database_;
+  return [pool_manager, wait_queue, backend_name, user, database](bool ok) {
+    if (ok)
+      pool_manager->put_backend(backend_name);
+    else
+      pool_manager->release(backend_name);
+    wait_queue->on_connection_available(backend_name, user, database);
+  };
 }
 
 void ClientSession::on_client_writable() {
@@ -616,6 +1173,8 @@ void ClientSession::on_client_writable() {
       event_free(client_write_event_);
       client_write_event_ = nullptr;
     }
+  } else if (client_write_event_ && !destroy_scheduled_) {
+    event_add(client_write_event_, nullptr);  // EV_WRITE is one-shot: wait for the next chunk of send buffer
   }
 }
 
@@ -630,19 +1189,174 @@ void ClientSession::close_auth_backend() {
   }
 }
 
+bool ClientSession::backend_retired() const {
+  return connection_pool_->generation(backend_name_) != backend_generation_;
+}
+
+bool ClientSession::close_if_backend_retired() {
+  if (!bev_backend_ || !backend_retired()) return false;
+  pgpooler::log::info(worker_prefix(worker_id_) + "session: backend=" + backend_name_ + " changed by config reload, closing its connection instead of pooling it", session_id_);
+  defer_free_bev(base_, bev_backend_);  // may run inside the backend read callback
+  bev_backend_ = nullptr;
+  if (pool_acquired_) {
+    pool_manager_->release(backend_name_);
+    pool_acquired_ = false;
+  }
+  backend_statements_.clear();
+  pending_requests_.clear();
+  outstanding_syncs_ = 0;
+  backend_tx_state_ = protocol::TXSTATE_IDLE;
+  wait_queue_->on_connection_available(backend_name_, user_, database_);
+  return true;
+}
+
+ClientSession::BackendRoute ClientSession::make_route(const std::vector<pgpooler::config::BackendTarget>& members,
+                                                     pgpooler::config::BalanceMode balance) const {
+  BackendRoute route;
+  route.balance = balance;
+  for (const auto& m : members) {
+    if (!pool_manager_->has_backend(m.name)) continue;  // served by another worker
+    route.members.push_back(m);
+    route.generations.push_back(connection_pool_->generation(m.name));
+  }
+  return route;
+}
+
+void ClientSession::use_route(bool read, std::uint64_t min_replay_lsn) {
+  const BackendRoute& route = read ? read_route_ : primary_route_;
+  const std::size_t i =
+      route.members.size() > 1 ? pool_manager_->pick(route.members, route.balance, min_replay_lsn) : 0;
+  const auto& member = route.members[i];
+  backend_name_ = member.name;
+  backend_host_ = member.host;
+  backend_port_ = member.port;
+  backend_generation_ = route.generations[i];
+  record_latency_ = route.members.size() > 1 && route.balance == pgpooler::config::BalanceMode::Latency;
+  on_read_route_ = read;
+  if (read) stats::counters().read_routed_requests.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool ClientSession::read_min_lsn(std::uint64_t& lsn) {
+  if (awaiting_write_lsn_) {
+    auto current = pool_manager_->current_lsn_since(write_backend_, write_done_at_);
+    if (!current) return false;
+    awaiting_write_lsn_ = false;
+    min_read_lsn_ = std::max(min_read_lsn_, *current);
+  }
+  lsn = min_read_lsn_;
+  return true;
+}
+
+bool ClientSession::next_request_is_read_only() {
+  const size_t avail = std::min<size_t>(evbuffer_get_length(client_input_), 65536);
+  if (avail < 5) return false;
+  const unsigned char* p = evbuffer_pullup(client_input_, static_cast<ev_ssize_t>(avail));
+  if (!p) return false;
+  std::vector<std::string> parsed;  // statements prepared by this request (read-only ones)
+  std::vector<std::uint8_t> msg;
+  for (size_t off = 0; off + 5 <= avail;) {
+    const std::uint32_t len = (static_cast<std::uint32_t>(p[off + 1]) << 24) | (static_cast<std::uint32_t>(p[off + 2]) << 16) |
+                              (static_cast<std::uint32_t>(p[off + 3]) << 8) | static_cast<std::uint32_t>(p[off + 4]);
+    if (len < 4 || off + 1 + len > avail) return false;  // decide once the whole request is here
+    msg.assign(p + off, p + off + 1 + len);
+    off += 1 + len;
+    switch (msg[0]) {
+      case 'Q': {
+        const char* text = nullptr;
+        size_t text_len = 0;
+        return parsed.empty() && protocol::get_query_text(msg, &text, &text_len) &&
+               protocol::is_read_only_query(text, text_len);
+      }
+      case 'P': {
+        std::string name;
+        const char* query = nullptr;
+        size_t query_len = 0;
+        if (!protocol::get_parse_fields(msg, name, &query, &query_len) || !protocol::is_read_only_query(query, query_len))
+          return false;
+        parsed.push_back(name);
+        break;
+      }
+      case 'B': {
+        std::string portal;
+        std::string name;
+        size_t name_offset = 0;
+        if (!protocol::get_bind_fields(msg, portal, name, &name_offset)) return false;
+        if (std::find(parsed.begin(), parsed.end(), name) != parsed.end()) break;
+        // A statement prepared earlier: its text is only known when the pooler tracks prepared statements.
+        auto it = name.empty() || !prepared_statements_enabled() ? client_statements_.end() : client_statements_.find(name);
+        if (it == client_statements_.end()) return false;
+        const auto& rest = it->second.parse_rest;
+        const char* query = reinterpret_cast<const char*>(rest.data());
+        if (!protocol::is_read_only_query(query, strnlen(query, rest.size()))) return false;
+        parsed.push_back(name);
+        break;
+      }
+      case 'D':
+      case 'E':
+      case 'H':
+        break;
+      case 'S':
+        return !parsed.empty();
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+void ClientSession::resume_held_request() {
+  /* Requests held back on the read route are picked up by the client read event: a nested on_client_read() here
+   * could take another backend while a callback of the old one is still on the stack. */
+  if (on_read_route_ && client_read_event_ && evbuffer_get_length(client_input_) >= 5)
+    event_active(client_read_event_, EV_READ, 0);
+}
+
+void ClientSession::ensure_cancel_key() {
+  if (cancel_pid_) return;
+  CancelRegistry::Key key = cancel_registry().add(this, worker_id_);
+  cancel_pid_ = key.pid;
+  cancel_secret_ = key.secret;
+}
+
+void ClientSession::handle_cancel_request(std::uint32_t pid, std::uint32_t secret) {
+  ClientSession* target = cancel_registry().find(pid, secret);
+  pgpooler::log::debug(worker_prefix(worker_id_) + "session: cancel request pid=" + std::to_string(pid) + (target ? "" : " (unknown key)"), session_id_);
+  if (target) target->cancel_backend_query();
+  destroy();  // no reply to a CancelRequest, the connection is just closed
+}
+
+void ClientSession::cancel_backend_query() {
+  /* Only while the session holds a backend: in transaction/statement mode the connection (and its real key)
+   * belongs to someone else once it is back in the pool. */
+  if (!bev_backend_ || (state_ != State::Forwarding && state_ != State::SendingDiscardAll)) {
+    pgpooler::log::debug(worker_prefix(worker_id_) + "session: cancel ignored, no backend in use state=" + state_name(state_), session_id_);
+    return;
+  }
+  std::uint32_t pid = 0;
+  std::uint32_t secret = 0;
+  if (!protocol::find_backend_key_data(cached_startup_response_, &pid, &secret)) {
+    pgpooler::log::warn(worker_prefix(worker_id_) + "session: cancel ignored, backend sent no BackendKeyData backend=" + backend_name_, session_id_);
+    return;
+  }
+  pgpooler::log::info(worker_prefix(worker_id_) + "session: cancelling query on backend=" + backend_name_ + " backend_pid=" + std::to_string(pid), session_id_);
+  send_cancel_request(base_, backend_host_, backend_port_, pid, secret);
+}
+
 void ClientSession::send_error_and_close(const std::string& sqlstate, const std::string& message) {
   auto msg = protocol::build_error_response(sqlstate, message);
-  client_out_buf_.insert(client_out_buf_.end(), msg.begin(), msg.end());
+  client_out_buf_.append(msg);
   flush_client_output();
   destroy();
 }
 
 void ClientSession::retry_connect_to_backend() {
   waiting_in_queue_ = false;
-  if (state_ == State::WaitingForBackend && pool_manager_->acquire(backend_name_)) {
-    pool_acquired_ = true;
-    connect_to_backend();
-  }
+  /* The freed slot is usually an idle connection just put back (or reset) — take it from the pool; if it is
+   * gone already, on_client_read acquires a new slot or queues us again. */
+  if (state_ == State::WaitingForBackend)
+    on_client_read();
+  else if (state_ == State::ReadingFirst)  // queued at startup, before any backend
+    acquire_startup_backend();
 }
 
 void ClientSession::on_wait_timeout() {
@@ -650,14 +1364,72 @@ void ClientSession::on_wait_timeout() {
   send_error_and_close("57100", "connection wait timeout");
 }
 
+void ClientSession::arm_session_timer() {
+  if (!timer_wheel_ || destroy_scheduled_) return;
+  TimerKind kind = TimerKind::None;
+  unsigned timeout_sec = 0;
+  if (outstanding_syncs_ > 0) {
+    if (session_timer_kind_ == TimerKind::Query && session_timer_.armed()) return;  // counts from the request
+    kind = TimerKind::Query;
+    timeout_sec = query_timeout_sec_;
+  } else if (state_ == State::Forwarding || state_ == State::WaitingForBackend) {
+    bool in_transaction = bev_backend_ && backend_tx_state_ != protocol::TXSTATE_IDLE;
+    kind = in_transaction ? TimerKind::IdleTransaction : TimerKind::ClientIdle;
+    timeout_sec = in_transaction ? idle_transaction_timeout_sec_ : client_idle_timeout_sec_;
+  }
+  if (timeout_sec == 0) {
+    timer_wheel_->cancel(session_timer_);
+    session_timer_kind_ = TimerKind::None;
+    return;
+  }
+  session_timer_kind_ = kind;
+  timer_wheel_->schedule(session_timer_, std::chrono::seconds(timeout_sec));
+}
+
+void ClientSession::on_session_timeout() {
+  if (destroy_scheduled_ || deferred_destroy_pending_) return;
+  TimerKind kind = session_timer_kind_;
+  session_timer_kind_ = TimerKind::None;
+  switch (kind) {
+    case TimerKind::Query:
+      if (query_cancel_sent_) {
+        /* The cancel did not help (backend unreachable or ignoring it): give up on the session. */
+        pgpooler::log::warn(worker_prefix(worker_id_) + "session: query still running after cancel, closing backend=" + backend_name_, session_id_);
+        send_error_and_close("57014", "canceling statement due to query timeout");
+        return;
+      }
+      pgpooler::log::info(worker_prefix(worker_id_) + "session: query_timeout " + std::to_string(query_timeout_sec_) + "s expired backend=" + backend_name_, session_id_);
+      query_cancel_sent_ = true;
+      cancel_backend_query();
+      session_timer_kind_ = TimerKind::Query;
+      timer_wheel_->schedule(session_timer_, std::chrono::seconds(query_timeout_sec_));
+      return;
+    case TimerKind::IdleTransaction:
+      pgpooler::log::info(worker_prefix(worker_id_) + "session: idle_transaction_timeout " + std::to_string(idle_transaction_timeout_sec_) + "s expired backend=" + backend_name_, session_id_);
+      send_error_and_close("25P03", "terminating connection due to idle-in-transaction timeout");
+      return;
+    case TimerKind::ClientIdle:
+      pgpooler::log::info(worker_prefix(worker_id_) + "session: client_idle_timeout " + std::to_string(client_idle_timeout_sec_) + "s expired", session_id_);
+      send_error_and_close("57P05", "terminating connection due to idle-session timeout");
+      return;
+    case TimerKind::None:
+      return;
+  }
+}
+
 void ClientSession::destroy() {
-  if (destroy_scheduled_) return;
+  if (destroy_scheduled_ || deferred_destroy_pending_) return;  // a pending deferred destroy still holds this
   destroy_scheduled_ = true;
   pgpooler::log::debug(worker_prefix(worker_id_) + "session: destroy started state=" + state_name(state_) + " backend_dead=" + (backend_dead_ ? "1" : "0") + " client_out_buf=" + std::to_string(client_out_buf_.size()) + " bev_backend=" + (bev_backend_ ? "1" : "0"), session_id_);
   if (waiting_in_queue_) {
     wait_queue_->remove(this);
     waiting_in_queue_ = false;
   }
+  if (cancel_pid_) {
+    cancel_registry().remove(cancel_pid_);
+    cancel_pid_ = 0;
+  }
+  if (timer_wheel_) timer_wheel_->cancel(session_timer_);
   if (bev_backend_ && backend_dead_) {
     /* Defer free: destroy() can be called from on_backend_event (send_error_and_close). */
     struct bufferevent* to_free = bev_backend_;
@@ -666,10 +1438,13 @@ void ClientSession::destroy() {
       pool_manager_->release(backend_name_);
       pool_acquired_ = false;
     }
-    DeferredFreeBev* h = new DeferredFreeBev{to_free};
-    event_base_once(base_, -1, 0, deferred_free_bev_cb, h, nullptr);
-  } else if (bev_backend_ && (state_ == State::Forwarding || state_ == State::SendingDiscardAll || pending_return_to_pool_)) {
+    defer_free_bev(base_, to_free);
+  } else if (bev_backend_ && (state_ == State::Forwarding || pending_return_to_pool_) && outstanding_syncs_ == 0 &&
+             backend_tx_state_ == protocol::TXSTATE_IDLE) {
     do_return_backend_to_pool();
+  } else if (bev_backend_ && pool_acquired_ && server_drain_timeout_sec_ > 0 &&
+             (state_ == State::Forwarding || state_ == State::SendingDiscardAll)) {
+    drain_backend_to_pool();  // replies still in flight, a reset running or a transaction to roll back
   } else if (bev_backend_) {
     /* Defer free: destroy() may be reentered from backend callback in edge cases. */
     struct bufferevent* to_free = bev_backend_;
@@ -678,8 +1453,7 @@ void ClientSession::destroy() {
       pool_manager_->release(backend_name_);
       pool_acquired_ = false;
     }
-    DeferredFreeBev* h = new DeferredFreeBev{to_free};
-    event_base_once(base_, -1, 0, deferred_free_bev_cb, h, nullptr);
+    defer_free_bev(base_, to_free);
   } else if (pool_acquired_) {
     pool_manager_->release(backend_name_);
     pool_acquired_ = false;
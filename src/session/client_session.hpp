@@ -1,10 +1,18 @@
 #pragma once
 
+#include "common/timer_wheel.hpp"
 #include "config/config.hpp"
+#include "pool/prepared_statement_cache.hpp"
+#include "protocol/message.hpp"
+#include "protocol/sql_classifier.hpp"
+#include "session/response_spool.hpp"
 #include <event2/util.h>
 #include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct event_base;
@@ -19,20 +27,31 @@ class ConnectionWaitQueue;
 }
 namespace session {
 
+/** Startup already parsed and routed by the dispatcher (route header of the handoff). */
+struct PreRouted {
+  pgpooler::config::ResolvedBackend resolved;
+  std::string user;
+  std::string database;
+  std::size_t startup_offset = 0;  // bytes of SSLRequest in front of the startup packet in initial_data
+};
+
 /** Holds client connection and proxies to a single PostgreSQL backend.
  * State: read first (length-prefixed) message from client → resolve backend →
  * connect to backend → send first message → then forward messages both ways. */
 class ClientSession {
  public:
-  /** If initial_data is non-empty, it is pushed into client input and on_client_read is scheduled once (for fd handoff from dispatcher). worker_id for log prefix (-1 if not from worker). */
+  /** If initial_data is non-empty, it is pushed into client input and on_client_read is scheduled once (for fd handoff from dispatcher). worker_id for log prefix (-1 if not from worker).
+   * pre_routed: initial_data is the startup packet, already routed; the session goes straight to its backend. */
   ClientSession(struct event_base* base, evutil_socket_t client_fd,
                 const std::string& client_addr,
                 pgpooler::config::BackendResolver resolver,
                 pgpooler::config::PoolManager* pool_manager,
                 pgpooler::pool::BackendConnectionPool* connection_pool,
                 pgpooler::pool::ConnectionWaitQueue* wait_queue,
+                pgpooler::common::TimerWheel* timer_wheel,
                 const std::vector<std::uint8_t>* initial_data = nullptr,
-                int worker_id = -1);
+                int worker_id = -1,
+                const PreRouted* pre_routed = nullptr);
   ~ClientSession();
 
   ClientSession(const ClientSession&) = delete;
@@ -53,10 +72,15 @@ class ClientSession {
   void retry_connect_to_backend();
   /** Called by ConnectionWaitQueue when wait timeout expires. */
   void on_wait_timeout();
+  /** session_timer_ expired: cancel the running query or close an idle client. */
+  void on_session_timeout();
 
   /** Called from client write event callback (same TU only): flush then maybe do_return_backend_to_pool. */
   void on_client_writable();
 
+  /** CancelRequest for this session's synthetic key: cancel on the backend connection the session holds now. */
+  void cancel_backend_query();
+
   /** One-shot callback for deferred destroy (must not destroy from inside flush/on_backend_read). */
   static void static_deferred_destroy_cb(evutil_socket_t, short, void* ctx);
 
@@ -71,17 +95,92 @@ class ClientSession {
   };
 
  private:
+  /** Startup routed to resolved: take its settings and routes, then acquire_startup_backend. msg_buf_ holds the
+   * client's first packet, startup_msg the startup packet in it. */
+  void start_routed(const pgpooler::config::ResolvedBackend& resolved, std::vector<std::uint8_t> startup_msg);
+  /** After startup was routed: take an idle connection (session mode), open a new one or wait in the queue. */
+  void acquire_startup_backend();
   void connect_to_backend();
   void on_backend_connected();
   void start_forwarding();
   void return_backend_to_pool();
   void do_return_backend_to_pool();  // actual put, called when client_out_buf_ empty
+  /** Client gone with replies in flight: cancel the query and hand the connection to the pool to drain. */
+  void drain_backend_to_pool();
+  /** Callback for put_resetting/put_draining: frees or hands over the pool slot and wakes a waiter. */
+  std::function<void(bool ok)> pool_slot_done() const;
   void destroy();
-  void schedule_flush_client();
+  /** Re-arm session_timer_ for what the session waits on now: query_timeout while requests are outstanding,
+   * else idle_transaction_timeout inside a transaction, else client_idle_timeout. */
+  void arm_session_timer();
   void send_error_and_close(const std::string& sqlstate, const std::string& message);
   void forward_client_to_backend();
+  /** Dirty tracking + (prepared statement mode) rewrite of one client message; appends bytes for the backend to out. */
+  void append_client_message(const std::vector<std::uint8_t>& msg, std::vector<std::uint8_t>& out);
+  /** Write the reset query the pooled backend needs (by backend_dirty_) and enter SendingDiscardAll
+   * (pipelined mode also sends buffered client messages); a clean connection goes straight to Forwarding. */
+  void send_reset_query();
+  /** Reset query the current backend needs (by backend_dirty_); empty = connection is clean. */
+  std::string reset_query_for_backend() const;
+  /** Update backend_dirty_ from a client message about to be sent to the backend. */
+  void track_dirty_state(const std::vector<std::uint8_t>& msg);
   /** Close the current backend without returning it to the pool (e.g. auth-only connection). */
   void close_auth_backend();
+  /** The backend was changed or removed by a config reload since this session was routed. The session keeps
+   * using the definition it was routed with: it neither takes pooled connections nor returns its own. */
+  bool backend_retired() const;
+  /** backend_retired(): close the held connection and release its slot instead of pooling it. True if it did. */
+  bool close_if_backend_retired();
+  /** Allocate the client's synthetic BackendKeyData (cancel_pid_/cancel_secret_) in the cancel registry. */
+  /** Point backend_name_/host/port at the read route or the primary route; for a backend group, at the member
+   * PoolManager::pick chooses (min_replay_lsn: see pick). Only while no backend connection is held. */
+  void use_route(bool read, std::uint64_t min_replay_lsn = 0);
+  /** Read-your-writes: WAL position a read backend must have replayed for this client's reads (0 = no write
+   * yet). False while the primary's position after the last write is not known yet (read from the primary). */
+  bool read_min_lsn(std::uint64_t& lsn);
+  /** More than one backend to choose from for the next connection (a group or read/write splitting). */
+  bool has_route_choice() const { return primary_route_.members.size() > 1 || !read_route_.members.empty(); }
+  /** The next buffered client request (a Query, or extended-protocol messages through Sync) only reads.
+   * False if it is not complete yet. */
+  bool next_request_is_read_only();
+  /** Backend returned while requests held back from the read backend are buffered: process them next. */
+  void resume_held_request();
+  void ensure_cancel_key();
+  /** First packet was a CancelRequest: pass it to the owning session and close. */
+  void handle_cancel_request(std::uint32_t pid, std::uint32_t secret);
+
+  /** Client's named prepared statement: pooler-unique server name + Parse payload after the name. */
+  struct ClientStatement {
+    std::string server_name;
+    std::vector<std::uint8_t> parse_rest;
+  };
+  /** Request sent to the backend (or answered by the pooler) whose reply the session must recognise. */
+  struct PendingRequest {
+    enum class Reply : std::uint8_t { Forward, Swallow, Synthetic };
+    unsigned char type = 0;  // client message type; for Synthetic — reply type to emit ('1', '3' or 'E')
+    Reply reply = Reply::Forward;
+    std::string statement;  // server statement created ('P') or closed ('C') by this request
+    std::string client_statement;  // client name registered by this Parse; for Synthetic 'E' — the duplicate
+    std::vector<std::uint8_t> parse_rest;  // 'C': Parse payload of the closed statement (restored if skipped)
+  };
+  /** Named prepared statements are managed by the pooler (transaction/statement mode, max_prepared_statements > 0). */
+  bool prepared_statements_enabled() const;
+  /** Rewrite a client message to pooler-unique statement names, injecting Parse/Close as needed. */
+  void rewrite_client_message(const std::vector<std::uint8_t>& msg, std::vector<std::uint8_t>& out);
+  /** Name for a statement with this Parse payload on the current connection: the hash name, or a suffixed one
+   * if the connection already holds different bytes under it. */
+  std::string backend_statement_name(const std::vector<std::uint8_t>& parse_rest) const;
+  /** Make sure stmt exists on the backend connection (inject Parse if not, renaming stmt if its name holds
+   * another statement there); touches it in the LRU. */
+  void ensure_backend_statement(ClientStatement& stmt, std::vector<std::uint8_t>& out);
+  /** Append Parse of stmt (and Close of the evicted LRU statement) to out; reply = how the Parse reply is handled. */
+  void prepare_on_backend(const ClientStatement& stmt, PendingRequest::Reply reply, std::vector<std::uint8_t>& out);
+  /** Match one backend reply against pending_requests_. Returns false if the client must not see it. */
+  bool on_pending_reply(unsigned char type);
+  /** Request failed or was skipped by the server: undo its effect on backend_statements_ and client_statements_. */
+  void undo_pending_request(const PendingRequest& req);
+  /** Append synthetic replies that reached the head of pending_requests_ to client output. */
+  void emit_synthetic_replies();
 
   struct event_base* base_ = nullptr;
   std::string backend_host_;
@@ -95,13 +194,68 @@ class ClientSession {
   unsigned server_idle_timeout_sec_ = 0;
   unsigned server_lifetime_sec_ = 0;
   unsigned query_wait_timeout_sec_ = 0;
+  unsigned server_drain_timeout_sec_ = 10;
+  unsigned client_idle_timeout_sec_ = 0;
+  unsigned idle_transaction_timeout_sec_ = 0;
+  unsigned query_timeout_sec_ = 0;
+  pgpooler::config::ResetMode server_reset_mode_ = pgpooler::config::ResetMode::Take;
+  bool server_reset_tracking_ = false;
+  std::string server_reset_query_;
+  unsigned max_prepared_statements_ = 0;
+  std::unordered_map<std::string, ClientStatement> client_statements_;
+  /** Pooler-managed statements on the current backend connection (travels with it through the pool). */
+  pgpooler::pool::PreparedStatementCache backend_statements_;
+  std::deque<PendingRequest> pending_requests_;
+  /** The pooler answered a Parse with an error: like the server, drop the client's messages up to Sync. */
+  bool skip_until_sync_ = false;
+  /** client_out_buf_ went over client_buffer_memory + client_buffer_spill: backend EV_READ is off until the
+   * client drains it. */
+  bool backend_read_paused_ = false;
+  bool replay_skip_until_sync_ = false;  // skip_until_sync_ before the messages in reset_replay_
+  /** Sync/Query/FunctionCall sent to the backend whose ReadyForQuery has not arrived yet. */
+  unsigned outstanding_syncs_ = 0;
+  /** Transaction state from the last ReadyForQuery on the backend connection the session holds. */
+  unsigned char backend_tx_state_ = pgpooler::protocol::TXSTATE_IDLE;
+  /** Server-side state the current backend connection carries (from the pool entry, then client traffic). */
+  pgpooler::protocol::SessionStateEffect backend_dirty_ = pgpooler::protocol::SessionStateEffect::None;
   std::chrono::steady_clock::time_point backend_created_at_{std::chrono::steady_clock::now()};
   pgpooler::config::PoolManager* pool_manager_ = nullptr;
   pgpooler::pool::ConnectionWaitQueue* wait_queue_ = nullptr;
   bool waiting_in_queue_ = false;
   pgpooler::pool::BackendConnectionPool* connection_pool_ = nullptr;
+  /** connection_pool_->generation(backend_name_) when the session was routed. */
+  std::uint64_t backend_generation_ = 0;
+  /** Backends the session sends requests to: the one (or group) it was routed to, or its read backend. */
+  struct BackendRoute {
+    std::vector<pgpooler::config::BackendTarget> members;
+    std::vector<std::uint64_t> generations;  // connection_pool_->generation() of each member when routed
+    pgpooler::config::BalanceMode balance = pgpooler::config::BalanceMode::LeastConnections;
+  };
+  BackendRoute make_route(const std::vector<pgpooler::config::BackendTarget>& members,
+                          pgpooler::config::BalanceMode balance) const;
+  BackendRoute primary_route_;
+  BackendRoute read_route_;  // no members = no read/write splitting for this session
+  bool on_read_route_ = false;
+  /** Read-your-writes (read_min_lsn): a request that may write went to the primary on the held connection;
+   * once it is returned, the primary's WAL position after write_done_at_ becomes the floor for reads. */
+  bool read_your_writes_ = false;
+  bool request_wrote_ = false;
+  bool awaiting_write_lsn_ = false;
+  std::string write_backend_;
+  std::chrono::steady_clock::time_point write_done_at_{};
+  std::uint64_t min_read_lsn_ = 0;
+  /** BalanceMode::Latency: time the first unanswered request went to the backend, reported on ReadyForQuery. */
+  bool record_latency_ = false;
+  std::chrono::steady_clock::time_point request_sent_at_{};
+  /** Last message forwarded to the backend did not end a request (extended protocol before Sync). */
+  bool client_mid_request_ = false;
   bool pool_acquired_ = false;
   pgpooler::config::BackendResolver resolver_;
+  pgpooler::common::TimerWheel* timer_wheel_ = nullptr;  // nullptr = client timeouts disabled
+  enum class TimerKind : std::uint8_t { None, ClientIdle, IdleTransaction, Query };
+  pgpooler::common::TimerWheel::Timer session_timer_;
+  TimerKind session_timer_kind_ = TimerKind::None;
+  bool query_cancel_sent_ = false;  // query_timeout fired once; the next expiry closes the session
 
   int worker_id_ = -1;
   evutil_socket_t client_fd_ = -1;
@@ -112,6 +266,14 @@ class ClientSession {
   bool destroy_scheduled_ = false;  // guard against double destroy / double delete
   bool deferred_destroy_pending_ = false;  // flush failed, destroy scheduled for next tick (must not delete inside callback)
   bool pending_return_to_pool_ = false;  // waiting for client_out_buf_ to drain before put
+  /** Startup response (through ReadyForQuery) relayed to the client; later backend startups are not shown to it. */
+  bool client_startup_done_ = false;
+  /** Backend returned while client_out_buf_ still held the response (client_buffer_memory); cleared on drain. */
+  bool released_early_ = false;
+  /** Synthetic key given to the client (pid 0 = not registered yet). */
+  std::uint32_t cancel_pid_ = 0;
+  std::uint32_t cancel_secret_ = 0;
+  std::chrono::steady_clock::time_point released_early_at_{};
   bool backend_dead_ = false;  // backend eof/error: do not put connection back to pool
 
   State state_ = State::ReadingFirst;
@@ -120,7 +282,10 @@ class ClientSession {
   std::vector<std::uint8_t> pending_startup_;
   std::vector<std::uint8_t> client_startup_cache_;
   std::vector<std::uint8_t> cached_startup_response_;
-  std::vector<std::uint8_t> client_out_buf_;
+  ResponseSpool client_out_buf_;
+  std::vector<std::uint8_t> backend_out_buf_;  // client messages (rewritten) batched into one backend write
+  /** Client bytes written to the backend while SendingDiscardAll; replayed if the pooled connection turns out stale. */
+  std::vector<std::uint8_t> reset_replay_;
 };
 
 }  // namespace session
@@ -0,0 +1,139 @@
+#include "session/response_spool.hpp"
+#include "common/log.hpp"
+#include "common/stats.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace pgpooler {
+namespace session {
+
+namespace {
+
+constexpr std::size_t SPILL_INITIAL_CAPACITY = 1u << 20;
+/** Compact the memory part once this much has been consumed from its front. */
+constexpr std::size_t MEM_COMPACT_THRESHOLD = 1u << 20;
+
+std::string& spill_directory() {
+  static std::string value = "/tmp";
+  return value;
+}
+
+}  // namespace
+
+ResponseSpool::~ResponseSpool() {
+  close_spill();
+}
+
+void ResponseSpool::set_spill_directory(const std::string& dir) {
+  if (!dir.empty()) spill_directory() = dir;
+}
+
+void ResponseSpool::configure(std::size_t memory_limit, std::size_t spill_limit) {
+  memory_limit_ = memory_limit;
+  spill_limit_ = memory_limit ? spill_limit : 0;
+}
+
+const std::uint8_t* ResponseSpool::data() const {
+  if (mem_off_ < mem_.size()) return mem_.data() + mem_off_;
+  return map_ ? map_ + file_off_ : nullptr;
+}
+
+std::size_t ResponseSpool::contiguous() const {
+  if (mem_off_ < mem_.size()) return mem_.size() - mem_off_;
+  return file_len_ - file_off_;
+}
+
+void ResponseSpool::append(const std::uint8_t* data, std::size_t len) {
+  if (len == 0) return;
+  const bool file_has_data = file_off_ < file_len_;
+  const bool fits_memory = memory_limit_ == 0 || (mem_.size() - mem_off_) + len <= memory_limit_;
+  if (file_has_data || (!fits_memory && spill_limit_ > 0)) {
+    if (spill_append(data, len)) return;
+    unspill();
+  }
+  mem_.insert(mem_.end(), data, data + len);
+}
+
+void ResponseSpool::consume(std::size_t n) {
+  if (mem_off_ < mem_.size()) {
+    mem_off_ += n;
+    if (mem_off_ >= mem_.size()) {
+      mem_.clear();
+      mem_off_ = 0;
+    } else if (mem_off_ >= MEM_COMPACT_THRESHOLD && mem_off_ * 2 >= mem_.size()) {
+      mem_.erase(mem_.begin(), mem_.begin() + static_cast<std::ptrdiff_t>(mem_off_));
+      mem_off_ = 0;
+    }
+    return;
+  }
+  file_off_ += n;
+  if (file_off_ >= file_len_) close_spill();  // drained: give the disk space back
+}
+
+bool ResponseSpool::within_limits() const {
+  return memory_limit_ > 0 && size() <= memory_limit_ + spill_limit_;
+}
+
+bool ResponseSpool::spill_append(const std::uint8_t* data, std::size_t len) {
+  if (fd_ < 0) {
+    std::string path = spill_directory() + "/pgpooler-spool-XXXXXX";
+    std::vector<char> tmpl(path.begin(), path.end());
+    tmpl.push_back('\0');
+    fd_ = mkstemp(tmpl.data());
+    if (fd_ < 0) {
+      pgpooler::log::warn("spool: cannot create spill file in " + spill_directory() + ": " + std::strerror(errno));
+      return false;
+    }
+    unlink(tmpl.data());  // the file lives only as long as the descriptor
+    stats::counters().spill_files.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (file_len_ + len > map_cap_ && file_off_ > 0 && (file_len_ - file_off_) + len <= map_cap_) {
+    std::memmove(map_, map_ + file_off_, file_len_ - file_off_);
+    file_len_ -= file_off_;
+    file_off_ = 0;
+  }
+  if (file_len_ + len > map_cap_) {
+    std::size_t cap = map_cap_ ? map_cap_ : SPILL_INITIAL_CAPACITY;
+    while (cap < file_len_ + len) cap *= 2;
+    /* Blocks are allocated now: writing to a hole of a sparse file on a full disk raises SIGBUS. */
+    int err = posix_fallocate(fd_, static_cast<off_t>(map_cap_), static_cast<off_t>(cap - map_cap_));
+    if (err != 0) {
+      pgpooler::log::warn(std::string("spool: cannot grow spill file: ") + std::strerror(err));
+      return false;
+    }
+    void* m = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (m == MAP_FAILED) {
+      pgpooler::log::warn(std::string("spool: mmap of spill file failed: ") + std::strerror(errno));
+      return false;
+    }
+    if (map_) munmap(map_, map_cap_);
+    map_ = static_cast<std::uint8_t*>(m);
+    map_cap_ = cap;
+  }
+  std::memcpy(map_ + file_len_, data, len);
+  file_len_ += len;
+  stats::counters().spill_bytes.fetch_add(len, std::memory_order_relaxed);
+  return true;
+}
+
+void ResponseSpool::unspill() {
+  if (map_ && file_off_ < file_len_) mem_.insert(mem_.end(), map_ + file_off_, map_ + file_len_);
+  close_spill();
+}
+
+void ResponseSpool::close_spill() {
+  if (map_) munmap(map_, map_cap_);
+  if (fd_ >= 0) close(fd_);
+  map_ = nullptr;
+  fd_ = -1;
+  map_cap_ = 0;
+  file_len_ = 0;
+  file_off_ = 0;
+}
+
+}  // namespace session
+}  // namespace pgpooler
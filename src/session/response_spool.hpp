@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pgpooler {
+namespace session {
+
+/** Output queue towards the client: bytes are kept in memory up to memory_limit, the rest goes to an unlinked,
+ * mmap'd spill file. FIFO order is kept across both parts. With memory_limit 0 everything stays in memory. */
+class ResponseSpool {
+ public:
+  ResponseSpool() = default;
+  ~ResponseSpool();
+
+  ResponseSpool(const ResponseSpool&) = delete;
+  ResponseSpool& operator=(const ResponseSpool&) = delete;
+
+  /** Directory for spill files (process-wide, set once at startup). Default /tmp. */
+  static void set_spill_directory(const std::string& dir);
+
+  /** memory_limit: bytes kept in memory (0 = unlimited, no spill); spill_limit: bytes that may go to the
+   * spill file (0 = no spill file). append() does not enforce them: the caller stops producing while
+   * over_limits(). */
+  void configure(std::size_t memory_limit, std::size_t spill_limit);
+
+  void append(const std::uint8_t* data, std::size_t len);
+  void append(const std::vector<std::uint8_t>& bytes) { append(bytes.data(), bytes.size()); }
+
+  bool empty() const { return size() == 0; }
+  /** Unread bytes in memory and in the spill file. */
+  std::size_t size() const { return (mem_.size() - mem_off_) + (file_len_ - file_off_); }
+  /** Front of the queue: pointer and length of the first contiguous chunk. */
+  const std::uint8_t* data() const;
+  std::size_t contiguous() const;
+  /** Drop n bytes from the front (n <= contiguous()). */
+  void consume(std::size_t n);
+
+  /** Buffering is enabled and everything queued fits into memory_limit + spill_limit. */
+  bool within_limits() const;
+  /** Buffering is enabled and more than memory_limit + spill_limit is queued. */
+  bool over_limits() const { return memory_limit_ > 0 && !within_limits(); }
+
+ private:
+  /** Append to the spill file; consumed space at its front is reused before the file grows. */
+  bool spill_append(const std::uint8_t* data, std::size_t len);
+  /** Move unread spill data back to memory and drop the file (spill write failed). */
+  void unspill();
+  void close_spill();
+
+  std::size_t memory_limit_ = 0;
+  std::size_t spill_limit_ = 0;
+  std::vector<std::uint8_t> mem_;
+  std::size_t mem_off_ = 0;
+  int fd_ = -1;
+  std::uint8_t* map_ = nullptr;
+  std::size_t map_cap_ = 0;
+  std::size_t file_len_ = 0;
+  std::size_t file_off_ = 0;
+};
+
+}  // namespace session
+}  // namespace pgpooler
@@ -0,0 +1,308 @@
+// LagMonitor against a stand-in server that answers the probe query with scripted rows (replay/receive/current
+// LSNs, replay age, WAL receiver state), plus parse_lsn. Built with the default PGPOOLER_BUILD_TESTS=ON, run by
+// ctest or directly: ./lag_monitor_test
+#include "config/config.hpp"
+#include "server/lag_monitor.hpp"
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pgpooler;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+  std::printf("%s %s\n", ok ? "OK  " : "FAIL", what.c_str());
+  if (!ok) ++failures;
+}
+
+using Row = std::vector<std::optional<std::string>>;
+
+/** Answer to the next probe queries: a DataRow, an ErrorResponse, or closing the connection. */
+struct Reply {
+  enum class Kind { Row, Error, Close } kind = Kind::Row;
+  Row row;
+};
+
+/** Minimal server: trust auth, then every Query gets the current Reply. One connection at a time. */
+class StandIn {
+ public:
+  StandIn() {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), len) != 0 || listen(listen_fd_, 4) != 0 ||
+        getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0) {
+      std::perror("stand-in listen");
+      std::exit(2);
+    }
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] { run(); });
+  }
+
+  ~StandIn() {
+    stop_ = true;
+    thread_.join();
+    close(listen_fd_);
+  }
+
+  unsigned port() const { return port_; }
+
+  void set(Reply reply) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reply_ = std::move(reply);
+  }
+
+  int connections() const { return connections_; }
+
+ private:
+  static void put_u32(std::vector<std::uint8_t>& out, std::uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<std::uint8_t>(v >> shift));
+  }
+
+  static std::vector<std::uint8_t> message(char type, const std::vector<std::uint8_t>& body) {
+    std::vector<std::uint8_t> out{static_cast<std::uint8_t>(type)};
+    put_u32(out, static_cast<std::uint32_t>(body.size() + 4));
+    out.insert(out.end(), body.begin(), body.end());
+    return out;
+  }
+
+  static bool write_all(int fd, const std::vector<std::uint8_t>& bytes) {
+    for (std::size_t off = 0; off < bytes.size();) {
+      const ssize_t n = ::write(fd, bytes.data() + off, bytes.size() - off);
+      if (n <= 0) return false;
+      off += static_cast<std::size_t>(n);
+    }
+    return true;
+  }
+
+  /** Read exactly n bytes, polling so that stop_ is noticed. */
+  bool read_exact(int fd, std::uint8_t* p, std::size_t n) {
+    while (n > 0) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 50) == 0) {
+        if (stop_) return false;
+        continue;
+      }
+      const ssize_t got = ::read(fd, p, n);
+      if (got <= 0) return false;
+      p += got;
+      n -= static_cast<std::size_t>(got);
+    }
+    return true;
+  }
+
+  static std::uint32_t u32(const std::uint8_t* p) {
+    return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+           (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+  }
+
+  void run() {
+    while (!stop_) {
+      struct pollfd pfd = {listen_fd_, POLLIN, 0};
+      if (poll(&pfd, 1, 50) <= 0) continue;
+      const int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) continue;
+      ++connections_;
+      serve(fd);
+      close(fd);
+    }
+  }
+
+  void serve(int fd) {
+    std::uint8_t head[5];
+    if (!read_exact(fd, head, 4)) return;  // StartupMessage: length, then protocol and parameters
+    std::vector<std::uint8_t> body(u32(head) - 4);
+    if (!read_exact(fd, body.data(), body.size())) return;
+    std::vector<std::uint8_t> hello = message('R', {0, 0, 0, 0});
+    const std::vector<std::uint8_t> ready = message('Z', {'I'});
+    hello.insert(hello.end(), ready.begin(), ready.end());
+    if (!write_all(fd, hello)) return;
+    while (read_exact(fd, head, 5)) {
+      body.assign(u32(head + 1) - 4, 0);
+      if (!read_exact(fd, body.data(), body.size())) return;
+      if (head[0] == 'X') return;
+      if (head[0] != 'Q') continue;
+      Reply reply;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reply = reply_;
+      }
+      std::vector<std::uint8_t> out;
+      if (reply.kind == Reply::Kind::Close) return;
+      if (reply.kind == Reply::Kind::Error) {
+        const std::string fields = std::string("SERROR") + '\0' + "C57014" + '\0' + "Mscripted failure" + '\0' + '\0';
+        out = message('E', std::vector<std::uint8_t>(fields.begin(), fields.end()));
+      } else {
+        std::vector<std::uint8_t> row{static_cast<std::uint8_t>(reply.row.size() >> 8),
+                                      static_cast<std::uint8_t>(reply.row.size())};
+        for (const auto& col : reply.row) {
+          if (!col) {
+            put_u32(row, 0xFFFFFFFFu);
+            continue;
+          }
+          put_u32(row, static_cast<std::uint32_t>(col->size()));
+          row.insert(row.end(), col->begin(), col->end());
+        }
+        out = message('D', row);
+        const std::string tag = "SELECT 1";
+        std::vector<std::uint8_t> complete(tag.begin(), tag.end());
+        complete.push_back(0);
+        const std::vector<std::uint8_t> done = message('C', complete);
+        out.insert(out.end(), done.begin(), done.end());
+      }
+      out.insert(out.end(), ready.begin(), ready.end());
+      if (!write_all(fd, out)) return;
+    }
+  }
+
+  int listen_fd_ = -1;
+  unsigned port_ = 0;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+  std::atomic<int> connections_{0};
+  std::mutex mutex_;
+  Reply reply_;
+};
+
+/** Probe row as LAG_QUERY returns it: replay LSN, replay age, current LSN, receive LSN, receiver streaming. */
+Row probe_row(std::optional<std::string> replay, std::optional<std::string> age, std::optional<std::string> current,
+              std::optional<std::string> receive, std::optional<std::string> streaming) {
+  return Row{std::move(replay), std::move(age), std::move(current), std::move(receive), std::move(streaming)};
+}
+
+Reply row(Row r) {
+  Reply reply;
+  reply.row = std::move(r);
+  return reply;
+}
+
+Reply of(Reply::Kind kind) {
+  Reply reply;
+  reply.kind = kind;
+  return reply;
+}
+
+/** Run the event loop long enough for several probes (interval 20 ms). */
+void run_probes(struct event_base* base) {
+  struct timeval tv = {0, 200 * 1000};
+  event_base_loopexit(base, &tv);
+  event_base_dispatch(base);
+}
+
+void test_parse_lsn() {
+  using server::parse_lsn;
+  check(parse_lsn("16/B374D848") == std::optional<std::uint64_t>(0x16B374D848ull), "parse_lsn 16/B374D848");
+  check(parse_lsn("0/0") == std::optional<std::uint64_t>(0), "parse_lsn 0/0");
+  check(parse_lsn("a/1f") == std::optional<std::uint64_t>(0xA0000001Full), "parse_lsn lowercase hex");
+  check(parse_lsn("FFFFFFFF/FFFFFFFF") == std::optional<std::uint64_t>(~0ull), "parse_lsn maximum");
+  for (const char* bad : {"", "16", "16/", "/1", "1/2/3", "0x1/2", " 1/2", "1/2 ", "-1/2", "+1/2", "123456789/0",
+                          "1/G"})
+    check(!parse_lsn(bad), std::string("parse_lsn rejects \"") + bad + "\"");
+}
+
+void test_probe() {
+  StandIn standin;
+  config::BackendEntry be;
+  be.name = "replica";
+  be.host = "127.0.0.1";
+  be.port = standin.port();
+  be.lag_probe.interval_sec = 0.02;
+  be.lag_probe.max_lag_sec = 5;
+  be.lag_probe.user = "probe";
+  config::BackendsConfig backends_cfg;
+  backends_cfg.backends.push_back(be);
+  config::RoutingState routing(config::make_routing_snapshot(backends_cfg, config::RoutingConfig{}));
+  config::PoolManager pool_manager(backends_cfg.backends);
+  const std::vector<config::BackendTarget> members{config::BackendTarget{be.name, be.host, be.port, 1}};
+  auto lagging = [&](std::uint64_t min_replay_lsn = 0) { return pool_manager.all_lagging(members, min_replay_lsn); };
+
+  struct event_base* base = event_base_new();
+  standin.set(row(probe_row("0/3000060", "120.5", std::nullopt, "0/3000060", "t")));
+  {
+    server::LagMonitor monitor(base, &routing, &pool_manager, "test: ");
+    run_probes(base);
+    check(!lagging(), "caught up and streaming: old replay age is no delay");
+    check(!lagging(0x3000060), "replayed up to its replay LSN");
+    check(lagging(0x3000061), "not replayed past its replay LSN");
+
+    standin.set(row(probe_row("0/3000060", "120.5", std::nullopt, "0/3000060", std::nullopt)));
+    run_probes(base);
+    check(lagging(), "no WAL receiver: the replay age counts");
+
+    standin.set(row(probe_row("0/3000060", "120.5", std::nullopt, "0/3000060", "f")));
+    run_probes(base);
+    check(lagging(), "WAL receiver not streaming: the replay age counts");
+
+    standin.set(row(probe_row("0/3000060", "1.5", std::nullopt, "0/4000000", "t")));
+    run_probes(base);
+    check(!lagging(), "replaying behind receive within max_lag");
+
+    standin.set(row(probe_row("0/3000060", "7.25", std::nullopt, "0/4000000", "t")));
+    run_probes(base);
+    check(lagging(), "replaying behind receive beyond max_lag");
+
+    standin.set(row(probe_row("0/4000000", "7.25", std::nullopt, "0/4000000", "t")));
+    run_probes(base);
+    check(!lagging(), "caught up again");
+    check(!lagging(0x4000000), "new replay LSN reported");
+
+    standin.set(of(Reply::Kind::Error));
+    run_probes(base);
+    check(lagging(), "probe error");
+
+    standin.set(row(probe_row("0/4000000", "0", std::nullopt, "0/4000000", "t")));
+    run_probes(base);
+    check(!lagging(), "probe recovered after an error");
+
+    const int before_close = standin.connections();
+    standin.set(of(Reply::Kind::Close));
+    run_probes(base);
+    check(lagging(), "connection lost");
+    standin.set(row(probe_row("0/4000000", "0", std::nullopt, "0/4000000", "t")));
+    run_probes(base);
+    check(!lagging() && standin.connections() > before_close, "reconnected after the connection was lost");
+
+    const auto sent_before = std::chrono::steady_clock::now();
+    standin.set(row(probe_row(std::nullopt, "3600", "16/B374D848", std::nullopt, std::nullopt)));
+    run_probes(base);
+    check(!lagging(), "primary (not in recovery): no delay");
+    check(pool_manager.current_lsn_since(be.name, sent_before) == std::optional<std::uint64_t>(0x16B374D848ull),
+          "primary current LSN reported");
+
+    standin.set(row(probe_row("zz", "0", std::nullopt, "0/4000000", "t")));
+    run_probes(base);
+    check(lagging(1), "malformed replay LSN is no position");
+  }
+  check(!lagging(), "dropped probe clears the verdict");
+  event_base_free(base);
+}
+
+}  // namespace
+
+int main() {
+  test_parse_lsn();
+  test_probe();
+  if (failures) {
+    std::printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  std::printf("all checks passed\n");
+  return 0;
+}
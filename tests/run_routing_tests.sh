@@ -7,25 +7,47 @@ set -e
 HOST="${PGHOST:-localhost}"
 PORT="${PGPORT:-6432}"
 
+# run_test user database expected [options]  (options -> PGOPTIONS, e.g. "-c app.tenant=acme")
 run_test() {
   user="$1"
   database="$2"
   expected="$3"
+  options="${4:-}"
   if [ "$user" = "reporting_reader" ]; then
     export PGPASSWORD="rreader"
   else
     export PGPASSWORD="postgres"
   fi
-  result=$(psql -h "$HOST" -p "$PORT" -U "$user" -d "$database" -t -A -v ON_ERROR_STOP=1 -c "SELECT name FROM backend_id;" 2>&1) || true
+  label="$user / $database"
+  [ -n "$options" ] && label="$label ($options)"
+  result=$(PGOPTIONS="$options" psql -h "$HOST" -p "$PORT" -U "$user" -d "$database" -t -A -v ON_ERROR_STOP=1 -c "SELECT name FROM backend_id;" 2>&1) || true
   if [ "$result" = "$expected" ]; then
-    echo "OK  $user / $database -> $expected"
+    echo "OK  $label -> $expected"
     return 0
   else
-    echo "FAIL $user / $database -> expected $expected, got: $result"
+    echo "FAIL $label -> expected $expected, got: $result"
     return 1
   fi
 }
 
+# run_test_no_route user database [options]  (pgpooler must refuse: no route for user/database)
+run_test_no_route() {
+  export PGPASSWORD="postgres"
+  label="$1 / $2"
+  [ -n "${3:-}" ] && label="$label ($3)"
+  result=$(PGOPTIONS="${3:-}" psql -h "$HOST" -p "$PORT" -U "$1" -d "$2" -t -A -v ON_ERROR_STOP=1 -c "SELECT name FROM backend_id;" 2>&1) || true
+  case "$result" in
+    *"no route"*)
+      echo "OK  $label -> no route"
+      return 0
+      ;;
+    *)
+      echo "FAIL $label -> expected no route, got: $result"
+      return 1
+      ;;
+  esac
+}
+
 echo "Routing tests (pgpooler at $HOST:$PORT)"
 failed=0
 
@@ -38,6 +60,17 @@ run_test postgres dwh_test replica || failed=1
 run_test postgres default_test primary || failed=1
 run_test reporting_reader reporting replica || failed=1
 
+# shard_map (tenants.yaml): range by database, pinned tenant
+run_test postgres tenant_b primary || failed=1
+run_test postgres tenant_n replica || failed=1
+run_test postgres tenant_z primary || failed=1
+
+# shard_map by options.app.tenant (tenant_options.yaml); -c and -- forms; without the option there is no route
+run_test postgres tenants primary "-c app.tenant=acme" || failed=1
+run_test postgres tenants replica "-c app.tenant=zeta" || failed=1
+run_test postgres tenants replica "--app.tenant=zeta" || failed=1
+run_test_no_route postgres tenants || failed=1
+
 if [ $failed -eq 0 ]; then
   echo "All routing tests passed."
   exit 0